@@ -1,26 +1,92 @@
-#ifndef ALMGR_H
-#define ALMGR_H
-
-#include <string>
-
-/********************************************************************************
- * ALMgr - Access List manager, basically reads from a text document to find the
- *         IP address given. If it's a whitelist, then returns true for allowed
- *         if found and opposite for blacklists
- ********************************************************************************/
-
-class ALMgr {
-   public:
-      ALMgr(const char *al_file, bool is_whitelist = true);
-      ~ALMgr();
-
-      bool isAllowed(const char *ipaddr);
-      bool isAllowed(unsigned long ipaddr);
-
-   private:
-      std::string _al_file;
-
-      bool _is_whitelist;
-};
-
-#endif // ALMGR_H
+#ifndef ALMGR_H
+#define ALMGR_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_set>
+#include <cstdint>
+#include <ctime>
+#include <sys/types.h>
+
+// How often (in seconds) the access list file is checked for changes
+const time_t al_check_secs = 1;
+
+/********************************************************************************
+ * AccessList - one loaded copy of an access list file. Plain addresses go in a
+ *              hash set; CIDR ranges (a.b.c.d/len) in a binary trie on the
+ *              address bits, so a lookup is one hash probe plus at most 32
+ *              steps down the trie. Never changed once built--a reload builds a
+ *              new one
+ ********************************************************************************/
+
+class AccessList {
+   public:
+      AccessList();
+
+      // Adds a line of the file. Returns false if it is not an address or range
+      bool addLine(const char *line);
+
+      // ipaddr in host byte order
+      bool contains(uint32_t ipaddr) const;
+
+   private:
+      void addRange(uint32_t prefix, unsigned int len);
+
+      // Trie node - children by the next address bit (0 = none), and whether a
+      // range ends here
+      struct TrieNode {
+         uint32_t child[2];
+         bool match;
+      };
+
+      std::unordered_set<uint32_t> _exact;
+      std::vector<TrieNode> _trie;
+};
+
+/********************************************************************************
+ * ALMgr - Access List manager, basically reads from a text document to find the
+ *         IP address given. If it's a whitelist, then returns true for allowed
+ *         if found and opposite for blacklists
+ *
+ *         The file holds one address (a.b.c.d) or CIDR range (a.b.c.d/len) per
+ *         line. It is read into memory on the first check and read again only
+ *         when it changes (its mtime, size or inode differ, looked at no more
+ *         than every al_check_secs), so one ALMgr can serve every accept. A
+ *         reload builds a whole new list and swaps it in, so checks running at
+ *         the time see either the old list or the new one. Safe to call from
+ *         any thread.
+ ********************************************************************************/
+
+class ALMgr {
+   public:
+      ALMgr(const char *al_file, bool is_whitelist = true);
+      ~ALMgr();
+
+      // Throws runtime_error if the list has never been loaded and the file
+      // cannot be opened. If a later reload fails, the last list stays in use
+      bool isAllowed(const char *ipaddr);
+      bool isAllowed(unsigned long ipaddr);
+
+   private:
+      std::shared_ptr<const AccessList> currentList();
+      std::shared_ptr<const AccessList> loadList();
+
+      std::string _al_file;
+
+      bool _is_whitelist;
+
+      // The list in use (swapped with atomic_load/atomic_store), what the file
+      // looked like when it was read, and when to look again. _reload_lock lets
+      // one thread do the reloading
+      std::shared_ptr<const AccessList> _list;
+      std::mutex _reload_lock;
+      std::atomic<time_t> _next_check;
+      struct timespec _mtime;
+      off_t _size;
+      ino_t _inode;
+};
+
+#endif // ALMGR_H
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include "exceptions.h"
 #include "DronePlotDB.h"
+#include "PlotRing.h"
 
 // Simulates an antenna receiving drone information and populates the DronePlotDB class as it "receives"
 // information. 
@@ -32,18 +33,34 @@ public:
 
    int getOffset() { return _time_offset; };
 
+   // Use this clock offset (0 = none) instead of a random one. Must be set before simulate()
+   // is started
+   void setOffset(int offset) { _time_offset = offset; _random_offset = false; };
+
+   // Hand new plots to a ring (drained by the replication thread) instead of writing them to
+   // the database directly. Must be set before simulate() is started
+   void setIngestRing(PlotRing *ring) { _ingest = ring; };
+
 private:
    
    double getAdjustedTime();
 
+   // Appends a plot file to the injects (-1 if it could not be read)
+   int readSource(const char *filename);
+
+   // Passes one round of injects on, to the ingest ring if there is one
+   void deliverPlots(const WirePlot *plots, size_t count);
+
    // Simulation checks periodically to know when to exit the thread
    bool _exiting;
 
    DronePlotDB &_to_db;
-   DronePlotDB _source_db;
+   PlotRing *_ingest;
+   std::vector<WirePlot> _source;      // the injects, in time order once simulate() starts
 
    float _time_mult;
    int _time_offset;
+   bool _random_offset;
    int _verbosity;
  
    time_t _start_time;
@@ -0,0 +1,89 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+
+/********************************************************************************************
+ * BoundedQueue - blocking FIFO with a fixed capacity, used to pass work between pipeline
+ *                stages running on different threads. A full queue pushes back on the stage
+ *                feeding it, so a slow stage cannot make the others buffer without bound.
+ *
+ *                Tracks its current depth and the deepest it has been, so each stage's
+ *                backlog can be reported.
+ ********************************************************************************************/
+template <typename T>
+class BoundedQueue
+{
+public:
+   BoundedQueue(size_t capacity):_capacity(capacity),_high_water(0),_closed(false) {};
+
+   // Moves an item in if there is room. Returns false (leaving item alone) if full or closed
+   bool tryPush(T &item) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_closed || (_items.size() >= _capacity))
+         return false;
+      add(item);
+      return true;
+   };
+
+   // Moves an item in, waiting for room. Returns false if the queue was closed first
+   bool push(T &item) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _not_full.wait(lock, [this] { return _closed || (_items.size() < _capacity); });
+      if (_closed)
+         return false;
+      add(item);
+      return true;
+   };
+
+   // Takes the oldest item, waiting up to timeout_ms for one. Returns false if none came
+   bool pop(T &item, int timeout_ms = 0) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      if ((_items.size() == 0) && (timeout_ms > 0))
+         _not_empty.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                             [this] { return _closed || (_items.size() > 0); });
+      if (_items.size() == 0)
+         return false;
+
+      item = std::move(_items.front());
+      _items.pop_front();
+      _not_full.notify_one();
+      return true;
+   };
+
+   // Wakes anyone waiting and refuses further pushes (what is queued can still be popped)
+   void close() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+      _not_full.notify_all();
+      _not_empty.notify_all();
+   };
+
+   bool isFull() { std::lock_guard<std::mutex> lock(_mutex); return _items.size() >= _capacity; };
+   size_t depth() { std::lock_guard<std::mutex> lock(_mutex); return _items.size(); };
+   size_t highWater() { std::lock_guard<std::mutex> lock(_mutex); return _high_water; };
+   size_t capacity() { return _capacity; };
+
+private:
+   void add(T &item) {
+      _items.push_back(std::move(item));
+      if (_items.size() > _high_water)
+         _high_water = _items.size();
+      _not_empty.notify_one();
+   };
+
+   std::deque<T> _items;
+   size_t _capacity;
+   size_t _high_water;
+   bool _closed;
+
+   std::mutex _mutex;
+   std::condition_variable _not_full;
+   std::condition_variable _not_empty;
+};
+
+#endif
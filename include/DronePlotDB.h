@@ -1,109 +1,414 @@
-#ifndef DRONEPLOTDB_H
-#define DRONEPLOTDB_H
-
-#include <list>
-#include <vector>
-#include <unistd.h>
-#include <pthread.h>
-#include "exceptions.h"
-
-
-// Flags for the DronePlot object. The first two are already coded in and
-// you can define more. It's based off bitwise and/or operations so just
-// create a new one up to 0x128 
-#define DBFLAG_NEW      0x1   // Was newly added to the database
-#define DBFLAG_SYNCD    0x2   // Has been sync'd
-#define DBFLAG_DUPE    0x4   // Skew has been calculated
-#define DBFLAG_LEADER    0x8   // Is time coordinator
-#define DBFLAG_SKEWED    0x16  // Change as needed
-#define DBFLAG_USER4    0x32
-
-// Manages the drone plot database for a particular node.
-class DronePlot
-{
-public:
-   DronePlot();
-   DronePlot(int in_droneid, int in_nodeid, int in_timestamp, float in_latitude, float in_longitude);
-   virtual ~DronePlot();
-
-   // Function to serialize, or convert this data into a binary stream in a vector class and back
-   void serialize(std::vector<uint8_t> &buf);
-   void deserialize(std::vector<uint8_t> &buf, unsigned int start_pt = 0);
-
-   // Reads and writes this plot to/from a buffer in comma-separated format
-   int readCSV(std::string &buf);
-   void writeCSV(std::string &buf);
-
-   static size_t getDataSize();   // Num of bytes required to store the data (for serialization)
-  
-   // Flag manipulation -- pass in a define above as in setFlags(DBFLAG_NEW); 
-   void setFlags(unsigned short flags);
-   void clrFlags(unsigned short flags);
-   bool isFlagSet(unsigned short flags); 
-
-   // attributes - freely accessible to modify as needed 
-   unsigned int drone_id;
-   unsigned int node_id;
-   time_t timestamp;
-   float latitude;
-   float longitude;
-   
-private:
-   unsigned short _flags;
-
-};
-
-
-/**************************************************************************************************
- * DronePlotDB - class to manage a database of DronePlot objects, which manage drone GPS plots that
- *               are "received" by the antenna or another replication server
- *
- **************************************************************************************************/
-class DronePlotDB 
-{
-public:
-   DronePlotDB();
-   virtual ~DronePlotDB();
-
-   // Add a plot to the database with the given attributes (mutex'd)
-   void addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude);
-
-   // Load or write the database to/from a CSV file, 
-   int loadCSVFile(const char *filename);
-   int writeCSVFile(const char *filename);
-
-   // Direct binary load/write to/from the specified file
-   int loadBinaryFile(const char *filename);
-   int writeBinaryFile(const char *filename);
-   
-   // Sort the database in order of timestamp 
-   void sortByTime();
-
-   // Remove all plotpoints of a particular node (used to generate binary, not for student use)
-   void removeNodeID(unsigned int node_id);
-
-   // Iterators for simple access to the database. Can use these to modify drone plot points
-   // but won't be able to add/delete PlotObjects. Use erase (below) for that as it is mutex'd
-   std::list<DronePlot>::iterator begin() { return _dbdata.begin(); };
-   std::list<DronePlot>::iterator end() { return _dbdata.end(); };
-   
-   // Manipulate database entries (mutex'd functions)
-   void popFront();
-   void erase(unsigned int i);
-   std::list<DronePlot>::iterator erase(std::list<DronePlot>::iterator dptr);
-
-
-   // Return the number of plot points stored
-   size_t size() { return _dbdata.size(); };
-
-   // Wipe the database
-   void clear();
-
-private:
-   std::list<DronePlot> _dbdata;
-
-   pthread_mutex_t _mutex; 
-};
-
-
-#endif
+#ifndef DRONEPLOTDB_H
+#define DRONEPLOTDB_H
+
+#include <vector>
+#include <unordered_map>
+#include <set>
+#include <memory>
+#include <atomic>
+#include <unistd.h>
+#include <pthread.h>
+#include "exceptions.h"
+#include "PlotStore.h"
+#include "PlotCodec.h"
+#include "PlotJournal.h"
+
+
+// Flags for the DronePlot object. The first two are already coded in and
+// you can define more. It's based off bitwise and/or operations so just
+// create a new one up to 0x80 (each must be a single bit)
+#define DBFLAG_NEW      0x1   // Was newly added to the database
+#define DBFLAG_SYNCD    0x2   // Has been sync'd
+#define DBFLAG_DUPE    0x4   // Marked for removal as a duplicate
+#define DBFLAG_LEADER    0x8   // Is time coordinator
+#define DBFLAG_SKEWED    0x10  // Change as needed
+#define DBFLAG_USER4    0x20
+
+// Manages the drone plot database for a particular node.
+class DronePlot
+{
+public:
+   DronePlot();
+   DronePlot(int in_droneid, int in_nodeid, int in_timestamp, float in_latitude, float in_longitude);
+   virtual ~DronePlot();
+
+   // Function to serialize, or convert this data into a binary stream in a vector class and back
+   // (the 24-byte record described in PlotCodec.h)
+   void serialize(std::vector<uint8_t> &buf);
+   void deserialize(std::vector<uint8_t> &buf, unsigned int start_pt = 0);
+   WirePlot toWire();
+
+   // Reads and writes this plot to/from a buffer in comma-separated format
+   int readCSV(std::string &buf);
+   void writeCSV(std::string &buf);
+
+   static size_t getDataSize();   // Num of bytes required to store the data (for serialization)
+  
+   // Flag manipulation -- pass in a define above as in setFlags(DBFLAG_NEW); 
+   void setFlags(unsigned short flags);
+   void clrFlags(unsigned short flags);
+   bool isFlagSet(unsigned short flags); 
+
+   // attributes - freely accessible to modify as needed 
+   unsigned int drone_id;
+   unsigned int node_id;
+   time_t timestamp;
+   float latitude;
+   float longitude;
+   
+private:
+   unsigned short _flags;
+
+};
+
+
+/**************************************************************************************************
+ * PlotRef - a reference to a plot held in a DronePlotDB's column store. Reads and writes go
+ *           straight to the columns, so it can be used like a DronePlot & (dptr->timestamp = ..).
+ *           timestamp is the time as the reporting node gave it; correctedTime() adds that
+ *           node's clock offset (see DronePlotDB::setNodeOffset). toPlot/toWire copy the
+ *           stored timestamp.
+ *           Only valid until the database is compacted (sortByTime), the plot is erased or the
+ *           plot is changed through a mutex'd DronePlotDB call (which may move it to a fresh
+ *           copy if a snapshot is pinned)--hold on to the PlotHandle instead to find the plot
+ *           again later. Writes through a PlotRef are not hidden from pinned snapshots.
+ **************************************************************************************************/
+class PlotRef
+{
+public:
+   PlotRef(PlotStore &store, size_t slot);
+
+   // Same behavior as the DronePlot versions
+   void serialize(std::vector<uint8_t> &buf);
+   void writeCSV(std::string &buf);
+
+   void setFlags(unsigned short flags) { _flags |= flags; };
+   void clrFlags(unsigned short flags) { _flags &= ~flags; };
+   bool isFlagSet(unsigned short flags) { return (bool) (_flags & flags); };
+
+   // Copies the plot out of the database
+   DronePlot toPlot() const;
+   WirePlot toWire() const;
+
+   PlotHandle getHandle() const { return _handle; };
+
+   time_t correctedTime() const { return timestamp + _offset; };
+
+   unsigned int &drone_id;
+   unsigned int &node_id;
+   time_t &timestamp;
+   float &latitude;
+   float &longitude;
+
+private:
+   unsigned short &_flags;
+   PlotHandle _handle;
+   time_t _offset;
+};
+
+
+/**************************************************************************************************
+ * PlotMatchKey - identifies a physical observation of a drone. Two plots with the same key are the
+ *                same drone at the same spot, reported by different nodes (possibly with skewed
+ *                clocks). Used to index the database so matches can be found without a full scan.
+ **************************************************************************************************/
+struct PlotMatchKey
+{
+   // folds -0.0 into 0.0 so == and the hash agree
+   template <typename Plot>
+   PlotMatchKey(const Plot &plot):drone_id(plot.drone_id),latitude(plot.latitude + 0.0f),
+                                  longitude(plot.longitude + 0.0f) {};
+
+   bool operator==(const PlotMatchKey &other) const {
+      return (drone_id == other.drone_id) && (latitude == other.latitude) &&
+             (longitude == other.longitude);
+   };
+
+   unsigned int drone_id;
+   float latitude;
+   float longitude;
+};
+
+struct PlotMatchHash
+{
+   size_t operator()(const PlotMatchKey &key) const;
+};
+
+/**************************************************************************************************
+ * PlotTimeKey - a drone at a point in time, on the reporting node's clock. Two plots whose keys
+ *               are the same once their nodes' offsets are added are duplicates of each other
+ **************************************************************************************************/
+struct PlotTimeKey
+{
+   template <typename Plot>
+   PlotTimeKey(const Plot &plot):drone_id(plot.drone_id),timestamp(plot.timestamp) {};
+   PlotTimeKey(unsigned int in_drone_id, time_t in_timestamp):drone_id(in_drone_id),
+                                                              timestamp(in_timestamp) {};
+
+   bool operator==(const PlotTimeKey &other) const {
+      return (drone_id == other.drone_id) && (timestamp == other.timestamp);
+   };
+
+   unsigned int drone_id;
+   time_t timestamp;
+};
+
+struct PlotTimeHash
+{
+   size_t operator()(const PlotTimeKey &key) const;
+};
+
+
+/**************************************************************************************************
+ * PlotTimeline - plots in time order (ties by handle), so a time window is a range lookup. The
+ *                track index keeps one per drone and the spatial grid one per cell. Entries
+ *                are keyed on the stored time, so a node's offset changing leaves them alone.
+ *
+ *                Kept as a balanced tree, so an entry goes in or comes out in log time
+ *                wherever it lands: re-timing a run of plots in order moves each one past the
+ *                plots already moved, and oldest-first erasure would shift a vector every time
+ **************************************************************************************************/
+class PlotTimeline
+{
+public:
+   typedef std::pair<time_t, PlotHandle> entry;
+   typedef std::set<entry>::const_iterator const_iterator;
+
+   void insert(time_t timestamp, PlotHandle plot);
+   void erase(time_t timestamp, PlotHandle plot);
+
+   // The entries from start to end inclusive
+   const_iterator first(time_t start) const;
+   const_iterator last(time_t end) const;
+
+   bool empty() const { return _entries.empty(); };
+
+private:
+   std::set<entry> _entries;
+};
+
+// Size of a spatial grid cell in degrees, both ways (about 1km of latitude)
+const float grid_cell_deg = 0.01f;
+
+// A pinned, read-only view of a DronePlotDB (see PlotSnapshot). Dropping the last copy releases it
+typedef std::shared_ptr<const PlotSnapshot> PlotSnapshotPtr;
+
+/**************************************************************************************************
+ * DronePlotDB - class to manage a database of DronePlot objects, which manage drone GPS plots that
+ *               are "received" by the antenna or another replication server
+ *
+ **************************************************************************************************/
+class DronePlotDB 
+{
+public:
+   DronePlotDB();
+   virtual ~DronePlotDB();
+
+   /**********************************************************************************************
+    * iterator - walks the live plots in storage order (corrected time order after sortByTime).
+    *            Dereferences to a PlotRef, so dptr->timestamp etc. work as they did on the list.
+    *            Stays valid across addPlot and erase, but not across sortByTime.
+    **********************************************************************************************/
+   class iterator
+   {
+   public:
+      iterator():_db(NULL),_slot(0) {};
+      iterator(DronePlotDB *db, size_t slot):_db(db),_slot(slot) {};
+
+      // Lets operator-> hand back a PlotRef by value
+      struct arrow {
+         PlotRef ref;
+         PlotRef *operator->() { return &ref; };
+      };
+
+      PlotRef operator*() const { return PlotRef(_db->_store, _slot); };
+      arrow operator->() const { return arrow{PlotRef(_db->_store, _slot)}; };
+
+      iterator &operator++() { _slot = _db->_store.nextLive(_slot + 1); return *this; };
+      iterator operator++(int) { iterator prev = *this; ++(*this); return prev; };
+
+      bool operator==(const iterator &other) const { return _slot == other._slot; };
+      bool operator!=(const iterator &other) const { return _slot != other._slot; };
+
+      PlotHandle getHandle() const { return _db->_store.handleAt(_slot); };
+
+   private:
+      friend class DronePlotDB;
+
+      DronePlotDB *_db;
+      size_t _slot;
+   };
+
+   // Add a plot to the database with the given attributes (mutex'd). Returns the plot's handle
+   PlotHandle addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude,
+                                                                  unsigned short flags = 0);
+
+   // Add a batch of plots under a single lock, each with the given flags
+   void addPlots(const WirePlot *plots, size_t count, unsigned short flags = 0);
+
+   // Load or write the database to/from a CSV file, 
+   int loadCSVFile(const char *filename);
+   int writeCSVFile(const char *filename);
+
+   // Direct binary load/write to/from the specified file
+   int loadBinaryFile(const char *filename);
+   int writeBinaryFile(const char *filename);
+   
+   // Sort the database in order of corrected time. Also reclaims the space of erased plots
+   void sortByTime();
+
+   // Remove all plotpoints of a particular node (used to generate binary, not for student use)
+   void removeNodeID(unsigned int node_id);
+
+   // Iterators for simple access to the database. Can use these to modify drone plot points
+   // but won't be able to add/delete PlotObjects. Use erase (below) for that as it is mutex'd
+   iterator begin() { return iterator(this, _store.firstLive()); };
+   iterator end() { return iterator(this, _store.endSlot()); };
+
+   // A consistent view of the database as it is now, which can be walked from any thread with
+   // no lock held while plots keep being added, changed, erased and sorted. Only the pin and the
+   // release lock the mutex, briefly. Must not outlive the database
+   PlotSnapshotPtr snapshot();
+
+   // Access to a plot by its handle, which (unlike an iterator) survives sortByTime
+   PlotRef getPlot(PlotHandle handle) { return PlotRef(_store, _store.slotOf(handle)); };
+
+   // Match index - hands back the plots added since the last call so a caller can process only
+   // new data, and finds all other plots of the same drone at the same coordinates (mutex'd)
+   void getUnmatched(std::vector<PlotHandle> &plots);
+   void findMatches(PlotHandle plot, std::vector<PlotHandle> &matches);
+
+   // Duplicate index - same idea, keyed by (drone_id, corrected time). getUndeduped also returns
+   // plots whose time was changed with adjustTime or setNodeOffset since the last call (mutex'd)
+   void getUndeduped(std::vector<PlotHandle> &plots);
+   void findDuplicates(PlotHandle plot, std::vector<PlotHandle> &dupes);
+
+   // Spatio-temporal queries, answered from indexes kept up to date on every add, erase and
+   // adjustTime. Time windows are inclusive and in corrected time; results are cleared first,
+   // then loaded (mutex'd)
+   //    findTrack - every plot of one drone from start to end, in time order
+   //    findInBox - every plot inside the lat/lon box (edges included) from start to end
+   void findTrack(unsigned int drone_id, time_t start, time_t end, std::vector<PlotHandle> &plots);
+   void findInBox(float lat_min, float lon_min, float lat_max, float lon_max, time_t start,
+                  time_t end, std::vector<PlotHandle> &plots);
+
+   // Flag changes that pinned snapshots do not see (mutex'd)
+   void setFlags(PlotHandle plot, unsigned short flags);
+   void clrFlags(PlotHandle plot, unsigned short flags);
+
+   // Collects every plot flagged DBFLAG_NEW and clears the flag, in one pass (mutex'd)
+   void takeNewPlots(std::vector<WirePlot> &plots);
+
+   // Shifts a plot's timestamp, keeping the indexes up to date. Use this rather than writing
+   // to timestamp directly once the database is in use by ReplServer (mutex'd)
+   void adjustTime(PlotHandle plot, time_t delta);
+
+   // Node clock offsets - every plot from node_id reads as its timestamp plus the offset in
+   // sorting, the duplicate and position queries and the exported files, without any plot
+   // being rewritten. Setting one queues the node's plots for the next getUndeduped. Throws
+   // runtime_error for a node_id of max_offset_nodes or more (mutex'd)
+   void setNodeOffset(unsigned int node_id, time_t offset);
+   time_t getNodeOffset(unsigned int node_id);
+
+   // Manipulate database entries (mutex'd functions)
+   void popFront();
+   void erase(unsigned int i);
+   void erasePlot(PlotHandle plot);
+   iterator erase(iterator dptr);
+
+
+   // Return the number of plot points stored
+   size_t size() { return _store.size(); };
+
+   // Change counter - goes up with every change made through the mutex'd calls (plots added,
+   // erased or re-timed, flags set or cleared, node offsets set), never down. Read without the
+   // lock, so a caller can tell nothing changed since it last looked for the price of one load.
+   // What changed is in the pending lists behind getUnmatched and getUndeduped
+   uint64_t generation() { return _generation.load(std::memory_order_acquire); };
+
+   // Wipe the database
+   void clear();
+
+   // Durability (see PlotJournal). recover fills an empty database from the journal's newest
+   // checkpoint and the records after it, and returns the number of plots (-1 if the
+   // checkpoint cannot be read). setJournal then has every change made through the mutex'd
+   // calls logged--changes written through a PlotRef are not. checkpoint writes a checkpoint
+   // (normally once checkpointDue says so) so the journal can drop what it covers
+   int recover(PlotJournal &journal);
+   void setJournal(PlotJournal *journal) { _journal = journal; };
+   bool checkpointDue();
+
+   // Journal position after the last change logged so far, and whether everything up to a
+   // position has been synced. Without a journal every position counts as synced; once the
+   // journal has failed none does, so acknowledgements are held and senders keep their copies
+   uint64_t journalMark();
+   bool journalSynced(uint64_t mark);
+   bool checkpoint();
+
+private:
+   // Adds a plot to the store and indexes (mutex must be held)
+   PlotHandle insertPlot(unsigned int drone_id, unsigned int node_id, time_t timestamp,
+                         float latitude, float longitude, unsigned short flags);
+
+   // Removes a plot from the indexes and the store (mutex must be held)
+   void removePlot(PlotHandle plot);
+
+   // Shifts a plot's timestamp and re-indexes it (mutex must be held)
+   void retime(PlotHandle plot, time_t delta);
+
+   // Sets a node's offset and queues its plots to be deduplicated again (mutex must be held)
+   void applyOffset(unsigned int node_id, time_t offset);
+
+   // Adds the entries of a timeline whose corrected time is in [start, end] to found, as
+   // (corrected time, handle) pairs, in order if they fall under one offset (mutex must be held)
+   void scanWindow(const PlotTimeline &line, time_t start, time_t end,
+                   std::vector<PlotTimeline::entry> &found);
+
+   // Pins a snapshot (mutex must be held, and released before the snapshot is dropped)
+   PlotSnapshotPtr pinSnapshot();
+
+   // Counts a change in the generation (mutex must be held, so there is only one writer)
+   void bumpGeneration() {
+      _generation.store(_generation.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+   };
+
+   // Journal - logs a change to the plot at slot (counting it in the generation), and finds
+   // and re-applies one on recovery (mutex must be held)
+   void logChange(uint8_t op, size_t slot, unsigned short flags = 0, int64_t arg = 0);
+   void logOffset(unsigned int node_id, time_t offset);
+   void applyJournal(const JournalEntry &entry);
+   PlotHandle findPlot(const WirePlot &plot);
+
+   // Hands out a list of pending plots, minus any erased since (mutex must be held)
+   void takePending(std::vector<PlotHandle> &pending, std::vector<PlotHandle> &plots);
+
+   // Adds a plot to, or takes it out of, the track and grid indexes (mutex must be held)
+   void indexPosition(PlotHandle plot, unsigned int drone_id, time_t timestamp, float latitude,
+                                                                           float longitude);
+   void unindexPosition(PlotHandle plot, unsigned int drone_id, time_t timestamp, float latitude,
+                                                                           float longitude);
+
+   PlotStore _store;
+
+   // (drone_id, lat, lon) -> plots, and the plots not yet handed out by getUnmatched
+   std::unordered_multimap<PlotMatchKey, PlotHandle, PlotMatchHash> _matchidx;
+   std::vector<PlotHandle> _unmatched;
+
+   // (drone_id, stored timestamp) -> plots, and the plots added or re-timed since the last
+   // getUndeduped
+   std::unordered_multimap<PlotTimeKey, PlotHandle, PlotTimeHash> _timeidx;
+   std::vector<PlotHandle> _undeduped;
+
+   // drone_id -> its track, and grid cell (see gridCell) -> the plots in it
+   std::unordered_map<unsigned int, PlotTimeline> _tracks;
+   std::unordered_map<uint64_t, PlotTimeline> _grid;
+
+   PlotJournal *_journal;
+
+   std::atomic<uint64_t> _generation;
+
+   pthread_mutex_t _mutex; 
+};
+
+
+#endif
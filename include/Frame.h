@@ -0,0 +1,66 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+/********************************************************************************************
+ * Wire framing for server-to-server messages. Every message is a fixed header followed by
+ * its payload:
+ *
+ *    version (1 byte) | type (1 byte) | flags (2 bytes) | length (4 bytes) | payload
+ *
+ * Multi-byte fields are in network (big endian) order. The length is the payload size, so
+ * a receiver always knows where a message ends without looking inside it.
+ ********************************************************************************************/
+
+const uint8_t frame_version = 1;
+const size_t frame_header_size = 8;
+
+// Largest payload accepted--anything bigger is treated as a corrupt stream
+const uint32_t max_frame_payload = 64 * 1024 * 1024;
+
+enum frame_type : uint8_t { frame_sid = 1, frame_auth = 2, frame_rep = 3, frame_ack = 4 };
+
+// An immutable, reference-counted message body. A replication batch is built once and the
+// same buffer sits in every peer's send queue until the last of them has written it out
+typedef std::shared_ptr<const std::vector<uint8_t>> SharedPayload;
+
+// Writes a frame header into hdr (which must hold frame_header_size bytes)
+void encodeFrameHeader(uint8_t type, uint16_t flags, uint32_t length, uint8_t *hdr);
+
+// Appends a complete frame (header and payload) to out
+void encodeFrame(uint8_t type, uint16_t flags, const std::vector<uint8_t> &payload,
+                                                            std::vector<uint8_t> &out);
+
+/********************************************************************************************
+ * FrameDecoder - streaming decoder. Bytes are fed in as they come off the socket, in pieces
+ *                of any size; next() hands back each frame once all of it has arrived. Every
+ *                byte is looked at once, however the stream was split up.
+ ********************************************************************************************/
+class FrameDecoder
+{
+public:
+   FrameDecoder();
+   ~FrameDecoder();
+
+   // Adds bytes received from the stream
+   void feed(const uint8_t *data, size_t len);
+   void feed(const std::vector<uint8_t> &data) { feed(data.data(), data.size()); };
+
+   // Takes the next complete frame, if there is one
+   bool next(uint8_t &type, uint16_t &flags, std::vector<uint8_t> &payload);
+
+   // Bytes buffered that are not yet a complete frame
+   size_t pending() { return _buf.size() - _pos; };
+
+   void clear();
+
+private:
+   std::vector<uint8_t> _buf;
+   size_t _pos;      // start of the first frame not yet taken
+};
+
+#endif
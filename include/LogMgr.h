@@ -1,36 +1,143 @@
-#ifndef LOGMGR_H
-#define LOGMGR_H
-
-#include <string>
-
-/********************************************************************************
- * LogMgr - Log file manager. Includes setting log levels and a function to write
- *          a log entry if it is below a specified log level. Opens for each write
- *          in append mode to help with thread conflicts (but no mutexing)
- ********************************************************************************/
-
-class LogMgr {
-   public:
-      LogMgr(const char *log_file, unsigned int log_lvl);
-      ~LogMgr();
-
-      void writeLog(const char *str, unsigned int lvl=0);
-      void writeLog(std::string &str, unsigned int lvl=0);
-      void strerrLog(const char *str, unsigned int lvl=0);
-
-      void closeLog();
-      
-      unsigned int getLogLvl() { return _log_lvl; }
-
-      static void createTimestamp(std::string &buf);
-
-      void changeFilename(const char *filename);
-
-   private:
-      std::string _log_file;  // Path/name of the log to write to
-      unsigned int _log_lvl;  // The verbosity level
-   
-      FILE *_lfptr = NULL;
-};
-
-#endif // ALMGR_H
+#ifndef LOGMGR_H
+#define LOGMGR_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+
+// Async mode - longest message kept (longer ones are cut short), messages each writing thread
+// can have waiting, and how often the background writer wakes to write them out (it is also
+// woken early when a ring gets half full)
+const size_t log_record_size = 240;
+const size_t log_ring_records = 4096;
+const unsigned int log_flush_ms = 50;
+
+// Rotated files kept (<log>.1 is the newest) when rotation is on
+const unsigned int log_keep_files = 5;
+
+/********************************************************************************
+ * LogRing - one writing thread's queue of waiting log messages in async mode.
+ *           Single producer (the thread), single consumer (the background
+ *           writer), lock-free in the same way as PlotRing
+ ********************************************************************************/
+struct LogRecord {
+   time_t when;
+   uint32_t len;
+   char text[log_record_size];
+};
+
+class LogRing {
+   public:
+      LogRing();
+
+      // Producer: returns the number of records waiting as of the producer's last
+      // look at the consumer, new one included--0 (and nothing queued) if the ring is full
+      size_t push(time_t when, const char *text, size_t len);
+
+      // Consumer: the oldest waiting record, or NULL; release it with pop()
+      const LogRecord *front();
+      void pop();
+
+   private:
+      std::vector<LogRecord> _buf;
+
+      alignas(64) std::atomic<size_t> _tail;
+      size_t _head_cache;
+
+      alignas(64) std::atomic<size_t> _head;
+      size_t _tail_cache;
+};
+
+/********************************************************************************
+ * LogMgr - Log file manager. Includes setting log levels and a function to write
+ *          a log entry if it is below a specified log level. Opens on the first
+ *          write in append mode; writes to the file are mutexed
+ *
+ *          In async mode (startAsync) writeLog only stamps the message with the
+ *          time and copies it into the calling thread's LogRing--no formatting,
+ *          locking or I/O. A background thread collects the rings every
+ *          log_flush_ms, formats the timestamps (ctime_r once per second, not per
+ *          message) and writes each batch with one write and flush. If a ring is
+ *          full the message is dropped and counted rather than making the caller
+ *          wait on the disk; the count is written to the log. Messages from one
+ *          thread stay in order.
+ *
+ *          With rotate_bytes set, once the file grows past it the log is moved to
+ *          <log>.1 (older ones shift up, keeping log_keep_files) and a new one
+ *          started.
+ ********************************************************************************/
+
+class LogMgr {
+   public:
+      LogMgr(const char *log_file, unsigned int log_lvl, size_t rotate_bytes = 0);
+      ~LogMgr();
+
+      void writeLog(const char *str, unsigned int lvl=0);
+      void writeLog(std::string &str, unsigned int lvl=0);
+      void strerrLog(const char *str, unsigned int lvl=0);
+
+      void closeLog();
+
+      unsigned int getLogLvl() { return _log_lvl; }
+
+      static void createTimestamp(std::string &buf);
+
+      void changeFilename(const char *filename);
+
+      // Async mode. stopAsync writes out everything waiting first. Messages that
+      // can't be written because the file won't open are counted as dropped
+      void startAsync();
+      void stopAsync();
+
+      // Messages dropped in async mode because their thread's ring was full
+      uint64_t dropped() { return _dropped.load(); };
+
+   private:
+      bool openLog();
+      void writeOut(const char *data, size_t len);
+      void rotate();
+
+      // Async mode - the calling thread's ring, the background writer, and one
+      // pass over every ring (_file_lock must be held for drainRings and stampFor)
+      LogRing *threadRing();
+      void runWriter();
+      void drainRings();
+      const std::string &stampFor(time_t when);
+
+      std::string _log_file;  // Path/name of the log to write to
+      unsigned int _log_lvl;  // The verbosity level
+
+      FILE *_lfptr = NULL;
+
+      // Rotation - size to rotate at (0 = never) and bytes in the current file
+      size_t _rotate_bytes;
+      size_t _written;
+
+      // _file_lock guards the file and the rotation state. _rings_lock guards the
+      // list of rings (new rings are rare, so the writer just copies the list)
+      std::mutex _file_lock;
+      std::mutex _rings_lock;
+      std::vector<std::unique_ptr<LogRing>> _rings;
+      uint64_t _serial;
+
+      std::atomic<bool> _async;
+      std::atomic<uint64_t> _dropped;
+      uint64_t _reported;
+      bool _stopping;         // guarded by _rings_lock, as is the wait on _wake
+      std::condition_variable _wake;
+      std::thread _writer;
+
+      // Cached timestamp string and the second it is for
+      time_t _stamp_time;
+      std::string _stamp;
+      std::vector<char> _batch;
+};
+
+#endif // LOGMGR_H
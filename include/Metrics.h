@@ -0,0 +1,158 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include "FileDesc.h"
+
+// Counters and histograms are split into this many cache-line sized shards. Each thread
+// updates its own shard; a scrape adds them up
+const unsigned int metric_shards = 8;
+
+// Histogram layout - log-linear: each power of two is split into metric_sub_buckets equal
+// buckets, so a bucket is never more than 25% wide. Values of 2^metric_max_exp or more only
+// land in +Inf
+const unsigned int metric_sub_buckets = 4;
+const unsigned int metric_max_exp = 32;
+const size_t metric_buckets = (metric_max_exp - 1) * metric_sub_buckets;
+
+/********************************************************************************************
+ * MetricCounter - a count that only goes up. add() is one relaxed atomic add on the calling
+ *                 thread's shard, so busy threads don't fight over a cache line
+ ********************************************************************************************/
+class MetricCounter
+{
+public:
+   MetricCounter();
+
+   void add(uint64_t count = 1);
+   uint64_t value();
+
+private:
+   struct alignas(64) Shard {
+      std::atomic<uint64_t> count;
+   };
+   Shard _shards[metric_shards];
+};
+
+/********************************************************************************************
+ * MetricGauge - a value that is set (or moved) to whatever it currently is, i.e. a depth
+ ********************************************************************************************/
+class MetricGauge
+{
+public:
+   MetricGauge():_value(0) {};
+
+   void set(int64_t value) { _value.store(value, std::memory_order_relaxed); };
+   void add(int64_t delta) { _value.fetch_add(delta, std::memory_order_relaxed); };
+   int64_t value() { return _value.load(std::memory_order_relaxed); };
+
+private:
+   std::atomic<int64_t> _value;
+};
+
+/********************************************************************************************
+ * MetricHistogram - distribution of non-negative integer samples (sizes, microseconds) in
+ *                   log-linear buckets. observe() is two relaxed adds on the calling
+ *                   thread's shard
+ ********************************************************************************************/
+class MetricHistogram
+{
+public:
+   MetricHistogram();
+
+   void observe(uint64_t value);
+
+   // Sample count in each bucket (metric_buckets of them, then +Inf) and the sum of the
+   // samples, added up over the shards
+   void collect(std::vector<uint64_t> &counts, uint64_t &sum);
+
+   // Bucket a value falls in, and the largest value that bucket holds
+   static size_t bucketOf(uint64_t value);
+   static uint64_t bucketTop(size_t bucket);
+
+private:
+   struct alignas(64) Shard {
+      std::atomic<uint64_t> counts[metric_buckets + 1];
+      std::atomic<uint64_t> sum;
+   };
+   std::unique_ptr<Shard[]> _shards;
+};
+
+/********************************************************************************************
+ * MetricsRegistry - named metrics for one server, rendered in the Prometheus text format.
+ *                   A metric is a name plus an optional label set, given preformatted (e.g.
+ *                   peer="ds2"); asking for the same pair again returns the same metric.
+ *                   Registering takes a lock, so callers look their metrics up once and keep
+ *                   the reference--updating one takes no lock at all. Metrics live as long
+ *                   as the registry
+ *
+ *                   Throws runtime_error if a name is registered again as a different type
+ ********************************************************************************************/
+class MetricsRegistry
+{
+public:
+   MetricsRegistry();
+   ~MetricsRegistry();
+
+   MetricCounter &counter(const char *name, const char *help, const std::string &labels = "");
+   MetricGauge &gauge(const char *name, const char *help, const std::string &labels = "");
+   MetricHistogram &histogram(const char *name, const char *help,
+                                                               const std::string &labels = "");
+
+   // Appends every metric, families in name order, to out
+   void render(std::string &out);
+
+   // One label of a label set, name="value", with the value escaped as the format needs
+   static std::string label(const char *name, const std::string &value);
+
+private:
+   enum metric_type { mt_counter, mt_gauge, mt_histogram };
+
+   struct Family {
+      metric_type type;
+      std::string help;
+      std::map<std::string, std::unique_ptr<MetricCounter>> counters;
+      std::map<std::string, std::unique_ptr<MetricGauge>> gauges;
+      std::map<std::string, std::unique_ptr<MetricHistogram>> histograms;
+   };
+
+   Family &family(const char *name, const char *help, metric_type type);
+
+   std::mutex _lock;
+   std::map<std::string, Family> _families;
+};
+
+/********************************************************************************************
+ * MetricsServer - answers HTTP GETs for /metrics with the registry's current contents, on a
+ *                 thread of its own so scrapes never touch the replication threads. Meant for
+ *                 a local scraper: one request per connection, one connection at a time
+ ********************************************************************************************/
+class MetricsServer
+{
+public:
+   MetricsServer(MetricsRegistry &registry);
+   ~MetricsServer();
+
+   // Binds and starts serving. Throws socket_error if the address cannot be bound
+   void start(const char *ip_addr, unsigned short port);
+
+   void stop();
+
+private:
+   void runServe();
+   void answer(int fd);
+
+   MetricsRegistry &_registry;
+   SocketFD _sockfd;
+   std::atomic<bool> _stopping;
+   std::thread _server;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef PLOTCSV_H
+#define PLOTCSV_H
+
+#include <vector>
+#include <cstddef>
+#include "PlotCodec.h"
+
+/********************************************************************************************
+ * CSV plot files - one plot per line, no header, no spaces around the commas:
+ *
+ *    drone_id,node_id,timestamp,latitude,longitude
+ *
+ * Lines may end in \n or \r\n; blank lines are skipped. Fields are parsed in place with
+ * std::from_chars, so nothing is allocated per line or per field.
+ *
+ * A whole file is parsed from one buffer (normally a mapping of the file): the buffer is cut
+ * into newline-aligned chunks, each chunk parsed on its own thread into its own vector, and
+ * the vectors come back in file order.
+ *
+ * Lines are written the way the original stream code wrote them (integers as-is, latitude
+ * and longitude to 10 significant digits, %g style) using std::to_chars into a caller's
+ * buffer, so output files compare byte for byte with older ones.
+ ********************************************************************************************/
+
+// Chunks smaller than this are not worth a thread of their own
+const size_t csv_min_chunk = 1024 * 1024;
+
+// Size of the buffer CSV output is formatted into before each write
+const size_t csv_write_buffer = 1024 * 1024;
+
+// Longest line formatPlotCSVLine can produce, newline included
+const size_t csv_max_line = 128;
+
+// Parses one line (without its newline). Returns false if it is not a valid plot
+bool parsePlotCSVLine(const char *begin, const char *end, WirePlot &plot);
+
+// Parses a buffer of lines into parts, one vector per chunk in file order. threads of 0
+// uses one per core. Returns the number of plots, or -1 if any line is not a valid plot
+long parsePlotCSV(const char *data, size_t len, std::vector<std::vector<WirePlot>> &parts,
+                                                                     unsigned int threads = 0);
+
+// Writes one line, newline included, to out (which must hold csv_max_line bytes). Returns
+// the number of bytes written
+size_t formatPlotCSVLine(const WirePlot &plot, char *out);
+
+#endif
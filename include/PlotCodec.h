@@ -0,0 +1,62 @@
+#ifndef PLOTCODEC_H
+#define PLOTCODEC_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/********************************************************************************************
+ * Binary layout of a drone plot, used on the wire between servers and in binary database
+ * files. Each record is exactly 24 bytes, little endian, no padding:
+ *
+ *    drone_id (u32) | node_id (u32) | timestamp (i64) | latitude (f32) | longitude (f32)
+ *
+ * A replication batch is a u32 record count followed by that many records.
+ *
+ * On a little-endian host the records are copied in and out whole; a big-endian host swaps
+ * the fields in a single tight loop over the batch.
+ ********************************************************************************************/
+
+struct WirePlot {
+   uint32_t drone_id;
+   uint32_t node_id;
+   int64_t timestamp;
+   float latitude;
+   float longitude;
+};
+
+static_assert(sizeof(WirePlot) == 24, "WirePlot must match the 24-byte wire record");
+
+const size_t wire_plot_size = sizeof(WirePlot);
+const size_t wire_batch_header = sizeof(uint32_t);
+
+// True on big-endian hosts, where records must be swapped to and from the wire layout. When
+// false a WirePlot in memory already is the wire record and can be used in place
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+const bool wire_needs_swap = true;
+#else
+const bool wire_needs_swap = false;
+#endif
+
+// Converts a single field between host and wire (little endian) order--the same call goes
+// either way
+inline uint16_t wireOrder(uint16_t val) { return wire_needs_swap ? __builtin_bswap16(val) : val; }
+inline uint32_t wireOrder(uint32_t val) { return wire_needs_swap ? __builtin_bswap32(val) : val; }
+inline uint64_t wireOrder(uint64_t val) { return wire_needs_swap ? __builtin_bswap64(val) : val; }
+inline int64_t wireOrder(int64_t val) { return (int64_t) wireOrder((uint64_t) val); }
+
+// Single records (out/in must hold wire_plot_size bytes)
+void encodeWirePlot(const WirePlot &plot, uint8_t *out);
+void decodeWirePlot(const uint8_t *in, WirePlot &plot);
+
+// Bare runs of records with no count (out/in must hold count * wire_plot_size bytes)
+void encodePlotRecords(const WirePlot *plots, size_t count, uint8_t *out);
+void decodePlotRecords(const uint8_t *in, size_t count, WirePlot *plots);
+
+// Appends a batch (count, then the records) to out
+void encodePlotBatch(const WirePlot *plots, size_t count, std::vector<uint8_t> &out);
+
+// Decodes a whole batch into plots (replacing what was there)
+void decodePlotBatch(const uint8_t *data, size_t len, std::vector<WirePlot> &plots);
+
+#endif
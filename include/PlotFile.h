@@ -0,0 +1,113 @@
+#ifndef PLOTFILE_H
+#define PLOTFILE_H
+
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <ctime>
+#include "PlotCodec.h"
+#include "FileDesc.h"
+
+/********************************************************************************************
+ * Binary plot file, version 2. Everything is little endian:
+ *
+ *    header (64 bytes) | records (record_count x 24 bytes) | [flags] | time index
+ *
+ * The records are the same 24-byte WirePlot records used on the wire and start on a 64-byte
+ * boundary, so a mapped file can be read in place. The time index is sparse: one entry
+ * (min_time, max_time) for each block of index_stride records, enough to go straight to the
+ * blocks a time range touches without reading the rest.
+ *
+ * Files that carry the database flags (checkpoints do) have a u16 per record right after the
+ * records, and plotfile_has_flags set.
+ *
+ * Version 1 files are just the records with no header; they are still read (without an
+ * index) and told apart by not starting with the magic.
+ ********************************************************************************************/
+
+const char plot_file_magic[8] = {'D', 'R', 'N', 'P', 'L', 'O', 'T', '\0'};
+const uint16_t plot_file_version = 2;
+const uint32_t plot_file_schema = 1;         // the WirePlot record layout
+const uint32_t plot_index_stride = 1024;
+
+// Header flag bits
+const uint16_t plotfile_sorted = 0x0001;     // records are in timestamp order
+const uint16_t plotfile_has_flags = 0x0002;  // a flags column follows the records
+
+struct PlotFileHeader {
+   char magic[8];
+   uint16_t version;
+   uint16_t header_size;      // records start here
+   uint16_t record_size;
+   uint16_t flags;
+   uint32_t schema;
+   uint32_t index_stride;     // records per index entry
+   uint64_t record_count;
+   int64_t min_time;
+   int64_t max_time;
+   uint64_t index_offset;
+   uint64_t index_count;
+};
+
+struct PlotIndexEntry {
+   int64_t min_time;
+   int64_t max_time;
+};
+
+static_assert(sizeof(PlotFileHeader) == 64, "PlotFileHeader must match the 64-byte file header");
+static_assert(sizeof(PlotIndexEntry) == 16, "PlotIndexEntry must match the 16-byte index entry");
+
+/********************************************************************************************
+ * PlotFile - a plot file opened for reading. The file is memory mapped, so opening it costs
+ *            the same whatever its size and records are only paged in as they are used.
+ ********************************************************************************************/
+class PlotFile
+{
+public:
+   PlotFile();
+   ~PlotFile();
+
+   // Maps and checks the file. Throws runtime_error if it cannot be opened or is corrupt
+   void open(const char *filename);
+   void close();
+
+   size_t size() { return _count; };
+   bool isLegacy() { return _legacy; };
+   bool isSorted() { return (_flags & plotfile_sorted) != 0; };
+   bool hasIndex() { return _index != NULL; };
+   bool hasFlags() { return _rec_flags != NULL; };
+   time_t minTime() { return _min_time; };
+   time_t maxTime() { return _max_time; };
+
+   // The records in place, in wire layout. Only usable as WirePlots when !wire_needs_swap--
+   // readRecords works on any host
+   const WirePlot *records() { return (const WirePlot *) _records; };
+   const uint8_t *rawRecords() { return _records; };
+
+   // Decodes count records starting at first into plots
+   void readRecords(size_t first, size_t count, WirePlot *plots);
+
+   // Copies out the flags of count records starting at first (all 0 without a flags column)
+   void readFlags(size_t first, size_t count, unsigned short *flags);
+
+   // Writes plots (and, if given, their flags) out as a version 2 file. durable syncs it to
+   // the disk before returning. Returns false if the file could not be written
+   static bool write(const char *filename, const WirePlot *plots, size_t count,
+                     const unsigned short *flags = NULL, bool durable = false);
+
+private:
+   time_t timeAt(size_t i);
+
+   std::unique_ptr<FileFD> _file;
+
+   const uint8_t *_records;
+   const uint8_t *_rec_flags;
+   const uint8_t *_index;
+   size_t _count;
+   bool _legacy;
+   uint16_t _flags;
+   time_t _min_time;
+   time_t _max_time;
+};
+
+#endif
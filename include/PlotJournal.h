@@ -0,0 +1,184 @@
+#ifndef PLOTJOURNAL_H
+#define PLOTJOURNAL_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include "PlotCodec.h"
+#include "FileDesc.h"
+
+/********************************************************************************************
+ * Write-ahead journal for DronePlotDB. Every change to the database is appended as a fixed
+ * 40-byte record, little endian:
+ *
+ *    op (u8) | reserved (u8) | flags (u16) | check (u32) | plot (24-byte WirePlot) | arg (i64)
+ *
+ * check is an FNV-1a hash of the other 36 bytes, so a record torn by a crash is spotted on
+ * replay. Plots are named by their contents, not their handles, since handles are not the
+ * same from one run to the next.
+ *
+ * The journal directory holds numbered segments and checkpoints:
+ *
+ *    journal.<seq>          16-byte header, then records
+ *    checkpoint.<seq>.bin   a version 2 plot file (with flags) of everything logged in the
+ *                           segments before <seq>
+ *
+ * Recovery loads the newest checkpoint and replays only the segments from its number on, so
+ * restart time is bounded by the checkpoint interval rather than the size of the database.
+ ********************************************************************************************/
+
+enum journal_op : uint8_t {
+   jop_insert = 1,      // plot added with flags
+   jop_erase = 2,       // plot removed
+   jop_retime = 3,      // plot's timestamp shifted by arg
+   jop_setflags = 4,    // flags set on plot
+   jop_clrflags = 5,    // flags cleared on plot
+   jop_takenew = 6,     // DBFLAG_NEW cleared on every plot
+   jop_clear = 7,       // everything removed
+   jop_offset = 8       // clock offset of node plot.node_id set to arg
+};
+
+struct JournalEntry {
+   uint8_t op;
+   unsigned short flags;
+   WirePlot plot;
+   int64_t arg;
+};
+
+const size_t journal_record_size = 40;
+const size_t journal_header_size = 16;
+const char journal_magic[8] = {'D', 'R', 'N', 'J', 'R', 'N', 'L', '\0'};
+const uint32_t journal_version = 1;
+
+// Appended records are committed (written and fdatasync'd together) at least this often
+const unsigned int journal_commit_ms = 20;
+
+// ...or as soon as this much is waiting
+const size_t journal_commit_bytes = 1024 * 1024;
+
+// A checkpoint is due once the current segments hold this many records
+const size_t journal_checkpoint_records = 1000000;
+
+/********************************************************************************************
+ * PlotJournal - the journal for one database. Appends only copy the record into a buffer; a
+ *               commit thread writes out and syncs everything appended since its last pass
+ *               in one go (group commit), so many changes share each fdatasync. A change is
+ *               durable once sync() returns true or committed() reaches the appended() count
+ *               taken after it.
+ *
+ *               A failed write stops the journal: the segment's end can no longer be trusted,
+ *               so nothing more is written, committed() stays where it was and failed() turns
+ *               true until a restart, whose recovery cuts the torn end off.
+ *
+ *               Recovery (checkpointFile, nextRecord) must come before start(). Appends are
+ *               safe from any thread; rotate is meant to be called with the database locked
+ *               so the checkpoint taken alongside it lines up with the segments exactly, and
+ *               does no I/O so that lock is not held across a sync.
+ ********************************************************************************************/
+class PlotJournal
+{
+public:
+   PlotJournal(const char *dir, size_t checkpoint_records = journal_checkpoint_records,
+                                             unsigned int commit_ms = journal_commit_ms);
+   ~PlotJournal();
+
+   // Recovery - the newest complete checkpoint ("" if none), then every record logged after
+   // it, in order. Replay stops at the first torn or corrupt record, which is cut off the
+   // end of its segment along with any segments after it
+   std::string checkpointFile();
+   bool nextRecord(JournalEntry &entry);
+
+   // Opens a new segment and starts the commit thread. Throws runtime_error if the segment
+   // cannot be created
+   void start();
+
+   // Commits whatever is waiting and stops the commit thread
+   void stop();
+
+   // Adds a record. It is written out by the next commit (dropped once the journal has failed)
+   void append(const JournalEntry &entry);
+
+   // Blocks until everything appended so far has been committed. false if a write failed
+   bool sync();
+   bool failed();
+
+   // Checkpointing, one at a time - prepareRotate creates and syncs the next segment and
+   // returns its number (0 if it could not). rotate makes it live; everything appended
+   // before the call belongs to checkpoint <that number>. finishRotate commits what was left
+   // for the old segment and closes it. The checkpoint is written to checkpointTemp(seq) and
+   // finishCheckpoint puts it in place and deletes what it replaces
+   bool checkpointDue();
+   uint64_t prepareRotate();
+   void rotate();
+   void finishRotate();
+   std::string checkpointTemp(uint64_t seq);
+   bool finishCheckpoint(uint64_t seq);
+
+   // Records appended, records committed and commits made since start. Compare committed
+   // against an earlier appended to see whether what was appended by then is durable
+   uint64_t appended();
+   uint64_t committed();
+   uint64_t commits();
+
+private:
+   void runCommit();
+   void commitPending(std::unique_lock<std::mutex> &lock);
+   void commitTail(std::unique_lock<std::mutex> &lock);
+   void endCommit(bool ok, uint64_t upto);
+   bool writeBatch(FileFD *seg, std::vector<uint8_t> &batch);
+   std::unique_ptr<FileFD> createSegment(uint64_t seq);
+
+   // Directory scan - segment and checkpoint numbers found, in order
+   void scanDir(std::vector<uint64_t> &segments, std::vector<uint64_t> &checkpoints);
+   std::string segmentFile(uint64_t seq);
+   std::string checkpointName(uint64_t seq);
+   bool syncDir();
+
+   // Abandons replay after a bad record at offset in the current segment
+   void cutReplay(size_t offset);
+
+   std::string _dir;
+   size_t _checkpoint_records;
+   unsigned int _commit_ms;
+
+   // Replay state
+   bool _scanned;
+   uint64_t _ckpt_seq;
+   std::vector<uint64_t> _replay;
+   size_t _replay_idx;
+   std::unique_ptr<FileFD> _replay_file;
+   size_t _replay_pos;
+   uint64_t _last_seq;
+
+   // Live segment. _io_lock orders whole commits (taken before _lock); _lock guards the
+   // pending buffer, the counters and which segment is which
+   std::unique_ptr<FileFD> _segment;
+   uint64_t _seq;
+
+   // Rotation - the next segment, ready to go live, and the one rotated away from with the
+   // records still owed to it. The tail is committed before anything appended after it
+   std::unique_ptr<FileFD> _next_segment;
+   std::unique_ptr<FileFD> _old_segment;
+   std::vector<uint8_t> _tail;
+   uint64_t _tail_upto;
+
+   std::mutex _io_lock;
+   std::mutex _lock;
+   std::condition_variable _wake;
+   std::condition_variable _done;
+   std::vector<uint8_t> _pending;
+   uint64_t _appended;
+   uint64_t _committed;
+   uint64_t _commits;
+   size_t _since_ckpt;
+   unsigned int _sync_waiters;
+   bool _failed;
+   bool _stopping;
+   std::thread _committer;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef PLOTRING_H
+#define PLOTRING_H
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include "PlotCodec.h"
+
+// Default capacity of the antenna-to-replication ring, in plots (a power of two)
+const size_t ingest_ring_size = 16384;
+
+/********************************************************************************************
+ * PlotRing - bounded, lock-free, single-producer/single-consumer ring of plots. The antenna
+ *            thread pushes what it receives and the replication thread drains it into the
+ *            database in batches, so neither waits on the other or on the database lock to
+ *            hand plots over.
+ *
+ *            Exactly one thread may push and exactly one thread may pop. The indexes only
+ *            ever grow; each side publishes its own with a release store and reads the
+ *            other's with an acquire load, and keeps a cached copy of the other's so it only
+ *            touches the shared cache line when the ring looks full (or empty).
+ ********************************************************************************************/
+class PlotRing
+{
+public:
+   PlotRing(size_t capacity = ingest_ring_size);
+   ~PlotRing();
+
+   // Producer: copies in as many of the plots as fit and returns how many that was
+   size_t push(const WirePlot *plots, size_t count);
+
+   // Consumer: copies out up to max plots, oldest first, and returns how many
+   size_t pop(WirePlot *plots, size_t max);
+
+   // Plots waiting (exact only when called from one of the two sides)
+   size_t size();
+
+   size_t capacity() { return _buf.size(); };
+
+private:
+   std::vector<WirePlot> _buf;
+   size_t _mask;
+
+   // Producer and consumer state on separate cache lines so they do not false-share
+   alignas(64) std::atomic<size_t> _tail;    // next slot to write, owned by the producer
+   size_t _head_cache;                       // producer's last look at _head
+
+   alignas(64) std::atomic<size_t> _head;    // next slot to read, owned by the consumer
+   size_t _tail_cache;                       // consumer's last look at _tail
+};
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef PLOTSTORE_H
+#define PLOTSTORE_H
+
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include <utility>
+#include <set>
+
+// Handle to a plot in a PlotStore. Unlike a slot, a handle stays attached to the same plot
+// when the store is compacted or sorted, until the plot is killed
+typedef uint32_t PlotHandle;
+const PlotHandle no_plot = (PlotHandle) -1;
+
+// Plots are stored in fixed-size chunks so appending never moves existing data
+const unsigned int plot_chunk_bits = 12;
+const unsigned int plot_chunk_size = 1 << plot_chunk_bits;
+const unsigned int plot_chunk_mask = plot_chunk_size - 1;
+const unsigned int max_plot_chunks = 1 << 16;      // ~268M plots
+
+// Reserved flag bits (DBFLAG_ values stay below 0x100). Dead marks a slot whose plot was
+// killed, moved one whose timestamp changed since the last sort
+const unsigned short plotflag_dead = 0x8000;
+const unsigned short plotflag_moved = 0x4000;
+
+// Node IDs a clock offset can be set for run from 0 to below this
+const unsigned int max_offset_nodes = 4096;
+
+/**************************************************************************************************
+ * PlotChunk - plot_chunk_size plots, one array per field. born is the store epoch the chunk was
+ *             (re)issued in--any snapshot taken at or after that epoch may be reading it
+ **************************************************************************************************/
+struct PlotChunk {
+   unsigned int drone_id[plot_chunk_size];
+   unsigned int node_id[plot_chunk_size];
+   time_t timestamp[plot_chunk_size];
+   float latitude[plot_chunk_size];
+   float longitude[plot_chunk_size];
+   unsigned short flags[plot_chunk_size];
+   PlotHandle handle[plot_chunk_size];
+   uint64_t born;
+};
+
+/**************************************************************************************************
+ * PlotSnapshot - a frozen, read-only view of a PlotStore as of one moment. It holds the chunk
+ *                pointers the store had then; the store copies a chunk before changing it while
+ *                any snapshot may still be reading it, so a snapshot can be walked without a lock
+ *                while the store keeps changing. Get one from PlotStore::pin and hand it back
+ *                with unpin (DronePlotDB::snapshot does both). The node clock offsets are
+ *                copied at the pin, so correctedTime is frozen along with everything else.
+ **************************************************************************************************/
+class PlotSnapshot
+{
+public:
+   PlotSnapshot():_end(0),_epoch(0) {};
+
+   size_t endSlot() const { return _end; };
+   size_t firstLive() const { return nextLive(0); };
+   size_t nextLive(size_t slot) const {
+      while ((slot < _end) && !isLive(slot))
+         slot++;
+      return slot;
+   };
+   bool isLive(size_t slot) const { return !(flags(slot) & plotflag_dead); };
+
+   unsigned int droneID(size_t slot) const { return chunk(slot).drone_id[slot & plot_chunk_mask]; };
+   unsigned int nodeID(size_t slot) const { return chunk(slot).node_id[slot & plot_chunk_mask]; };
+   time_t timestamp(size_t slot) const { return chunk(slot).timestamp[slot & plot_chunk_mask]; };
+   float latitude(size_t slot) const { return chunk(slot).latitude[slot & plot_chunk_mask]; };
+   float longitude(size_t slot) const { return chunk(slot).longitude[slot & plot_chunk_mask]; };
+   unsigned short flags(size_t slot) const { return chunk(slot).flags[slot & plot_chunk_mask]; };
+
+   // The timestamp with its node's clock offset applied
+   time_t correctedTime(size_t slot) const { return timestamp(slot) + offsetOf(nodeID(slot)); };
+   time_t offsetOf(unsigned int node_id) const {
+      return (node_id < _offsets.size()) ? _offsets[node_id] : 0;
+   };
+
+   uint64_t epoch() const { return _epoch; };
+
+private:
+   friend class PlotStore;
+
+   const PlotChunk &chunk(size_t slot) const { return *_chunks[slot >> plot_chunk_bits]; };
+
+   std::vector<const PlotChunk *> _chunks;
+   std::vector<time_t> _offsets;
+   size_t _end;
+   uint64_t _epoch;
+};
+
+/**************************************************************************************************
+ * PlotStore - columnar (struct-of-arrays) storage for drone plots. Each field lives in its own
+ *             array inside a chunk, so a sweep over one or two fields streams through memory
+ *             instead of chasing list nodes around the heap.
+ *
+ *             Plots are addressed two ways: by slot, their current position (which is the
+ *             iteration order), and by handle, which is stable. Killing a plot only marks its
+ *             slot dead; sortByTime() squeezes dead slots out as it re-orders.
+ *
+ *             Timestamps are stored as the reporting node gave them. Each node can be given a
+ *             clock offset, added on the way out (correctedTime), so correcting a node's clock
+ *             is one table entry rather than a rewrite of its plots. "Time order" always
+ *             means corrected time.
+ *
+ *             Time order is kept incrementally. The store tracks the sorted run at the front,
+ *             which in-order appends simply extend, plus the slots appended out of order or
+ *             re-timed since the last sort. sortByTime() merges just those back in and
+ *             rewrites only the slots from the first change on--or does nothing at all if
+ *             nothing changed. Changing a node's offset makes the next sort a full one.
+ *
+ *             The chunk and handle directories are reserved up front and never reallocate, so
+ *             a reader walking slots is not invalidated by another thread appending.
+ *
+ *             Snapshots are multi-version: pin() bumps the store epoch and shares the current
+ *             chunks with the snapshot. Writing to a chunk born at or before the newest pinned
+ *             epoch first replaces it with a copy, and the old one is retired with the epoch it
+ *             was retired in. Once every snapshot that could hold it has been unpinned, a
+ *             retired chunk goes back on the spare list.
+ *
+ *             Not thread-safe on its own--DronePlotDB does the locking.
+ **************************************************************************************************/
+class PlotStore
+{
+public:
+   PlotStore();
+   virtual ~PlotStore();
+
+   // Adds a plot at the end and returns its handle
+   PlotHandle append(unsigned int drone_id, unsigned int node_id, time_t timestamp,
+                     float latitude, float longitude, unsigned short flags = 0);
+
+   // Marks a plot dead and releases its handle. The slot is reclaimed by sortByTime()
+   void kill(PlotHandle handle);
+
+   // Changes a plot's timestamp, noting that it may now be out of order
+   void setTimestamp(size_t slot, time_t timestamp);
+
+   // Node clock offsets - added to every timestamp from that node when read through
+   // correctedTime. shifts() lists the distinct offsets in use, 0 (the default) included.
+   // setOffset throws runtime_error for a node_id of max_offset_nodes or more
+   void setOffset(unsigned int node_id, time_t offset);
+   time_t offsetOf(unsigned int node_id) const {
+      return (node_id < _offsets.size()) ? _offsets[node_id] : 0;
+   };
+   const std::vector<time_t> &shifts() const { return _shifts; };
+   const std::vector<time_t> &offsets() const { return _offsets; };
+   time_t correctedTime(size_t slot) const { return timeAt(slot); };
+
+   // Puts the plots in corrected time order (stable) and drops dead slots
+   void sortByTime();
+
+   // True if the plots are in corrected time order (ignoring dead slots)
+   bool isSorted() { return (_run_end == _end) && (_displaced.size() == 0); };
+
+   // Removes everything
+   void clear();
+
+   // Slot access -- slots run from 0 to endSlot(), dead ones included
+   size_t endSlot() { return _end; };
+   size_t firstLive();
+   size_t nextLive(size_t slot);
+   bool isLive(size_t slot) { return !(flagsAt(slot) & plotflag_dead); };
+
+   // Handle <-> slot lookup
+   size_t slotOf(PlotHandle handle) {
+      return _handle_dir[handle >> plot_chunk_bits][handle & plot_chunk_mask];
+   };
+   PlotHandle handleAt(size_t slot) { return rchunk(slot).handle[slot & plot_chunk_mask]; };
+   bool isValid(PlotHandle handle);
+
+   // Column access by slot. Change timestamps with setTimestamp to keep the sort order right.
+   // Writing through these changes the plot in place, where a pinned snapshot may see it--use
+   // setTimestamp/setFlags/clrFlags for changes snapshots must not see
+   unsigned int &droneID(size_t slot) { return rawChunk(slot).drone_id[slot & plot_chunk_mask]; };
+   unsigned int &nodeID(size_t slot) { return rawChunk(slot).node_id[slot & plot_chunk_mask]; };
+   time_t &timestamp(size_t slot) { return rawChunk(slot).timestamp[slot & plot_chunk_mask]; };
+   float &latitude(size_t slot) { return rawChunk(slot).latitude[slot & plot_chunk_mask]; };
+   float &longitude(size_t slot) { return rawChunk(slot).longitude[slot & plot_chunk_mask]; };
+   unsigned short &flags(size_t slot) { return rawChunk(slot).flags[slot & plot_chunk_mask]; };
+
+   // Flag changes that leave pinned snapshots as they were
+   void setFlags(size_t slot, unsigned short set) {
+      chunk(slot).flags[slot & plot_chunk_mask] |= set;
+   };
+   void clrFlags(size_t slot, unsigned short clr) {
+      chunk(slot).flags[slot & plot_chunk_mask] &= ~clr;
+   };
+
+   // Number of live plots
+   size_t size() { return _live; };
+
+   // Freezes the current contents into snap, and releases a snapshot taken earlier
+   void pin(PlotSnapshot &snap);
+   void unpin(const PlotSnapshot &snap);
+
+private:
+   // Read (and raw) access never copies. chunk() copies the chunk first if a snapshot may
+   // share it, and is what every change made by the store itself goes through
+   const PlotChunk &rchunk(size_t slot) const { return *_chunks[slot >> plot_chunk_bits]; };
+   PlotChunk &rawChunk(size_t slot) { return *_chunks[slot >> plot_chunk_bits]; };
+   PlotChunk &chunk(size_t slot) {
+      PlotChunk *&cptr = _chunks[slot >> plot_chunk_bits];
+      if ((_pins.size() > 0) && (cptr->born <= *_pins.rbegin()))
+         cptr = copyChunk(cptr);
+      return *cptr;
+   };
+   time_t timeAt(size_t slot) const {
+      const PlotChunk &from = rchunk(slot);
+      return from.timestamp[slot & plot_chunk_mask] + offsetOf(from.node_id[slot & plot_chunk_mask]);
+   };
+   unsigned short flagsAt(size_t slot) const { return rchunk(slot).flags[slot & plot_chunk_mask]; };
+
+   // Gets a chunk from the spares or allocates a new one
+   PlotChunk *newChunk();
+
+   // Copy-on-write, and giving back a chunk that is no longer in the store
+   PlotChunk *copyChunk(PlotChunk *shared);
+   void releaseChunk(PlotChunk *chunk);
+   void reclaim();
+
+   PlotHandle newHandle(size_t slot);
+
+   // Writes the plots at the listed slots, in order, into the slots starting at first
+   void rewrite(size_t first, const std::vector<std::pair<time_t, uint32_t>> &order);
+
+   // Drops dead slots without re-ordering (store must already be sorted)
+   void compact();
+
+   std::vector<PlotChunk *> _chunks;      // slot >> plot_chunk_bits -> chunk
+   std::vector<PlotChunk *> _spare;       // released chunks, ready for reuse
+
+   std::vector<uint32_t *> _handle_dir;   // handle -> slot, chunked the same way
+   std::vector<PlotHandle> _free_handles;
+   PlotHandle _next_handle;
+
+   size_t _end;      // one past the last slot used
+   size_t _live;     // slots in use that are not dead
+   size_t _head;     // no live slot below this (speeds up firstLive after popFront)
+
+   // Sort tracking - [0, _run_end) was in order as of the last sort or append, except for the
+   // _displaced slots. Nothing below _first_dirty was displaced or killed since the last sort
+   size_t _run_end;
+   time_t _run_max;
+   std::vector<uint32_t> _displaced;
+   size_t _first_dirty;
+
+   // Node clock offsets (node_id -> offset) and the distinct values among them, plus 0
+   std::vector<time_t> _offsets;
+   std::vector<time_t> _shifts;
+
+   // Snapshot epochs - _epoch is bumped by each pin, _pins holds the epochs still pinned and
+   // _retired the replaced chunks some of them may still be reading, with the retiring epoch
+   uint64_t _epoch;
+   std::multiset<uint64_t> _pins;
+   std::vector<std::pair<uint64_t, PlotChunk *>> _retired;
+};
+
+#endif
@@ -1,92 +1,123 @@
-#ifndef QUEUEMGR_H
-#define QUEUEMGR_H
-
-#include <queue>
-#include <vector>
-#include <crypto++/secblock.h>
-#include "TCPServer.h"
-
-/*******************************************************************************************
- * QueueMgr - Child class of the TCPServer object, manages a Queue for a middleware/app
- *            server. Designed in a modular format. Messages are placed into the outgoing
- *            queue using sendToServer by Server ID or sendToAll to send to all servers in
- *            the list (Multicast flooding). 
- *             
- *            The handleQueue method is called by the management process, which looks for 
- *            new connections on the socket. These connections are accepted and authenticated,
- *            where they store their data until their data is moved into the queue for
- *            retrieval. 
- *            
- *            The pop function does two things. First, it "pops" (sends) incoming data to the
- *            management process and second, it assigns all outgoing data to a "Message
- *            Channel Agent", or TCPConn object.
- *
- *******************************************************************************************/
-class QueueMgr : public TCPServer 
-{
-public:
-   QueueMgr(unsigned int verbosity=1);
-   virtual ~QueueMgr();
-
-   void handleQueue();
-
-   void populateQueue();
-
-   // Pops a received queue element off the queue
-   bool pop(std::string &sid, std::vector<uint8_t> &data);
-
-   // Loads replication information into the Queue to transmit to servers
-   void sendToAll(std::vector<uint8_t> &data);
-   void sendToServer(const char *server_id, std::vector<uint8_t> &data);
-   
-   // Overload simply to remove this server from _server_list. Calls parent funct
-   void bindSvr(const char *ip_addr, unsigned short port);
-
-
-   // Gets the ID of this particular server
-   const char *getServerID() { return _server_ID.c_str(); };
-
-   // Get the number of servers we are replicating to
-   unsigned int getNumServers() { return _server_list.size(); };
-
-   // Looks up another server based off IP address and port
-   const char *getClientID(unsigned long ip_addr, unsigned short port);
-
-   // Overloaded to prevent this function from being used
-   virtual void runServer();
-
-   //return leader details
-   std::vector<std::string> getLeader();
-
-private:
-
-   // Launches a connection to the other server from queue data
-   void launchDataConn(const char *sid, std::vector<uint8_t> &data);
-
-   // Loads server information from servers.txt
-   int loadServerList(const char *filename);
-
-   // Set up our types for managing our queue
-   enum qe_type {send, recv};
-   struct queue_element {
-
-      queue_element(qe_type in_type, const char *in_sid, std::vector<uint8_t> &in_data)
-                  : type(in_type), server_id(in_sid), data(in_data) {}
-
-      qe_type type;
-      std::string server_id;
-      std::vector<uint8_t> data;
-   };
-
-   std::string _server_ID;
-
-   // The queue list
-   std::queue<queue_element> _queue;
-
-   std::vector<std::tuple<std::string, unsigned long, unsigned short>> _server_list;
-
-   std::vector<std::string> _leader_order;  
-};
-
-
-#endif
+#ifndef QUEUEMGR_H
+#define QUEUEMGR_H
+
+#include <queue>
+#include <map>
+#include <vector>
+#include <crypto++/secblock.h>
+#include "TCPServer.h"
+
+// Names a received message so it can be acknowledged once it is stored: the connection it
+// came in on and its number there (see TCPConn::ackInput)
+struct MsgReceipt {
+   uint64_t conn_id;
+   uint64_t seq;
+};
+
+/*******************************************************************************************
+ * QueueMgr - Child class of the TCPServer object, manages a Queue for a middleware/app
+ *            server. Designed in a modular format. Messages are placed into the outgoing
+ *            queue using sendToServer by Server ID or sendToAll to send to all servers in
+ *            the list (Multicast flooding). 
+ *             
+ *            The handleQueue method is called by the management process after pollEvents has
+ *            waited for socket activity, and looks for new connections on the socket. These connections are accepted and authenticated,
+ *            where they store their data until their data is moved into the queue for
+ *            retrieval. 
+ *            
+ *            The pop function does two things. First, it "pops" (sends) incoming data to the
+ *            management process and second, it assigns all outgoing data to a "Message
+ *            Channel Agent", or TCPConn object. Incoming data is not acknowledged to the
+ *            sender until the management process hands its receipt to acknowledge.
+ *
+ *            There is one outbound channel per peer, kept open and reused for every message
+ *            to that peer, so a replication pass costs no connects or handshakes once the
+ *            channels are up.
+ *
+ *******************************************************************************************/
+class QueueMgr : public TCPServer 
+{
+public:
+   QueueMgr(unsigned int verbosity=1);
+   virtual ~QueueMgr();
+
+   void handleQueue();
+
+   void populateQueue();
+
+   // Pops a received queue element off the queue
+   bool pop(std::string &sid, std::vector<uint8_t> &data, MsgReceipt &receipt);
+
+   // Acknowledges a popped element to its sender, if the connection it came on is still up
+   void acknowledge(const MsgReceipt &receipt);
+
+   // Loads replication information into the Queue to transmit to servers. The buffer is
+   // shared by every send, never copied
+   void sendToAll(SharedPayload data);
+   void sendToServer(const char *server_id, SharedPayload data);
+   
+   // Overload simply to remove this server from _server_list. Calls parent funct
+   void bindSvr(const char *ip_addr, unsigned short port);
+
+
+   // Gets the ID of this particular server
+   const char *getServerID() { return _server_ID.c_str(); };
+
+   // Get the number of servers we are replicating to
+   unsigned int getNumServers() { return _server_list.size(); };
+
+   // ID of server i of getNumServers()
+   const char *getServerIDAt(unsigned int i) { return std::get<0>(_server_list[i]).c_str(); };
+
+   // Elements (received and to send) waiting in the queue
+   size_t getQueueDepth() { return _queue.size(); };
+
+   // Looks up another server based off IP address and port
+   const char *getClientID(unsigned long ip_addr, unsigned short port);
+
+   // Overloaded to prevent this function from being used
+   virtual void runServer();
+
+   //return leader details - server IDs in priority order, leader first
+   const std::vector<std::string> &getLeader() { return _leader_order; };
+
+private:
+
+   // Queues data on the channel to the other server, launching the channel if needed
+   void launchDataConn(const char *sid, SharedPayload data);
+
+   // Loads server information from servers.txt
+   int loadServerList(const char *filename);
+
+   // Set up our types for managing our queue
+   enum qe_type {send, recv};
+   struct queue_element {
+
+      queue_element(const char *in_sid, std::vector<uint8_t> &&in_data, MsgReceipt in_receipt)
+                  : type(recv), server_id(in_sid), data(std::move(in_data)),
+                    receipt(in_receipt) {}
+      queue_element(const char *in_sid, SharedPayload in_payload)
+                  : type(send), server_id(in_sid), payload(std::move(in_payload)) {}
+
+      qe_type type;
+      std::string server_id;
+      std::vector<uint8_t> data;    // recv
+      MsgReceipt receipt;           // recv
+      SharedPayload payload;        // send
+   };
+
+   std::string _server_ID;
+
+   // The queue list
+   std::queue<queue_element> _queue;
+
+   std::vector<std::tuple<std::string, unsigned long, unsigned short>> _server_list;
+
+   std::vector<std::string> _leader_order;  
+
+   // Outbound channel per peer server ID (owned by _connlist, never removed from it)
+   std::map<std::string, TCPConn *> _channels;
+};
+
+
+#endif
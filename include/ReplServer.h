@@ -2,9 +2,18 @@
 #define REPLSERVER_H
 
 #include <map>
+#include <deque>
 #include <memory>
+#include <atomic>
+#include <pthread.h>
 #include "QueueMgr.h"
 #include "DronePlotDB.h"
+#include "PlotRing.h"
+#include "BoundedQueue.h"
+#include "Metrics.h"
+
+// Most batches each pipeline queue holds before the stage feeding it has to wait
+const size_t pipeline_queue_depth = 64;
 
 /***************************************************************************************
  * ReplServer - class that manages replication between servers. The data is automatically
@@ -13,6 +22,20 @@
  *              the communications. This object simply runs management loops and should
  *              do deconfliction of nodes
  *
+ *              replicate() runs a three stage pipeline, each stage on its own thread:
+ *
+ *                 network - QueueMgr sockets and framing (the thread that called replicate)
+ *                 decode  - turns received batches into plots
+ *                 db      - ingest, skew correction and deduplication
+ *
+ *              connected by bounded queues. Only the network thread touches the QueueMgr
+ *              and only the db thread touches the database, so a long database pass never
+ *              holds up servicing the sockets.
+ *
+ *              Each received batch carries its receipt down the pipeline. The db thread
+ *              hands receipts back to the network thread once the journal has synced the
+ *              batch's plots, and only then is the batch acknowledged to its sender.
+ *
  ***************************************************************************************/
 class ReplServer 
 {
@@ -29,6 +52,11 @@ public:
    // Call this to shutdown the loop 
    void shutdown();
 
+   // Take new local plots from this ring (filled by the antenna) rather than finding them in
+   // the database. drainIngest moves whatever is waiting into the database
+   void setIngestRing(PlotRing *ring) { _ingest = ring; };
+   size_t drainIngest();
+
    void checkSkew();
    void correctSkew();
    void deduplicate();
@@ -38,20 +66,78 @@ public:
    // attempts to check "simulator time" should use this function
    time_t getAdjustedTime();
 
+   // Backlog of each pipeline queue: received batches waiting to be decoded, decoded ones
+   // waiting for the database, and outgoing ones waiting for the network
+   struct StageDepth {
+      size_t depth;
+      size_t high_water;
+      size_t capacity;
+   };
+   struct PipelineDepths {
+      StageDepth decode;
+      StageDepth apply;
+      StageDepth send;
+   };
+   PipelineDepths getPipelineDepths();
+
+   // This server's metrics: plots and batches in and out per peer, queue depths, network loop
+   // and database pass times, and connection state times. Serve them with a MetricsServer
+   MetricsRegistry &getMetrics() { return _metrics; };
+
 private:
 
-   void addReplDronePlots(std::vector<uint8_t> &data);
-   void addSingleDronePlot(std::vector<uint8_t> &data);
+   // Pipeline stages and their thread entry points
+   void runNetwork();
+   void runDecode();
+   void runDBMaint();
+   static void *t_decode(void *data);
+   static void *t_dbmaint(void *data);
+
+   void applyReplBatch(std::vector<WirePlot> &plots);
+   void releaseAcks();
+
+   // Sets up the metrics below, and the QueueMgr's
+   void registerMetrics();
+
+   // Traffic with one peer. Looked up by the network stage only
+   struct PeerMetrics {
+      MetricCounter *batches_in;
+      MetricCounter *plots_in;
+      MetricCounter *plots_out;
+   };
+   PeerMetrics &peerMetrics(const std::string &sid);
 
    unsigned int queueNewPlots();
 
+   // A pair of matching plots from two nodes whose clock offsets were not both known yet,
+   // kept with the raw (uncorrected) times so it can be settled once either offset is learned
+   struct SkewLink {
+      unsigned int node_a;
+      time_t time_a;
+      unsigned int node_b;
+      time_t time_b;
+   };
+
+   // Offset that puts a node's timestamps on the leader's clock, false if not known yet
+   bool getSkew(unsigned int node_id, time_t &skew);
+   bool resolveSkewLink(const SkewLink &link);
+
+   // Deconfliction priority of a node--0 is the leader, larger numbers lose ties
+   void buildNodeRanks();
+   unsigned int getNodeRank(unsigned int node_id) {
+      return (node_id < _node_rank.size()) ? _node_rank[node_id] : _unranked;
+   };
+
+
+   // Declared ahead of _queue so it outlasts the connections timing their states into it
+   MetricsRegistry _metrics;
 
    QueueMgr _queue;    
 
    // Holds our drone plot information
    DronePlotDB &_plotdb;
 
-   bool _shutdown;
+   std::atomic<bool> _shutdown;
 
    // How fast to run the system clock - 1.0 = normal speed, 2.0 = 2x as fast
    float _time_mult;
@@ -69,8 +155,60 @@ private:
    std::string _ip_addr;
    unsigned short _port;
 
-   std::map<unsigned int, unsigned int> _skew;
-   std::vector<std::list<DronePlot>::iterator> _toErase;
+   // Node ID of the time coordinator--all other nodes' clocks are corrected to match it
+   unsigned int _leader_id;
+
+   // Priority of each node indexed by node ID, and the rank given to nodes not listed
+   std::vector<unsigned int> _node_rank;
+   unsigned int _unranked;
+
+   // Database generation the last maintenance pass (sort, skew, deduplicate) ran at
+   uint64_t _maint_gen;
+
+   std::map<unsigned int, time_t> _skew;
+   std::map<std::pair<unsigned int, unsigned int>, SkewLink> _skew_links;
+   std::vector<PlotHandle> _toErase;
+
+   // New plots from the antenna, and the buffer they are drained through
+   PlotRing *_ingest;
+   std::vector<WirePlot> _ingest_plots;
+
+   // A received batch on its way through the pipeline, with the receipt to acknowledge it by
+   struct InBatch {
+      MsgReceipt receipt;
+      std::vector<uint8_t> data;
+   };
+   struct DecodedBatch {
+      MsgReceipt receipt;
+      std::vector<WirePlot> plots;
+   };
+
+   // network -> decode -> db, and db -> network for outgoing batches and acknowledgements
+   BoundedQueue<InBatch> _decode_q;
+   BoundedQueue<DecodedBatch> _apply_q;
+   BoundedQueue<SharedPayload> _send_q;
+   BoundedQueue<MsgReceipt> _ack_q;
+
+   // Applied batches waiting on the journal, with the journal position that covers each
+   // (db thread only)
+   std::deque<std::pair<uint64_t, MsgReceipt>> _unsynced;
+
+   // Metrics, all owned by _metrics
+   std::map<std::string, PeerMetrics> _peer_metrics;
+   MetricCounter *_plots_ingested;
+   MetricCounter *_batches_dropped;
+   MetricHistogram *_batch_in;
+   MetricHistogram *_batch_out;
+   MetricHistogram *_loop_time;
+   MetricHistogram *_sort_time;
+   MetricHistogram *_skew_time;
+   MetricHistogram *_dedup_time;
+   MetricGauge *_queue_depth;
+   MetricGauge *_decode_depth;
+   MetricGauge *_apply_depth;
+   MetricGauge *_send_depth;
+   MetricGauge *_db_plots;
+   MetricGauge *_db_generation;
 };
 
 
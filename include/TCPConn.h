@@ -1,125 +1,230 @@
-#ifndef TCPCONN_H
-#define TCPCONN_H
-
-#include <crypto++/secblock.h>
-#include "FileDesc.h"
-#include "LogMgr.h"
-
-const int max_attempts = 2;
-
-// Methods and attributes to manage a network connection, including tracking the username
-// and a buffer for user input. Status tracks what "phase" of login the user is currently in
-class TCPConn 
-{
-public:
-   TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int verbosity);
-   ~TCPConn();
-
-   // The current status of the connection
-   enum statustype { s_none, s_connecting, s_connected, s_datatx, s_datarx, s_waitack, s_hasdata, s_authenticate, s_handshake };
-
-   statustype getStatus() { return _status; };
-
-   bool accept(SocketFD &server);
-
-   // Primary maintenance function. Checks this connection for input and handles it
-   // depending on the state of the connection
-   void handleConnection();
-
-   // connect - second version uses ip_addr in network format (big endian)
-   void connect(const char *ip_addr, unsigned short port);
-   void connect(unsigned long ip_addr, unsigned short port);
-
-   // Send data to the other end of the connection without encryption
-   bool getData(std::vector<uint8_t> &buf);
-   bool sendData(std::vector<uint8_t> &buf);
-
-   // Calls encryptData or decryptData before send or after receive
-   bool getEncryptedData(std::vector<uint8_t> &buf);
-   bool sendEncryptedData(std::vector<uint8_t> &buf);
-
-   // Simply encrypts or decrypts a buffer
-   void encryptData(std::vector<uint8_t> &buf);
-   void decryptData(std::vector<uint8_t> &buf);
-
-   // Input data received on the socket
-   bool isInputDataReady() { return _data_ready; };
-   void getInputData(std::vector<uint8_t> &buf);
-
-   // Data about the connection (NodeID = other end's Server Node ID string)
-   unsigned long getIPAddr() { return _connfd.getIPAddr(); }; // Network format
-   const char *getIPAddrStr(std::string &buf);
-   unsigned short getPort() { return _connfd.getPort(); }; // host format
-   const char *getNodeID() { return _node_id.c_str(); };
-
-   // Connections can set the node or server ID of this connection
-   void setNodeID(const char *new_id) { _node_id = new_id; };
-   void setSvrID(const char *new_id) { _svr_id = new_id; };
-
-   // Closes the socket
-   void disconnect();
-
-   // Checks if the socket FD is marked as open
-   bool isConnected();
-
-   // When should we try to reconnect (prevents spam)
-   time_t reconnect;
-
-   // Assign outgoing data and sets up the socket to manage the transmission
-   void assignOutgoingData(std::vector<uint8_t> &data);
-
-protected:
-   // Functions to execute various stages of a connection 
-   void sendSID();
-   void waitForSID();
-   void transmitData();
-   void waitForData();
-   void awaitAck();
-
-   void waitForAuthentication();
-   void initiateHandshake();
-
-   // Looks for commands in the data stream
-   std::vector<uint8_t>::iterator findCmd(std::vector<uint8_t> &buf,
-                                                   std::vector<uint8_t> &cmd);
-   bool hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd);
-
-   // Gets the data between startcmd and endcmd strings and places in buf
-   std::vector<uint8_t> getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd);
-
-   // Places startcmd and endcmd strings around the data in buf and returns it in buf
-   void wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd);
-
-
-private:
-
-   bool _connected = false;
-
-   std::vector<uint8_t> c_rep, c_endrep, c_auth, c_endauth, c_ack, c_sid, c_endsid;
-
-   statustype _status = s_none;
-
-   SocketFD _connfd;
- 
-   std::string _node_id; // The username this connection is associated with
-   std::string _svr_id;  // The server ID that hosts this connection object
-
-   // Store incoming data to be read by the queue manager
-   std::vector<uint8_t> _inputbuf;
-   bool _data_ready;    // Is the input buffer full and data ready to be read?
-
-   // Store outgoing data to be sent over the network
-   std::vector<uint8_t> _outputbuf;
-
-   CryptoPP::SecByteBlock &_aes_key; // Read from a file, our shared key
-   std::string _authstr;   // remembers the random authorization string sent
-
-   unsigned int _verbosity;
-
-   LogMgr &_server_log;
-};
-
-
-#endif
+#ifndef TCPCONN_H
+#define TCPCONN_H
+
+#include <deque>
+#include <crypto++/secblock.h>
+#include <crypto++/aes.h>
+#include <crypto++/modes.h>
+#include "FileDesc.h"
+#include "LogMgr.h"
+#include "Frame.h"
+
+class MetricHistogram;
+class MetricCounter;
+struct ConnMetrics;
+
+const int max_attempts = 2;
+
+// Reconnect backoff for outbound channels: starts at reconnect_delay and doubles with each
+// failure, up to max_reconnect_delay
+const time_t reconnect_delay = 5;
+const time_t max_reconnect_delay = 60;
+
+// Methods and attributes to manage a network connection, including tracking the username
+// and a buffer for user input. Status tracks what "phase" of login the user is currently in
+//
+// Connections are long-lived channels. An outbound one (we connected) authenticates once,
+// then carries every message queued for that peer, pipelined, each acknowledged in turn. If
+// it drops, it goes back to s_connecting with its unacknowledged messages re-queued and
+// reconnects after a backoff. An inbound one receives any number of messages, queuing each
+// for the QueueMgr, and acknowledges each when told it has been stored (see ackInput).
+class TCPConn 
+{
+public:
+   TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int verbosity);
+   ~TCPConn();
+
+   // The current status of the connection
+   enum statustype { s_none, s_connecting, s_connected, s_datatx, s_datarx, s_waitack, s_authenticate, s_handshake };
+
+   statustype getStatus() { return _status; };
+
+   bool accept(SocketFD &server);
+
+   // Primary maintenance function. Checks this connection for input and handles it
+   // depending on the state of the connection
+   void handleConnection();
+
+   // Called by the server's reactor when the socket has input (or was closed), or has
+   // room for output it was waiting on
+   void markReadable() { _readable = true; };
+   void markWritable() { _writable = true; };
+
+   // Output is backed up waiting for the socket (or a connect is waiting for it to turn
+   // writable); the reactor tracks which are watched
+   bool wantsWrite() { return _connect_pending || (_sendq.size() > 0); };
+   bool isWatchingWrite() { return _watching_write; };
+   void setWatchingWrite(bool watching) { _watching_write = watching; };
+
+   // connect - second version uses ip_addr in network format (big endian). Neither waits:
+   // the connect completes in handleConnection once the reactor sees the socket writable
+   void connect(const char *ip_addr, unsigned short port);
+   void connect(unsigned long ip_addr, unsigned short port);
+
+   // Send data to the other end of the connection without encryption. getData appends
+   bool getData(std::vector<uint8_t> &buf);
+   bool sendData(std::vector<uint8_t> &buf);
+
+   // Calls encryptData before sending
+   bool sendEncryptedData(std::vector<uint8_t> &buf);
+
+   // Simply encrypts a buffer, leaving it in the form <IV><Data>
+   void encryptData(std::vector<uint8_t> &buf);
+
+   // Decrypts an <IV><Data> buffer where it sits, leaving the IV in front. Returns the
+   // length of the data, which starts iv_size bytes in
+   size_t decryptInPlace(uint8_t *data, size_t len);
+
+   // Messages received on the socket, oldest first. seq numbers each one on this connection
+   bool isInputDataReady() { return (_inqueue.size() > 0); };
+   void getInputData(std::vector<uint8_t> &buf, uint64_t &seq);
+
+   // Sends the acknowledgement for received message seq, once the receiver has stored it.
+   // Acknowledgements go out in the order the messages came in; false (and nothing sent) if
+   // seq is not the next one owed or the connection is down
+   bool ackInput(uint64_t seq);
+
+   // Tells this connection apart from every other one made by this process, including
+   // later ones from the same peer
+   uint64_t getConnID() { return _conn_id; };
+
+   // Data about the connection (NodeID = other end's Server Node ID string)
+   unsigned long getIPAddr() { return _connfd.getIPAddr(); }; // Network format
+   const char *getIPAddrStr(std::string &buf);
+   unsigned short getPort() { return _connfd.getPort(); }; // host format
+   int getFD() { return _connfd.getFD(); };
+   const char *getNodeID() { return _node_id.c_str(); };
+
+   // Connections can set the node or server ID of this connection
+   void setNodeID(const char *new_id) { _node_id = new_id; };
+   void setSvrID(const char *new_id) { _svr_id = new_id; };
+
+   // Closes the socket
+   void disconnect();
+
+   // Checks if the socket FD is marked as open
+   bool isConnected();
+
+   // True if we opened this connection (it reconnects instead of going away)
+   bool isOutbound() { return _outbound; };
+
+   // When should we try to reconnect (prevents spam)
+   time_t reconnect;
+
+   // Queues a message to go out on this connection, sent once it is authenticated. The
+   // buffer is shared, not copied
+   void assignOutgoingData(SharedPayload data);
+
+   // Messages queued or sent but not yet acknowledged
+   size_t getOutgoingCount() { return _outqueue.size(); };
+
+   // Where to record time spent in each state and bytes moved (see ConnMetrics). NULL
+   // records nothing. The metrics are the server's
+   void setMetrics(const ConnMetrics *metrics) { _metrics = metrics; };
+
+protected:
+   // Functions to execute various stages of a connection 
+   void sendSID();
+   void waitForSID();
+   void transmitData();
+   void waitForData();
+   void awaitAck();
+
+   void waitForAuthentication();
+   void initiateHandshake();
+
+   // Reads anything the reactor flagged into the decoder. False if the connection was lost
+   bool readInput();
+
+   // Takes the next complete frame, which must be of the given type
+   bool nextFrame(uint8_t type, std::vector<uint8_t> &payload);
+
+   // Frames a message and queues it for the socket, writing as much as it will take now
+   void sendFrame(uint8_t type, SharedPayload payload);
+   void sendFrame(uint8_t type, std::vector<uint8_t> &&payload);
+
+   // Writes queued frames until done or the socket is full
+   void flushOutput();
+
+   // Moves to a new state, timing the one being left
+   void setStatus(statustype status);
+
+   // Completes a connect left in progress, if the socket says it is done. False while
+   // still waiting
+   bool finishConnect();
+
+private:
+
+   bool _connected = false;
+
+   statustype _status = s_none;
+
+   // When the current state was entered (steady clock, microseconds), and where to record it
+   int64_t _status_since;
+   const ConnMetrics *_metrics;
+
+   SocketFD _connfd;
+ 
+   std::string _node_id; // The username this connection is associated with
+   std::string _svr_id;  // The server ID that hosts this connection object
+
+   // Splits the incoming byte stream into frames
+   FrameDecoder _decoder;
+   std::vector<uint8_t> _readbuf;
+   bool _readable;      // The reactor saw input on the socket that we have not read yet
+
+   // Messages received, waiting to be read by the queue manager, how many have been read
+   // and how many acknowledged
+   std::deque<std::vector<uint8_t>> _inqueue;
+   uint64_t _rx_taken = 0;
+   uint64_t _rx_acked = 0;
+   uint64_t _conn_id;
+
+   // Messages to send. The first _unacked have gone out and are waiting on their ACK
+   std::deque<SharedPayload> _outqueue;
+   size_t _unacked;
+
+   // Frames on their way to the socket. Header and body go out together with one gather
+   // write; sent says how far a frame got if the socket only took part of it
+   struct OutFrame {
+      uint8_t header[frame_header_size];
+      SharedPayload body;
+      size_t sent;
+   };
+   std::deque<OutFrame> _sendq;
+   bool _writable;         // the reactor says the socket has room again
+   bool _watching_write;   // registered for EPOLLOUT
+
+   bool _outbound;
+   bool _connect_pending;  // connect() under way, waiting for the socket to turn writable
+   bool _auth_verified; // client: the server's AUTH checked out, waiting on its SID
+   time_t _backoff;     // next reconnect delay
+
+   CryptoPP::SecByteBlock &_aes_key; // Read from a file, our shared key
+
+   // Keyed from _aes_key on first use and then only given a new IV per message
+   void keyCiphers();
+   CryptoPP::CFB_Mode<CryptoPP::AES>::Encryption _encryptor;
+   CryptoPP::CFB_Mode<CryptoPP::AES>::Decryption _decryptor;
+   bool _ciphers_keyed;
+   std::string _authstr;   // remembers the random authorization string sent
+
+   unsigned int _verbosity;
+
+   LogMgr &_server_log;
+};
+
+
+/**********************************************************************************************
+ * ConnMetrics - what a server's connections record into, shared by all of them. Time spent in
+ *               a state, in microseconds, goes to state_time[state] as the connection leaves
+ *               it; bytes read and written off the socket to bytes_in and bytes_out. NULL
+ *               entries are not recorded
+ **********************************************************************************************/
+struct ConnMetrics {
+   MetricHistogram *state_time[TCPConn::s_handshake + 1];
+   MetricCounter *bytes_in;
+   MetricCounter *bytes_out;
+};
+
+#endif
@@ -1,63 +1,103 @@
-#ifndef TCPSERVER_H
-#define TCPSERVER_H
-
-#include <list>
-#include <memory>
-#include "Server.h"
-#include "FileDesc.h"
-#include "TCPConn.h"
-#include "LogMgr.h"
-#include <crypto++/secblock.h>
-
-/********************************************************************************************
- * TCPServer - Basic functionality to manage a server socket and a list of connections. 
- *             Includes functionality to manage an AES encryption key loaded from file.
- *
- *             handleConnection is the primary maintenance function. Calls all the TCPConn
- *             handleConnection functions. 
- ********************************************************************************************/
-
-const time_t reconnect_delay = 5;
-
-class TCPServer : public Server 
-{
-public:
-   TCPServer(unsigned int _verbosity = 1);
-   virtual ~TCPServer();
-
-   virtual void bindSvr(const char *ip_addr, unsigned short port);
-   void listenSvr();
-   virtual void runServer();
-
-   void shutdown();
-
-   TCPConn *handleSocket();
-   virtual void handleConnections();
-
-   unsigned long getIPAddr() { return _sockfd.getIPAddr(); };
-   unsigned short getPort() { return _sockfd.getPort(); };
-
-   // Change where the log file is writing to
-   void changeLogfile(const char *newfile);
-
-protected:
-
-   void loadAESKey(const char *filename);
-
-   // List of TCPConn objects to manage connections
-   std::list<std::unique_ptr<TCPConn>> _connlist;
-
-   CryptoPP::SecByteBlock _aes_key;
-
-   LogMgr _server_log;
-
-   unsigned int _verbosity;
-
-private:
-   // Class to manage the server socket
-   SocketFD _sockfd;
-
-};
-
-
-#endif
+#ifndef TCPSERVER_H
+#define TCPSERVER_H
+
+#include <list>
+#include <memory>
+#include "Server.h"
+#include "FileDesc.h"
+#include "TCPConn.h"
+#include "LogMgr.h"
+#include "ALMgr.h"
+#include "Metrics.h"
+#include <crypto++/secblock.h>
+
+/********************************************************************************************
+ * TCPServer - Basic functionality to manage a server socket and a list of connections. 
+ *             Includes functionality to manage an AES encryption key loaded from file.
+ *
+ *             handleConnection is the primary maintenance function. Calls all the TCPConn
+ *             handleConnection functions. 
+ *
+ *             Socket readiness comes from an epoll reactor: pollEvents makes one epoll_wait
+ *             call covering the listening socket and every connection, and flags the ones
+ *             with input. Connections without input return from handleConnection without
+ *             touching their socket, so an idle peer costs no system calls. An eventfd in the
+ *             same epoll set lets other threads wake a waiting reactor (see wake).
+ ********************************************************************************************/
+
+// Most readiness events collected per pollEvents call (the rest wait for the next one)
+const int max_events = 64;
+
+// The server log is rotated once it reaches this size
+const size_t server_log_rotate_bytes = 16 * 1024 * 1024;
+
+class TCPServer : public Server 
+{
+public:
+   TCPServer(unsigned int _verbosity = 1);
+   virtual ~TCPServer();
+
+   virtual void bindSvr(const char *ip_addr, unsigned short port);
+   void listenSvr();
+   virtual void runServer();
+
+   void shutdown();
+
+   // Waits up to timeout_ms for socket activity (or a wake) and flags what is ready.
+   // 0 = just check
+   void pollEvents(int timeout_ms = 0);
+
+   // Ends a pollEvents wait early. Safe to call from any thread
+   void wake();
+
+   TCPConn *handleSocket();
+   virtual void handleConnections();
+
+   unsigned long getIPAddr() { return _sockfd.getIPAddr(); };
+   unsigned short getPort() { return _sockfd.getPort(); };
+
+   // Change where the log file is writing to
+   void changeLogfile(const char *newfile);
+
+   // Times the handshake states (and waits for acknowledgement) of every connection from
+   // here on in the registry's repsvr_conn_state_microseconds histograms, and counts their
+   // bytes in repsvr_wire_bytes_total
+   void setMetrics(MetricsRegistry &registry);
+
+protected:
+
+   void loadAESKey(const char *filename);
+
+   // Registers a connected TCPConn with the reactor (closing its socket unregisters it)
+   void watchConn(TCPConn *conn);
+
+   // Watches for room to write on a connection if, and only if, it has output backed up
+   void updateWriteInterest(TCPConn *conn);
+
+   // List of TCPConn objects to manage connections
+   std::list<std::unique_ptr<TCPConn>> _connlist;
+
+   CryptoPP::SecByteBlock _aes_key;
+
+   LogMgr _server_log;
+
+   unsigned int _verbosity;
+
+   // Metrics handed to each new connection (see TCPConn::setMetrics)
+   ConnMetrics _conn_metrics;
+
+private:
+   // Class to manage the server socket
+   SocketFD _sockfd;
+
+   int _epfd;              // the reactor's epoll instance
+   int _wake_fd;           // eventfd written by wake(), read by pollEvents
+   bool _accept_ready;     // listening socket has a connection waiting
+
+   // The whitelist, loaded once and shared by every accept (reloads itself when the file changes)
+   ALMgr _access_list;
+
+};
+
+
+#endif
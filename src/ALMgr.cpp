@@ -1,60 +1,200 @@
-#include <arpa/inet.h>
-#include <stdexcept>
-#include "ALMgr.h"
-#include "strfuncts.h"
-
-ALMgr::ALMgr(const char *al_file, bool is_whitelist):_al_file(al_file),_is_whitelist(is_whitelist) {
-
-}
-
-
-ALMgr::~ALMgr() {
-
-}
-
-/******************************************************************************************************
- * isAllowed - checks to see if the IP address is in the list and allows/denies based off _is_whitelist
- *  
- *    Second version takes in an unsigned long IP Addr in network (big endian) format
- ******************************************************************************************************/
-bool ALMgr::isAllowed(const char *ipaddr) {
-   in_addr testaddr;
-
-   inet_pton(AF_INET, ipaddr, &testaddr);
-   return isAllowed(testaddr.s_addr);
-}
-
-bool ALMgr::isAllowed(unsigned long ipaddr) {
-   FILE *alfile;
-
-   // First, find the IP address in the file
-   if ((alfile = fopen(_al_file.c_str(), "r")) == NULL) {
-      throw std::runtime_error("Unable to open white list file.");
-   }
-
-   in_addr al_ip;
-   char strbuf[30];
-   strbuf[0] = '\0';
-   std::string ipstr;
-
-   while (fgets(strbuf, 30, alfile) != NULL) {
-      ipstr = strbuf;
-      clrNewlines(ipstr);
-      inet_pton(AF_INET, ipstr.c_str(), &al_ip);
-
-      if (al_ip.s_addr == ipaddr) {
-         fclose(alfile);
-         if (_is_whitelist)
-            return true;
-         else
-            return false;
-      }
-   }
-
-   fclose(alfile);
-
-   if (_is_whitelist)
-      return false;
-   return true;
-}
-
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include "ALMgr.h"
+#include "strfuncts.h"
+
+/******************************************************************************************************
+ * AccessList (constructor) - an empty list: no addresses, and a trie of just the root
+ ******************************************************************************************************/
+AccessList::AccessList():_trie(1) {
+   _trie[0].child[0] = _trie[0].child[1] = 0;
+   _trie[0].match = false;
+}
+
+/******************************************************************************************************
+ * addLine - adds one line of an access list file: an address or a.b.c.d/len range, with blanks
+ *           around it ignored. A /32 range is just an address
+ *
+ *    Returns: false if the line is blank or not a valid address or range (nothing is added)
+ ******************************************************************************************************/
+bool AccessList::addLine(const char *line) {
+   std::string entry = line;
+   clrNewlines(entry);
+
+   size_t first = entry.find_first_not_of(" \t");
+   if (first == std::string::npos)
+      return false;
+   entry = entry.substr(first, entry.find_last_not_of(" \t") - first + 1);
+
+   unsigned long len = 32;
+   size_t slash = entry.find('/');
+   if (slash != std::string::npos) {
+      const char *lenstr = entry.c_str() + slash + 1;
+      char *end;
+      len = strtoul(lenstr, &end, 10);
+      if ((end == lenstr) || (*end != '\0') || (len > 32))
+         return false;
+      entry.resize(slash);
+   }
+
+   in_addr addr;
+   if (inet_pton(AF_INET, entry.c_str(), &addr) != 1)
+      return false;
+
+   uint32_t ipaddr = ntohl(addr.s_addr);
+   if (len == 32)
+      _exact.insert(ipaddr);
+   else
+      addRange(ipaddr, (unsigned int) len);
+   return true;
+}
+
+/******************************************************************************************************
+ * addRange - marks the trie node for the first len bits of prefix, adding the path to it as needed
+ ******************************************************************************************************/
+void AccessList::addRange(uint32_t prefix, unsigned int len) {
+   uint32_t node = 0;
+
+   for (unsigned int i = 0; i < len; i++) {
+      unsigned int bit = (prefix >> (31 - i)) & 1;
+      if (_trie[node].child[bit] == 0) {
+         TrieNode fresh;
+         fresh.child[0] = fresh.child[1] = 0;
+         fresh.match = false;
+         _trie.push_back(fresh);
+         _trie[node].child[bit] = (uint32_t) (_trie.size() - 1);
+      }
+      node = _trie[node].child[bit];
+   }
+   _trie[node].match = true;
+}
+
+/******************************************************************************************************
+ * contains - true if the address is listed or falls in a listed range. Walks the trie down the
+ *            address bits until a range ends (match) or the path runs out
+ ******************************************************************************************************/
+bool AccessList::contains(uint32_t ipaddr) const {
+   if (_exact.count(ipaddr) > 0)
+      return true;
+
+   uint32_t node = 0;
+   for (unsigned int i = 0; i < 32; i++) {
+      if (_trie[node].match)
+         return true;
+
+      node = _trie[node].child[(ipaddr >> (31 - i)) & 1];
+      if (node == 0)
+         return false;
+   }
+   return _trie[node].match;
+}
+
+
+ALMgr::ALMgr(const char *al_file, bool is_whitelist):_al_file(al_file),_is_whitelist(is_whitelist),
+                                                     _next_check(0),_size(0),_inode(0) {
+   _mtime.tv_sec = 0;
+   _mtime.tv_nsec = 0;
+}
+
+
+ALMgr::~ALMgr() {
+
+}
+
+/******************************************************************************************************
+ * isAllowed - checks to see if the IP address is in the list and allows/denies based off _is_whitelist
+ *  
+ *    Second version takes in an unsigned long IP Addr in network (big endian) format
+ *
+ *    Throws: runtime_error if the list has never been loaded and the file cannot be opened
+ ******************************************************************************************************/
+bool ALMgr::isAllowed(const char *ipaddr) {
+   in_addr testaddr;
+
+   inet_pton(AF_INET, ipaddr, &testaddr);
+   return isAllowed(testaddr.s_addr);
+}
+
+bool ALMgr::isAllowed(unsigned long ipaddr) {
+   std::shared_ptr<const AccessList> list = currentList();
+
+   if (list->contains(ntohl((uint32_t) ipaddr)))
+      return _is_whitelist;
+   return !_is_whitelist;
+}
+
+/******************************************************************************************************
+ * currentList - the list to check against. Loads it the first time; after that, once every
+ *               al_check_secs, one caller looks at the file and reloads it if it has changed while
+ *               the rest carry on with the list they have
+ *
+ *    Throws: runtime_error if there is no list yet and the file cannot be opened
+ ******************************************************************************************************/
+std::shared_ptr<const AccessList> ALMgr::currentList() {
+   std::shared_ptr<const AccessList> list = std::atomic_load(&_list);
+   time_t now = time(NULL);
+
+   if ((list != NULL) && (now < _next_check.load()))
+      return list;
+
+   if (list == NULL) {
+      std::lock_guard<std::mutex> lock(_reload_lock);
+      if ((list = std::atomic_load(&_list)) == NULL) {
+         if ((list = loadList()) == NULL)
+            throw std::runtime_error("Unable to open white list file.");
+         std::atomic_store(&_list, list);
+      }
+      return list;
+   }
+
+   std::unique_lock<std::mutex> lock(_reload_lock, std::try_to_lock);
+   if (!lock.owns_lock())
+      return list;
+
+   _next_check = now + al_check_secs;
+
+   struct stat st;
+   if ((stat(_al_file.c_str(), &st) != 0) || ((st.st_mtim.tv_sec == _mtime.tv_sec) &&
+         (st.st_mtim.tv_nsec == _mtime.tv_nsec) && (st.st_size == _size) && (st.st_ino == _inode)))
+      return list;
+
+   std::shared_ptr<const AccessList> fresh = loadList();
+   if (fresh == NULL)
+      return list;
+
+   std::atomic_store(&_list, fresh);
+   return fresh;
+}
+
+/******************************************************************************************************
+ * loadList - reads the whole file into a new AccessList, noting its mtime, size and inode for the
+ *            change check (_reload_lock held). Lines that are not addresses or ranges are skipped
+ *
+ *    Returns: the list, or NULL if the file cannot be opened
+ ******************************************************************************************************/
+std::shared_ptr<const AccessList> ALMgr::loadList() {
+   FILE *alfile;
+
+   if ((alfile = fopen(_al_file.c_str(), "r")) == NULL)
+      return NULL;
+
+   struct stat st;
+   if (fstat(fileno(alfile), &st) == 0) {
+      _mtime = st.st_mtim;
+      _size = st.st_size;
+      _inode = st.st_ino;
+   }
+   _next_check = time(NULL) + al_check_secs;
+
+   std::shared_ptr<AccessList> list = std::make_shared<AccessList>();
+   char strbuf[128];
+   while (fgets(strbuf, sizeof(strbuf), alfile) != NULL)
+      list->addLine(strbuf);
+
+   fclose(alfile);
+   return list;
+}
@@ -1,148 +1,202 @@
-#include <iostream>
-#include "AntennaSim.h"
-#include "DronePlotDB.h"
-
-/*****************************************************************************************
- * AntennaSim (constructor) - takes in a reference to the accessible database that will be
- *            populated by the simulator
- *
- *    Params:  dpdb - a reference to the operational database to inject into
- *             time_mult - how fast to run the injects (2.0 = 2x faster)
- *****************************************************************************************/
-AntennaSim::AntennaSim(DronePlotDB &dpdb, const char *source_filename, float time_mult, 
-                       int verbosity): 
-                                             _to_db(dpdb),
-                                             _time_mult(time_mult),
-                                             _time_offset(0),
-                                             _verbosity(verbosity),
-                                             _start_time(0)
-{
-   if (_verbosity == 3)
-      std::cout << "SIM: Loading source database: " << source_filename << "\n";
-
-   if (_source_db.loadBinaryFile(source_filename) <= 0)
-      throw std::runtime_error("Source database could not be opened or was empty.");
-
-   if (_verbosity >= 2)
-      std::cout << "SIM: Source database " << source_filename << " successfully loaded.\n";
-   if (_verbosity >= 1)
-      std::cout << "SIM: simulation started, time multiplier: " << _time_mult << "\n";
-}
-
-// Constructor - no action right now
-AntennaSim::~AntennaSim() {
-
-}
-
-/*****************************************************************************************
- * loadSourceDB - Loads in the source file in binary format
- *
- *****************************************************************************************/
-
-void AntennaSim::loadSourceDB(const char *filename) {
-
-   // Load our drone plots to feed to the accessible database
-   int results = _source_db.loadBinaryFile(filename);
-
-   if (results < 0)
-      throw std::runtime_error("Unable to load the source data file for the simulator.");
-   if (results == 0)
-      throw std::runtime_error("Source data file for simulator was empty.");
-
-}
-
-double AntennaSim::getAdjustedTime() {
-   return static_cast<time_t>(((double) time(NULL) - (double) _start_time) * _time_mult);
-}
-
-/*****************************************************************************************
- * simulate - process that manages the simulation that feeds data into the student's database
- *            to simulate receiving drone data
- *
- *****************************************************************************************/
-
-void AntennaSim::simulate() {
-
-   // Sort the database by time   
-   _source_db.sortByTime();
-
-   // Set up a random offset between 1 and 3 seconds from true
-   srand(time(NULL));
-   _time_offset = (rand() % 6) - 3;
-   if (_verbosity >= 2) 
-      std::cout << "SIM: Simulator time offset: " << _time_offset << " secs\n";
-
-   if (_verbosity >= 1)
-      std::cout << "SIM: Delaying 3 seconds before starting sim to let servers come online.\n";
-
-   // Provide a short 3 second delay before starting
-   for (unsigned int i=3; i>0; i--) {
-      if (_verbosity >= 2)
-         std::cout << i << "\n";
-      sleep(1);
-   }
-
-   // Initialize
-   _start_time = time(NULL);
-
-   timespec sleeptime;
-   std::list<DronePlot>::iterator diter;
-
-   // Change all the inject timestamps to the offset time
-   for (diter = _source_db.begin(); diter != _source_db.end(); diter++) {
-      diter->timestamp += _time_offset;
-   }
-   
-   // Loop through the injects, sending them as their time arrives
-   while (_source_db.size() > 0) {
-
-      // Get the time until our next inject
-      diter = _source_db.begin();
-      double adjusted_time = getAdjustedTime();
-
-      // If the adjusted time is not past the timestamp on our next inject, sleep until it is
-      if (adjusted_time < (double) diter->timestamp) {
-
-         // We need a more precise adjusted time
-
-         // timespan = how long we need to sleep (add .55 secs to prevent rounding down issues
-         double timespan = ((double) diter->timestamp - adjusted_time) / _time_mult + .55;
-         sleeptime.tv_sec = (time_t) timespan;
-         sleeptime.tv_nsec = (long) (1000000000.0 * (timespan - (double) sleeptime.tv_sec));
-         
-         if (_verbosity == 3)
-            std::cout << "SIM: Sim sleeping for " << sleeptime.tv_sec << " secs, " << sleeptime.tv_nsec
-                                                                        << " nanosecs\n";
-         nanosleep(&sleeptime, NULL);
-      }
-      
-      // Now inject all that have a timestamp less than the current time
-      adjusted_time = getAdjustedTime();
-      diter = _source_db.begin();
-
-      if (_verbosity >= 2)
-            std::cout << "SIM: Cur systime: " << (time_t) getAdjustedTime() << "\n";
-
-      while ((_source_db.size() > 0) && (diter->timestamp <= adjusted_time)) {
-        
-         if (_verbosity >= 1)
-            std::cout << "SIM: Injecting plot NodeID: " << diter->node_id << " DroneID: " << 
-                  diter->drone_id << ", Time: " << diter->timestamp << " Lat: " << 
-                  diter->latitude << ", Long: " << diter->longitude << "\n";
-
-         _to_db.addPlot(diter->drone_id, diter->node_id, diter->timestamp, diter->latitude, diter->longitude);
-         diter = _to_db.end();
-         diter--;
-         diter->setFlags(DBFLAG_NEW);
-
-         _source_db.popFront();
-         diter = _source_db.begin();
-      }
-   }
-   
-   if (_verbosity >= 2) {
-      std::cout << "SIM: Drone plot injections complete.\n";
-   }
-
-
-}
+#include <iostream>
+#include <algorithm>
+#include "AntennaSim.h"
+#include "DronePlotDB.h"
+#include "PlotFile.h"
+
+/*****************************************************************************************
+ * AntennaSim (constructor) - takes in a reference to the accessible database that will be
+ *            populated by the simulator
+ *
+ *    Params:  dpdb - a reference to the operational database to inject into
+ *             time_mult - how fast to run the injects (2.0 = 2x faster)
+ *****************************************************************************************/
+AntennaSim::AntennaSim(DronePlotDB &dpdb, const char *source_filename, float time_mult, 
+                       int verbosity): 
+                                             _exiting(false),
+                                             _to_db(dpdb),
+                                             _ingest(NULL),
+                                             _time_mult(time_mult),
+                                             _time_offset(0),
+                                             _random_offset(true),
+                                             _verbosity(verbosity),
+                                             _start_time(0)
+{
+   if (_verbosity == 3)
+      std::cout << "SIM: Loading source database: " << source_filename << "\n";
+
+   if (readSource(source_filename) <= 0)
+      throw std::runtime_error("Source database could not be opened or was empty.");
+
+   if (_verbosity >= 2)
+      std::cout << "SIM: Source database " << source_filename << " successfully loaded.\n";
+   if (_verbosity >= 1)
+      std::cout << "SIM: simulation started, time multiplier: " << _time_mult << "\n";
+}
+
+// Constructor - no action right now
+AntennaSim::~AntennaSim() {
+
+}
+
+/*****************************************************************************************
+ * loadSourceDB - Loads in the source file in binary format
+ *
+ *****************************************************************************************/
+
+void AntennaSim::loadSourceDB(const char *filename) {
+
+   // Load our drone plots to feed to the accessible database
+   int results = readSource(filename);
+
+   if (results < 0)
+      throw std::runtime_error("Unable to load the source data file for the simulator.");
+   if (results == 0)
+      throw std::runtime_error("Source data file for simulator was empty.");
+
+}
+
+/*****************************************************************************************
+ * readSource - appends the plots in a binary plot file to the injects. They are kept as
+ *              plain records--the simulator only ever walks them in time order, so there is
+ *              nothing for a database's indexes to do
+ *
+ *    Returns: -1 if the file could not be opened or is corrupt, otherwise num read in
+ *****************************************************************************************/
+
+int AntennaSim::readSource(const char *filename) {
+   PlotFile infile;
+
+   try {
+      infile.open(filename);
+   } catch (std::runtime_error &e) {
+      return -1;
+   }
+
+   size_t first = _source.size();
+   _source.resize(first + infile.size());
+   infile.readRecords(0, infile.size(), _source.data() + first);
+   return (int) infile.size();
+}
+
+double AntennaSim::getAdjustedTime() {
+   return static_cast<time_t>(((double) time(NULL) - (double) _start_time) * _time_mult);
+}
+
+/*****************************************************************************************
+ * simulate - process that manages the simulation that feeds data into the student's database
+ *            to simulate receiving drone data
+ *
+ *****************************************************************************************/
+
+void AntennaSim::simulate() {
+
+   // Sort the injects by time
+   std::stable_sort(_source.begin(), _source.end(), [](const WirePlot &a, const WirePlot &b) {
+      return a.timestamp < b.timestamp;
+   });
+
+   // Set up a random offset between 1 and 3 seconds from true, unless one was given
+   if (_random_offset) {
+      srand(time(NULL));
+      _time_offset = (rand() % 6) - 3;
+   }
+   if (_verbosity >= 2) 
+      std::cout << "SIM: Simulator time offset: " << _time_offset << " secs\n";
+
+   if (_verbosity >= 1)
+      std::cout << "SIM: Delaying 3 seconds before starting sim to let servers come online.\n";
+
+   // Provide a short 3 second delay before starting
+   for (unsigned int i=3; i>0; i--) {
+      if (_verbosity >= 2)
+         std::cout << i << "\n";
+      sleep(1);
+   }
+
+   // Initialize
+   _start_time = time(NULL);
+
+   timespec sleeptime;
+
+   // Change all the inject timestamps to the offset time
+   for (WirePlot &plot : _source)
+      plot.timestamp += _time_offset;
+   
+   // Loop through the injects, sending them as their time arrives. next is the first not sent
+   size_t next = 0;
+   while (next < _source.size()) {
+
+      // Get the time until our next inject
+      double adjusted_time = getAdjustedTime();
+
+      // If the adjusted time is not past the timestamp on our next inject, sleep until it is
+      if (adjusted_time < (double) _source[next].timestamp) {
+
+         // We need a more precise adjusted time
+
+         // timespan = how long we need to sleep (add .55 secs to prevent rounding down issues
+         double timespan = ((double) _source[next].timestamp - adjusted_time) / _time_mult + .55;
+         sleeptime.tv_sec = (time_t) timespan;
+         sleeptime.tv_nsec = (long) (1000000000.0 * (timespan - (double) sleeptime.tv_sec));
+         
+         if (_verbosity == 3)
+            std::cout << "SIM: Sim sleeping for " << sleeptime.tv_sec << " secs, " << sleeptime.tv_nsec
+                                                                        << " nanosecs\n";
+         nanosleep(&sleeptime, NULL);
+      }
+      
+      // Now inject all that have a timestamp less than the current time
+      adjusted_time = getAdjustedTime();
+      size_t due = next;
+
+      if (_verbosity >= 2)
+            std::cout << "SIM: Cur systime: " << (time_t) getAdjustedTime() << "\n";
+
+      while ((next < _source.size()) && (_source[next].timestamp <= adjusted_time)) {
+         const WirePlot &plot = _source[next];
+        
+         if (_verbosity >= 1)
+            std::cout << "SIM: Injecting plot NodeID: " << plot.node_id << " DroneID: " << 
+                  plot.drone_id << ", Time: " << plot.timestamp << " Lat: " << 
+                  plot.latitude << ", Long: " << plot.longitude << "\n";
+
+         next++;
+      }
+
+      deliverPlots(_source.data() + due, next - due);
+   }
+   
+   if (_verbosity >= 2) {
+      std::cout << "SIM: Drone plot injections complete.\n";
+   }
+
+
+}
+
+/*****************************************************************************************
+ * deliverPlots - passes on the plots that came due together. With an ingest ring they are
+ *                pushed for the replication thread to pick up, waiting for room if it has
+ *                fallen behind; otherwise they go straight into the database under one lock.
+ *                Either way they arrive flagged DBFLAG_NEW
+ *
+ *    Params:  plots - the plots to deliver
+ *             count - how many there are
+ *****************************************************************************************/
+
+void AntennaSim::deliverPlots(const WirePlot *plots, size_t count) {
+   if (count == 0)
+      return;
+
+   if (_ingest == NULL) {
+      _to_db.addPlots(plots, count, DBFLAG_NEW);
+      return;
+   }
+
+   // Ring full means the replication thread is behind--give it a moment rather than spin
+   size_t sent = _ingest->push(plots, count);
+   while ((sent < count) && !_exiting) {
+      usleep(1000);
+      sent += _ingest->push(plots + sent, count - sent);
+   }
+}
@@ -1,502 +1,1287 @@
-#include <stdexcept>
-#include <strings.h>
-#include <cstring>
-#include <unistd.h>
-#include <iostream>
-#include <sstream>
-#include <fstream>
-#include <iomanip>
-
-#include "DronePlotDB.h"
-#include "strfuncts.h"
-#include "FileDesc.h"
-
-
-// Short compare function for database sort by timestamp
-bool compare_plot(const DronePlot &pp1, const DronePlot &pp2) {
-   return (pp1.timestamp < pp2.timestamp);
-}
-
-/*****************************************************************************************
- * DronePlot - Constructor for a drone plot object, default initializers
- *****************************************************************************************/
-DronePlot::DronePlot():
-               drone_id(-1),
-               node_id(-1),
-               timestamp(0),
-               latitude(0.0),
-               longitude(0.0),
-               _flags(0)
-{
-   
-}
-
-/*****************************************************************************************
- * DronePlot - Constructor for a drone plot object, initialized by parameters
- *****************************************************************************************/
-
-DronePlot::DronePlot(int in_droneid, int in_nodeid, int in_timestamp, float in_latitude, float in_longitude):
-               drone_id(in_droneid),
-               node_id(in_nodeid),
-               timestamp(in_timestamp),
-               latitude(in_latitude),
-               longitude(in_longitude),
-               _flags(0)
-{
-
-}
-
-DronePlot::~DronePlot() {
-
-}
-
-/*****************************************************************************************
- * getDataSize - returns the total size in bytes of all data stored in this object, minus
- *               the flags data. Helpful when reserving space in the vector to improve
- *               serialization efficiency.
- *****************************************************************************************/
-size_t DronePlot::getDataSize() {
-
-   return sizeof(drone_id) + sizeof(node_id) + sizeof(timestamp) + sizeof(latitude) +
-                     sizeof(longitude);
-}
-
-/*****************************************************************************************
- * serialize - converts the data in this object into a series of binary data and stores the
- *             bytes in a vector buffer
- *
- *    Params:  buf - the vector to store the data in--in the following order:
- *             drone_id, node_id, timestamp, latitude, longitude (flags not serialized)
- *             Note: does not clear the vector, merely adds to the end.
- *****************************************************************************************/
-void DronePlot::serialize(std::vector<uint8_t> &buf) {
-
-   uint8_t *dataptrs[5] = { (uint8_t *) &drone_id,
-                            (uint8_t *) &node_id,
-                            (uint8_t *) &timestamp,
-                            (uint8_t *) &latitude,
-                            (uint8_t *) &longitude };
-   uint8_t sizes[5] = {sizeof(drone_id), sizeof(node_id), sizeof(timestamp), 
-                       sizeof(latitude), sizeof(longitude)};
-
-   if (drone_id == 0)
-      throw std::runtime_error("Die");
-   // Loop through all our data variables and their sizes, and push to vector byte by byte
-   for (unsigned int i=0; i<5; i++) { 
-      for (unsigned int j=0; j < sizes[i]; j++, dataptrs[i]++)
-      {  
-         buf.push_back(*dataptrs[i]);
-      }
-   }
-}
-
-/*****************************************************************************************
- * deserialize - retrieves the data from a vector for this object and loads it into this
- *               DronePlot object's attributes in order
- *
- *    Params:  buf - the vector to load the data in--in the following order:
- *                drone_id, node_id, timestamp, latitude, longitude (flags not serialized)
- *                Note: does not clear the vector, merely adds to the end.
- *             start_pt - the vector index to start reading data
- *
- *    Throws: runtime_error - vector is not large enough--ran out of data
- *****************************************************************************************/
-
-void DronePlot::deserialize(std::vector<uint8_t> &buf, unsigned int start_pt) {
-   uint8_t *dataptrs[5] = { (uint8_t *) &drone_id,
-                            (uint8_t *) &node_id,
-                            (uint8_t *) &timestamp,
-                            (uint8_t *) &latitude,
-                            (uint8_t *) &longitude };
-   uint8_t sizes[5] = {sizeof(drone_id), sizeof(node_id), sizeof(timestamp),
-                       sizeof(latitude), sizeof(longitude)};
-
-   // Loop through all our data variables and their sizes, and read in the data
-   unsigned int vpos = start_pt;
-   for (unsigned int i=0; i<5; i++) {
-      for (unsigned int j=0; j < sizes[i]; j++, dataptrs[i]++){
-         if (vpos > buf.size())
-            throw std::runtime_error("DronePlot deserialize ran out of data in vector buffer prematurely");
-         *dataptrs[i] = buf[vpos++];
-      }
-   }
-
-}
-
-/*****************************************************************************************
- * readCSV - Populates this drone entry from a csv string
- *
- *    Returns: -1 for failure, 0 otherwise
- *****************************************************************************************/
-int DronePlot::readCSV(std::string &buf) {
-      std::string::size_type commapos;
-      std::string data;
-      unsigned int startpos = 0;
-
-      // Loop and get the first four data points
-      for (unsigned int i=0; i<4; i++) {
-
-         // Find the next comma
-         commapos = buf.find(",", startpos);
-         if (commapos == std::string::npos)
-            return -1;
-
-         // Get the substring of our target variable
-         data = buf.substr(startpos, commapos-startpos);
-
-         // Now load the data
-         switch (i) {
-         case 0:
-            drone_id = std::stoi(data);
-            break;
-         case 1:
-            node_id = std::stoi(data);
-            break;
-         case 2:
-            timestamp = (time_t) std::stoi(data);
-            break;
-         case 3:
-            latitude = std::stof(data);
-            break;
-         default:
-            throw std::runtime_error("This should not have happened");
-            break;
-         }
-         startpos = commapos + 1;
-      }
-
-      // Now get the final float
-      data = buf.substr(startpos, buf.size());
-      longitude = std::stof(data);
-
-      return 0;
-}
-
-/*****************************************************************************************
- * writeCSV - writes this drone entry into a CSV entry (storing in buf)
- *
- *****************************************************************************************/
-void DronePlot::writeCSV(std::string &buf) {
-   std::stringstream tmpbuf;
-
-   tmpbuf << drone_id << "," << node_id << "," << timestamp << "," << std::setprecision(10) << latitude << "," <<
-                                                                      longitude << "\n";
-   buf = tmpbuf.str();
-}
-
-/*****************************************************************************************
- * setFlags - turns on the indicated flags
- * clrFlags - disables the indicated flags
- * isFlagSet - returns true if the flag is set
- *
- *    Params: flags - a bit mask to indicate the desired flag, using defines.
- *                   so: clrFlags(DBFLAG_SYNCD);
- *****************************************************************************************/
-
-void DronePlot::setFlags(unsigned short flags) {
-   _flags |= flags;
-}
-
-void DronePlot::clrFlags(unsigned short flags) {
-   _flags &= ~flags;
-}
-
-bool DronePlot::isFlagSet(unsigned short flags) {
-   return (bool) (_flags & flags);
-}
-
-/*****************************************************************************************
- * DronePlotDB - Constructor, currently initializes the mutex only
- *
- *****************************************************************************************/
-DronePlotDB::DronePlotDB() {
-
-   // Initialize our mutex for thread protection
-   pthread_mutex_init(&_mutex, NULL);
-}
-
-// No behavior for destructor yet
-DronePlotDB::~DronePlotDB() {
-
-}
-
-
-/*****************************************************************************************
- * addPlot - Adds a plot object at the end of the doubly-linked list
- *
- *    Params:  drone_id - the unique integer ID of this particular drone
- *             node_id - the unique integer ID of the receiving site
- *             timestamp - the plot's time in seconds
- *             latitude - floating point latitude coordinate of this plot point
- *             longitude - floating point longitude coordinate of this plot point
- *             
- *****************************************************************************************/
-
-void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude, float longitude) {
-   // First lock the mutex (blocking)
-   pthread_mutex_lock(&_mutex);
-
-   _dbdata.emplace_back(drone_id, node_id, timestamp, latitude, longitude);
-
-   // Unlock the mutex before we exit
-   pthread_mutex_unlock(&_mutex);
-}
-
-/*****************************************************************************************
- * loadCSVFile - loads in a CSV file containing the plot entries in the right order. The
- *               order should be (no spaces around commas):
- *               drone_id,node_id,timestamp,latitude,longitude
- *
- *    Params:  filename - the path/filename of the CSV file to load
- *
- *    Returns: -1 if there was an issue reading the file, otherwise num read in
- *
- *****************************************************************************************/
-
-int DronePlotDB::loadCSVFile(const char *filename) {
-
-   std::ifstream cfile;
-
-   // Open our file stream with default read settings
-   cfile.open(filename);
-   if (cfile.fail())
-      return -1;
-   
-   // Get line by line, parsing out our data
-   std::string buf, data;
-   int count = 0;
-   std::list<DronePlot>::iterator newplot;
-  
-   while (!cfile.eof()) {
-      std::getline(cfile, buf);
-
-      if (buf.size() == 0)
-         continue;
-      
-      // Add this to the end and get an iterator pointing to it
-      _dbdata.emplace_back(-1, -1, 0, 0.0, 0.0);
-      newplot = _dbdata.end();
-      newplot--;
-
-      if (newplot->readCSV(buf) == -1)
-         return -1;
-
-      // Add it to the database 
-      count++;
-   }
-   cfile.close();
-   return count;
-}
-
-/*****************************************************************************************
- * writeCSVFile - writes the database in order to a CSV text file. The order is:
- *               drone_id,node_id,timestamp,latitude,longitude
- *
- *    Params:  filename - the path/filename of the CSV file to write to
- *
- *    Returns: -1 if there was an issue reading the file, otherwise num read in
- *
- *****************************************************************************************/
-
-int DronePlotDB::writeCSVFile(const char *filename) {
-   std::ofstream cfile;
-   int count = 0;
-
-   cfile.open(filename);
-   if (cfile.fail())
-      return -1;
-
-   std::string buf;
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
-   for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->writeCSV(buf);
-      cfile << buf;
-      count++;
-   }
-
-   cfile.close();
-   return count; 
-}
-
-
-/*****************************************************************************************
- * writeBinaryFile - writes the contents of the database to a file in raw binary form with
- *                   no newlines
- *
- *    Params:  filename - the path/filename of the output file
- *
- *    Returns: -1 if there was an issue opening the file, otherwise num written out
- *
- *****************************************************************************************/
-
-int DronePlotDB::writeBinaryFile(const char *filename) {
-   FileFD outfile(filename);
-   int count = 0;
-
-   if (!outfile.openFile(FileFD::writefd, true))
-      return -1;
-
-   // Prep our vector that will be storing our plotpt data with exactly the right size
-   std::vector<uint8_t> plot;
-   unsigned int ppsize = DronePlot::getDataSize() * _dbdata.size();
-   plot.reserve(ppsize);
-
-   // Loop through all data points and write them to our binary vector
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
-   for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->serialize(plot);
-
-      count++;
-   }
-   // Write it to a file
-   std::cout << "Writing count: " << plot.size() << "\n";
-   outfile.writeBytes<uint8_t>(plot);
-
-   return count;
-}
-
-/*****************************************************************************************
- * loadBinaryFile - reads the contents of a binary dump of the data into the database
- *
- *    Params:  filename - the path/filename of the input file
- *
- *    Returns: -1 if there was an issue opening the file, otherwise num read in 
- *
- *****************************************************************************************/
-
-int DronePlotDB::loadBinaryFile(const char *filename) {
-   std::vector<uint8_t> buf;
-   std::list<DronePlot>::iterator dptr;
-
-   FileFD infile(filename);
-   int count = 0;
-
-   if (!infile.openFile(FileFD::readfd))
-      return -1;
-
-   // Loop through grabbing the bytes of each plotpt
-   unsigned int size = 0;
-   unsigned int ppsize = DronePlot::getDataSize();
-   while ((size = infile.readBytes<uint8_t>(buf, ppsize)) == ppsize) {
-      _dbdata.emplace_back();
-      dptr = _dbdata.end();
-      dptr--;
-
-      // Deserialize
-      dptr->deserialize(buf);
-      buf.clear();
-
-      count++;
-   }
-   
-   // Final read should be size = 0 or this may be a corrupted file
-   if (size != 0) {
-      return -1;
-   }
-
-   infile.closeFD();
-   return count; 
-}
-
-/*****************************************************************************************
- * popFront - removes the front element from the database 
- *
- *    Note: this locks the mutex and may block if it is already locked.
- *
- *****************************************************************************************/
-
-void DronePlotDB::popFront() {
-   // First lock the mutex (blocking)
-   pthread_mutex_lock(&_mutex);
-
-   _dbdata.pop_front();
-
-   // Unlock the mutex before we exit
-   pthread_mutex_unlock(&_mutex);
-}
-
-/*****************************************************************************************
- * erase - removes the DronePlot at the specified index
- *
- *    Warning: this has up to linear time speed--better to use iterators when possible
- *
- *    Note: this locks the mutex and may block if it is already locked.
- *
- *****************************************************************************************/
-
-void DronePlotDB::erase(unsigned int i) {
-   // First lock the mutex (blocking)
-   pthread_mutex_lock(&_mutex);
-
-   if (i > _dbdata.size())
-      throw std::runtime_error("erase function called with index out of scope for std::list.");
-
-   std::list<DronePlot>::iterator diter = _dbdata.begin();
-   for (unsigned int x=0; x<i; x++, diter++);
-
-   _dbdata.erase(diter);
-
-
-   // Unlock the mutex before we exit
-   pthread_mutex_unlock(&_mutex);
-}
-
-/*****************************************************************************************
- * erase - removes the DronePlot at the location pointed to by the iterator
- *
- *    Returns: an iterator pointing to the next element in the list
- *
- *    Note: this locks the mutex and may block if it is already locked.
- *
- *****************************************************************************************/
-
-std::list<DronePlot>::iterator DronePlotDB::erase(std::list<DronePlot>::iterator dptr) {
-   // First lock the mutex (blocking)
-   pthread_mutex_lock(&_mutex);
-
-   auto retptr = _dbdata.erase(dptr);
-
-   // Unlock the mutex before we exit
-   pthread_mutex_unlock(&_mutex);
-
-   return retptr;
-}
-
-
-// Removes all of a particular node (not for student use)
-void DronePlotDB::removeNodeID(unsigned int node_id) {
-   pthread_mutex_lock(&_mutex);
-
-   auto del_iter = _dbdata.begin();
-   while (del_iter != _dbdata.end()) {
-      if (del_iter->node_id == node_id)
-         del_iter = _dbdata.erase(del_iter);
-      else
-         del_iter++;
-   }
-
-   pthread_mutex_unlock(&_mutex);
-}
-
-/*****************************************************************************************
- * sortByTime - sort the database from earliest timestamp to latest
- *
- *       Used by the simulator--students should not need to use this
- *****************************************************************************************/
-void DronePlotDB::sortByTime() {
-   pthread_mutex_lock(&_mutex);
-
-   _dbdata.sort(compare_plot);
-
-   pthread_mutex_unlock(&_mutex);
-}
-
-/*****************************************************************************************
- * clear - removes all the drone data from this class
- *****************************************************************************************/
-
-void DronePlotDB::clear() {
-   _dbdata.clear();
-}
-
-
+#include <stdexcept>
+#include <strings.h>
+#include <cstring>
+#include <unistd.h>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "DronePlotDB.h"
+#include "strfuncts.h"
+#include "FileDesc.h"
+#include "PlotFile.h"
+#include "PlotCSV.h"
+
+
+/*****************************************************************************************
+ * DronePlot - Constructor for a drone plot object, default initializers
+ *****************************************************************************************/
+DronePlot::DronePlot():
+               drone_id(-1),
+               node_id(-1),
+               timestamp(0),
+               latitude(0.0),
+               longitude(0.0),
+               _flags(0)
+{
+   
+}
+
+/*****************************************************************************************
+ * DronePlot - Constructor for a drone plot object, initialized by parameters
+ *****************************************************************************************/
+
+DronePlot::DronePlot(int in_droneid, int in_nodeid, int in_timestamp, float in_latitude, float in_longitude):
+               drone_id(in_droneid),
+               node_id(in_nodeid),
+               timestamp(in_timestamp),
+               latitude(in_latitude),
+               longitude(in_longitude),
+               _flags(0)
+{
+
+}
+
+DronePlot::~DronePlot() {
+
+}
+
+/*****************************************************************************************
+ * getDataSize - returns the total size in bytes of all data stored in this object, minus
+ *               the flags data. Helpful when reserving space in the vector to improve
+ *               serialization efficiency.
+ *****************************************************************************************/
+size_t DronePlot::getDataSize() {
+   return wire_plot_size;
+}
+
+/*****************************************************************************************
+ * serialize - converts the data in this object into a series of binary data and stores the
+ *             bytes in a vector buffer
+ *
+ *    Params:  buf - the vector to store the data in--in the following order:
+ *             drone_id, node_id, timestamp, latitude, longitude (flags not serialized)
+ *             Note: does not clear the vector, merely adds to the end.
+ *****************************************************************************************/
+void DronePlot::serialize(std::vector<uint8_t> &buf) {
+   if (drone_id == 0)
+      throw std::runtime_error("Die");
+
+   size_t start = buf.size();
+   buf.resize(start + wire_plot_size);
+   encodeWirePlot(toWire(), &buf[start]);
+}
+
+/*****************************************************************************************
+ * deserialize - retrieves the data from a vector for this object and loads it into this
+ *               DronePlot object's attributes in order
+ *
+ *    Params:  buf - the vector to load the data in--in the following order:
+ *                drone_id, node_id, timestamp, latitude, longitude (flags not serialized)
+ *                Note: does not clear the vector, merely adds to the end.
+ *             start_pt - the vector index to start reading data
+ *
+ *    Throws: runtime_error - vector is not large enough--ran out of data
+ *****************************************************************************************/
+
+void DronePlot::deserialize(std::vector<uint8_t> &buf, unsigned int start_pt) {
+   if ((size_t) start_pt + wire_plot_size > buf.size())
+      throw std::runtime_error("DronePlot deserialize ran out of data in vector buffer prematurely");
+
+   WirePlot plot;
+   decodeWirePlot(&buf[start_pt], plot);
+   drone_id = plot.drone_id;
+   node_id = plot.node_id;
+   timestamp = (time_t) plot.timestamp;
+   latitude = plot.latitude;
+   longitude = plot.longitude;
+}
+
+/*****************************************************************************************
+ * toWire - this plot as a wire record
+ *****************************************************************************************/
+WirePlot DronePlot::toWire() {
+   WirePlot plot;
+   plot.drone_id = drone_id;
+   plot.node_id = node_id;
+   plot.timestamp = (int64_t) timestamp;
+   plot.latitude = latitude;
+   plot.longitude = longitude;
+   return plot;
+}
+
+/*****************************************************************************************
+ * readCSV - Populates this drone entry from a csv string
+ *
+ *    Returns: -1 for failure, 0 otherwise
+ *****************************************************************************************/
+int DronePlot::readCSV(std::string &buf) {
+   WirePlot plot;
+   if (!parsePlotCSVLine(buf.data(), buf.data() + buf.size(), plot))
+      return -1;
+
+   drone_id = plot.drone_id;
+   node_id = plot.node_id;
+   timestamp = (time_t) plot.timestamp;
+   latitude = plot.latitude;
+   longitude = plot.longitude;
+   return 0;
+}
+
+/*****************************************************************************************
+ * writeCSV - writes this drone entry into a CSV entry (storing in buf)
+ *
+ *****************************************************************************************/
+void DronePlot::writeCSV(std::string &buf) {
+   char line[csv_max_line];
+   buf.assign(line, formatPlotCSVLine(toWire(), line));
+}
+
+/*****************************************************************************************
+ * setFlags - turns on the indicated flags
+ * clrFlags - disables the indicated flags
+ * isFlagSet - returns true if the flag is set
+ *
+ *    Params: flags - a bit mask to indicate the desired flag, using defines.
+ *                   so: clrFlags(DBFLAG_SYNCD);
+ *****************************************************************************************/
+
+void DronePlot::setFlags(unsigned short flags) {
+   _flags |= flags;
+}
+
+void DronePlot::clrFlags(unsigned short flags) {
+   _flags &= ~flags;
+}
+
+bool DronePlot::isFlagSet(unsigned short flags) {
+   return (bool) (_flags & flags);
+}
+
+/*****************************************************************************************
+ * PlotRef - binds the reference to the columns of the given slot
+ *****************************************************************************************/
+PlotRef::PlotRef(PlotStore &store, size_t slot):
+               drone_id(store.droneID(slot)),
+               node_id(store.nodeID(slot)),
+               timestamp(store.timestamp(slot)),
+               latitude(store.latitude(slot)),
+               longitude(store.longitude(slot)),
+               _flags(store.flags(slot)),
+               _handle(store.handleAt(slot)),
+               _offset(store.offsetOf(node_id))
+{
+
+}
+
+/*****************************************************************************************
+ * toPlot - copies the referenced plot (with flags) into a standalone DronePlot
+ *****************************************************************************************/
+DronePlot PlotRef::toPlot() const {
+   DronePlot plot(drone_id, node_id, 0, latitude, longitude);
+   plot.timestamp = timestamp;
+   plot.setFlags(_flags & ~plotflag_dead);
+   return plot;
+}
+
+WirePlot PlotRef::toWire() const {
+   WirePlot plot;
+   plot.drone_id = drone_id;
+   plot.node_id = node_id;
+   plot.timestamp = (int64_t) timestamp;
+   plot.latitude = latitude;
+   plot.longitude = longitude;
+   return plot;
+}
+
+// serialize/writeCSV - same format as DronePlot, which does the work
+void PlotRef::serialize(std::vector<uint8_t> &buf) {
+   toPlot().serialize(buf);
+}
+
+void PlotRef::writeCSV(std::string &buf) {
+   toPlot().writeCSV(buf);
+}
+
+/*****************************************************************************************
+ * PlotMatchHash - mixes the drone ID and the raw bits of the coordinates
+ *****************************************************************************************/
+size_t PlotMatchHash::operator()(const PlotMatchKey &key) const {
+   uint32_t lat, lon;
+   memcpy(&lat, &key.latitude, sizeof(lat));
+   memcpy(&lon, &key.longitude, sizeof(lon));
+
+   uint64_t h = ((uint64_t) lat << 32) | lon;
+   h ^= (uint64_t) key.drone_id * 0x9E3779B97F4A7C15ULL;
+   h ^= h >> 29;
+   h *= 0xBF58476D1CE4E5B9ULL;
+   h ^= h >> 32;
+   return (size_t) h;
+}
+
+/*****************************************************************************************
+ * PlotTimeHash - mixes the drone ID and timestamp
+ *****************************************************************************************/
+size_t PlotTimeHash::operator()(const PlotTimeKey &key) const {
+   uint64_t h = (uint64_t) key.timestamp ^ ((uint64_t) key.drone_id << 40);
+   h ^= h >> 31;
+   h *= 0x9E3779B97F4A7C15ULL;
+   h ^= h >> 29;
+   return (size_t) h;
+}
+
+/*****************************************************************************************
+ * DronePlotDB - Constructor, currently initializes the mutex only
+ *
+ *****************************************************************************************/
+DronePlotDB::DronePlotDB():_journal(NULL),_generation(0) {
+
+   // Initialize our mutex for thread protection
+   pthread_mutex_init(&_mutex, NULL);
+}
+
+// No behavior for destructor yet
+DronePlotDB::~DronePlotDB() {
+
+}
+
+
+/*****************************************************************************************
+ * addPlot - Adds a plot object at the end of the database
+ *
+ *    Params:  drone_id - the unique integer ID of this particular drone
+ *             node_id - the unique integer ID of the receiving site
+ *             timestamp - the plot's time in seconds
+ *             latitude - floating point latitude coordinate of this plot point
+ *             longitude - floating point longitude coordinate of this plot point
+ *             flags - DBFLAG_ values to start the plot with (set under the same lock)
+ *
+ *    Returns: the handle of the new plot
+ *
+ *****************************************************************************************/
+
+PlotHandle DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude,
+                                                float longitude, unsigned short flags) {
+   // First lock the mutex (blocking)
+   pthread_mutex_lock(&_mutex);
+
+   PlotHandle handle = insertPlot(drone_id, node_id, timestamp, latitude, longitude, flags);
+
+   // Unlock the mutex before we exit
+   pthread_mutex_unlock(&_mutex);
+
+   return handle;
+}
+
+/*****************************************************************************************
+ * addPlots - adds a batch of plots at the end of the database, all under one lock
+ *
+ *    Params:  plots - the plots (as decoded by decodePlotBatch)
+ *             count - how many
+ *             flags - flags to set on every one of them
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::addPlots(const WirePlot *plots, size_t count, unsigned short flags) {
+   pthread_mutex_lock(&_mutex);
+
+   // Size the indexes once for the whole batch instead of rehashing part way through
+   _matchidx.reserve(_matchidx.size() + count);
+   _timeidx.reserve(_timeidx.size() + count);
+
+   for (size_t i=0; i<count; i++) {
+      insertPlot(plots[i].drone_id, plots[i].node_id, (time_t) plots[i].timestamp,
+                                        plots[i].latitude, plots[i].longitude, flags);
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * loadCSVFile - loads in a CSV file containing the plot entries in the right order. The
+ *               order should be (no spaces around commas):
+ *               drone_id,node_id,timestamp,latitude,longitude
+ *
+ *               The file is mapped and parsed in parallel (see PlotCSV.h), and nothing is
+ *               added unless every line parses
+ *
+ *    Params:  filename - the path/filename of the CSV file to load
+ *
+ *    Returns: -1 if there was an issue reading the file, otherwise num read in
+ *
+ *****************************************************************************************/
+
+int DronePlotDB::loadCSVFile(const char *filename) {
+   FileFD cfile(filename);
+
+   if (!cfile.openFile(FileFD::readfd))
+      return -1;
+
+   bool mapped = cfile.mapFile();
+   cfile.closeFD();
+   if (!mapped)
+      return -1;
+
+   std::vector<std::vector<WirePlot>> parts;
+   long count = parsePlotCSV((const char *) cfile.mapData(), cfile.mapSize(), parts);
+   if (count < 0)
+      return -1;
+
+   for (unsigned int i=0; i<parts.size(); i++)
+      addPlots(parts[i].data(), parts[i].size(), 0);
+
+   return (int) count;
+}
+
+/*****************************************************************************************
+ * writeCSVFile - writes the database in order to a CSV text file. The order is:
+ *               drone_id,node_id,timestamp,latitude,longitude
+ *
+ *               timestamp is the corrected time (node clock offset applied)
+ *
+ *               Rows are formatted with to_chars into a large buffer and written a
+ *               buffer at a time
+ *
+ *    Params:  filename - the path/filename of the CSV file to write to
+ *
+ *    Returns: -1 if there was an issue writing the file, otherwise num written
+ *
+ *****************************************************************************************/
+
+int DronePlotDB::writeCSVFile(const char *filename) {
+   FileFD cfile(filename);
+   int count = 0;
+
+   if (!cfile.openFile(FileFD::writefd, true))
+      return -1;
+
+   // Written from a snapshot so ingest carries on while the file is written
+   PlotSnapshotPtr snap = snapshot();
+
+   // Lines are formatted into one buffer that is written out each time it fills
+   std::vector<char> buf(csv_write_buffer);
+   size_t used = 0;
+   bool ok = true;
+
+   for (size_t slot = snap->firstLive(); slot < snap->endSlot(); slot = snap->nextLive(slot + 1)) {
+      if (buf.size() - used < csv_max_line) {
+         ok = ok && (cfile.writeAll(buf.data(), used) >= 0);
+         used = 0;
+      }
+
+      WirePlot plot;
+      plot.drone_id = snap->droneID(slot);
+      plot.node_id = snap->nodeID(slot);
+      plot.timestamp = (int64_t) snap->correctedTime(slot);
+      plot.latitude = snap->latitude(slot);
+      plot.longitude = snap->longitude(slot);
+      used += formatPlotCSVLine(plot, &buf[used]);
+      count++;
+   }
+   ok = ok && (cfile.writeAll(buf.data(), used) >= 0);
+
+   cfile.closeFD();
+   return ok ? count : -1;
+}
+
+
+/*****************************************************************************************
+ * gatherPlots - copies the live plots out of a snapshot as wire records, in slot order, and
+ *               optionally their database flags (DBFLAG_ bits only). Timestamps are the
+ *               corrected ones if corrected is set, the stored ones otherwise
+ *****************************************************************************************/
+static void gatherPlots(const PlotSnapshot &snap, bool corrected, std::vector<WirePlot> &plots,
+                                                   std::vector<unsigned short> *flags) {
+   plots.clear();
+   plots.reserve(snap.endSlot());
+   if (flags != NULL) {
+      flags->clear();
+      flags->reserve(snap.endSlot());
+   }
+
+   for (size_t slot = snap.firstLive(); slot < snap.endSlot(); slot = snap.nextLive(slot + 1)) {
+      WirePlot wire;
+      wire.drone_id = snap.droneID(slot);
+      wire.node_id = snap.nodeID(slot);
+      wire.timestamp = (int64_t) (corrected ? snap.correctedTime(slot) : snap.timestamp(slot));
+      wire.latitude = snap.latitude(slot);
+      wire.longitude = snap.longitude(slot);
+      plots.push_back(wire);
+
+      if (flags != NULL)
+         flags->push_back(snap.flags(slot) & ~(plotflag_dead | plotflag_moved));
+   }
+}
+
+/*****************************************************************************************
+ * writeBinaryFile - writes the contents of the database to a version 2 plot file (header,
+ *                   records and time index--see PlotFile.h), with corrected timestamps
+ *
+ *    Params:  filename - the path/filename of the output file
+ *
+ *    Returns: -1 if there was an issue writing the file, otherwise num written out
+ *
+ *****************************************************************************************/
+
+int DronePlotDB::writeBinaryFile(const char *filename) {
+   // Written from a snapshot so ingest carries on while the file is written
+   PlotSnapshotPtr snap = snapshot();
+
+   std::vector<WirePlot> plots;
+   gatherPlots(*snap, true, plots, NULL);
+
+   if (!PlotFile::write(filename, plots.data(), plots.size()))
+      return -1;
+
+   return (int) plots.size();
+}
+
+/*****************************************************************************************
+ * loadBinaryFile - reads a plot file (version 2, or the headerless version 1) into the
+ *                  database. The file is mapped and, on a little-endian host, its records
+ *                  go into the database straight from the mapping with no read calls or
+ *                  copies in between
+ *
+ *    Params:  filename - the path/filename of the input file
+ *
+ *    Returns: -1 if there was an issue opening the file or it is corrupt, otherwise num
+ *             read in
+ *
+ *****************************************************************************************/
+
+int DronePlotDB::loadBinaryFile(const char *filename) {
+   PlotFile infile;
+
+   try {
+      infile.open(filename);
+   } catch (std::runtime_error &e) {
+      return -1;
+   }
+
+   if (!wire_needs_swap) {
+      addPlots(infile.records(), infile.size(), 0);
+      return (int) infile.size();
+   }
+
+   // Big-endian host - decode a block at a time
+   const size_t step = 4096;
+   std::vector<WirePlot> plots(step);
+   for (size_t i=0; i<infile.size(); i+=step) {
+      size_t n = std::min(step, infile.size() - i);
+      infile.readRecords(i, n, plots.data());
+      addPlots(plots.data(), n, 0);
+   }
+   return (int) infile.size();
+}
+
+/*****************************************************************************************
+ * popFront - removes the front element from the database
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::popFront() {
+   // First lock the mutex (blocking)
+   pthread_mutex_lock(&_mutex);
+
+   size_t slot = _store.firstLive();
+   if (slot != _store.endSlot())
+      removePlot(_store.handleAt(slot));
+
+   // Unlock the mutex before we exit
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * erase - removes the DronePlot at the specified index
+ *
+ *    Warning: this has up to linear time speed--better to use iterators when possible
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::erase(unsigned int i) {
+   // First lock the mutex (blocking)
+   pthread_mutex_lock(&_mutex);
+
+   if (i >= _store.size()) {
+      pthread_mutex_unlock(&_mutex);
+      throw std::runtime_error("erase function called with index out of scope for the database.");
+   }
+
+   size_t slot = _store.firstLive();
+   for (unsigned int x=0; x<i; x++)
+      slot = _store.nextLive(slot + 1);
+
+   removePlot(_store.handleAt(slot));
+
+   // Unlock the mutex before we exit
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * erase - removes the DronePlot with the given handle, or the one pointed to by the iterator
+ *
+ *    Returns: (iterator version) an iterator pointing to the next element in the database
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::erasePlot(PlotHandle plot) {
+   // First lock the mutex (blocking)
+   pthread_mutex_lock(&_mutex);
+
+   removePlot(plot);
+
+   // Unlock the mutex before we exit
+   pthread_mutex_unlock(&_mutex);
+}
+
+DronePlotDB::iterator DronePlotDB::erase(iterator dptr) {
+   // First lock the mutex (blocking)
+   pthread_mutex_lock(&_mutex);
+
+   removePlot(dptr.getHandle());
+   dptr._slot = _store.nextLive(dptr._slot + 1);
+
+   // Unlock the mutex before we exit
+   pthread_mutex_unlock(&_mutex);
+
+   return dptr;
+}
+
+
+// Removes all of a particular node (not for student use)
+void DronePlotDB::removeNodeID(unsigned int node_id) {
+   pthread_mutex_lock(&_mutex);
+
+   for (size_t slot = _store.firstLive(); slot < _store.endSlot(); slot = _store.nextLive(slot + 1)) {
+      if (_store.nodeID(slot) == node_id)
+         removePlot(_store.handleAt(slot));
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * sortByTime - sort the database from earliest timestamp to latest. Erased plots are
+ *              dropped from storage at the same time. Outstanding iterators are
+ *              invalidated; handles are not
+ *
+ *              Cheap to call often: only plots added out of order or re-timed since the
+ *              last call are sorted and merged in, and if there are none it does nothing
+ *
+ *       Used by the simulator--students should not need to use this
+ *****************************************************************************************/
+void DronePlotDB::sortByTime() {
+   pthread_mutex_lock(&_mutex);
+
+   _store.sortByTime();
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * snapshot - pins the database's current contents. The returned view releases itself (under
+ *            the mutex) when the last copy of it is dropped
+ *
+ *    Returns: the view, which stays unchanged however the database changes after this
+ *****************************************************************************************/
+
+PlotSnapshotPtr DronePlotDB::snapshot() {
+   pthread_mutex_lock(&_mutex);
+   PlotSnapshotPtr snap = pinSnapshot();
+   pthread_mutex_unlock(&_mutex);
+
+   return snap;
+}
+
+PlotSnapshotPtr DronePlotDB::pinSnapshot() {
+   PlotSnapshot *snap = new PlotSnapshot;
+   _store.pin(*snap);
+
+   return PlotSnapshotPtr(snap, [this](const PlotSnapshot *done) {
+      pthread_mutex_lock(&_mutex);
+      _store.unpin(*done);
+      pthread_mutex_unlock(&_mutex);
+      delete done;
+   });
+}
+
+/*****************************************************************************************
+ * clear - removes all the drone data from this class. Node clock offsets are kept
+ *****************************************************************************************/
+
+void DronePlotDB::clear() {
+   logChange(jop_clear, 0);
+
+   _store.clear();
+   _matchidx.clear();
+   _unmatched.clear();
+   _timeidx.clear();
+   _tracks.clear();
+   _grid.clear();
+   _undeduped.clear();
+}
+
+/*****************************************************************************************
+ * insertPlot - adds a plot to the store, to the match and duplicate indexes and to the
+ *              lists of plots waiting to be handed out by getUnmatched/getUndeduped
+ * removePlot - takes a plot out of the indexes and releases its storage
+ *
+ *    Note: the mutex must already be held (or the database not yet shared)
+ *****************************************************************************************/
+
+// Removes plot from one of the multimap indexes, looking only within its key
+template <typename Index, typename Key>
+static void removeIndexed(Index &index, const Key &key, PlotHandle plot) {
+   auto range = index.equal_range(key);
+   for (auto iptr = range.first; iptr != range.second; iptr++) {
+      if (iptr->second == plot) {
+         index.erase(iptr);
+         return;
+      }
+   }
+}
+
+PlotHandle DronePlotDB::insertPlot(unsigned int drone_id, unsigned int node_id, time_t timestamp,
+                                   float latitude, float longitude, unsigned short flags) {
+   PlotHandle plot = _store.append(drone_id, node_id, timestamp, latitude, longitude, flags);
+   PlotRef ref = getPlot(plot);
+   logChange(jop_insert, _store.slotOf(plot), flags);
+
+   _matchidx.emplace(PlotMatchKey(ref), plot);
+   _unmatched.push_back(plot);
+   _timeidx.emplace(PlotTimeKey(ref), plot);
+   _undeduped.push_back(plot);
+   indexPosition(plot, drone_id, timestamp, latitude, longitude);
+
+   return plot;
+}
+
+void DronePlotDB::removePlot(PlotHandle plot) {
+   PlotRef ref = getPlot(plot);
+   logChange(jop_erase, _store.slotOf(plot));
+
+   removeIndexed(_matchidx, PlotMatchKey(ref), plot);
+   removeIndexed(_timeidx, PlotTimeKey(ref), plot);
+   unindexPosition(plot, ref.drone_id, ref.timestamp, ref.latitude, ref.longitude);
+
+   // Left in the pending lists--dropped when they are handed out (see takePending)
+   _store.kill(plot);
+}
+
+/*****************************************************************************************
+ * getUnmatched - hands back every plot added since the last call and resets the list.
+ *                Lets the skew check look only at new data
+ *
+ *    Params:  plots - cleared, then loaded with handles of the new plots
+ *****************************************************************************************/
+
+void DronePlotDB::getUnmatched(std::vector<PlotHandle> &plots) {
+   pthread_mutex_lock(&_mutex);
+   takePending(_unmatched, plots);
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * findMatches - finds all other plots of the same drone at the same latitude/longitude
+ *
+ *    Params:  plot - the plot to match against (not included in the results)
+ *             matches - cleared, then loaded with handles of the matching plots
+ *****************************************************************************************/
+
+void DronePlotDB::findMatches(PlotHandle plot, std::vector<PlotHandle> &matches) {
+   matches.clear();
+
+   pthread_mutex_lock(&_mutex);
+
+   auto range = _matchidx.equal_range(PlotMatchKey(getPlot(plot)));
+   for (auto mptr = range.first; mptr != range.second; mptr++) {
+      if (mptr->second != plot)
+         matches.push_back(mptr->second);
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * getUndeduped - hands back every plot added or re-timed since the last call and resets
+ *                the list. Lets the duplicate check look only at plots that changed
+ *
+ *    Params:  plots - cleared, then loaded with handles of the changed plots
+ *****************************************************************************************/
+
+void DronePlotDB::getUndeduped(std::vector<PlotHandle> &plots) {
+   pthread_mutex_lock(&_mutex);
+   takePending(_undeduped, plots);
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * takePending - moves a pending list into plots, leaving out plots erased since they were
+ *               queued. Erase does not search the pending lists, as they can grow long on a
+ *               database nobody drains (i.e. the simulator's source data)
+ *
+ *    Note: a queued handle may have been reused by a newer plot. That plot is pending
+ *          anyway, so at worst it is handed out twice
+ *****************************************************************************************/
+
+void DronePlotDB::takePending(std::vector<PlotHandle> &pending, std::vector<PlotHandle> &plots) {
+   plots.clear();
+   plots.swap(pending);
+
+   plots.erase(std::remove_if(plots.begin(), plots.end(),
+                  [this](PlotHandle plot) { return !_store.isValid(plot); }), plots.end());
+}
+
+/*****************************************************************************************
+ * findDuplicates - finds all other plots of the same drone with the same corrected time.
+ *                  The index holds stored times, so it is looked up once per offset in use:
+ *                  at (corrected time - offset), keeping only plots from nodes with that
+ *                  offset
+ *
+ *    Params:  plot - the plot to check (not included in the results)
+ *             dupes - cleared, then loaded with handles of the duplicate plots
+ *****************************************************************************************/
+
+void DronePlotDB::findDuplicates(PlotHandle plot, std::vector<PlotHandle> &dupes) {
+   dupes.clear();
+
+   pthread_mutex_lock(&_mutex);
+
+   PlotRef ref = getPlot(plot);
+   const std::vector<time_t> &shifts = _store.shifts();
+   for (auto sptr = shifts.begin(); sptr != shifts.end(); sptr++) {
+      auto range = _timeidx.equal_range(PlotTimeKey(ref.drone_id, ref.correctedTime() - *sptr));
+      for (auto tptr = range.first; tptr != range.second; tptr++) {
+         if ((tptr->second != plot) && ((shifts.size() == 1) ||
+                                        (getPlot(tptr->second).correctedTime() == ref.correctedTime())))
+            dupes.push_back(tptr->second);
+      }
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * adjustTime - shifts a plot's timestamp by delta seconds, re-keys it in the duplicate
+ *              index and queues it to be returned by the next getUndeduped
+ *
+ *    Note: does not re-sort the database--call sortByTime if order matters
+ *****************************************************************************************/
+void DronePlotDB::adjustTime(PlotHandle plot, time_t delta) {
+   pthread_mutex_lock(&_mutex);
+   retime(plot, delta);
+   pthread_mutex_unlock(&_mutex);
+}
+
+void DronePlotDB::retime(PlotHandle plot, time_t delta) {
+   logChange(jop_retime, _store.slotOf(plot), 0, (int64_t) delta);
+
+   PlotRef ref = getPlot(plot);
+   removeIndexed(_timeidx, PlotTimeKey(ref), plot);
+   unindexPosition(plot, ref.drone_id, ref.timestamp, ref.latitude, ref.longitude);
+   _store.setTimestamp(_store.slotOf(plot), ref.timestamp + delta);
+
+   // setTimestamp may have moved the plot to a copy-on-write chunk, so look it up again
+   PlotRef moved = getPlot(plot);
+   _timeidx.emplace(PlotTimeKey(moved), plot);
+   indexPosition(plot, moved.drone_id, moved.timestamp, moved.latitude, moved.longitude);
+   _undeduped.push_back(plot);
+}
+
+/*****************************************************************************************
+ * setNodeOffset - sets the clock offset added to every timestamp from a node. The plots
+ *                 themselves are not touched: sorting, the indexes and the exports all apply
+ *                 the offset as they read. The node's plots are queued for the next
+ *                 getUndeduped, since their corrected times may now collide with others
+ * getNodeOffset - the offset currently set for a node (0 if none)
+ *
+ *    Note: does not re-sort the database--call sortByTime if order matters
+ *
+ *    Throws: runtime_error if node_id is max_offset_nodes or more
+ *****************************************************************************************/
+void DronePlotDB::setNodeOffset(unsigned int node_id, time_t offset) {
+   if (node_id >= max_offset_nodes)
+      throw std::runtime_error("setNodeOffset called with a node ID too large to give an offset.");
+
+   pthread_mutex_lock(&_mutex);
+   applyOffset(node_id, offset);
+   pthread_mutex_unlock(&_mutex);
+}
+
+time_t DronePlotDB::getNodeOffset(unsigned int node_id) {
+   pthread_mutex_lock(&_mutex);
+   time_t offset = _store.offsetOf(node_id);
+   pthread_mutex_unlock(&_mutex);
+
+   return offset;
+}
+
+void DronePlotDB::applyOffset(unsigned int node_id, time_t offset) {
+   if (_store.offsetOf(node_id) == offset)
+      return;
+
+   bumpGeneration();
+   logOffset(node_id, offset);
+   _store.setOffset(node_id, offset);
+
+   for (size_t slot = _store.firstLive(); slot < _store.endSlot(); slot = _store.nextLive(slot + 1)) {
+      if (_store.nodeID(slot) == node_id)
+         _undeduped.push_back(_store.handleAt(slot));
+   }
+}
+
+/*****************************************************************************************
+ * setFlags/clrFlags - turn DBFLAG_ bits on or off for one plot
+ *
+ *    Params:  plot - the plot to change
+ *             flags - bit mask of DBFLAG_ values
+ *****************************************************************************************/
+void DronePlotDB::setFlags(PlotHandle plot, unsigned short flags) {
+   pthread_mutex_lock(&_mutex);
+   _store.setFlags(_store.slotOf(plot), flags);
+   logChange(jop_setflags, _store.slotOf(plot), flags);
+   pthread_mutex_unlock(&_mutex);
+}
+
+void DronePlotDB::clrFlags(PlotHandle plot, unsigned short flags) {
+   pthread_mutex_lock(&_mutex);
+   _store.clrFlags(_store.slotOf(plot), flags);
+   logChange(jop_clrflags, _store.slotOf(plot), flags);
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * takeNewPlots - collects the plots flagged DBFLAG_NEW, in storage order, and clears the
+ *                flag on each so they are only taken once
+ *
+ *    Params:  plots - cleared, then loaded with the new plots
+ *****************************************************************************************/
+void DronePlotDB::takeNewPlots(std::vector<WirePlot> &plots) {
+   plots.clear();
+
+   pthread_mutex_lock(&_mutex);
+
+   for (size_t slot = _store.firstLive(); slot < _store.endSlot(); slot = _store.nextLive(slot + 1)) {
+      if (!(_store.flags(slot) & DBFLAG_NEW))
+         continue;
+
+      plots.push_back(PlotRef(_store, slot).toWire());
+      _store.clrFlags(slot, DBFLAG_NEW);
+   }
+   if (plots.size() > 0)
+      logChange(jop_takenew, 0);
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * PlotTimeline::insert - adds an entry, hinted at the end since plots mostly arrive in order
+ * PlotTimeline::erase - removes one entry, if present
+ *****************************************************************************************/
+void PlotTimeline::insert(time_t timestamp, PlotHandle plot) {
+   _entries.emplace_hint(_entries.end(), timestamp, plot);
+}
+
+void PlotTimeline::erase(time_t timestamp, PlotHandle plot) {
+   _entries.erase(entry(timestamp, plot));
+}
+
+PlotTimeline::const_iterator PlotTimeline::first(time_t start) const {
+   return _entries.lower_bound(entry(start, 0));
+}
+
+PlotTimeline::const_iterator PlotTimeline::last(time_t end) const {
+   return _entries.upper_bound(entry(end, no_plot));
+}
+
+/*****************************************************************************************
+ * gridCell - the spatial grid cell a coordinate falls in, packed into one key
+ *****************************************************************************************/
+static int32_t gridRow(float degrees) {
+   double row = std::floor((double) degrees / grid_cell_deg);
+
+   // Anything off the map (or NaN) still needs a valid row
+   if (!(row > -2147483648.0))
+      return INT32_MIN;
+   if (row > 2147483647.0)
+      return INT32_MAX;
+   return (int32_t) row;
+}
+
+static uint64_t gridCell(int32_t lat_row, int32_t lon_row) {
+   return ((uint64_t) (uint32_t) lat_row << 32) | (uint32_t) lon_row;
+}
+
+/*****************************************************************************************
+ * indexPosition - adds a plot to its drone's track and to its grid cell
+ * unindexPosition - takes it out again (timestamp and coordinates must be the ones it was
+ *                   indexed with). Emptied tracks and cells are dropped
+ *****************************************************************************************/
+void DronePlotDB::indexPosition(PlotHandle plot, unsigned int drone_id, time_t timestamp,
+                                                   float latitude, float longitude) {
+   _tracks[drone_id].insert(timestamp, plot);
+   _grid[gridCell(gridRow(latitude), gridRow(longitude))].insert(timestamp, plot);
+}
+
+void DronePlotDB::unindexPosition(PlotHandle plot, unsigned int drone_id, time_t timestamp,
+                                                   float latitude, float longitude) {
+   auto tptr = _tracks.find(drone_id);
+   if (tptr != _tracks.end()) {
+      tptr->second.erase(timestamp, plot);
+      if (tptr->second.empty())
+         _tracks.erase(tptr);
+   }
+
+   auto gptr = _grid.find(gridCell(gridRow(latitude), gridRow(longitude)));
+   if (gptr != _grid.end()) {
+      gptr->second.erase(timestamp, plot);
+      if (gptr->second.empty())
+         _grid.erase(gptr);
+   }
+}
+
+/*****************************************************************************************
+ * scanWindow - collects the entries of a timeline inside a corrected time window. The
+ *              timeline is keyed on stored times, so the window is looked up once per offset
+ *              in use, moved back by that offset, keeping only plots from nodes with that
+ *              offset. With more than one offset the results come back per offset, so the
+ *              caller sorts them
+ *
+ *    Params:  line - the track or grid cell
+ *             start, end - the window in corrected time (inclusive)
+ *             found - (corrected time, handle) pairs are appended
+ *****************************************************************************************/
+
+// t - shift, pinned to the ends of time_t instead of wrapping
+static time_t unshiftTime(time_t t, time_t shift) {
+   time_t res;
+   if (!__builtin_sub_overflow(t, shift, &res))
+      return res;
+   return (shift > 0) ? std::numeric_limits<time_t>::min() : std::numeric_limits<time_t>::max();
+}
+
+void DronePlotDB::scanWindow(const PlotTimeline &line, time_t start, time_t end,
+                             std::vector<PlotTimeline::entry> &found) {
+   const std::vector<time_t> &shifts = _store.shifts();
+
+   for (auto sptr = shifts.begin(); sptr != shifts.end(); sptr++) {
+      auto first = line.first(unshiftTime(start, *sptr)), last = line.last(unshiftTime(end, *sptr));
+      for ( ; first != last; first++) {
+         PlotRef ref = getPlot(first->second);
+         if ((shifts.size() == 1) || (_store.offsetOf(ref.node_id) == *sptr))
+            found.emplace_back(ref.correctedTime(), first->second);
+      }
+   }
+}
+
+/*****************************************************************************************
+ * findTrack - finds a drone's plots within a time window
+ *
+ *    Params:  drone_id - the drone
+ *             start, end - the window (inclusive)
+ *             plots - cleared, then loaded with the handles in time order
+ *****************************************************************************************/
+void DronePlotDB::findTrack(unsigned int drone_id, time_t start, time_t end,
+                                                   std::vector<PlotHandle> &plots) {
+   std::vector<PlotTimeline::entry> found;
+   plots.clear();
+
+   pthread_mutex_lock(&_mutex);
+
+   auto tptr = _tracks.find(drone_id);
+   if ((tptr != _tracks.end()) && (start <= end))
+      scanWindow(tptr->second, start, end, found);
+   bool mixed = _store.shifts().size() > 1;
+
+   pthread_mutex_unlock(&_mutex);
+
+   if (mixed)
+      std::sort(found.begin(), found.end());
+
+   plots.reserve(found.size());
+   for (auto fptr = found.begin(); fptr != found.end(); fptr++)
+      plots.push_back(fptr->second);
+}
+
+/*****************************************************************************************
+ * findInBox - finds the plots inside a lat/lon box within a time window. Looks only at the
+ *             grid cells the box covers (or, for a box bigger than the area in use, at the
+ *             occupied cells) and only at the part of each cell's timeline in the window
+ *
+ *    Params:  lat_min, lon_min, lat_max, lon_max - the box (edges included)
+ *             start, end - the window (inclusive)
+ *             plots - cleared, then loaded with the handles (grouped by cell, each cell's in
+ *                     time order)
+ *****************************************************************************************/
+void DronePlotDB::findInBox(float lat_min, float lon_min, float lat_max, float lon_max,
+                            time_t start, time_t end, std::vector<PlotHandle> &plots) {
+   plots.clear();
+   if ((lat_min > lat_max) || (lon_min > lon_max) || (start > end))
+      return;
+
+   int32_t lat_lo = gridRow(lat_min), lat_hi = gridRow(lat_max);
+   int32_t lon_lo = gridRow(lon_min), lon_hi = gridRow(lon_max);
+
+   // Checks the plots of one cell in the window against the box (edge cells are partial)
+   std::vector<PlotTimeline::entry> found;
+   auto scanCell = [&](const PlotTimeline &cell) {
+      found.clear();
+      scanWindow(cell, start, end, found);
+      if (_store.shifts().size() > 1)
+         std::sort(found.begin(), found.end());
+
+      for (auto fptr = found.begin(); fptr != found.end(); fptr++) {
+         PlotRef ref = getPlot(fptr->second);
+         if ((ref.latitude >= lat_min) && (ref.latitude <= lat_max) &&
+             (ref.longitude >= lon_min) && (ref.longitude <= lon_max))
+            plots.push_back(fptr->second);
+      }
+   };
+
+   pthread_mutex_lock(&_mutex);
+
+   double cells = ((double) lat_hi - lat_lo + 1) * ((double) lon_hi - lon_lo + 1);
+   if (cells > (double) _grid.size()) {
+      for (auto gptr = _grid.begin(); gptr != _grid.end(); gptr++) {
+         int32_t lat_row = (int32_t) (uint32_t) (gptr->first >> 32);
+         int32_t lon_row = (int32_t) (uint32_t) gptr->first;
+         if ((lat_row >= lat_lo) && (lat_row <= lat_hi) && (lon_row >= lon_lo) &&
+                                                             (lon_row <= lon_hi))
+            scanCell(gptr->second);
+      }
+   } else {
+      for (int32_t lat_row = lat_lo; lat_row <= lat_hi; lat_row++) {
+         for (int32_t lon_row = lon_lo; lon_row <= lon_hi; lon_row++) {
+            auto gptr = _grid.find(gridCell(lat_row, lon_row));
+            if (gptr != _grid.end())
+               scanCell(gptr->second);
+         }
+      }
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * recover - rebuilds the database from a journal: loads the newest checkpoint, flags and
+ *           all, then replays the records logged after it. Call on an empty database, before
+ *           setJournal and before the journal is started
+ *
+ *    Params:  journal - the journal to recover from
+ *
+ *    Returns: the number of plots recovered, or -1 if the checkpoint could not be read
+ *****************************************************************************************/
+int DronePlotDB::recover(PlotJournal &journal) {
+   std::string ckpt = journal.checkpointFile();
+   PlotFile infile;
+
+   if (ckpt.size() > 0) {
+      try {
+         infile.open(ckpt.c_str());
+      } catch (std::runtime_error &e) {
+         std::cerr << "Unable to recover from " << ckpt << ": " << e.what() << "\n";
+         return -1;
+      }
+   }
+
+   pthread_mutex_lock(&_mutex);
+
+   PlotJournal *attached = _journal;
+   _journal = NULL;
+
+   const size_t step = 4096;
+   std::vector<WirePlot> plots(step);
+   std::vector<unsigned short> flags(step);
+   for (size_t i=0; i<infile.size(); i+=step) {
+      size_t n = std::min(step, infile.size() - i);
+      infile.readRecords(i, n, plots.data());
+      infile.readFlags(i, n, flags.data());
+      for (size_t j=0; j<n; j++) {
+         insertPlot(plots[j].drone_id, plots[j].node_id, (time_t) plots[j].timestamp,
+                                    plots[j].latitude, plots[j].longitude, flags[j]);
+      }
+   }
+
+   JournalEntry entry;
+   while (journal.nextRecord(entry))
+      applyJournal(entry);
+
+   _journal = attached;
+   int count = (int) _store.size();
+
+   pthread_mutex_unlock(&_mutex);
+   return count;
+}
+
+/*****************************************************************************************
+ * checkpointDue - true if a journal is attached and has logged enough since the last
+ *                 checkpoint that one should be written
+ *****************************************************************************************/
+bool DronePlotDB::checkpointDue() {
+   return (_journal != NULL) && _journal->checkpointDue();
+}
+
+/*****************************************************************************************
+ * journalMark - how many records the journal has been given, so a caller can tell later
+ *               (with journalSynced) when the changes it has made so far are on disk
+ * journalSynced - true once the journal has committed everything up to mark. Never true
+ *                 again once the journal has failed
+ *****************************************************************************************/
+uint64_t DronePlotDB::journalMark() {
+   return (_journal != NULL) ? _journal->appended() : 0;
+}
+
+bool DronePlotDB::journalSynced(uint64_t mark) {
+   return (_journal == NULL) || (!_journal->failed() && (_journal->committed() >= mark));
+}
+
+/*****************************************************************************************
+ * checkpoint - writes the whole database to a new checkpoint and retires the journal
+ *              segments it covers. Only the switch to the new segment and the snapshot pin
+ *              happen under the lock; the segment is created beforehand, and the old one's
+ *              tail and the file are written afterwards while the database carries on
+ *
+ *    Returns: false if there is no journal or the checkpoint could not be written (the
+ *             journal still holds everything in that case)
+ *****************************************************************************************/
+bool DronePlotDB::checkpoint() {
+   if (_journal == NULL)
+      return false;
+
+   uint64_t seq = _journal->prepareRotate();
+   if (seq == 0)
+      return false;
+
+   pthread_mutex_lock(&_mutex);
+   _journal->rotate();
+   PlotSnapshotPtr snap = pinSnapshot();
+
+   // The checkpoint file only holds plots, so the offsets start the new segment
+   const std::vector<time_t> &offsets = _store.offsets();
+   for (unsigned int node_id = 0; node_id < offsets.size(); node_id++) {
+      if (offsets[node_id] != 0)
+         logOffset(node_id, offsets[node_id]);
+   }
+   pthread_mutex_unlock(&_mutex);
+
+   _journal->finishRotate();
+
+   std::vector<WirePlot> plots;
+   std::vector<unsigned short> flags;
+   gatherPlots(*snap, false, plots, &flags);
+   snap.reset();
+
+   std::string temp = _journal->checkpointTemp(seq);
+   if (!PlotFile::write(temp.c_str(), plots.data(), plots.size(), flags.data(), true)) {
+      unlink(temp.c_str());
+      return false;
+   }
+   return _journal->finishCheckpoint(seq);
+}
+
+/*****************************************************************************************
+ * logChange - counts a change in the generation and appends it to the journal, if one is
+ *             attached. The plot is identified by its contents as they are before the change
+ *
+ *    Params:  op - the journal_op
+ *             slot - the plot (ignored for jop_takenew and jop_clear)
+ *             flags, arg - as the op needs them
+ *****************************************************************************************/
+void DronePlotDB::logChange(uint8_t op, size_t slot, unsigned short flags, int64_t arg) {
+   bumpGeneration();
+   if (_journal == NULL)
+      return;
+
+   JournalEntry entry;
+   memset(&entry, 0, sizeof(entry));
+   entry.op = op;
+   entry.flags = flags;
+   entry.arg = arg;
+   if ((op != jop_takenew) && (op != jop_clear))
+      entry.plot = PlotRef(_store, slot).toWire();
+
+   _journal->append(entry);
+}
+
+/*****************************************************************************************
+ * logOffset - appends a node clock offset to the journal, if one is attached
+ *****************************************************************************************/
+void DronePlotDB::logOffset(unsigned int node_id, time_t offset) {
+   if (_journal == NULL)
+      return;
+
+   JournalEntry entry;
+   memset(&entry, 0, sizeof(entry));
+   entry.op = jop_offset;
+   entry.plot.node_id = node_id;
+   entry.arg = (int64_t) offset;
+
+   _journal->append(entry);
+}
+
+/*****************************************************************************************
+ * applyJournal - re-applies one journal record. Records naming a plot that is not there are
+ *                skipped
+ *****************************************************************************************/
+void DronePlotDB::applyJournal(const JournalEntry &entry) {
+   PlotHandle plot = no_plot;
+   if ((entry.op == jop_erase) || (entry.op == jop_retime) || (entry.op == jop_setflags) ||
+                                                               (entry.op == jop_clrflags)) {
+      if ((plot = findPlot(entry.plot)) == no_plot)
+         return;
+   }
+
+   switch (entry.op) {
+   case jop_insert:
+      insertPlot(entry.plot.drone_id, entry.plot.node_id, (time_t) entry.plot.timestamp,
+                                 entry.plot.latitude, entry.plot.longitude, entry.flags);
+      break;
+   case jop_erase:
+      removePlot(plot);
+      break;
+   case jop_retime:
+      retime(plot, (time_t) entry.arg);
+      break;
+   case jop_setflags:
+      _store.setFlags(_store.slotOf(plot), entry.flags);
+      break;
+   case jop_clrflags:
+      _store.clrFlags(_store.slotOf(plot), entry.flags);
+      break;
+   case jop_takenew:
+      for (size_t slot = _store.firstLive(); slot < _store.endSlot(); slot = _store.nextLive(slot + 1)) {
+         if (_store.flags(slot) & DBFLAG_NEW)
+            _store.clrFlags(slot, DBFLAG_NEW);
+      }
+      break;
+   case jop_clear:
+      clear();
+      break;
+   case jop_offset:
+      if (entry.plot.node_id < max_offset_nodes)
+         applyOffset(entry.plot.node_id, (time_t) entry.arg);
+      break;
+   }
+}
+
+/*****************************************************************************************
+ * findPlot - finds a live plot with exactly these contents through the match index
+ *
+ *    Returns: its handle, or no_plot if there is none
+ *****************************************************************************************/
+PlotHandle DronePlotDB::findPlot(const WirePlot &plot) {
+   auto range = _matchidx.equal_range(PlotMatchKey(plot));
+   for (auto mptr = range.first; mptr != range.second; mptr++) {
+      PlotRef ref = getPlot(mptr->second);
+      if ((ref.node_id == plot.node_id) && (ref.timestamp == (time_t) plot.timestamp))
+         return mptr->second;
+   }
+   return no_plot;
+}
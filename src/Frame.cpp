@@ -0,0 +1,109 @@
+#include <cstring>
+#include <arpa/inet.h>
+#include "Frame.h"
+#include "exceptions.h"
+
+/*****************************************************************************************
+ * encodeFrameHeader - fills in a frame header
+ *
+ *    Params:  type - the frame_type of the message
+ *             flags - per-type flags, 0 if unused
+ *             length - size of the payload that follows
+ *             hdr - buffer of at least frame_header_size bytes to write to
+ *****************************************************************************************/
+void encodeFrameHeader(uint8_t type, uint16_t flags, uint32_t length, uint8_t *hdr) {
+   uint16_t n_flags = htons(flags);
+   uint32_t n_length = htonl(length);
+
+   hdr[0] = frame_version;
+   hdr[1] = type;
+   memcpy(&hdr[2], &n_flags, sizeof(n_flags));
+   memcpy(&hdr[4], &n_length, sizeof(n_length));
+}
+
+/*****************************************************************************************
+ * encodeFrame - appends a header and payload to out
+ *****************************************************************************************/
+void encodeFrame(uint8_t type, uint16_t flags, const std::vector<uint8_t> &payload,
+                                                            std::vector<uint8_t> &out) {
+   size_t start = out.size();
+   out.resize(start + frame_header_size + payload.size());
+
+   encodeFrameHeader(type, flags, (uint32_t) payload.size(), &out[start]);
+   if (payload.size() > 0)
+      memcpy(&out[start + frame_header_size], payload.data(), payload.size());
+}
+
+FrameDecoder::FrameDecoder():_pos(0) {
+
+}
+
+FrameDecoder::~FrameDecoder() {
+
+}
+
+/*****************************************************************************************
+ * feed - adds received bytes to the end of the buffer. Frames already taken are dropped
+ *        from the front first, once they make up at least half of it, so the buffer does
+ *        not grow without bound and the shifting stays linear overall
+ *****************************************************************************************/
+void FrameDecoder::feed(const uint8_t *data, size_t len) {
+   if ((_pos > 0) && (_pos >= _buf.size() / 2)) {
+      _buf.erase(_buf.begin(), _buf.begin() + _pos);
+      _pos = 0;
+   }
+   _buf.insert(_buf.end(), data, data + len);
+}
+
+/*****************************************************************************************
+ * next - if a whole frame is buffered, takes it off the front
+ *
+ *    Params:  type, flags - from the frame header
+ *             payload - receives the payload
+ *
+ *    Returns: true if a frame was taken, false if the next one has not fully arrived
+ *
+ *    Throws: socket_error if the header has the wrong version or an impossible length--the
+ *            stream cannot be trusted after that
+ *****************************************************************************************/
+bool FrameDecoder::next(uint8_t &type, uint16_t &flags, std::vector<uint8_t> &payload) {
+   if (pending() < frame_header_size)
+      return false;
+
+   const uint8_t *hdr = &_buf[_pos];
+   if (hdr[0] != frame_version)
+      throw socket_error("Frame with unsupported protocol version received.");
+
+   uint16_t n_flags;
+   uint32_t n_length;
+   memcpy(&n_flags, &hdr[2], sizeof(n_flags));
+   memcpy(&n_length, &hdr[4], sizeof(n_length));
+
+   uint32_t length = ntohl(n_length);
+   if (length > max_frame_payload)
+      throw socket_error("Frame length exceeds the maximum payload size.");
+
+   if (pending() < frame_header_size + length)
+      return false;
+
+   type = hdr[1];
+   flags = ntohs(n_flags);
+
+   const uint8_t *body = hdr + frame_header_size;
+   payload.assign(body, body + length);
+
+   _pos += frame_header_size + length;
+   if (_pos == _buf.size()) {
+      _buf.clear();
+      _pos = 0;
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * clear - drops anything buffered (used when a connection is reset)
+ *****************************************************************************************/
+void FrameDecoder::clear() {
+   _buf.clear();
+   _pos = 0;
+}
@@ -1,113 +1,400 @@
-#include <stdexcept>
-#include <time.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <ostream>
-#include <string>
-#include <string.h>
-#include "LogMgr.h"
-#include "strfuncts.h"
-#include "exceptions.h"
-
-
-// Log manager, supports log_lvl for verbosity control
-LogMgr::LogMgr(const char *log_file, unsigned int log_lvl):_log_file(log_file),_log_lvl(log_lvl) {
-
-}
-
-
-LogMgr::~LogMgr() {
-   closeLog();
-}
-
-/***************************************************************************************************
- * createTimeStamp - creates a time stamp string and places it in buf
- ***************************************************************************************************/
-void LogMgr::createTimestamp(std::string &buf) {
-   // Put together our timestamp and start the log with the stamp
-   std::string logstr;
-   time_t curtime = time(NULL);
-   char timestr[27];
-   if (ctime_r(&curtime, timestr) == NULL)
-      throw std::runtime_error("ctime_r function failed unexpectedly");
-
-   buf = timestr;
-   clrNewlines(buf);
-
-}
-
-/***************************************************************************************************
- * writeLog - Writes a string to a log with the timestamp
- *
- *    Params:  str - string to write to the log in const char * or std::string format
- *             lvl - the "importance" of this log - can be used to set verbosity
- ***************************************************************************************************/
-
-void LogMgr::writeLog(const char *str, unsigned int lvl) {
-
-   // Don't log it if the item is not important enough for logging verbosity
-   if (lvl > _log_lvl)
-      return;
-
-   // If the file is not open yet, open it
-   if (_lfptr == NULL) {
-      if ((_lfptr = fopen(_log_file.c_str(), "a+")) == NULL) {
-         throw logfile_error("Unable to open log file to append.");
-      }
-   }
-
-   // Put together our timestamp and start the log with the stamp
-   std::string logstr;
-   createTimestamp(logstr);
-
-   // Now add on the text to log
-   logstr += " ";
-   logstr += str;
-   logstr += "\n";
-
-   fputs(logstr.c_str(), _lfptr);
-   fflush(_lfptr);
-
-}
-
-void LogMgr::writeLog(std::string &str, unsigned int lvl) {
-   return writeLog(str.c_str(), lvl);
-}
-
-/***************************************************************************************************
- * strerrLog - Writes to the log and retrieves the errno string to attach at the end
- *
- *    Params:  str - string to write to the log in const char * or std::string format
- *             lvl - the "importance" of this log - can be used to set verbosity
- ***************************************************************************************************/
-
-void LogMgr::strerrLog(const char *str, unsigned int lvl) {
-   char strerr_buf[100];
-   std::string logstr = str;
-
-   logstr += " Reason: ";
-   if (strerror_r(errno, strerr_buf, 100) != 0) 
-      throw std::runtime_error("Unexpected error writing to log when calling strerror_r");
-
-   logstr += strerr_buf;
-   return writeLog(logstr.c_str(), lvl);
-}
-
-// self-explanatory
-void LogMgr::closeLog() {
-   if (_lfptr != NULL) {
-      fclose(_lfptr);
-      _lfptr = NULL;
-   }
-}
-
-
-/***************************************************************************************************
- * changeFilename - Changes the filename the log file is set to write to
- *
- ***************************************************************************************************/
-
-void LogMgr::changeFilename(const char *filename) {
-   closeLog();
-   _log_file = filename;
-}
+#include <stdexcept>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ostream>
+#include <string>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+#include <sys/stat.h>
+#include "LogMgr.h"
+#include "strfuncts.h"
+#include "exceptions.h"
+
+// Hands each LogMgr a number no other one has had, so a thread's cached ring can't be
+// mistaken for one belonging to a LogMgr that has since been destroyed
+static std::atomic<uint64_t> next_log_serial(1);
+
+// Async batches are written out once they reach this size
+const size_t log_batch_bytes = 64 * 1024;
+
+/***************************************************************************************************
+ * LogRing - single-producer/single-consumer ring of log records (see PlotRing for the scheme)
+ ***************************************************************************************************/
+LogRing::LogRing():_buf(log_ring_records),_tail(0),_head_cache(0),_head(0),_tail_cache(0) {
+
+}
+
+size_t LogRing::push(time_t when, const char *text, size_t len) {
+   size_t tail = _tail.load(std::memory_order_relaxed);
+
+   if (tail - _head_cache >= _buf.size()) {
+      _head_cache = _head.load(std::memory_order_acquire);
+      if (tail - _head_cache >= _buf.size())
+         return 0;
+   }
+
+   LogRecord &rec = _buf[tail % _buf.size()];
+   rec.when = when;
+   rec.len = (uint32_t) std::min(len, log_record_size);
+   memcpy(rec.text, text, rec.len);
+
+   _tail.store(tail + 1, std::memory_order_release);
+   return tail + 1 - _head_cache;
+}
+
+const LogRecord *LogRing::front() {
+   size_t head = _head.load(std::memory_order_relaxed);
+
+   if (head == _tail_cache) {
+      _tail_cache = _tail.load(std::memory_order_acquire);
+      if (head == _tail_cache)
+         return NULL;
+   }
+   return &_buf[head % _buf.size()];
+}
+
+void LogRing::pop() {
+   _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+
+// Log manager, supports log_lvl for verbosity control
+LogMgr::LogMgr(const char *log_file, unsigned int log_lvl, size_t rotate_bytes):
+                                 _log_file(log_file),
+                                 _log_lvl(log_lvl),
+                                 _rotate_bytes(rotate_bytes),
+                                 _written(0),
+                                 _serial(next_log_serial++),
+                                 _async(false),
+                                 _dropped(0),
+                                 _reported(0),
+                                 _stopping(false),
+                                 _stamp_time(0)
+{
+
+}
+
+
+LogMgr::~LogMgr() {
+   stopAsync();
+   closeLog();
+}
+
+/***************************************************************************************************
+ * createTimeStamp - creates a time stamp string and places it in buf
+ ***************************************************************************************************/
+void LogMgr::createTimestamp(std::string &buf) {
+   // Put together our timestamp and start the log with the stamp
+   std::string logstr;
+   time_t curtime = time(NULL);
+   char timestr[27];
+   if (ctime_r(&curtime, timestr) == NULL)
+      throw std::runtime_error("ctime_r function failed unexpectedly");
+
+   buf = timestr;
+   clrNewlines(buf);
+
+}
+
+/***************************************************************************************************
+ * writeLog - Writes a string to a log with the timestamp. In async mode the string is only
+ *            queued (see LogMgr.h)
+ *
+ *    Params:  str - string to write to the log in const char * or std::string format
+ *             lvl - the "importance" of this log - can be used to set verbosity
+ *
+ *    Throws:  logfile_error if the log file cannot be opened (not in async mode)
+ ***************************************************************************************************/
+
+void LogMgr::writeLog(const char *str, unsigned int lvl) {
+
+   // Don't log it if the item is not important enough for logging verbosity
+   if (lvl > _log_lvl)
+      return;
+
+   if (_async.load(std::memory_order_acquire)) {
+      size_t waiting = threadRing()->push(time(NULL), str, strlen(str));
+      if (waiting == 0)
+         _dropped++;
+      else if (waiting == log_ring_records / 2)
+         _wake.notify_one();
+      return;
+   }
+
+   std::lock_guard<std::mutex> lock(_file_lock);
+
+   // If the file is not open yet, open it
+   if ((_lfptr == NULL) && !openLog())
+      throw logfile_error("Unable to open log file to append.");
+
+   // Put together our timestamp and start the log with the stamp
+   std::string logstr;
+   createTimestamp(logstr);
+
+   // Now add on the text to log
+   logstr += " ";
+   logstr += str;
+   logstr += "\n";
+
+   writeOut(logstr.c_str(), logstr.size());
+}
+
+void LogMgr::writeLog(std::string &str, unsigned int lvl) {
+   return writeLog(str.c_str(), lvl);
+}
+
+/***************************************************************************************************
+ * strerrLog - Writes to the log and retrieves the errno string to attach at the end
+ *
+ *    Params:  str - string to write to the log in const char * or std::string format
+ *             lvl - the "importance" of this log - can be used to set verbosity
+ ***************************************************************************************************/
+
+void LogMgr::strerrLog(const char *str, unsigned int lvl) {
+   char strerr_buf[100];
+   std::string logstr = str;
+
+   logstr += " Reason: ";
+   if (strerror_r(errno, strerr_buf, 100) != 0)
+      throw std::runtime_error("Unexpected error writing to log when calling strerror_r");
+
+   logstr += strerr_buf;
+   return writeLog(logstr.c_str(), lvl);
+}
+
+// self-explanatory
+void LogMgr::closeLog() {
+   std::lock_guard<std::mutex> lock(_file_lock);
+
+   if (_lfptr != NULL) {
+      fclose(_lfptr);
+      _lfptr = NULL;
+   }
+}
+
+
+/***************************************************************************************************
+ * changeFilename - Changes the filename the log file is set to write to. In async mode whatever
+ *                  is waiting goes to the old file first
+ *
+ ***************************************************************************************************/
+
+void LogMgr::changeFilename(const char *filename) {
+   std::lock_guard<std::mutex> lock(_file_lock);
+
+   if (_async.load())
+      drainRings();
+
+   if (_lfptr != NULL) {
+      fclose(_lfptr);
+      _lfptr = NULL;
+   }
+   _log_file = filename;
+}
+
+/***************************************************************************************************
+ * openLog - opens the log file to append and picks up how big it already is (_file_lock held)
+ *
+ *    Returns: false if it could not be opened
+ ***************************************************************************************************/
+
+bool LogMgr::openLog() {
+   if ((_lfptr = fopen(_log_file.c_str(), "a+")) == NULL)
+      return false;
+
+   struct stat st;
+   _written = (fstat(fileno(_lfptr), &st) == 0) ? (size_t) st.st_size : 0;
+   return true;
+}
+
+/***************************************************************************************************
+ * writeOut - writes and flushes text to the open log, rotating it afterwards if it has grown past
+ *            the limit (_file_lock held)
+ ***************************************************************************************************/
+
+void LogMgr::writeOut(const char *data, size_t len) {
+   fwrite(data, 1, len, _lfptr);
+   fflush(_lfptr);
+
+   _written += len;
+   if ((_rotate_bytes > 0) && (_written >= _rotate_bytes))
+      rotate();
+}
+
+/***************************************************************************************************
+ * rotate - moves the log to <log>.1, shifting older ones up and dropping the oldest, and starts a
+ *          new one (_file_lock held). If the new file cannot be opened the next write tries again
+ ***************************************************************************************************/
+
+void LogMgr::rotate() {
+   fclose(_lfptr);
+   _lfptr = NULL;
+
+   for (unsigned int i = log_keep_files; i > 1; i--) {
+      std::string older = _log_file + "." + std::to_string(i);
+      std::string newer = _log_file + "." + std::to_string(i - 1);
+      rename(newer.c_str(), older.c_str());
+   }
+   rename(_log_file.c_str(), (_log_file + ".1").c_str());
+
+   openLog();
+}
+
+/***************************************************************************************************
+ * startAsync - switches to async mode by starting the background writer. The file is still only
+ *              opened once there is something to write
+ ***************************************************************************************************/
+
+void LogMgr::startAsync() {
+   if (_async.load())
+      return;
+
+   _stopping = false;
+   _writer = std::thread(&LogMgr::runWriter, this);
+   _async.store(true, std::memory_order_release);
+}
+
+/***************************************************************************************************
+ * stopAsync - goes back to writing on the caller's thread, once everything queued is written out
+ ***************************************************************************************************/
+
+void LogMgr::stopAsync() {
+   if (!_async.load())
+      return;
+
+   _async.store(false, std::memory_order_release);
+
+   {
+      std::lock_guard<std::mutex> lock(_rings_lock);
+      _stopping = true;
+   }
+   _wake.notify_one();
+   _writer.join();
+
+   std::lock_guard<std::mutex> lock(_file_lock);
+   drainRings();
+}
+
+/***************************************************************************************************
+ * threadRing - the calling thread's ring for this log, made on its first message. Each thread keeps
+ *              its own short list of (log, ring), so only that first message takes a lock
+ ***************************************************************************************************/
+
+LogRing *LogMgr::threadRing() {
+   thread_local std::vector<std::pair<uint64_t, LogRing *>> mine;
+
+   for (auto mptr = mine.begin(); mptr != mine.end(); mptr++) {
+      if (mptr->first == _serial)
+         return mptr->second;
+   }
+
+   std::lock_guard<std::mutex> lock(_rings_lock);
+   _rings.emplace_back(new LogRing);
+   mine.emplace_back(_serial, _rings.back().get());
+   return _rings.back().get();
+}
+
+/***************************************************************************************************
+ * runWriter - the background writer. Writes out whatever the rings hold every log_flush_ms until
+ *             stopAsync
+ ***************************************************************************************************/
+
+void LogMgr::runWriter() {
+   std::unique_lock<std::mutex> lock(_rings_lock);
+
+   while (!_stopping) {
+      // Woken early (not under the lock) by a ring getting half full, or by stopAsync
+      _wake.wait_for(lock, std::chrono::milliseconds(log_flush_ms));
+      lock.unlock();
+
+      {
+         std::lock_guard<std::mutex> flock(_file_lock);
+         drainRings();
+      }
+
+      lock.lock();
+   }
+}
+
+/***************************************************************************************************
+ * drainRings - formats everything waiting in the rings and writes it out a batch at a time, with
+ *              a note of any messages dropped since the last pass (_file_lock held)
+ ***************************************************************************************************/
+
+void LogMgr::drainRings() {
+   std::vector<LogRing *> rings;
+   bool waiting = (_dropped.load() != _reported);
+   {
+      std::lock_guard<std::mutex> lock(_rings_lock);
+      for (auto rptr = _rings.begin(); rptr != _rings.end(); rptr++) {
+         rings.push_back(rptr->get());
+         waiting = waiting || ((*rptr)->front() != NULL);
+      }
+   }
+
+   // Don't open (and so create) the file until there is something to put in it
+   if (!waiting)
+      return;
+
+   if ((_lfptr == NULL) && !openLog()) {
+      // Nowhere to put them--count them as dropped rather than let the rings fill
+      for (auto rptr = rings.begin(); rptr != rings.end(); rptr++) {
+         while ((*rptr)->front() != NULL) {
+            (*rptr)->pop();
+            _dropped++;
+         }
+      }
+      return;
+   }
+
+   _batch.clear();
+   for (auto rptr = rings.begin(); rptr != rings.end(); rptr++) {
+      const LogRecord *rec;
+      while ((rec = (*rptr)->front()) != NULL) {
+         const std::string &stamp = stampFor(rec->when);
+         _batch.insert(_batch.end(), stamp.begin(), stamp.end());
+         _batch.push_back(' ');
+         _batch.insert(_batch.end(), rec->text, rec->text + rec->len);
+         _batch.push_back('\n');
+         (*rptr)->pop();
+
+         if (_batch.size() >= log_batch_bytes) {
+            writeOut(_batch.data(), _batch.size());
+            _batch.clear();
+            if (_lfptr == NULL)
+               return;
+         }
+      }
+   }
+
+   uint64_t dropped = _dropped.load();
+   if (dropped != _reported) {
+      std::string note = stampFor(time(NULL)) + " " + std::to_string(dropped - _reported) +
+                         " log messages dropped (the log could not keep up)\n";
+      _batch.insert(_batch.end(), note.begin(), note.end());
+      _reported = dropped;
+   }
+
+   if (_batch.size() > 0)
+      writeOut(_batch.data(), _batch.size());
+}
+
+/***************************************************************************************************
+ * stampFor - the timestamp text for a time, as createTimestamp makes it. Only re-formatted when the
+ *            second changes (_file_lock held)
+ ***************************************************************************************************/
+
+const std::string &LogMgr::stampFor(time_t when) {
+   if ((when != _stamp_time) || (_stamp.size() == 0)) {
+      char timestr[27];
+      if (ctime_r(&when, timestr) == NULL)
+         timestr[0] = '\0';
+
+      _stamp = timestr;
+      clrNewlines(_stamp);
+      _stamp_time = when;
+   }
+   return _stamp;
+}
@@ -0,0 +1,345 @@
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstring>
+#include <stdexcept>
+#include "Metrics.h"
+
+// How often the metrics server looks up from waiting for a scrape to see if it should stop
+const int metrics_poll_ms = 200;
+
+// A scraper gets this long to send its request and take the reply before it is cut off
+const time_t metrics_io_secs = 1;
+
+// Largest request read--anything past it is ignored
+const size_t metrics_request_max = 8192;
+
+// Two bits of each value under its top bit pick the sub-bucket
+const unsigned int metric_sub_bits = 2;
+static_assert((1u << metric_sub_bits) == metric_sub_buckets, "sub-buckets must be 2^sub_bits");
+
+/********************************************************************************************
+ * metricShard - the shard the calling thread updates, handed out to threads in turn
+ ********************************************************************************************/
+static unsigned int metricShard() {
+   static std::atomic<unsigned int> next_shard(0);
+   thread_local unsigned int shard = next_shard++ % metric_shards;
+   return shard;
+}
+
+/********************************************************************************************
+ * appendSeries - appends one line of a metric: name{labels,extra} value
+ ********************************************************************************************/
+static void appendSeries(std::string &out, const std::string &name, const std::string &labels,
+                                                const std::string &extra, const std::string &value) {
+   out += name;
+   if ((labels.size() > 0) || (extra.size() > 0)) {
+      out += "{";
+      out += labels;
+      if ((labels.size() > 0) && (extra.size() > 0))
+         out += ",";
+      out += extra;
+      out += "}";
+   }
+   out += " ";
+   out += value;
+   out += "\n";
+}
+
+
+MetricCounter::MetricCounter() {
+   for (unsigned int i = 0; i < metric_shards; i++)
+      _shards[i].count.store(0, std::memory_order_relaxed);
+}
+
+void MetricCounter::add(uint64_t count) {
+   _shards[metricShard()].count.fetch_add(count, std::memory_order_relaxed);
+}
+
+uint64_t MetricCounter::value() {
+   uint64_t total = 0;
+   for (unsigned int i = 0; i < metric_shards; i++)
+      total += _shards[i].count.load(std::memory_order_relaxed);
+   return total;
+}
+
+
+MetricHistogram::MetricHistogram():_shards(new Shard[metric_shards]) {
+   for (unsigned int i = 0; i < metric_shards; i++) {
+      for (size_t b = 0; b <= metric_buckets; b++)
+         _shards[i].counts[b].store(0, std::memory_order_relaxed);
+      _shards[i].sum.store(0, std::memory_order_relaxed);
+   }
+}
+
+void MetricHistogram::observe(uint64_t value) {
+   Shard &shard = _shards[metricShard()];
+
+   shard.counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+   shard.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+/********************************************************************************************
+ * collect - adds up the shards. Samples landing during the call may be counted in the
+ *           buckets but not yet the sum, or the other way round
+ ********************************************************************************************/
+void MetricHistogram::collect(std::vector<uint64_t> &counts, uint64_t &sum) {
+   counts.assign(metric_buckets + 1, 0);
+   sum = 0;
+
+   for (unsigned int i = 0; i < metric_shards; i++) {
+      for (size_t b = 0; b <= metric_buckets; b++)
+         counts[b] += _shards[i].counts[b].load(std::memory_order_relaxed);
+      sum += _shards[i].sum.load(std::memory_order_relaxed);
+   }
+}
+
+/********************************************************************************************
+ * bucketOf - values under metric_sub_buckets get a bucket each. Above that, the position of
+ *            the top bit picks the power of two and the next two bits the quarter of it
+ ********************************************************************************************/
+size_t MetricHistogram::bucketOf(uint64_t value) {
+   if (value < metric_sub_buckets)
+      return (size_t) value;
+
+   unsigned int top = 63 - __builtin_clzll(value);
+   if (top >= metric_max_exp)
+      return metric_buckets;
+
+   return (top - metric_sub_bits + 1) * metric_sub_buckets +
+                        ((value >> (top - metric_sub_bits)) & (metric_sub_buckets - 1));
+}
+
+uint64_t MetricHistogram::bucketTop(size_t bucket) {
+   if (bucket >= metric_buckets)
+      return UINT64_MAX;
+
+   // One less than where the next bucket starts
+   size_t next = bucket + 1;
+   if (next < metric_sub_buckets)
+      return next - 1;
+
+   uint64_t start = (uint64_t) (metric_sub_buckets + (next % metric_sub_buckets)) <<
+                                             (next / metric_sub_buckets - 1);
+   return start - 1;
+}
+
+
+MetricsRegistry::MetricsRegistry() {
+
+}
+
+MetricsRegistry::~MetricsRegistry() {
+
+}
+
+/********************************************************************************************
+ * family - finds or adds the family for a metric name (_lock held)
+ *
+ *    Throws: runtime_error if the name is already registered as a different type
+ ********************************************************************************************/
+MetricsRegistry::Family &MetricsRegistry::family(const char *name, const char *help,
+                                                                        metric_type type) {
+   auto fptr = _families.find(name);
+   if (fptr == _families.end()) {
+      Family &fresh = _families[name];
+      fresh.type = type;
+      fresh.help = help;
+      return fresh;
+   }
+
+   if (fptr->second.type != type)
+      throw std::runtime_error(std::string("Metric ") + name + " registered as two types.");
+   return fptr->second;
+}
+
+MetricCounter &MetricsRegistry::counter(const char *name, const char *help,
+                                                                  const std::string &labels) {
+   std::lock_guard<std::mutex> lock(_lock);
+   std::unique_ptr<MetricCounter> &metric = family(name, help, mt_counter).counters[labels];
+
+   if (metric == NULL)
+      metric.reset(new MetricCounter);
+   return *metric;
+}
+
+MetricGauge &MetricsRegistry::gauge(const char *name, const char *help,
+                                                                  const std::string &labels) {
+   std::lock_guard<std::mutex> lock(_lock);
+   std::unique_ptr<MetricGauge> &metric = family(name, help, mt_gauge).gauges[labels];
+
+   if (metric == NULL)
+      metric.reset(new MetricGauge);
+   return *metric;
+}
+
+MetricHistogram &MetricsRegistry::histogram(const char *name, const char *help,
+                                                                  const std::string &labels) {
+   std::lock_guard<std::mutex> lock(_lock);
+   std::unique_ptr<MetricHistogram> &metric = family(name, help, mt_histogram).histograms[labels];
+
+   if (metric == NULL)
+      metric.reset(new MetricHistogram);
+   return *metric;
+}
+
+/********************************************************************************************
+ * label - quotes the value, escaping backslashes, quotes and newlines
+ ********************************************************************************************/
+std::string MetricsRegistry::label(const char *name, const std::string &value) {
+   std::string out = name;
+
+   out += "=\"";
+   for (auto cptr = value.begin(); cptr != value.end(); cptr++) {
+      if (*cptr == '\n')
+         out += "\\n";
+      else {
+         if ((*cptr == '\\') || (*cptr == '"'))
+            out += '\\';
+         out += *cptr;
+      }
+   }
+   out += "\"";
+   return out;
+}
+
+/********************************************************************************************
+ * render - writes out every metric in the Prometheus text exposition format (version 0.0.4).
+ *          Histogram buckets are cumulative, as the format wants
+ ********************************************************************************************/
+void MetricsRegistry::render(std::string &out) {
+   std::lock_guard<std::mutex> lock(_lock);
+   std::vector<uint64_t> counts;
+
+   for (auto fptr = _families.begin(); fptr != _families.end(); fptr++) {
+      const std::string &name = fptr->first;
+      Family &fam = fptr->second;
+
+      out += "# HELP " + name + " " + fam.help + "\n";
+      out += "# TYPE " + name + " ";
+      out += (fam.type == mt_counter) ? "counter\n" : (fam.type == mt_gauge) ? "gauge\n" :
+                                                                                 "histogram\n";
+
+      for (auto cptr = fam.counters.begin(); cptr != fam.counters.end(); cptr++)
+         appendSeries(out, name, cptr->first, "", std::to_string(cptr->second->value()));
+
+      for (auto gptr = fam.gauges.begin(); gptr != fam.gauges.end(); gptr++)
+         appendSeries(out, name, gptr->first, "", std::to_string(gptr->second->value()));
+
+      for (auto hptr = fam.histograms.begin(); hptr != fam.histograms.end(); hptr++) {
+         uint64_t sum, total = 0;
+         hptr->second->collect(counts, sum);
+
+         for (size_t b = 0; b < metric_buckets; b++) {
+            total += counts[b];
+            appendSeries(out, name + "_bucket", hptr->first,
+                  "le=\"" + std::to_string(MetricHistogram::bucketTop(b)) + "\"",
+                  std::to_string(total));
+         }
+         total += counts[metric_buckets];
+         appendSeries(out, name + "_bucket", hptr->first, "le=\"+Inf\"", std::to_string(total));
+         appendSeries(out, name + "_sum", hptr->first, "", std::to_string(sum));
+         appendSeries(out, name + "_count", hptr->first, "", std::to_string(total));
+      }
+   }
+}
+
+
+MetricsServer::MetricsServer(MetricsRegistry &registry):_registry(registry),_stopping(false) {
+
+}
+
+MetricsServer::~MetricsServer() {
+   stop();
+}
+
+/********************************************************************************************
+ * start - binds the listening socket and starts the server thread
+ *
+ *    Throws: socket_error if the socket cannot be bound or listened on
+ ********************************************************************************************/
+void MetricsServer::start(const char *ip_addr, unsigned short port) {
+   if (_server.joinable())
+      return;
+
+   _sockfd.setReusable();
+   _sockfd.bindFD(ip_addr, port);
+   _sockfd.listenFD();
+
+   _stopping = false;
+   _server = std::thread(&MetricsServer::runServe, this);
+}
+
+void MetricsServer::stop() {
+   if (!_server.joinable())
+      return;
+
+   _stopping = true;
+   _server.join();
+   _sockfd.closeFD();
+}
+
+/********************************************************************************************
+ * runServe - waits for scrapes and answers each in turn until stop()
+ ********************************************************************************************/
+void MetricsServer::runServe() {
+   while (!_stopping) {
+      pollfd pfd;
+      pfd.fd = _sockfd.getFD();
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, metrics_poll_ms) <= 0)
+         continue;
+
+      int fd = accept4(_sockfd.getFD(), NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0)
+         continue;
+
+      answer(fd);
+      close(fd);
+   }
+}
+
+/********************************************************************************************
+ * answer - reads one request and replies: the metrics for GET / or /metrics, 404 otherwise.
+ *          A scraper that stalls for metrics_io_secs is dropped
+ ********************************************************************************************/
+void MetricsServer::answer(int fd) {
+   struct timeval timeout = {metrics_io_secs, 0};
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+   // Read up to the blank line ending the headers
+   std::string request;
+   char buf[1024];
+   while ((request.find("\r\n\r\n") == std::string::npos) &&
+                                          (request.size() < metrics_request_max)) {
+      ssize_t got = recv(fd, buf, sizeof(buf), 0);
+      if (got <= 0)
+         return;
+      request.append(buf, got);
+   }
+
+   std::string status, body;
+   if ((request.compare(0, 13, "GET /metrics ") == 0) || (request.compare(0, 6, "GET / ") == 0) ||
+                                          (request.compare(0, 13, "GET /metrics?") == 0)) {
+      status = "200 OK";
+      _registry.render(body);
+   } else {
+      status = "404 Not Found";
+      body = "Not found--metrics are at /metrics\n";
+   }
+
+   std::string reply = "HTTP/1.0 " + status + "\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                       "Connection: close\r\n\r\n" + body;
+
+   size_t sent = 0;
+   while (sent < reply.size()) {
+      ssize_t put = send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+      if (put <= 0)
+         return;
+      sent += put;
+   }
+}
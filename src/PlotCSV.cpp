@@ -0,0 +1,166 @@
+#include <charconv>
+#include <cstring>
+#include <thread>
+#include <algorithm>
+#include "PlotCSV.h"
+
+static bool isBlank(char c) {
+   return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+/*****************************************************************************************
+ * parseField - parses one number starting at pos and steps pos past it and the delimiter
+ *              that ends it (none for the last field, which must run to the end). Leading
+ *              blanks and a leading '+' are allowed, as they were with stoi/stof
+ *
+ *    Returns: false if there is no number or something other than the delimiter follows it
+ *****************************************************************************************/
+template <typename T>
+static bool parseField(const char *&pos, const char *end, bool last, T &val) {
+   while ((pos < end) && isBlank(*pos))
+      pos++;
+   if ((pos < end) && (*pos == '+'))
+      pos++;
+
+   std::from_chars_result res = std::from_chars(pos, end, val);
+   if (res.ec != std::errc())
+      return false;
+
+   pos = res.ptr;
+   while ((pos < end) && isBlank(*pos))
+      pos++;
+
+   if (last)
+      return pos == end;
+
+   if ((pos == end) || (*pos != ','))
+      return false;
+   pos++;
+   return true;
+}
+
+/*****************************************************************************************
+ * parsePlotCSVLine - parses a single CSV line into a plot
+ *
+ *    Params:  begin, end - the line, without its newline
+ *             plot - receives the plot
+ *
+ *    Returns: false if the line is not five numeric fields, true otherwise
+ *****************************************************************************************/
+bool parsePlotCSVLine(const char *begin, const char *end, WirePlot &plot) {
+   const char *pos = begin;
+   return parseField(pos, end, false, plot.drone_id) &&
+          parseField(pos, end, false, plot.node_id) &&
+          parseField(pos, end, false, plot.timestamp) &&
+          parseField(pos, end, false, plot.latitude) &&
+          parseField(pos, end, true, plot.longitude);
+}
+
+/*****************************************************************************************
+ * formatPlotCSVLine - writes a plot as a CSV line. The coordinates are widened to double
+ *                     and written with 10 significant digits in general format--what
+ *                     "<< std::setprecision(10) << latitude" gave--so the text is unchanged
+ *
+ *    Params:  plot - the plot to write
+ *             out - where to write it, at least csv_max_line bytes
+ *
+ *    Returns: number of bytes written
+ *****************************************************************************************/
+size_t formatPlotCSVLine(const WirePlot &plot, char *out) {
+   char *end = out + csv_max_line;
+   char *pos = out;
+
+   pos = std::to_chars(pos, end, plot.drone_id).ptr;
+   *pos++ = ',';
+   pos = std::to_chars(pos, end, plot.node_id).ptr;
+   *pos++ = ',';
+   pos = std::to_chars(pos, end, plot.timestamp).ptr;
+   *pos++ = ',';
+   pos = std::to_chars(pos, end, (double) plot.latitude, std::chars_format::general, 10).ptr;
+   *pos++ = ',';
+   pos = std::to_chars(pos, end, (double) plot.longitude, std::chars_format::general, 10).ptr;
+   *pos++ = '\n';
+
+   return pos - out;
+}
+
+/*****************************************************************************************
+ * parseChunk - parses every line in [begin, end), skipping blank ones
+ *
+ *    Returns: false at the first line that is not a valid plot
+ *****************************************************************************************/
+static bool parseChunk(const char *begin, const char *end, std::vector<WirePlot> &plots) {
+   // Our lines run around 40 bytes--reserving a little over that many avoids most regrowth
+   plots.reserve((end - begin) / 32);
+
+   WirePlot plot;
+   const char *line = begin;
+   while (line < end) {
+      const char *eol = (const char *) memchr(line, '\n', end - line);
+      if (eol == NULL)
+         eol = end;
+
+      const char *last = eol;
+      while ((last > line) && isBlank(last[-1]))
+         last--;
+
+      if (last > line) {
+         if (!parsePlotCSVLine(line, last, plot))
+            return false;
+         plots.push_back(plot);
+      }
+      line = eol + 1;
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * parsePlotCSV - parses a whole buffer of CSV plots, splitting it into one chunk per thread.
+ *                Each chunk boundary is moved up to just past the next newline so no line
+ *                is split, then the chunks are parsed in parallel (the first on the calling
+ *                thread)
+ *
+ *    Params:  data, len - the CSV text
+ *             parts - receives the plots, one vector per chunk, in file order
+ *             threads - how many threads to use at most (0 for one per core)
+ *
+ *    Returns: number of plots parsed, or -1 if any line was not a valid plot
+ *****************************************************************************************/
+long parsePlotCSV(const char *data, size_t len, std::vector<std::vector<WirePlot>> &parts,
+                                                                        unsigned int threads) {
+   if (threads == 0)
+      threads = std::max(1U, std::thread::hardware_concurrency());
+   size_t nchunks = std::max((size_t) 1, std::min((size_t) threads, len / csv_min_chunk));
+
+   std::vector<const char *> bounds(nchunks + 1);
+   bounds[0] = data;
+   bounds[nchunks] = data + len;
+   for (size_t i=1; i<nchunks; i++) {
+      const char *pos = std::max(bounds[i-1], data + (len / nchunks) * i);
+      const char *eol = (const char *) memchr(pos, '\n', (data + len) - pos);
+      bounds[i] = (eol == NULL) ? data + len : eol + 1;
+   }
+
+   parts.clear();
+   parts.resize(nchunks);
+   std::vector<char> ok(nchunks, 0);
+
+   std::vector<std::thread> workers;
+   for (size_t i=1; i<nchunks; i++) {
+      workers.emplace_back([&, i]() {
+         ok[i] = parseChunk(bounds[i], bounds[i+1], parts[i]);
+      });
+   }
+   ok[0] = parseChunk(bounds[0], bounds[1], parts[0]);
+
+   for (unsigned int i=0; i<workers.size(); i++)
+      workers[i].join();
+
+   long count = 0;
+   for (size_t i=0; i<nchunks; i++) {
+      if (!ok[i])
+         return -1;
+      count += parts[i].size();
+   }
+   return count;
+}
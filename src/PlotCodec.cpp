@@ -0,0 +1,114 @@
+#include <cstring>
+#include <stdexcept>
+#include <sstream>
+#include "PlotCodec.h"
+
+/*****************************************************************************************
+ * swapPlots - converts records between host and wire (little endian) byte order. Only does
+ *             anything on a big-endian host. Written as a plain loop over whole records so
+ *             the compiler can vectorize it
+ *****************************************************************************************/
+static void swapPlots(WirePlot *plots, size_t count) {
+   if (!wire_needs_swap)
+      return;
+
+   for (size_t i=0; i<count; i++) {
+      uint32_t lat, lon;
+      memcpy(&lat, &plots[i].latitude, sizeof(lat));
+      memcpy(&lon, &plots[i].longitude, sizeof(lon));
+
+      plots[i].drone_id = __builtin_bswap32(plots[i].drone_id);
+      plots[i].node_id = __builtin_bswap32(plots[i].node_id);
+      plots[i].timestamp = (int64_t) __builtin_bswap64((uint64_t) plots[i].timestamp);
+      lat = __builtin_bswap32(lat);
+      lon = __builtin_bswap32(lon);
+
+      memcpy(&plots[i].latitude, &lat, sizeof(lat));
+      memcpy(&plots[i].longitude, &lon, sizeof(lon));
+   }
+}
+
+/*****************************************************************************************
+ * encodeWirePlot / decodeWirePlot - one record to or from its 24 wire bytes
+ *****************************************************************************************/
+void encodeWirePlot(const WirePlot &plot, uint8_t *out) {
+   WirePlot tmp = plot;
+   swapPlots(&tmp, 1);
+   memcpy(out, &tmp, wire_plot_size);
+}
+
+void decodeWirePlot(const uint8_t *in, WirePlot &plot) {
+   memcpy(&plot, in, wire_plot_size);
+   swapPlots(&plot, 1);
+}
+
+/*****************************************************************************************
+ * encodePlotRecords / decodePlotRecords - a run of records to or from the wire layout, one
+ *                                         bulk copy (plus the swap on big-endian hosts)
+ *****************************************************************************************/
+void encodePlotRecords(const WirePlot *plots, size_t count, uint8_t *out) {
+   if (count == 0)
+      return;
+
+   if (wire_needs_swap) {
+      std::vector<WirePlot> tmp(plots, plots + count);
+      swapPlots(tmp.data(), count);
+      memcpy(out, tmp.data(), count * wire_plot_size);
+   } else
+      memcpy(out, plots, count * wire_plot_size);
+}
+
+void decodePlotRecords(const uint8_t *in, size_t count, WirePlot *plots) {
+   if (count == 0)
+      return;
+
+   memcpy(plots, in, count * wire_plot_size);
+   swapPlots(plots, count);
+}
+
+/*****************************************************************************************
+ * encodePlotBatch - appends the record count and the records, sized once and copied in
+ *                   bulk
+ *
+ *    Params:  plots - the records to encode
+ *             count - how many
+ *             out - where the batch is appended
+ *****************************************************************************************/
+void encodePlotBatch(const WirePlot *plots, size_t count, std::vector<uint8_t> &out) {
+   size_t start = out.size();
+   out.resize(start + wire_batch_header + count * wire_plot_size);
+
+   uint32_t n_count = wireOrder((uint32_t) count);
+   memcpy(&out[start], &n_count, sizeof(n_count));
+
+   encodePlotRecords(plots, count, &out[start + wire_batch_header]);
+}
+
+/*****************************************************************************************
+ * decodePlotBatch - checks a batch's size against its count and decodes all the records in
+ *                   one copy
+ *
+ *    Params:  data - the batch
+ *             len - its size in bytes
+ *             plots - receives the records
+ *
+ *    Throws: runtime_error if the batch is short or its size does not match its count
+ *****************************************************************************************/
+void decodePlotBatch(const uint8_t *data, size_t len, std::vector<WirePlot> &plots) {
+   if (len < wire_batch_header)
+      throw std::runtime_error("Plot batch too short to hold its record count.");
+
+   uint32_t n_count;
+   memcpy(&n_count, data, sizeof(n_count));
+   size_t count = wireOrder(n_count);
+
+   if ((len - wire_batch_header) != count * wire_plot_size) {
+      std::stringstream msg;
+      msg << "Plot batch claims " << count << " records but holds " <<
+                                 (len - wire_batch_header) << " bytes of them.";
+      throw std::runtime_error(msg.str());
+   }
+
+   plots.resize(count);
+   decodePlotRecords(data + wire_batch_header, count, plots.data());
+}
@@ -0,0 +1,276 @@
+#include <stdexcept>
+#include <sstream>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "PlotFile.h"
+
+PlotFile::PlotFile():
+                     _records(NULL),
+                     _rec_flags(NULL),
+                     _index(NULL),
+                     _count(0),
+                     _legacy(false),
+                     _flags(0),
+                     _min_time(0),
+                     _max_time(0)
+{
+}
+
+PlotFile::~PlotFile() {
+   close();
+}
+
+/*****************************************************************************************
+ * open - maps a plot file and checks that its header, records and index all fit in it.
+ *        Nothing past the header is read here, so this takes the same time for any size
+ *        of file--except a version 1 file, whose time range has to be found by a scan
+ *
+ *    Params:  filename - the path/filename of the plot file
+ *
+ *    Throws: runtime_error if the file cannot be opened or mapped, or is not a plot file
+ *****************************************************************************************/
+void PlotFile::open(const char *filename) {
+   close();
+
+   _file.reset(new FileFD(filename));
+   if (!_file->openFile(FileFD::readfd)) {
+      std::stringstream msg;
+      msg << "Unable to open plot file " << filename << ".";
+      throw std::runtime_error(msg.str());
+   }
+
+   bool mapped = _file->mapFile();
+   _file->closeFD();
+   if (!mapped) {
+      std::stringstream msg;
+      msg << "Unable to map plot file " << filename << ".";
+      throw std::runtime_error(msg.str());
+   }
+
+   const uint8_t *data = _file->mapData();
+   size_t len = _file->mapSize();
+
+   // Version 1 - headerless records
+   if ((len < sizeof(PlotFileHeader)) || (memcmp(data, plot_file_magic, sizeof(plot_file_magic)) != 0)) {
+      if (len % wire_plot_size != 0) {
+         close();
+         throw std::runtime_error("Plot file is neither version 2 nor a whole number of records.");
+      }
+
+      _legacy = true;
+      _records = data;
+      _count = len / wire_plot_size;
+      for (size_t i=0; i<_count; i++) {
+         time_t t = timeAt(i);
+         if ((i == 0) || (t < _min_time))
+            _min_time = t;
+         if ((i == 0) || (t > _max_time))
+            _max_time = t;
+      }
+      return;
+   }
+
+   PlotFileHeader hdr;
+   memcpy(&hdr, data, sizeof(hdr));
+
+   std::stringstream msg;
+   uint64_t header_size = wireOrder(hdr.header_size);
+   uint64_t count = wireOrder(hdr.record_count);
+   uint64_t stride = wireOrder(hdr.index_stride);
+   uint64_t index_offset = wireOrder(hdr.index_offset);
+   uint64_t index_count = wireOrder(hdr.index_count);
+
+   // Where the records (and then the flags column, if there is one) end. Only used once the
+   // records are known to fit
+   uint64_t records_end = header_size + count * wire_plot_size;
+   if (wireOrder(hdr.flags) & plotfile_has_flags)
+      records_end += count * sizeof(uint16_t);
+
+   if (wireOrder(hdr.version) != plot_file_version)
+      msg << "Plot file version " << wireOrder(hdr.version) << " is not supported.";
+   else if ((wireOrder(hdr.record_size) != wire_plot_size) ||
+                                                (wireOrder(hdr.schema) != plot_file_schema))
+      msg << "Plot file record layout is not supported.";
+   else if ((header_size < sizeof(PlotFileHeader)) || (header_size > len) ||
+                                          (header_size % sizeof(int64_t) != 0) ||
+                                          (count > (len - header_size) / wire_plot_size))
+      msg << "Plot file claims " << count << " records but is only " << len << " bytes.";
+   else if (records_end > len)
+      msg << "Plot file flags column runs past the end of the file.";
+   else if ((index_count > 0) && ((stride == 0) ||
+                                  (index_count != (count + stride - 1) / stride) ||
+                                  (index_offset < records_end) ||
+                                  (index_offset > len) ||
+                                  (index_count > (len - index_offset) / sizeof(PlotIndexEntry))))
+      msg << "Plot file time index does not fit its records.";
+
+   if (msg.str().size() > 0) {
+      close();
+      throw std::runtime_error(msg.str());
+   }
+
+   _records = data + header_size;
+   _count = count;
+   _flags = wireOrder(hdr.flags);
+   if (_flags & plotfile_has_flags)
+      _rec_flags = _records + count * wire_plot_size;
+   _min_time = (time_t) wireOrder(hdr.min_time);
+   _max_time = (time_t) wireOrder(hdr.max_time);
+   if (index_count > 0)
+      _index = data + index_offset;
+}
+
+/*****************************************************************************************
+ * close - releases the mapping
+ *****************************************************************************************/
+void PlotFile::close() {
+   _file.reset();
+   _records = NULL;
+   _rec_flags = NULL;
+   _index = NULL;
+   _count = 0;
+   _legacy = false;
+   _flags = 0;
+   _min_time = _max_time = 0;
+}
+
+/*****************************************************************************************
+ * readRecords - decodes a run of records out of the mapping
+ *
+ *    Params:  first - the first record
+ *             count - how many
+ *             plots - receives them
+ *
+ *    Throws: runtime_error if the run goes past the last record
+ *****************************************************************************************/
+void PlotFile::readRecords(size_t first, size_t count, WirePlot *plots) {
+   if ((first > _count) || (count > _count - first))
+      throw std::runtime_error("Attempted to read past the end of the plot file.");
+
+   decodePlotRecords(_records + first * wire_plot_size, count, plots);
+}
+
+/*****************************************************************************************
+ * readFlags - copies out the flags column for a run of records
+ *
+ *    Params:  first - the first record
+ *             count - how many
+ *             flags - receives them (zeroes if the file has no flags column)
+ *
+ *    Throws: runtime_error if the run goes past the last record
+ *****************************************************************************************/
+void PlotFile::readFlags(size_t first, size_t count, unsigned short *flags) {
+   if ((first > _count) || (count > _count - first))
+      throw std::runtime_error("Attempted to read past the end of the plot file.");
+
+   for (size_t i=0; i<count; i++) {
+      uint16_t f = 0;
+      if (_rec_flags != NULL)
+         memcpy(&f, _rec_flags + (first + i) * sizeof(f), sizeof(f));
+      flags[i] = wireOrder(f);
+   }
+}
+
+/*****************************************************************************************
+ * write - writes plots out as a version 2 file: header, records, then the time index. The
+ *         records go out in one write straight from plots on a little-endian host
+ *
+ *    Params:  filename - the path/filename of the output file
+ *             plots - the plots to write
+ *             count - how many
+ *             flags - a flags column to write after the records (NULL for none)
+ *             durable - true to sync the file to the disk before returning
+ *
+ *    Returns: false if the file could not be opened or written, true otherwise
+ *****************************************************************************************/
+bool PlotFile::write(const char *filename, const WirePlot *plots, size_t count,
+                                                   const unsigned short *flags, bool durable) {
+   PlotFileHeader hdr;
+   memset(&hdr, 0, sizeof(hdr));
+
+   // Time range, sort order and one index entry per block of records
+   std::vector<PlotIndexEntry> index((count + plot_index_stride - 1) / plot_index_stride);
+   bool sorted = true;
+   int64_t min_time = 0, max_time = 0;
+   for (size_t i=0; i<count; i++) {
+      int64_t t = plots[i].timestamp;
+      PlotIndexEntry &entry = index[i / plot_index_stride];
+
+      if (i % plot_index_stride == 0)
+         entry.min_time = entry.max_time = t;
+      else {
+         entry.min_time = std::min(entry.min_time, t);
+         entry.max_time = std::max(entry.max_time, t);
+      }
+
+      if ((i > 0) && (t < plots[i-1].timestamp))
+         sorted = false;
+      if ((i == 0) || (t < min_time))
+         min_time = t;
+      if ((i == 0) || (t > max_time))
+         max_time = t;
+   }
+
+   for (unsigned int i=0; i<index.size(); i++) {
+      index[i].min_time = wireOrder(index[i].min_time);
+      index[i].max_time = wireOrder(index[i].max_time);
+   }
+
+   memcpy(hdr.magic, plot_file_magic, sizeof(hdr.magic));
+   hdr.version = wireOrder(plot_file_version);
+   hdr.header_size = wireOrder((uint16_t) sizeof(PlotFileHeader));
+   hdr.record_size = wireOrder((uint16_t) wire_plot_size);
+   hdr.flags = wireOrder((uint16_t) ((sorted ? plotfile_sorted : 0) |
+                                      ((flags != NULL) ? plotfile_has_flags : 0)));
+   hdr.schema = wireOrder(plot_file_schema);
+   hdr.index_stride = wireOrder(plot_index_stride);
+   hdr.record_count = wireOrder((uint64_t) count);
+   hdr.min_time = wireOrder(min_time);
+   hdr.max_time = wireOrder(max_time);
+   size_t flags_size = (flags != NULL) ? count * sizeof(uint16_t) : 0;
+   hdr.index_offset = wireOrder((uint64_t) (sizeof(PlotFileHeader) + count * wire_plot_size +
+                                                                                 flags_size));
+   hdr.index_count = wireOrder((uint64_t) index.size());
+
+   FileFD outfile(filename);
+   if (!outfile.openFile(FileFD::writefd, true))
+      return false;
+
+   bool ok = (outfile.writeAll(&hdr, sizeof(hdr)) >= 0);
+
+   if (!wire_needs_swap)
+      ok = ok && (outfile.writeAll(plots, count * wire_plot_size) >= 0);
+   else {
+      const size_t step = 4096;
+      std::vector<uint8_t> buf(step * wire_plot_size);
+      for (size_t i=0; ok && (i<count); i+=step) {
+         size_t n = std::min(step, count - i);
+         encodePlotRecords(&plots[i], n, buf.data());
+         ok = (outfile.writeAll(buf.data(), n * wire_plot_size) >= 0);
+      }
+   }
+
+   if (flags != NULL) {
+      std::vector<uint16_t> column(count);
+      for (size_t i=0; i<count; i++)
+         column[i] = wireOrder((uint16_t) flags[i]);
+      ok = ok && (outfile.writeAll(column.data(), flags_size) >= 0);
+   }
+
+   ok = ok && (outfile.writeAll(index.data(), index.size() * sizeof(PlotIndexEntry)) >= 0);
+
+   if (durable)
+      ok = ok && outfile.syncFD();
+   outfile.closeFD();
+   return ok;
+}
+
+/*****************************************************************************************
+ * timeAt - one record's timestamp, read out of the mapping
+ *****************************************************************************************/
+time_t PlotFile::timeAt(size_t i) {
+   int64_t t;
+   memcpy(&t, _records + i * wire_plot_size + offsetof(WirePlot, timestamp), sizeof(t));
+   return (time_t) wireOrder(t);
+}
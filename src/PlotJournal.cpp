@@ -0,0 +1,595 @@
+#include <stdexcept>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "PlotJournal.h"
+
+/*****************************************************************************************
+ * checkRecord - FNV-1a hash of a record, skipping the bytes the hash itself is stored in
+ *****************************************************************************************/
+static uint32_t checkRecord(const uint8_t *rec) {
+   uint32_t hash = 2166136261u;
+   for (size_t i=0; i<journal_record_size; i++) {
+      if ((i >= 4) && (i < 8))
+         continue;
+      hash ^= rec[i];
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+/*****************************************************************************************
+ * encodeEntry / decodeEntry - one journal record to or from its 40 bytes
+ *****************************************************************************************/
+static void encodeEntry(const JournalEntry &entry, uint8_t *rec) {
+   memset(rec, 0, journal_record_size);
+   rec[0] = entry.op;
+
+   uint16_t flags = wireOrder((uint16_t) entry.flags);
+   memcpy(&rec[2], &flags, sizeof(flags));
+   encodeWirePlot(entry.plot, &rec[8]);
+   int64_t arg = wireOrder(entry.arg);
+   memcpy(&rec[32], &arg, sizeof(arg));
+
+   uint32_t check = wireOrder(checkRecord(rec));
+   memcpy(&rec[4], &check, sizeof(check));
+}
+
+static bool decodeEntry(const uint8_t *rec, JournalEntry &entry) {
+   uint32_t check;
+   memcpy(&check, &rec[4], sizeof(check));
+   if ((wireOrder(check) != checkRecord(rec)) || (rec[0] < jop_insert) || (rec[0] > jop_offset))
+      return false;
+
+   uint16_t flags;
+   int64_t arg;
+   memcpy(&flags, &rec[2], sizeof(flags));
+   memcpy(&arg, &rec[32], sizeof(arg));
+
+   entry.op = rec[0];
+   entry.flags = wireOrder(flags);
+   decodeWirePlot(&rec[8], entry.plot);
+   entry.arg = wireOrder(arg);
+   return true;
+}
+
+/*****************************************************************************************
+ * parseSeq - reads the number out of "<prefix><digits><suffix>"
+ *
+ *    Returns: true if name has that form, false otherwise
+ *****************************************************************************************/
+static bool parseSeq(const std::string &name, const char *prefix, const char *suffix,
+                                                                           uint64_t &seq) {
+   size_t plen = strlen(prefix), slen = strlen(suffix);
+   if ((name.size() <= plen + slen) || (name.compare(0, plen, prefix) != 0) ||
+                           (name.compare(name.size() - slen, slen, suffix) != 0))
+      return false;
+
+   seq = 0;
+   for (size_t i=plen; i<name.size() - slen; i++) {
+      if ((name[i] < '0') || (name[i] > '9'))
+         return false;
+      seq = seq * 10 + (name[i] - '0');
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * PlotJournal (constructor) - creates the journal directory if it is not there yet. Nothing
+ *                             is read or written until recovery or start
+ *
+ *    Params:  dir - the journal directory
+ *             checkpoint_records - records per checkpoint interval (see checkpointDue)
+ *             commit_ms - longest an appended record waits to be committed
+ *****************************************************************************************/
+PlotJournal::PlotJournal(const char *dir, size_t checkpoint_records, unsigned int commit_ms):
+                                             _dir(dir),
+                                             _checkpoint_records(checkpoint_records),
+                                             _commit_ms(commit_ms),
+                                             _scanned(false),
+                                             _ckpt_seq(0),
+                                             _replay_idx(0),
+                                             _replay_pos(0),
+                                             _last_seq(0),
+                                             _seq(0),
+                                             _tail_upto(0),
+                                             _appended(0),
+                                             _committed(0),
+                                             _commits(0),
+                                             _since_ckpt(0),
+                                             _sync_waiters(0),
+                                             _failed(false),
+                                             _stopping(false)
+{
+   mkdir(_dir.c_str(), S_IRWXU);
+}
+
+PlotJournal::~PlotJournal() {
+   stop();
+}
+
+/*****************************************************************************************
+ * checkpointFile - finds the newest checkpoint and lines up the segments written after it
+ *                  for nextRecord
+ *
+ *    Returns: the checkpoint's path, or "" if there is none (replay from the first segment)
+ *****************************************************************************************/
+std::string PlotJournal::checkpointFile() {
+   std::vector<uint64_t> segments, checkpoints;
+   scanDir(segments, checkpoints);
+
+   _scanned = true;
+   _ckpt_seq = (checkpoints.size() > 0) ? checkpoints.back() : 0;
+   _last_seq = std::max(_ckpt_seq, (segments.size() > 0) ? segments.back() : 0);
+
+   _replay.clear();
+   for (unsigned int i=0; i<segments.size(); i++) {
+      if (segments[i] >= _ckpt_seq)
+         _replay.push_back(segments[i]);
+   }
+   _replay_idx = 0;
+   _replay_file.reset();
+
+   if (checkpoints.size() == 0)
+      return "";
+   return _dir + "/" + checkpointName(_ckpt_seq);
+}
+
+/*****************************************************************************************
+ * nextRecord - the next record to replay, walking the segments after the checkpoint in
+ *              order
+ *
+ *    Params:  entry - receives the record
+ *
+ *    Returns: true if there was one, false once replay is done
+ *****************************************************************************************/
+bool PlotJournal::nextRecord(JournalEntry &entry) {
+   if (!_scanned)
+      checkpointFile();
+
+   while (_replay_idx < _replay.size()) {
+      if (!_replay_file) {
+         _replay_file.reset(new FileFD(segmentFile(_replay[_replay_idx]).c_str()));
+         if (!_replay_file->openFile(FileFD::readfd)) {
+            cutReplay(0);
+            return false;
+         }
+         bool mapped = _replay_file->mapFile();
+         _replay_file->closeFD();
+
+         const uint8_t *hdr = _replay_file->mapData();
+         uint32_t version = 0, rec_size = 0;
+         if (mapped && (_replay_file->mapSize() >= journal_header_size)) {
+            memcpy(&version, &hdr[8], sizeof(version));
+            memcpy(&rec_size, &hdr[12], sizeof(rec_size));
+         }
+         if (!mapped || (_replay_file->mapSize() < journal_header_size) ||
+                        (memcmp(hdr, journal_magic, sizeof(journal_magic)) != 0) ||
+                        (wireOrder(version) != journal_version) ||
+                        (wireOrder(rec_size) != journal_record_size)) {
+            cutReplay(0);
+            return false;
+         }
+         _replay_pos = journal_header_size;
+      }
+
+      size_t len = _replay_file->mapSize();
+      if (_replay_pos == len) {
+         _replay_file.reset();
+         _replay_idx++;
+         continue;
+      }
+
+      if ((len - _replay_pos < journal_record_size) ||
+                           !decodeEntry(_replay_file->mapData() + _replay_pos, entry)) {
+         cutReplay(_replay_pos);
+         return false;
+      }
+
+      _replay_pos += journal_record_size;
+      return true;
+   }
+   return false;
+}
+
+/*****************************************************************************************
+ * cutReplay - ends replay at a torn or corrupt record. The current segment is cut back to
+ *             the last good record (or removed, if its header is bad) and later segments
+ *             are removed, so the next recovery reads the same history and new segments
+ *             follow on from it
+ *
+ *    Params:  offset - where the bad record starts
+ *****************************************************************************************/
+void PlotJournal::cutReplay(size_t offset) {
+   _replay_file.reset();
+
+   std::string seg = segmentFile(_replay[_replay_idx]);
+   if (offset < journal_header_size)
+      unlink(seg.c_str());
+   else if (truncate(seg.c_str(), (off_t) offset) != 0)
+      std::cerr << "Unable to truncate damaged journal segment " << seg << "\n";
+
+   for (size_t i=_replay_idx + 1; i<_replay.size(); i++)
+      unlink(segmentFile(_replay[i]).c_str());
+
+   syncDir();
+   _replay_idx = _replay.size();
+}
+
+/*****************************************************************************************
+ * start - opens the segment after the last one found and starts the commit thread
+ *
+ *    Throws: runtime_error if the segment cannot be created
+ *****************************************************************************************/
+void PlotJournal::start() {
+   if (!_scanned)
+      checkpointFile();
+   _replay_file.reset();
+
+   std::unique_ptr<FileFD> seg = createSegment(_last_seq + 1);
+
+   std::lock_guard<std::mutex> lock(_lock);
+   _segment = std::move(seg);
+   _seq = _last_seq + 1;
+
+   _stopping = false;
+   _committer = std::thread(&PlotJournal::runCommit, this);
+}
+
+/*****************************************************************************************
+ * stop - commits anything waiting, stops the commit thread and closes the segment
+ *****************************************************************************************/
+void PlotJournal::stop() {
+   {
+      std::lock_guard<std::mutex> lock(_lock);
+      _stopping = true;
+   }
+   _wake.notify_one();
+
+   if (_committer.joinable())
+      _committer.join();
+
+   if (_segment) {
+      _segment->closeFD();
+      _segment.reset();
+   }
+}
+
+/*****************************************************************************************
+ * append - encodes a record onto the pending buffer. Wakes the commit thread early if the
+ *          buffer has grown large
+ *****************************************************************************************/
+void PlotJournal::append(const JournalEntry &entry) {
+   std::lock_guard<std::mutex> lock(_lock);
+   if (_failed)
+      return;
+
+   size_t start = _pending.size();
+   _pending.resize(start + journal_record_size);
+   encodeEntry(entry, &_pending[start]);
+   _appended++;
+   _since_ckpt++;
+
+   if (_pending.size() >= journal_commit_bytes)
+      _wake.notify_one();
+}
+
+/*****************************************************************************************
+ * sync - asks for a commit now and waits for it
+ *
+ *    Returns: false if any commit has failed to write, true otherwise
+ *****************************************************************************************/
+bool PlotJournal::sync() {
+   std::unique_lock<std::mutex> lock(_lock);
+   if (!_committer.joinable())
+      return !_failed;
+
+   uint64_t target = _appended;
+   _sync_waiters++;
+   _wake.notify_one();
+   _done.wait(lock, [&]() { return _failed || (_committed >= target); });
+   _sync_waiters--;
+
+   return !_failed;
+}
+
+bool PlotJournal::failed() {
+   std::lock_guard<std::mutex> lock(_lock);
+   return _failed;
+}
+
+/*****************************************************************************************
+ * runCommit - commit thread. Wakes every commit interval (sooner if the buffer is large or
+ *             someone is waiting in sync) and commits everything appended since last time
+ *****************************************************************************************/
+void PlotJournal::runCommit() {
+   std::unique_lock<std::mutex> lock(_lock);
+
+   while (!_stopping) {
+      _wake.wait_for(lock, std::chrono::milliseconds(_commit_ms), [this]() {
+         return _stopping || ((_sync_waiters > 0) && (_pending.size() > 0)) ||
+                                             (_pending.size() >= journal_commit_bytes);
+      });
+      commitPending(lock);
+   }
+   commitPending(lock);
+}
+
+/*****************************************************************************************
+ * commitPending - takes the pending buffer and writes and syncs it as one batch. Called and
+ *                 returns with _lock held, but drops it for the write so appends carry on
+ *****************************************************************************************/
+void PlotJournal::commitPending(std::unique_lock<std::mutex> &lock) {
+   if ((_pending.size() == 0) && !_old_segment)
+      return;
+
+   // _io_lock comes first, so commits reach the disk in the order their batches were taken
+   lock.unlock();
+   std::lock_guard<std::mutex> io(_io_lock);
+   lock.lock();
+
+   commitTail(lock);
+
+   // Nothing goes after a failed write--replay would stop at it and cut the rest off
+   if (_failed)
+      _pending.clear();
+   if (_pending.size() == 0)
+      return;
+
+   std::vector<uint8_t> batch;
+   batch.swap(_pending);
+   uint64_t upto = _appended;
+   FileFD *seg = _segment.get();
+   lock.unlock();
+
+   bool ok = writeBatch(seg, batch);
+
+   lock.lock();
+   endCommit(ok, upto);
+}
+
+/*****************************************************************************************
+ * commitTail - writes and syncs the records a rotate left for the old segment, then closes
+ *              it. Replay reads the segments in order, so this has to land before any commit
+ *              to the new one. Called with _io_lock and _lock held; drops _lock for the write
+ *****************************************************************************************/
+void PlotJournal::commitTail(std::unique_lock<std::mutex> &lock) {
+   if (!_old_segment)
+      return;
+
+   std::unique_ptr<FileFD> seg = std::move(_old_segment);
+   std::vector<uint8_t> batch;
+   batch.swap(_tail);
+   uint64_t upto = _tail_upto;
+   bool failed = _failed;
+   lock.unlock();
+
+   bool ok = !failed && writeBatch(seg.get(), batch);
+   seg->closeFD();
+
+   lock.lock();
+   endCommit(ok, upto);
+}
+
+/*****************************************************************************************
+ * endCommit - records a finished commit and wakes anyone in sync (_lock held). A failed one
+ *             leaves _committed alone and stops the journal
+ *****************************************************************************************/
+void PlotJournal::endCommit(bool ok, uint64_t upto) {
+   if (ok) {
+      _committed = upto;
+      _commits++;
+   } else if (!_failed) {
+      _failed = true;
+      std::cerr << "Journal stopped after a failed commit--nothing more is durable until a restart\n";
+   }
+   _done.notify_all();
+}
+
+/*****************************************************************************************
+ * writeBatch - writes records to a segment and fdatasyncs it (_io_lock held)
+ *****************************************************************************************/
+bool PlotJournal::writeBatch(FileFD *seg, std::vector<uint8_t> &batch) {
+   if (batch.size() == 0)
+      return true;
+   if (seg == NULL)
+      return false;
+
+   if (seg->writeAll(batch.data(), batch.size()) < 0) {
+      std::cerr << "Journal write failed: " << strerror(errno) << "\n";
+      return false;
+   }
+   return seg->syncFD(true);
+}
+
+/*****************************************************************************************
+ * createSegment - creates a segment file, writes its header and makes it durable
+ *
+ *    Throws: runtime_error if the segment cannot be created
+ *****************************************************************************************/
+std::unique_ptr<FileFD> PlotJournal::createSegment(uint64_t seq) {
+   std::string name = segmentFile(seq);
+   std::unique_ptr<FileFD> seg(new FileFD(name.c_str()));
+
+   uint8_t hdr[journal_header_size];
+   uint32_t version = wireOrder(journal_version);
+   uint32_t rec_size = wireOrder((uint32_t) journal_record_size);
+   memcpy(hdr, journal_magic, sizeof(journal_magic));
+   memcpy(&hdr[8], &version, sizeof(version));
+   memcpy(&hdr[12], &rec_size, sizeof(rec_size));
+
+   if (!seg->openFile(FileFD::writefd, true))
+      throw std::runtime_error("Unable to create journal segment " + name);
+   if ((seg->writeAll(hdr, sizeof(hdr)) < 0) || !seg->syncFD() || !syncDir()) {
+      seg->closeFD();
+      throw std::runtime_error("Unable to write journal segment " + name);
+   }
+   return seg;
+}
+
+/*****************************************************************************************
+ * checkpointDue - true once the segments since the last checkpoint hold enough records
+ *                 that replaying them would start to slow a restart
+ *****************************************************************************************/
+bool PlotJournal::checkpointDue() {
+   std::lock_guard<std::mutex> lock(_lock);
+   return !_failed && (_since_ckpt >= _checkpoint_records);
+}
+
+/*****************************************************************************************
+ * prepareRotate - creates and syncs the segment after the live one, ready for rotate. Call
+ *                 without the database locked--this is where the rotation's I/O happens
+ *
+ *    Returns: the new segment's number (the checkpoint's), or 0 if it could not be created
+ *****************************************************************************************/
+uint64_t PlotJournal::prepareRotate() {
+   uint64_t next;
+   {
+      std::lock_guard<std::mutex> lock(_lock);
+      next = _seq + 1;
+   }
+
+   try {
+      std::unique_ptr<FileFD> seg = createSegment(next);
+
+      std::lock_guard<std::mutex> lock(_lock);
+      _next_segment = std::move(seg);
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      return 0;
+   }
+   return next;
+}
+
+/*****************************************************************************************
+ * rotate - makes the prepared segment live. What is pending stays with the old segment and
+ *          is written by finishRotate or the next commit, whichever comes first. Call with
+ *          the database locked and pin the checkpoint's snapshot before unlocking it, so the
+ *          checkpoint holds exactly what the earlier segments do
+ *****************************************************************************************/
+void PlotJournal::rotate() {
+   std::lock_guard<std::mutex> lock(_lock);
+   if (!_next_segment)
+      return;
+
+   _tail.swap(_pending);
+   _tail_upto = _appended;
+   _old_segment = std::move(_segment);
+   _segment = std::move(_next_segment);
+   _seq++;
+   _since_ckpt = 0;
+}
+
+/*****************************************************************************************
+ * finishRotate - commits the old segment's tail and closes it, after the database is
+ *                unlocked
+ *****************************************************************************************/
+void PlotJournal::finishRotate() {
+   std::lock_guard<std::mutex> io(_io_lock);
+   std::unique_lock<std::mutex> lock(_lock);
+   commitTail(lock);
+}
+
+std::string PlotJournal::checkpointTemp(uint64_t seq) {
+   return _dir + "/" + checkpointName(seq) + ".tmp";
+}
+
+/*****************************************************************************************
+ * finishCheckpoint - moves a fully written (and synced) checkpoint into place, then deletes
+ *                    the older checkpoints and the segments it covers
+ *
+ *    Params:  seq - the checkpoint's number, from rotate
+ *
+ *    Returns: false if it could not be put in place (the journal is still complete)
+ *****************************************************************************************/
+bool PlotJournal::finishCheckpoint(uint64_t seq) {
+   std::string name = _dir + "/" + checkpointName(seq);
+   if ((rename(checkpointTemp(seq).c_str(), name.c_str()) != 0) || !syncDir())
+      return false;
+
+   std::vector<uint64_t> segments, checkpoints;
+   scanDir(segments, checkpoints);
+   for (unsigned int i=0; i<checkpoints.size(); i++) {
+      if (checkpoints[i] < seq)
+         unlink((_dir + "/" + checkpointName(checkpoints[i])).c_str());
+   }
+   for (unsigned int i=0; i<segments.size(); i++) {
+      if (segments[i] < seq)
+         unlink(segmentFile(segments[i]).c_str());
+   }
+   return syncDir();
+}
+
+uint64_t PlotJournal::appended() {
+   std::lock_guard<std::mutex> lock(_lock);
+   return _appended;
+}
+
+uint64_t PlotJournal::committed() {
+   std::lock_guard<std::mutex> lock(_lock);
+   return _committed;
+}
+
+uint64_t PlotJournal::commits() {
+   std::lock_guard<std::mutex> lock(_lock);
+   return _commits;
+}
+
+/*****************************************************************************************
+ * scanDir - lists the segment and checkpoint numbers in the journal directory, in order
+ *****************************************************************************************/
+void PlotJournal::scanDir(std::vector<uint64_t> &segments, std::vector<uint64_t> &checkpoints) {
+   segments.clear();
+   checkpoints.clear();
+
+   DIR *dir = opendir(_dir.c_str());
+   if (dir == NULL)
+      return;
+
+   struct dirent *ent;
+   while ((ent = readdir(dir)) != NULL) {
+      uint64_t seq;
+      std::string name(ent->d_name);
+      if (parseSeq(name, "journal.", "", seq))
+         segments.push_back(seq);
+      else if (parseSeq(name, "checkpoint.", ".bin", seq))
+         checkpoints.push_back(seq);
+   }
+   closedir(dir);
+
+   std::sort(segments.begin(), segments.end());
+   std::sort(checkpoints.begin(), checkpoints.end());
+}
+
+std::string PlotJournal::segmentFile(uint64_t seq) {
+   std::stringstream name;
+   name << _dir << "/journal." << std::setw(16) << std::setfill('0') << seq;
+   return name.str();
+}
+
+std::string PlotJournal::checkpointName(uint64_t seq) {
+   std::stringstream name;
+   name << "checkpoint." << std::setw(16) << std::setfill('0') << seq << ".bin";
+   return name.str();
+}
+
+/*****************************************************************************************
+ * syncDir - makes file creations, renames and removals in the directory durable
+ *****************************************************************************************/
+bool PlotJournal::syncDir() {
+   FileFD dir(_dir.c_str());
+   if (!dir.openFile(FileFD::readfd))
+      return false;
+
+   bool ok = dir.syncFD();
+   dir.closeFD();
+   return ok;
+}
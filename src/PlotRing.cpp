@@ -0,0 +1,91 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include "PlotRing.h"
+
+/*****************************************************************************************
+ * PlotRing (constructor) - allocates the ring
+ *
+ *    Params:  capacity - how many plots it holds, must be a power of two
+ *
+ *    Throws: runtime_error if capacity is not a power of two
+ *****************************************************************************************/
+PlotRing::PlotRing(size_t capacity):
+                           _buf(capacity),
+                           _mask(capacity - 1),
+                           _tail(0),
+                           _head_cache(0),
+                           _head(0),
+                           _tail_cache(0)
+{
+   if ((capacity == 0) || ((capacity & _mask) != 0))
+      throw std::runtime_error("PlotRing capacity must be a power of two.");
+}
+
+PlotRing::~PlotRing() {
+
+}
+
+/*****************************************************************************************
+ * push - producer side. Copies the plots into the free slots (in at most two pieces when
+ *        the free space wraps) and then publishes them all with one store
+ *
+ *    Params:  plots - the plots to add
+ *             count - how many
+ *
+ *    Returns: how many were added--fewer than count if the ring filled up
+ *****************************************************************************************/
+size_t PlotRing::push(const WirePlot *plots, size_t count) {
+   size_t tail = _tail.load(std::memory_order_relaxed);
+
+   if (tail - _head_cache + count > _buf.size())
+      _head_cache = _head.load(std::memory_order_acquire);
+
+   size_t n = std::min(count, _buf.size() - (tail - _head_cache));
+   if (n == 0)
+      return 0;
+
+   size_t start = tail & _mask;
+   size_t first = std::min(n, _buf.size() - start);
+   memcpy(&_buf[start], plots, first * sizeof(WirePlot));
+   if (n > first)
+      memcpy(&_buf[0], plots + first, (n - first) * sizeof(WirePlot));
+
+   _tail.store(tail + n, std::memory_order_release);
+   return n;
+}
+
+/*****************************************************************************************
+ * pop - consumer side. Copies out up to max plots and then frees their slots with one
+ *       store
+ *
+ *    Params:  plots - receives the plots (must hold max)
+ *             max - the most to take
+ *
+ *    Returns: how many were taken, 0 if the ring was empty
+ *****************************************************************************************/
+size_t PlotRing::pop(WirePlot *plots, size_t max) {
+   size_t head = _head.load(std::memory_order_relaxed);
+
+   if (_tail_cache - head < max)
+      _tail_cache = _tail.load(std::memory_order_acquire);
+
+   size_t n = std::min(max, _tail_cache - head);
+   if (n == 0)
+      return 0;
+
+   size_t start = head & _mask;
+   size_t first = std::min(n, _buf.size() - start);
+   memcpy(plots, &_buf[start], first * sizeof(WirePlot));
+   if (n > first)
+      memcpy(plots + first, &_buf[0], (n - first) * sizeof(WirePlot));
+
+   _head.store(head + n, std::memory_order_release);
+   return n;
+}
+
+size_t PlotRing::size() {
+   // Head first--tail can only have moved further on by the time it is read
+   size_t head = _head.load(std::memory_order_acquire);
+   return _tail.load(std::memory_order_acquire) - head;
+}
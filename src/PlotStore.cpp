@@ -0,0 +1,436 @@
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+#include "PlotStore.h"
+
+/*****************************************************************************************
+ * PlotStore (constructor) - reserves the chunk directories so they never reallocate
+ *****************************************************************************************/
+PlotStore::PlotStore():
+               _next_handle(0),
+               _end(0),
+               _live(0),
+               _head(0),
+               _run_end(0),
+               _run_max(0),
+               _first_dirty(0),
+               _shifts(1, 0),
+               _epoch(0)
+{
+   _chunks.reserve(max_plot_chunks);
+   _handle_dir.reserve(max_plot_chunks);
+}
+
+PlotStore::~PlotStore() {
+   for (auto cptr = _chunks.begin(); cptr != _chunks.end(); cptr++)
+      delete *cptr;
+   for (auto cptr = _spare.begin(); cptr != _spare.end(); cptr++)
+      delete *cptr;
+   for (auto rptr = _retired.begin(); rptr != _retired.end(); rptr++)
+      delete rptr->second;
+   for (auto hptr = _handle_dir.begin(); hptr != _handle_dir.end(); hptr++)
+      delete[] *hptr;
+}
+
+/*****************************************************************************************
+ * newChunk - takes a chunk off the spare list, or allocates one if there are none. It is
+ *            born after every snapshot taken so far, so none of them can be sharing it
+ *
+ *    Throws: runtime_error if the store is full
+ *****************************************************************************************/
+PlotChunk *PlotStore::newChunk() {
+   if (_chunks.size() >= max_plot_chunks)
+      throw std::runtime_error("PlotStore is full, cannot add another chunk of plots.");
+
+   PlotChunk *chunk;
+   if (_spare.size() > 0) {
+      chunk = _spare.back();
+      _spare.pop_back();
+   } else
+      chunk = new PlotChunk;
+
+   chunk->born = _epoch + 1;
+   return chunk;
+}
+
+/*****************************************************************************************
+ * copyChunk - copy-on-write. Makes a private copy of a chunk a snapshot may be reading and
+ *             retires the original
+ *
+ *    Params:  shared - the chunk currently in the store
+ *
+ *    Returns: the copy, which the caller puts in its place
+ *****************************************************************************************/
+PlotChunk *PlotStore::copyChunk(PlotChunk *shared) {
+   PlotChunk *chunk;
+   if (_spare.size() > 0) {
+      chunk = _spare.back();
+      _spare.pop_back();
+   } else
+      chunk = new PlotChunk;
+
+   *chunk = *shared;
+   chunk->born = _epoch + 1;
+
+   _retired.emplace_back(_epoch, shared);
+   return chunk;
+}
+
+/*****************************************************************************************
+ * releaseChunk - gives back a chunk the store no longer uses. It is kept as a spare, unless a
+ *                snapshot may still be reading it, in which case it is retired until then
+ *****************************************************************************************/
+void PlotStore::releaseChunk(PlotChunk *chunk) {
+   if ((_pins.size() > 0) && (chunk->born <= *_pins.rbegin()))
+      _retired.emplace_back(_epoch, chunk);
+   else
+      _spare.push_back(chunk);
+}
+
+/*****************************************************************************************
+ * reclaim - moves retired chunks to the spare list once no snapshot can hold them, i.e. once
+ *           every snapshot still pinned was taken after the chunk was retired
+ *****************************************************************************************/
+void PlotStore::reclaim() {
+   uint64_t oldest = (_pins.size() > 0) ? *_pins.begin() : _epoch + 1;
+
+   size_t kept = 0;
+   for (size_t i = 0; i < _retired.size(); i++) {
+      if (_retired[i].first < oldest)
+         _spare.push_back(_retired[i].second);
+      else
+         _retired[kept++] = _retired[i];
+   }
+   _retired.resize(kept);
+}
+
+/*****************************************************************************************
+ * pin - freezes the store's current contents into a snapshot. Only copies the chunk pointers;
+ *       the chunks themselves are copied later, and only if they are written to before the
+ *       snapshot is unpinned
+ *
+ *    Params:  snap - receives the view
+ *****************************************************************************************/
+void PlotStore::pin(PlotSnapshot &snap) {
+   snap._epoch = ++_epoch;
+   snap._chunks.assign(_chunks.begin(), _chunks.end());
+   snap._offsets = _offsets;
+   snap._end = _end;
+
+   _pins.insert(snap._epoch);
+}
+
+/*****************************************************************************************
+ * unpin - releases a snapshot taken with pin and reclaims what only it was holding on to
+ *****************************************************************************************/
+void PlotStore::unpin(const PlotSnapshot &snap) {
+   auto pptr = _pins.find(snap._epoch);
+   if (pptr == _pins.end())
+      return;
+
+   _pins.erase(pptr);
+   reclaim();
+}
+
+/*****************************************************************************************
+ * newHandle - hands out a free handle (reusing released ones first) and points it at slot
+ *****************************************************************************************/
+PlotHandle PlotStore::newHandle(size_t slot) {
+   PlotHandle handle;
+
+   if (_free_handles.size() > 0) {
+      handle = _free_handles.back();
+      _free_handles.pop_back();
+   } else {
+      handle = _next_handle++;
+      if ((handle >> plot_chunk_bits) >= _handle_dir.size()) {
+         if (_handle_dir.size() >= max_plot_chunks)
+            throw std::runtime_error("PlotStore is out of plot handles.");
+         _handle_dir.push_back(new uint32_t[plot_chunk_size]);
+      }
+   }
+
+   _handle_dir[handle >> plot_chunk_bits][handle & plot_chunk_mask] = (uint32_t) slot;
+   return handle;
+}
+
+/*****************************************************************************************
+ * append - adds a plot to the end of the store
+ *
+ *    Returns: the handle of the new plot
+ *****************************************************************************************/
+PlotHandle PlotStore::append(unsigned int drone_id, unsigned int node_id, time_t timestamp,
+                             float latitude, float longitude, unsigned short flags) {
+   size_t slot = _end;
+   if ((slot >> plot_chunk_bits) >= _chunks.size())
+      _chunks.push_back(newChunk());
+
+   PlotChunk &dst = chunk(slot);
+   size_t off = slot & plot_chunk_mask;
+   dst.drone_id[off] = drone_id;
+   dst.node_id[off] = node_id;
+   dst.timestamp[off] = timestamp;
+   dst.latitude[off] = latitude;
+   dst.longitude[off] = longitude;
+   dst.flags[off] = flags & ~(plotflag_dead | plotflag_moved);
+   dst.handle[off] = newHandle(slot);
+
+   // In-order appends (the usual case for a live feed) just extend the sorted run
+   time_t corrected = timestamp + offsetOf(node_id);
+   if ((_run_end == slot) && ((slot == 0) || (corrected >= _run_max))) {
+      _run_end = slot + 1;
+      _run_max = corrected;
+   }
+
+   // Publish the slot only once it is filled in
+   _end = slot + 1;
+   _live++;
+   return dst.handle[off];
+}
+
+/*****************************************************************************************
+ * kill - marks a plot's slot dead and releases its handle for reuse
+ *****************************************************************************************/
+void PlotStore::kill(PlotHandle handle) {
+   size_t slot = slotOf(handle);
+
+   setFlags(slot, plotflag_dead);
+   _free_handles.push_back(handle);
+   _live--;
+
+   if (slot < _first_dirty)
+      _first_dirty = slot;
+}
+
+/*****************************************************************************************
+ * setTimestamp - changes a plot's timestamp. A plot inside the sorted run is listed as
+ *                displaced so the next sortByTime() moves it to its new place
+ *****************************************************************************************/
+void PlotStore::setTimestamp(size_t slot, time_t ts) {
+   chunk(slot).timestamp[slot & plot_chunk_mask] = ts;
+
+   if ((slot >= _run_end) || (flagsAt(slot) & plotflag_moved))
+      return;
+
+   setFlags(slot, plotflag_moved);
+   _displaced.push_back((uint32_t) slot);
+   if (slot < _first_dirty)
+      _first_dirty = slot;
+}
+
+/*****************************************************************************************
+ * setOffset - sets the clock offset of one node. Nothing stored changes; every plot from the
+ *             node just reads back shifted by the new amount. Since that can reorder any of
+ *             them, the sorted run is dropped and the next sortByTime() sorts everything
+ *
+ *    Throws: runtime_error if node_id is max_offset_nodes or more
+ *****************************************************************************************/
+void PlotStore::setOffset(unsigned int node_id, time_t offset) {
+   if (node_id >= max_offset_nodes)
+      throw std::runtime_error("PlotStore node ID too large to give a clock offset.");
+
+   if (offsetOf(node_id) == offset)
+      return;
+
+   if (node_id >= _offsets.size())
+      _offsets.resize(node_id + 1, 0);
+   _offsets[node_id] = offset;
+
+   _shifts.assign(1, 0);
+   for (auto optr = _offsets.begin(); optr != _offsets.end(); optr++) {
+      if (std::find(_shifts.begin(), _shifts.end(), *optr) == _shifts.end())
+         _shifts.push_back(*optr);
+   }
+
+   // Displaced slots are picked up by the full sort along with the rest
+   _run_end = 0;
+   _displaced.clear();
+   _first_dirty = 0;
+}
+
+/*****************************************************************************************
+ * isValid - true if the handle currently refers to a live plot
+ *****************************************************************************************/
+bool PlotStore::isValid(PlotHandle handle) {
+   if (handle >= _next_handle)
+      return false;
+
+   size_t slot = slotOf(handle);
+   return (slot < _end) && isLive(slot) && (handleAt(slot) == handle);
+}
+
+/*****************************************************************************************
+ * firstLive - returns the first live slot, or endSlot() if there is none
+ * nextLive - returns the first live slot at or after the given slot
+ *****************************************************************************************/
+size_t PlotStore::firstLive() {
+   _head = nextLive(_head);
+   return _head;
+}
+
+size_t PlotStore::nextLive(size_t slot) {
+   while ((slot < _end) && !isLive(slot))
+      slot++;
+   return slot;
+}
+
+/*****************************************************************************************
+ * sortByTime - puts the live plots in corrected time order (ties keep their current order) and
+ *              squeezes out dead slots. Handles follow their plots.
+ *
+ *              Only the plots appended out of order or re-timed since the last sort get
+ *              sorted; they are then merged with the rest of the run. Slots before the first
+ *              change are left alone, so a late batch costs about as much as the plots newer
+ *              than it. If the order is already right this returns at once, only compacting
+ *              when dead slots have piled up.
+ *****************************************************************************************/
+void PlotStore::sortByTime() {
+   typedef std::pair<time_t, uint32_t> sortkey;
+
+   if (isSorted()) {
+      if ((_end - _live) > (_end / 4))
+         compact();
+      return;
+   }
+
+   // The plots that need placing. Keying on (timestamp, slot) keeps the sort stable
+   std::vector<sortkey> moved;
+   for (auto sptr = _displaced.begin(); sptr != _displaced.end(); sptr++) {
+      if (isLive(*sptr))
+         moved.emplace_back(timeAt(*sptr), *sptr);
+   }
+   for (size_t slot = _run_end; slot < _end; slot++) {
+      if (isLive(slot))
+         moved.emplace_back(timeAt(slot), (uint32_t) slot);
+   }
+   std::sort(moved.begin(), moved.end());
+
+   // Everything below _first_dirty is untouched and in order, so binary search it for the
+   // first slot the earliest moved plot has to go in front of
+   size_t first = std::min(_first_dirty, _run_end);
+   if (moved.size() > 0) {
+      size_t lo = 0, hi = first;
+      while (lo < hi) {
+         size_t mid = lo + (hi - lo) / 2;
+         if (sortkey(timeAt(mid), (uint32_t) mid) < moved.front())
+            lo = mid + 1;
+         else
+            hi = mid;
+      }
+      first = lo;
+   }
+
+   // Rest of the run from there on, minus dead and displaced plots, then merge
+   std::vector<sortkey> run;
+   run.reserve(_run_end - first);
+   for (size_t slot = first; slot < _run_end; slot++) {
+      if (!(flagsAt(slot) & (plotflag_dead | plotflag_moved)))
+         run.emplace_back(timeAt(slot), (uint32_t) slot);
+   }
+
+   std::vector<sortkey> order(run.size() + moved.size());
+   std::merge(run.begin(), run.end(), moved.begin(), moved.end(), order.begin());
+
+   rewrite(first, order);
+}
+
+/*****************************************************************************************
+ * compact - squeezes dead slots out of a sorted store, starting from the first one
+ *****************************************************************************************/
+void PlotStore::compact() {
+   std::vector<std::pair<time_t, uint32_t>> order;
+
+   size_t first = std::min(_first_dirty, _head);
+   while ((first < _end) && isLive(first))
+      first++;
+
+   order.reserve(_end - first);
+   for (size_t slot = first; slot < _end; slot++) {
+      if (isLive(slot))
+         order.emplace_back(timeAt(slot), (uint32_t) slot);
+   }
+
+   rewrite(first, order);
+}
+
+/*****************************************************************************************
+ * rewrite - copies the plots at the slots in order (all at or after first) into slots
+ *           first, first+1, ..., and truncates the store after them. Afterwards the whole
+ *           store counts as sorted and clean.
+ *****************************************************************************************/
+void PlotStore::rewrite(size_t first, const std::vector<std::pair<time_t, uint32_t>> &order) {
+
+   // Stage the plots first, since the destination overlaps the source
+   struct staged {
+      unsigned int drone_id, node_id;
+      time_t timestamp;
+      float latitude, longitude;
+      unsigned short flags;
+      PlotHandle handle;
+   };
+   std::vector<staged> tmp(order.size());
+
+   for (size_t i = 0; i < order.size(); i++) {
+      size_t src = order[i].second;
+      const PlotChunk &from = rchunk(src);
+      size_t off = src & plot_chunk_mask;
+
+      tmp[i] = { from.drone_id[off], from.node_id[off], from.timestamp[off], from.latitude[off],
+                 from.longitude[off], (unsigned short) (from.flags[off] & ~plotflag_moved),
+                 from.handle[off] };
+   }
+
+   for (size_t i = 0; i < tmp.size(); i++) {
+      size_t dst = first + i;
+      PlotChunk &to = chunk(dst);
+      size_t off = dst & plot_chunk_mask;
+
+      to.drone_id[off] = tmp[i].drone_id;
+      to.node_id[off] = tmp[i].node_id;
+      to.timestamp[off] = tmp[i].timestamp;
+      to.latitude[off] = tmp[i].latitude;
+      to.longitude[off] = tmp[i].longitude;
+      to.flags[off] = tmp[i].flags;
+      to.handle[off] = tmp[i].handle;
+
+      PlotHandle handle = tmp[i].handle;
+      _handle_dir[handle >> plot_chunk_bits][handle & plot_chunk_mask] = (uint32_t) dst;
+   }
+
+   _end = first + tmp.size();
+   if (first < _head)
+      _head = first;
+
+   // Hand back chunks that are now past the end
+   size_t need = (_end + plot_chunk_size - 1) >> plot_chunk_bits;
+   while (_chunks.size() > need) {
+      releaseChunk(_chunks.back());
+      _chunks.pop_back();
+   }
+
+   _run_end = _end;
+   _run_max = (_end > 0) ? timeAt(_end - 1) : 0;
+   _displaced.clear();
+   _first_dirty = _end;
+}
+
+/*****************************************************************************************
+ * clear - removes all plots. Chunks are kept as spares (or retired, if a snapshot has them).
+ *         The node clock offsets are kept
+ *****************************************************************************************/
+void PlotStore::clear() {
+   for (auto cptr = _chunks.begin(); cptr != _chunks.end(); cptr++)
+      releaseChunk(*cptr);
+   _chunks.clear();
+
+   _free_handles.clear();
+   _next_handle = 0;
+   _end = 0;
+   _live = 0;
+   _head = 0;
+
+   _run_end = 0;
+   _run_max = 0;
+   _displaced.clear();
+   _first_dirty = 0;
+}
@@ -1,10 +1,52 @@
 #include <iostream>
 #include <tuple>
+#include <algorithm>
+#include <cstring>
 #include <exception>
+#include <chrono>
 #include "ReplServer.h"
 
 const time_t secs_between_repl = 20;
+
+// How long the database stage waits for replicated data after a pass that found nothing to do
+const int db_idle_wait_ms = 10;
+
+// Longest the network stage sleeps in the reactor with nothing happening--bounds how late a
+// reconnect timer or shutdown is noticed. While received batches wait on a full decode queue,
+// which nothing signals, it looks again after backlog_poll_ms instead
+const int network_poll_ms = 100;
+const int backlog_poll_ms = 1;
+// Receipts of synced batches waiting for the network stage to send their ACKs
+const size_t ack_queue_depth = 4 * pipeline_queue_depth;
+
 const unsigned int max_servers = 10;
+const unsigned int no_leader = (unsigned int) -1;
+
+/*********************************************************************************************
+ * sidToNodeID - converts a server ID (i.e. "ds3") into the node ID used in the drone plots
+ *               so the two can be compared without building strings
+ *
+ *    Returns: the node ID, or no_leader if the server ID has no number in it
+ *********************************************************************************************/
+static unsigned int sidToNodeID(const std::string &sid) {
+   auto digits = sid.find_first_of("0123456789");
+   if (digits == std::string::npos)
+      return no_leader;
+
+   return (unsigned int) strtoul(sid.c_str() + digits, NULL, 10);
+}
+
+// Steady clock in microseconds, for timing passes
+static int64_t steadyMicros() {
+   return std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Plots in an encoded batch of this many bytes, going by its size (a malformed batch is
+// caught when decoded)
+static size_t batchPlots(size_t bytes) {
+   return (bytes > wire_batch_header) ? (bytes - wire_batch_header) / wire_plot_size : 0;
+}
 
 /*********************************************************************************************
  * ReplServer (constructor) - creates our ReplServer. Initializes:
@@ -22,9 +64,17 @@ ReplServer::ReplServer(DronePlotDB &plotdb, float time_mult)
                                _time_mult(time_mult),
                                _verbosity(1),
                                _ip_addr("127.0.0.1"),
-                               _port(9999)
+                               _port(9999),
+                               _maint_gen(0),
+                               _ingest(NULL),
+                               _decode_q(pipeline_queue_depth),
+                               _apply_q(pipeline_queue_depth),
+                               _send_q(pipeline_queue_depth),
+                               _ack_q(ack_queue_depth)
 {
    _start_time = time(NULL);
+   buildNodeRanks();
+   registerMetrics();
 }
 
 ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short port, int offset, 
@@ -35,16 +85,108 @@ ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short
                                   _time_mult(time_mult), 
                                   _verbosity(verbosity),
                                   _ip_addr(ip_addr),
-                                  _port(port)
-
+                                  _port(port),
+                                  _maint_gen(0),
+                                  _ingest(NULL),
+                                  _decode_q(pipeline_queue_depth),
+                                  _apply_q(pipeline_queue_depth),
+                                  _send_q(pipeline_queue_depth),
+                                  _ack_q(ack_queue_depth)
 {
    _start_time = time(NULL) + offset;
+   buildNodeRanks();
+   registerMetrics();
 }
 
 ReplServer::~ReplServer() {
 
 }
 
+/**********************************************************************************************
+ * buildNodeRanks - turns the QueueMgr's priority list of server IDs into a table indexed by
+ *                  node ID so deconfliction can compare priorities with a single lookup.
+ *                  Rank 0 is the leader; nodes not in the list rank below all that are
+ **********************************************************************************************/
+
+void ReplServer::buildNodeRanks() {
+   const std::vector<std::string> &order = _queue.getLeader();
+
+   _leader_id = no_leader;
+   _node_rank.clear();
+   _unranked = order.size();
+
+   for (unsigned int rank = 0; rank < order.size(); rank++) {
+      unsigned int node_id = sidToNodeID(order[rank]);
+      if (node_id == no_leader)
+         continue;
+
+      if (rank == 0)
+         _leader_id = node_id;
+
+      if (node_id >= _node_rank.size())
+         _node_rank.resize(node_id + 1, _unranked);
+      _node_rank[node_id] = rank;
+   }
+}
+
+/**********************************************************************************************
+ * registerMetrics - registers this server's metrics and has the QueueMgr time its connections
+ *                   into the same registry. Per-peer metrics are added as peers turn up
+ **********************************************************************************************/
+
+void ReplServer::registerMetrics() {
+   _queue.setMetrics(_metrics);
+
+   _plots_ingested = &_metrics.counter("repsvr_plots_ingested_total",
+                                       "Plots taken in from the local antenna");
+   _batches_dropped = &_metrics.counter("repsvr_batches_dropped_total",
+                                        "Received batches dropped as malformed");
+
+   const char *batch_help = "Plots per replication batch";
+   _batch_in = &_metrics.histogram("repsvr_batch_plots", batch_help, "direction=\"in\"");
+   _batch_out = &_metrics.histogram("repsvr_batch_plots", batch_help, "direction=\"out\"");
+
+   _loop_time = &_metrics.histogram("repsvr_network_loop_microseconds",
+                                    "Time for one pass of the network stage, not counting its sleep");
+
+   const char *pass_help = "Time for each phase of a database maintenance pass";
+   _sort_time = &_metrics.histogram("repsvr_db_pass_microseconds", pass_help, "phase=\"sort\"");
+   _skew_time = &_metrics.histogram("repsvr_db_pass_microseconds", pass_help, "phase=\"skew\"");
+   _dedup_time = &_metrics.histogram("repsvr_db_pass_microseconds", pass_help, "phase=\"dedup\"");
+
+   _queue_depth = &_metrics.gauge("repsvr_queue_depth",
+                                  "Messages waiting in the QueueMgr queue, received and to send");
+
+   const char *depth_help = "Batches waiting in each pipeline queue";
+   _decode_depth = &_metrics.gauge("repsvr_pipeline_depth", depth_help, "queue=\"decode\"");
+   _apply_depth = &_metrics.gauge("repsvr_pipeline_depth", depth_help, "queue=\"apply\"");
+   _send_depth = &_metrics.gauge("repsvr_pipeline_depth", depth_help, "queue=\"send\"");
+
+   _db_plots = &_metrics.gauge("repsvr_db_plots", "Plots in the database as of the last pass");
+   _db_generation = &_metrics.gauge("repsvr_db_generation",
+                                    "Database generation as of the last pass");
+}
+
+/**********************************************************************************************
+ * peerMetrics - the metrics for traffic with one peer, registered the first time it is seen.
+ *               Network stage only
+ **********************************************************************************************/
+
+ReplServer::PeerMetrics &ReplServer::peerMetrics(const std::string &sid) {
+   auto pptr = _peer_metrics.find(sid);
+   if (pptr != _peer_metrics.end())
+      return pptr->second;
+
+   std::string peer = MetricsRegistry::label("peer", sid);
+   PeerMetrics &fresh = _peer_metrics[sid];
+   fresh.batches_in = &_metrics.counter("repsvr_batches_received_total",
+                                        "Replication batches received from each peer", peer);
+   fresh.plots_in = &_metrics.counter("repsvr_plots_received_total",
+                                      "Plots received from each peer", peer);
+   fresh.plots_out = &_metrics.counter("repsvr_plots_sent_total",
+                                       "Plots queued to send to each peer", peer);
+   return fresh;
+}
 
 /**********************************************************************************************
  * getAdjustedTime - gets the time since the replication server started up in seconds, modified
@@ -85,80 +227,293 @@ void ReplServer::replicate() {
    if (_verbosity >= 2)
       std::cout << "Server bound to " << _ip_addr << ", port: " << _port << " and listening\n";
 
-  
+   // Start the decode and database stages--this thread carries on as the network stage
+   pthread_t decodethread, dbthread;
+   if (pthread_create(&decodethread, NULL, t_decode, (void *) this) != 0)
+      throw std::runtime_error("Unable to create replication decode thread");
+   if (pthread_create(&dbthread, NULL, t_dbmaint, (void *) this) != 0) {
+      _shutdown = true;
+      pthread_join(decodethread, NULL);
+      throw std::runtime_error("Unable to create replication database thread");
+   }
+
+   runNetwork();
+
+   // Release any stage waiting on a queue and wait for both to finish
+   _decode_q.close();
+   _apply_q.close();
+   _send_q.close();
+   _ack_q.close();
+   pthread_join(decodethread, NULL);
+   pthread_join(dbthread, NULL);
+}
+
+void *ReplServer::t_decode(void *data) {
+   static_cast<ReplServer *>(data)->runDecode();
+   return NULL;
+}
+
+void *ReplServer::t_dbmaint(void *data) {
+   static_cast<ReplServer *>(data)->runDBMaint();
+   return NULL;
+}
+
+/**********************************************************************************************
+ * runNetwork - network stage. Services the sockets, sends out the batches the database stage
+ *              has built and hands received batches to the decode stage. Received batches
+ *              are only taken off the QueueMgr while the decode queue has room, so a backlog
+ *              further down waits in the QueueMgr instead of piling up in the pipeline.
+ *              Received batches are acknowledged as the database stage hands back their
+ *              receipts. Between passes it sleeps in the reactor, woken by socket activity or
+ *              by the database stage queuing a batch or a receipt, so an idle server does not
+ *              spin
+ **********************************************************************************************/
+
+void ReplServer::runNetwork() {
+   std::string sid;
+   InBatch batch;
+   SharedPayload outgoing;
+   MsgReceipt receipt;
+   int wait_ms = 0;
+
    // Replicate until we get the shutdown signal
    while (!_shutdown) {
 
+      // Sleep until a socket is ready or another stage wakes us with something to send
+      _queue.pollEvents(wait_ms);
+      int64_t start = steadyMicros();
+
       // Check for new connections, process existing connections, and populate the queue as applicable
       _queue.handleQueue();     
 
+      // Acknowledge the batches the database stage has made durable
+      while (_ack_q.pop(receipt))
+         _queue.acknowledge(receipt);
+
+      // Send to the queue manager--every peer shares this one buffer
+      while (_send_q.pop(outgoing)) {
+         size_t count = batchPlots(outgoing->size());
+         _batch_out->observe(count);
+
+         for (unsigned int i = 0; i < _queue.getNumServers(); i++) {
+            const char *peer = _queue.getServerIDAt(i);
+            _queue.sendToServer(peer, outgoing);
+            peerMetrics(peer).plots_out->add(count);
+         }
+      }
+
+      // Check the queue for updates and pop them. The pop command only returns incoming
+      // replication information--outgoing replication in the queue gets turned into a TCPConn
+      // object and automatically removed from the queue by pop
+      while (!_decode_q.isFull() && _queue.pop(sid, batch.data, batch.receipt)) {
+         size_t count = batchPlots(batch.data.size());
+         PeerMetrics &peer = peerMetrics(sid);
+         peer.batches_in->add();
+         peer.plots_in->add(count);
+         _batch_in->observe(count);
+
+         _decode_q.tryPush(batch);
+      }
+
+      _queue_depth->set(_queue.getQueueDepth());
+      _decode_depth->set(_decode_q.depth());
+      _apply_depth->set(_apply_q.depth());
+      _send_depth->set(_send_q.depth());
+      _loop_time->observe(steadyMicros() - start);
+
+      wait_ms = (_decode_q.isFull() && (_queue.getQueueDepth() > 0)) ? backlog_poll_ms :
+                                                                        network_poll_ms;
+   }   
+}
+
+/**********************************************************************************************
+ * runDecode - decode stage. Validates and decodes each received batch and passes the plots
+ *             on to the database stage. A malformed batch is reported and its plots dropped,
+ *             but it still goes on with none so it is acknowledged in turn
+ **********************************************************************************************/
+
+void ReplServer::runDecode() {
+   InBatch batch;
+
+   while (!_shutdown) {
+      if (!_decode_q.pop(batch, 100))
+         continue;
+
+      DecodedBatch decoded;
+      decoded.receipt = batch.receipt;
+      try {
+         decodePlotBatch(batch.data.data(), batch.data.size(), decoded.plots);
+      } catch (std::runtime_error &e) {
+         std::cout << "Dropping replication batch: " << e.what() << "\n";
+         _batches_dropped->add();
+         decoded.plots.clear();
+      }
+
+      _apply_q.push(decoded);
+   }
+}
+
+/**********************************************************************************************
+ * runDBMaint - database stage. Takes in new local and replicated plots, builds the outgoing
+ *              batch when it is time to replicate, then sorts, corrects skew and deduplicates.
+ *              Waits on the apply queue between passes so replicated data is picked up as
+ *              soon as it is decoded--briefly while data is flowing, a little longer once a
+ *              pass finds nothing to do.
+ *
+ *              The maintenance phases only run when the database generation has moved since
+ *              they last ran, and each works only from what changed (see checkSkew and
+ *              deduplicate), so a quiet replica just sleeps between polls of the ingest ring
+ **********************************************************************************************/
+
+void ReplServer::runDBMaint() {
+   DecodedBatch batch;
+   bool idle = false;
+
+   while (!_shutdown) {
+
+      // Pick up anything the antenna has received since the last pass
+      drainIngest();
+
+      // Incoming replication--add it to this server's local database, noting how far the
+      // journal has to get before the batch can be acknowledged
+      if (_apply_q.pop(batch, idle ? db_idle_wait_ms : 1)) {
+         do {
+            if (batch.plots.size() > 0)
+               applyReplBatch(batch.plots);
+            _unsynced.emplace_back(_plotdb.journalMark(), batch.receipt);
+         } while (_apply_q.pop(batch));
+      }
+      releaseAcks();
+
       // See if it's time to replicate and, if so, go through the database, identifying new plots
       // that have not been replicated yet and adding them to the queue for replication
       if (getAdjustedTime() - _last_repl > secs_between_repl) {
 
          queueNewPlots();
          _last_repl = getAdjustedTime();
+
+         if (_verbosity >= 2) {
+            PipelineDepths depths = getPipelineDepths();
+            std::cout << "Pipeline queues (depth/max/capacity): decode " << depths.decode.depth <<
+                  "/" << depths.decode.high_water << "/" << depths.decode.capacity << ", apply " <<
+                  depths.apply.depth << "/" << depths.apply.high_water << "/" <<
+                  depths.apply.capacity << ", send " << depths.send.depth << "/" <<
+                  depths.send.high_water << "/" << depths.send.capacity << "\n";
+         }
       }
-      
-      // Check the queue for updates and pop them until the queue is empty. The pop command only returns
-      // incoming replication information--outgoing replication in the queue gets turned into a TCPConn
-      // object and automatically removed from the queue by pop
-      std::string sid;
-      std::vector<uint8_t> data;
-      while (_queue.pop(sid, data)) {
 
-         // Incoming replication--add it to this server's local database
-         addReplDronePlots(data);         
-      }       
+      //sort through database, check for skew and duplicates here, unless nothing changed.
+      // Changes made by the pass itself move the generation on again, so the next pass
+      // checks once more and then settles
+      uint64_t gen = _plotdb.generation();
+      idle = (gen == _maint_gen);
+      if (!idle) {
+         int64_t start = steadyMicros();
+         _plotdb.sortByTime();
+         int64_t sorted = steadyMicros();
+
+         checkSkew();
+         correctSkew();
+         int64_t skewed = steadyMicros();
+
+         deduplicate();
+         _maint_gen = gen;
+
+         _sort_time->observe(sorted - start);
+         _skew_time->observe(skewed - sorted);
+         _dedup_time->observe(steadyMicros() - skewed);
+         _db_plots->set(_plotdb.size());
+         _db_generation->set(gen);
+      }
 
-      //sort through database, check for skew and duplicates here
-      _plotdb.sortByTime();
+      // Keep the journal's replay tail (and so restart time) bounded
+      if (_plotdb.checkpointDue() && !_plotdb.checkpoint())
+         std::cerr << "Database checkpoint failed--the journal keeps growing until one succeeds\n";
+   }
+}
 
-      checkSkew();
-      correctSkew();
-      deduplicate();
+/**********************************************************************************************
+ * releaseAcks - passes the network stage the receipts of applied batches the journal has now
+ *               synced, oldest first, so a sender only hears a batch is stored once it would
+ *               survive a crash. Database stage only
+ **********************************************************************************************/
 
-      
+void ReplServer::releaseAcks() {
+   if ((_unsynced.size() == 0) || !_plotdb.journalSynced(_unsynced.front().first))
+      return;
 
-      usleep(1000);
-   }   
+   do {
+      // Full means the network stage is behind--make sure it is awake before waiting on it
+      if (!_ack_q.tryPush(_unsynced.front().second)) {
+         _queue.wake();
+         if (!_ack_q.push(_unsynced.front().second))
+            return;
+      }
+      _unsynced.pop_front();
+   } while ((_unsynced.size() > 0) && _plotdb.journalSynced(_unsynced.front().first));
+
+   _queue.wake();
+}
+
+/**********************************************************************************************
+ * getPipelineDepths - current and peak backlog of each pipeline queue. Safe from any thread
+ **********************************************************************************************/
+
+ReplServer::PipelineDepths ReplServer::getPipelineDepths() {
+   PipelineDepths depths;
+
+   depths.decode = { _decode_q.depth(), _decode_q.highWater(), _decode_q.capacity() };
+   depths.apply = { _apply_q.depth(), _apply_q.highWater(), _apply_q.capacity() };
+   depths.send = { _send_q.depth(), _send_q.highWater(), _send_q.capacity() };
+   return depths;
+}
+
+/**********************************************************************************************
+ * drainIngest - moves the plots waiting in the ingest ring into the database, flagged new so
+ *               the next queueNewPlots sends them out. Each chunk taken off the ring goes in
+ *               under a single database lock. Only the database stage should call this
+ *               while the antenna is running (the ring allows one consumer)
+ *
+ *    Returns: number of plots added
+ **********************************************************************************************/
+
+size_t ReplServer::drainIngest() {
+   if (_ingest == NULL)
+      return 0;
+
+   if (_ingest_plots.size() < _ingest->capacity())
+      _ingest_plots.resize(_ingest->capacity());
+
+   size_t total = 0, count;
+   while ((count = _ingest->pop(_ingest_plots.data(), _ingest_plots.size())) > 0) {
+      _plotdb.addPlots(_ingest_plots.data(), count, DBFLAG_NEW);
+      total += count;
+   }
+
+   if (total > 0)
+      _plots_ingested->add(total);
+   return total;
 }
 
 /**********************************************************************************************
  * queueNewPlots - looks at the database and grabs the new plots, marshalling them and
- *                 sending them to the queue manager
+ *                 handing the batch to the network stage to send
  *
- *    Returns: number of new plots sent to the QueueMgr
+ *    Returns: number of new plots queued to send
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
 unsigned int ReplServer::queueNewPlots() {
-   std::vector<uint8_t> marshall_data;
-   unsigned int count = 0;
+   std::vector<WirePlot> plots;
 
    if (_verbosity >= 3)
       std::cout << "Replicating plots.\n";
 
-   // Loop through the drone plots, looking for new ones
-   std::list<DronePlot>::iterator dpit = _plotdb.begin();
-   for ( ; dpit != _plotdb.end(); dpit++) {
-
-      // If this is a new one, marshall it and clear the flag
-      if (dpit->isFlagSet(DBFLAG_NEW)) {
-         
-         
-         dpit->serialize(marshall_data);
-         
-         dpit->clrFlags(DBFLAG_NEW);
+   // Collect the new drone plots, clearing their flag
+   _plotdb.takeNewPlots(plots);
 
-         count++;
-      }
-      if (marshall_data.size() % DronePlot::getDataSize() != 0)
-         throw std::runtime_error("Issue with marshalling!");
-
-   }
-  
+   unsigned int count = plots.size();
    if (count == 0) {
       if (_verbosity >= 3)
          std::cout << "No new plots found to replicate.\n";
@@ -166,17 +521,14 @@ unsigned int ReplServer::queueNewPlots() {
       return 0;
    }
  
-   // Add the count onto the front
-   if (_verbosity >= 3)
-      std::cout << "Adding in count: " << count << "\n";
-
-   uint8_t *ctptr_begin = (uint8_t *) &count;
-   marshall_data.insert(marshall_data.begin(), ctptr_begin, ctptr_begin+sizeof(unsigned int));
+   // Encode the batch (count up front, then the records) in one go
+   std::vector<uint8_t> marshall_data;
+   encodePlotBatch(plots.data(), plots.size(), marshall_data);
 
-   // Send to the queue manager
-   if (marshall_data.size() > 0) {
-      _queue.sendToAll(marshall_data);
-   }
+   // Hand it to the network stage, which sends it to every peer
+   SharedPayload payload = std::make_shared<const std::vector<uint8_t>>(std::move(marshall_data));
+   _send_q.push(payload);
+   _queue.wake();
 
    if (_verbosity >= 2) 
       std::cout << "Queued up " << count << " plots to be replicated.\n";
@@ -185,197 +537,182 @@ unsigned int ReplServer::queueNewPlots() {
 }
 
 /**********************************************************************************************
- * addReplDronePlots - Adds drone plots to the database from data that was replicated in. 
- *                     Deconflicts issues between plot points.
+ * applyReplBatch - Adds drone plots that were replicated in (already decoded by the decode
+ *                  stage) to the database under one lock
  * 
- * Params:  data - should start with the number of data points in a 32 bit unsigned integer, 
- *                 then a series of drone plot points
+ * Params:  plots - the plots from one batch
  *
  **********************************************************************************************/
 
-void ReplServer::addReplDronePlots(std::vector<uint8_t> &data) {
-   if (data.size() < 4) {
-      throw std::runtime_error("Not enough data passed into addReplDronePlots");
-   }
-
-   if ((data.size() - 4) % DronePlot::getDataSize() != 0) {
-      throw std::runtime_error("Data passed into addReplDronePlots was not the right multiple of DronePlot size");
-   }
+void ReplServer::applyReplBatch(std::vector<WirePlot> &plots) {
+   _plotdb.addPlots(plots.data(), plots.size());
 
-   // Get the number of plot points
-   unsigned int *numptr = (unsigned int *) data.data();
-   unsigned int count = *numptr;
+   if (_verbosity >= 2)
+      std::cout << "Replicated in " << plots.size() << " plots\n";   
+}
 
-   // Store sub-vectors for efficiency
-   std::vector<uint8_t> plot;
-   auto dptr = data.begin() + sizeof(unsigned int);
 
-   for (unsigned int i=0; i<count; i++) {
-      plot.clear();
-      plot.assign(dptr, dptr + DronePlot::getDataSize());
-      addSingleDronePlot(plot);
-      dptr += DronePlot::getDataSize();      
-   }
-   if (_verbosity >= 2)
-      std::cout << "Replicated in " << count << " plots\n";   
+void ReplServer::shutdown() {
+   _shutdown = true;
+   _queue.wake();
 }
 
 
 /**********************************************************************************************
- * addSingleDronePlot - Takes in binary serialized drone data and adds it to the database. 
+ * checkSkew - looks at the plots added since the last pass and, using the database's match
+ *             index, finds the same observation reported by other nodes. The time difference
+ *             between the two gives the clock offset of one node relative to the other, which
+ *             is chained back to the leader's clock and stored in _skew
  *
+ *             Cost is proportional to the number of new plots, not the size of the database
  **********************************************************************************************/
 
-void ReplServer::addSingleDronePlot(std::vector<uint8_t> &data) {
-   DronePlot tmp_plot;
+void ReplServer::checkSkew(){
+   std::vector<PlotHandle> fresh, matches;
 
-   tmp_plot.deserialize(data);
-   
-   
+   _plotdb.getUnmatched(fresh);
+   if (fresh.size() == 0)
+      return;
 
-      _plotdb.addPlot(tmp_plot.drone_id, tmp_plot.node_id, tmp_plot.timestamp, tmp_plot.latitude,
-                                                         tmp_plot.longitude);
-   
+   size_t known = _skew.size();
+   for (auto pptr = fresh.begin(); pptr != fresh.end(); pptr++) {
+      _plotdb.findMatches(*pptr, matches);
+
+      for (auto mptr = matches.begin(); mptr != matches.end(); mptr++) {
+         PlotRef plot = _plotdb.getPlot(*pptr), match = _plotdb.getPlot(*mptr);
+         if (plot.node_id == match.node_id)
+            continue;
+
+         // Stored timestamps are always on the reporting node's own clock
+         SkewLink link = {plot.node_id, plot.timestamp, match.node_id, match.timestamp};
+
+         // Only one link per node pair needs to wait--any of them gives the same offset
+         if (!resolveSkewLink(link))
+            _skew_links.emplace(std::minmax(link.node_a, link.node_b), link);
+      }
+   }
+
+   // Newly learned offsets may settle links that were waiting on them, possibly in a chain
+   while ((_skew.size() != known) && (_skew_links.size() > 0)) {
+      known = _skew.size();
+
+      auto lptr = _skew_links.begin();
+      while (lptr != _skew_links.end()) {
+         if (resolveSkewLink(lptr->second))
+            lptr = _skew_links.erase(lptr);
+         else
+            lptr++;
+      }
+   }
 }
 
+/**********************************************************************************************
+ * getSkew - gets the offset to add to a node's timestamps to put them on the leader's clock
+ *
+ *    Returns: true if the offset is known (always for the leader), false otherwise
+ **********************************************************************************************/
 
-void ReplServer::shutdown() {
-   _shutdown = true;
+bool ReplServer::getSkew(unsigned int node_id, time_t &skew) {
+   if (node_id == _leader_id) {
+      skew = 0;
+      return true;
+   }
+
+   auto sptr = _skew.find(node_id);
+   if (sptr == _skew.end())
+      return false;
+
+   skew = sptr->second;
+   return true;
 }
 
+/**********************************************************************************************
+ * resolveSkewLink - if one side of the link has a known offset, derives the offset of the
+ *                   other side from it
+ *
+ *    Returns: true if both offsets are now known (link no longer needed), false otherwise
+ **********************************************************************************************/
 
-//check for time skew and map skew to node_id
-//return true if duplicate, false otherwise
-void ReplServer::checkSkew(){
-     
-   auto leader = _queue.getLeader();
-   auto leader_id = leader.front();
+bool ReplServer::resolveSkewLink(const SkewLink &link) {
+   time_t skew_a, skew_b;
+   bool known_a = getSkew(link.node_a, skew_a);
+   bool known_b = getSkew(link.node_b, skew_b);
 
-      for(auto i = _plotdb.begin(); i != _plotdb.end(); i++)
-      {
-         if(leader.front() == ("ds" + std::to_string(i->node_id)))
-         {
-           i->setFlags(DBFLAG_LEADER);
-         }
+   if (known_a && !known_b)
+      _skew.emplace(link.node_b, (skew_a + link.time_a) - link.time_b);
+   else if (known_b && !known_a)
+      _skew.emplace(link.node_a, (skew_b + link.time_b) - link.time_a);
 
-         for(auto j = _plotdb.begin(); j != _plotdb.end(); j++)
-         {
-            if(leader.front() == ("ds" + std::to_string(j->node_id)))
-            {
-               j->setFlags(DBFLAG_LEADER);
-            }
-            /*else if(!i->isFlagSet(DBFLAG_LEADER))
-            {
-               for(int it = 0; it != leader.size(); it++)
-               {
-                  if(leader.at(it) == ("ds" + std::to_string(j->node_id)))
-                  {
-                     j->setFlags(DBFLAG_LEADER); //priorty != leader
-                     it = leader.size() + 1;
-                  }
-                  else if(leader.at(it) ==("ds" + std::to_string(i->node_id)))
-                  {
-                     i->setFlags(DBFLAG_LEADER); //priority != leader
-                     it = leader.size() + 1;
-
-                  }
-               }
-            }*/
-
-            if((i != j) && (i->latitude == j->latitude) && (i->longitude == j->longitude) && (i->drone_id == j->drone_id))
-            {
-               if(i->isFlagSet(DBFLAG_LEADER) && !j->isFlagSet(DBFLAG_SYNCD))
-               {
-                  _skew.emplace(j->node_id,(i->timestamp - j->timestamp));
-                  j->setFlags(DBFLAG_SKEWED);
-               }
-               else if(j->isFlagSet(DBFLAG_LEADER) && !i->isFlagSet(DBFLAG_SYNCD))
-               {
-                  _skew.emplace(i->node_id,(j->timestamp - i->timestamp));
-                  i->setFlags(DBFLAG_SKEWED);
-               }
-               else if(_skew.find(i->node_id) != _skew.end() && !j->isFlagSet(DBFLAG_SYNCD)) 
-               {
-                  _skew.emplace(j->node_id,((_skew[i->node_id] + i->timestamp) - j->timestamp));
-                  j->setFlags(DBFLAG_SKEWED);
-               }
-               else if(_skew.find(j->node_id) != _skew.end() && !i->isFlagSet(DBFLAG_SYNCD))
-               {
-                  _skew.emplace(i->node_id,((_skew[j->node_id] + j->timestamp) - i->timestamp));
-                  i->setFlags(DBFLAG_SKEWED);
-               }
-            }
-
-            j->clrFlags(DBFLAG_LEADER);
-            i->clrFlags(DBFLAG_LEADER);
-         }
-         i->clrFlags(DBFLAG_LEADER);
-      }
+   return known_a || known_b;
 }
 
-//iterate through database, if node is skewed, fix time
-void ReplServer::correctSkew(){
-   //if node is skewed, fix time
+/**********************************************************************************************
+ * correctSkew - puts plots from nodes with a known clock offset onto the leader's clock by
+ *               handing the offsets to the database, which applies them as plots are read.
+ *               No plot is rewritten, so this costs one table lookup per known node, and plots
+ *               arriving later from a corrected node need nothing done to them
+ **********************************************************************************************/
 
-   for(auto i = _plotdb.begin(); i != _plotdb.end(); i++)
+void ReplServer::correctSkew(){
+   for (auto sptr = _skew.begin(); sptr != _skew.end(); sptr++)
    {
-      if(!i->isFlagSet(DBFLAG_SYNCD) && (_skew.find(i->node_id) != _skew.end()))
-      {
-         
-         i->timestamp += _skew[i->node_id];
-         i->setFlags(DBFLAG_SYNCD);
-         i->clrFlags(DBFLAG_SKEWED);
-            
-      }
+      if (_plotdb.getNodeOffset(sptr->first) != sptr->second)
+         _plotdb.setNodeOffset(sptr->first, sptr->second);
    }
-
 }
 
-//delete duplicate points
-//call after correctSkew()
+/**********************************************************************************************
+ * deduplicate - looks at plots added or re-timed since the last pass and finds others of the
+ *               same drone at the same time. Of each set, the plot from the highest priority
+ *               node is kept and the rest are erased. Call after correctSkew()
+ **********************************************************************************************/
+
 void ReplServer::deduplicate(){
+   std::vector<PlotHandle> changed, dupes;
 
-   auto priorityOrder = _queue.getLeader();
+   _plotdb.getUndeduped(changed);
 
-   for(auto i = _plotdb.begin(); i != _plotdb.end(); i++)
+   for (auto cptr = changed.begin(); cptr != changed.end(); cptr++)
    {
+      PlotRef plot = _plotdb.getPlot(*cptr);
+      if (plot.isFlagSet(DBFLAG_DUPE))
+         continue;
+
+      // Flagging a plot can move it (copy-on-write for snapshots), so keep what is needed
+      unsigned int plot_rank = getNodeRank(plot.node_id);
 
-      for(auto j = _plotdb.begin(); j != _plotdb.end(); j++)
+      _plotdb.findDuplicates(*cptr, dupes);
+      for (auto dptr = dupes.begin(); dptr != dupes.end(); dptr++)
       {
-         if(i != j){
-         if(i->timestamp == j->timestamp) //if point is duplicate, delete lower priority
-         {
-            for(auto it = priorityOrder.begin(); it != priorityOrder.end(); it++)
-            {
-               if(*it == ("ds" + std::to_string(i->node_id)))
-               {
-                  _toErase.push_back(j);
-                  
-               }
-               else if(*it == ("ds" + std::to_string(j->node_id)))
-               {
-                 _toErase.push_back(i);
-                  
-               }
-            }
+         PlotRef dupe = _plotdb.getPlot(*dptr);
+         if (dupe.isFlagSet(DBFLAG_DUPE))
+            continue;
+
+         // Lower rank wins. On a tie the plot already in the database stays
+         if (plot_rank < getNodeRank(dupe.node_id)) {
+            _plotdb.setFlags(*dptr, DBFLAG_DUPE);
+            _toErase.push_back(*dptr);
+         } else {
+            _plotdb.setFlags(*cptr, DBFLAG_DUPE);
+            _toErase.push_back(*cptr);
+            break;
          }
-         }
-         
       }
-      
    }
 
    erasePlots();
    
 }
 
+// Erases the plots deduplicate marked. Each is marked with DBFLAG_DUPE when added to _toErase
+// so none can be erased twice
 void ReplServer::erasePlots(){
 
    for(auto i = _toErase.begin(); i != _toErase.end(); i++)
    {
-      _plotdb.erase(*i);
+      _plotdb.erasePlot(*i);
    }
 
    _toErase.clear();
 
-}
\ No newline at end of file
+}
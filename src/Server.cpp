@@ -1,10 +1,10 @@
-#include "Server.h"
-
-
-Server::Server() {
-
-}
-
-Server::~Server() {
-}
-
+#include "Server.h"
+
+
+Server::Server() {
+
+}
+
+Server::~Server() {
+}
+
@@ -1,756 +1,860 @@
-#include <stdexcept>
-#include <strings.h>
-#include <unistd.h>
-#include <cstring>
-#include <algorithm>
-#include <iostream>
-#include <sstream>
-#include "TCPConn.h"
-#include "strfuncts.h"
-#include <crypto++/secblock.h>
-#include <crypto++/osrng.h>
-#include <crypto++/filters.h>
-#include <crypto++/rijndael.h>
-#include <crypto++/gcm.h>
-#include <crypto++/aes.h>
-
-using namespace CryptoPP;
-
-// Common defines for this TCPConn
-const unsigned int iv_size = AES::BLOCKSIZE;
-const unsigned int key_size = AES::DEFAULT_KEYLENGTH;
-const unsigned int auth_size = 16;
-
-/**********************************************************************************************
- * TCPConn (constructor) - creates the connector and initializes - creates the command strings
- *                         to wrap around network commands
- *
- *    Params: key - reference to the pre-loaded AES key
- *            verbosity - stdout verbosity - 3 = max
- *
- **********************************************************************************************/
-
-TCPConn::TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int verbosity):
-                                    _data_ready(false),
-                                    _aes_key(key),
-                                    _verbosity(verbosity),
-                                    _server_log(server_log)
-{
-   // prep some tools to search for command sequences in data
-   uint8_t slash = (uint8_t) '/';
-   c_rep.push_back((uint8_t) '<');
-   c_rep.push_back((uint8_t) 'R');
-   c_rep.push_back((uint8_t) 'E');
-   c_rep.push_back((uint8_t) 'P');
-   c_rep.push_back((uint8_t) '>');
-
-   c_endrep = c_rep;
-   c_endrep.insert(c_endrep.begin()+1, 1, slash);
-
-   c_ack.push_back((uint8_t) '<');
-   c_ack.push_back((uint8_t) 'A');
-   c_ack.push_back((uint8_t) 'C');
-   c_ack.push_back((uint8_t) 'K');
-   c_ack.push_back((uint8_t) '>');
-
-   c_auth.push_back((uint8_t) '<');
-   c_auth.push_back((uint8_t) 'A');
-   c_auth.push_back((uint8_t) 'U');
-   c_auth.push_back((uint8_t) 'T');
-   c_auth.push_back((uint8_t) '>');
-
-   c_endauth = c_auth;
-   c_endauth.insert(c_endauth.begin()+1, 1, slash);
-
-   c_sid.push_back((uint8_t) '<');
-   c_sid.push_back((uint8_t) 'S');
-   c_sid.push_back((uint8_t) 'I');
-   c_sid.push_back((uint8_t) 'D');
-   c_sid.push_back((uint8_t) '>');
-
-   c_endsid = c_sid;
-   c_endsid.insert(c_endsid.begin()+1, 1, slash);
-}
-
-
-TCPConn::~TCPConn() {
-
-}
-
-/**********************************************************************************************
- * accept - simply calls the acceptFD FileDesc method to accept a connection on a server socket.
- *
- *    Params: server - an open/bound server file descriptor with an available connection
- *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
- **********************************************************************************************/
-
-bool TCPConn::accept(SocketFD &server) {
-   // Accept the connection
-   bool results = _connfd.acceptFD(server);
-
-
-   // Set the state as waiting for the authorization packet
-   _status = s_connected;
-   _connected = true;
-   return results;
-}
-
-/**********************************************************************************************
- * sendData - sends the data in the parameter to the socket
- *
- *    Params:  msg - the string to be sent
- *             size - if we know how much data we should expect to send, this should be populated
- *
- *    Throws: runtime_error for unrecoverable errors
- **********************************************************************************************/
-
-bool TCPConn::sendData(std::vector<uint8_t> &buf) {
-   
-   _connfd.writeBytes<uint8_t>(buf);
-   
-   return true;
-}
-
-/**********************************************************************************************
- * sendEncryptedData - sends the data in the parameter to the socket after block encrypting it
- *
- *    Params:  msg - the string to be sent
- *             size - if we know how much data we should expect to send, this should be populated
- *
- *    Throws: runtime_error for unrecoverable errors
- **********************************************************************************************/
-
-bool TCPConn::sendEncryptedData(std::vector<uint8_t> &buf) {
-
-   // Encrypt
-   encryptData(buf);
-
-   // And send!
-   return sendData(buf);
-}
-
-/**********************************************************************************************
- * encryptData - block encrypts data and places the results in the buffer in <ID><Data> format
- *
- *    Params:  buf - where to place the <IV><Data> stream
- *
- *    Throws: runtime_error for unrecoverable errors
- **********************************************************************************************/
-
-void TCPConn::encryptData(std::vector<uint8_t> &buf) {
-   // For the initialization vector
-   SecByteBlock init_vector(iv_size);
-   AutoSeededRandomPool rnd;
-
-   // Generate our random init vector
-   rnd.GenerateBlock(init_vector, init_vector.size());
-
-   // Encrypt the data
-   CFB_Mode<AES>::Encryption encryptor;
-   encryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
-
-   std::string cipher;
-   ArraySource as(buf.data(), buf.size(), true,
-            new StreamTransformationFilter(encryptor, new StringSink(cipher)));
-
-   // Now add the IV to the stream we will be sending out
-   std::vector<uint8_t> enc_data(init_vector.begin(), init_vector.end());
-   enc_data.insert(enc_data.end(), cipher.begin(), cipher.end());
-   buf = enc_data;
-}
-
-/**********************************************************************************************
- * handleConnection - performs a check of the connection, looking for data on the socket and
- *                    handling it based on the _status, or stage, of the connection
- *
- *    Throws: runtime_error for unrecoverable issues
- **********************************************************************************************/
-
-void TCPConn::handleConnection() {
-
-   try {
-      switch (_status) {
-
-         // Client: Just connected, send our SID
-         case s_connecting:
-            sendSID();
-            break;
-
-         // Server: Wait for the SID from a newly-connected client, then send our SID
-         case s_connected:
-            waitForSID();
-            break;
-
-         //encrypt sid and reply with encrypted sid and our unencrypted sid
-         //wait for reply of our encrypted sid, now we are authenticated
-
-         //Server: Wait for return of our encrypted sid
-         case s_authenticate:
-            waitForAuthentication();
-            break;
-         
-         //Client: verify return of encrypted SID, reply with encryption of server SID
-         case s_handshake:
-            initiateHandshake();
-            break;
-   
-         // Client: connecting user - replicate data
-         case s_datatx:
-            transmitData();
-            break;
-
-         // Server: Receive data from the client
-         case s_datarx:
-            waitForData();
-            break;
-   
-         // Client: Wait for acknowledgement that data sent was received before disconnecting
-         case s_waitack:
-            awaitAck();
-            break;
-         
-         // Server: Data received and conn disconnected, but waiting for the data to be retrieved
-         case s_hasdata:
-            break;
-
-         default:
-            throw std::runtime_error("Invalid connection status!");
-            break;
-      }
-   } catch (socket_error &e) {
-      std::cout << "Socket error, disconnecting.\n";
-      disconnect();
-      return;
-   }
-
-}
-
-/**********************************************************************************************
- * sendSID()  - Client: after a connection, client sends its Server ID to the server
- *
- *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
- **********************************************************************************************/
-
-void TCPConn::sendSID() {
-   std::vector<uint8_t> buf(_svr_id.begin(), _svr_id.end());
-   wrapCmd(buf, c_sid, c_endsid);
-   sendData(buf);
-
-   _status = s_handshake; 
-}
-
-/**********************************************************************************************
- * waitForSID()  - receives the SID and sends our SID
- *
- *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
- **********************************************************************************************/
-
-void TCPConn::waitForSID() {
-
-   // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf, cmd;
-
-      if (!getData(buf))
-         return;
-
-      cmd = getCmdData(buf, c_sid, c_endsid);
-      std::string command(cmd.begin(),cmd.end());
-      if (cmd.size() < 1) {
-         std::stringstream msg;
-         msg << "IN: waitForSID CMD: " << command;
-         //msg << "SID string from connecting client invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
-
-      std::string node(cmd.begin(), cmd.end());
-      setNodeID(node.c_str());
-
-      std::string server(_svr_id.begin(), _svr_id.end());
-      //check if client sid matches server sid for reflection attack
-      if(node == server)
-      {
-         std::stringstream msg;
-         msg << "IN: waitForSID. Passed SID matches Server SID. Reflection Attack Thwarted.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-      }
-
-      //encrypt and return SID
-      encryptData(cmd);
-      wrapCmd(cmd,c_auth,c_endauth);
-      sendData(cmd);
-
-      // Send our unencrypted Node ID
-      buf.assign(_svr_id.begin(), _svr_id.end());
-      wrapCmd(buf, c_sid, c_endsid);
-      //cmd.insert(cmd.end(),buf.begin(),buf.end());
-      sendData(buf);
-
-      _status = s_authenticate;
-   }
-}
-
-
-/**********************************************************************************************
- * transmitData()  - receives the SID from the server and transmits data
- *
- *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
- **********************************************************************************************/
-
-void TCPConn::transmitData() {
-
-   // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf, cmd;
-
-      if (!getData(buf))
-         return;
-
-      cmd = getCmdData(buf, c_sid, c_endsid);
-      if (cmd.size() < 1) {
-         std::stringstream msg;
-         msg << "SID string from connected server invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
-
-      std::string node(cmd.begin(), cmd.end());
-      setNodeID(node.c_str());
-
-      // Send the replication data
-      sendData(_outputbuf);
-
-      if (_verbosity >= 3)
-         std::cout << "Successfully authenticated connection with " << getNodeID() <<
-                      " and sending replication data.\n";
-
-      // Wait for their response
-      _status = s_waitack;
-   }
-}
-
-
-/**********************************************************************************************
- * waitForData - receiving server, authentication complete, wait for replication datai
-               Also sends a plaintext random auth string of our own
- *
- *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
- **********************************************************************************************/
-
-void TCPConn::waitForData() {
-
-   // If data on the socket, should be replication data
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf,cmd;
-
-      if (!getData(buf))
-         return;
-
-      cmd = getCmdData(buf, c_rep, c_endrep);
-      if (cmd.size() < 1) {
-         std::stringstream msg;
-         msg << "Replication data possibly corrupted from" << getNodeID() << "\n";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
-
-      // Got the data, save it
-      _inputbuf = cmd;
-      _data_ready = true;
-
-      // Send the acknowledgement and disconnect
-      sendData(c_ack);
-
-      if (_verbosity >= 2)
-         std::cout << "Successfully received replication data from " << getNodeID() << "\n";
-
-
-      disconnect();
-      _status = s_hasdata;
-   }
-}
-
-
-/**********************************************************************************************
- * awaitAwk - waits for the awk that data was received and disconnects
- *
- *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
- **********************************************************************************************/
-
-void TCPConn::awaitAck() {
-
-   // Should have the awk message
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
-
-      if (!getData(buf))
-         return;
-
-      if (findCmd(buf, c_ack) == buf.end())
-      {
-         std::stringstream msg;
-         msg << "Awk expected from data send, received something else. Node:" << getNodeID() << "\n";
-         _server_log.writeLog(msg.str().c_str());
-      }
-  
-      if (_verbosity >= 3)
-         std::cout << "Data ack received from " << getNodeID() << ". Disconnecting.\n";
-
- 
-      disconnect();
-   }
-}
-
-/**********************************************************************************************
- * getData - Reads in data from the socket and checks to see if there's an end command to the
- *           message to confirm we got it all
- *
- *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
- *
- *    Returns: true if the data is ready to be read, false if they lost connection
- *
- *    Throws: runtime_error for unrecoverable issues
- **********************************************************************************************/
-
-bool TCPConn::getData(std::vector<uint8_t> &buf) {
-
-   std::vector<uint8_t> readbuf;
-   size_t count = 0;
-
-   buf.clear();
-
-   while (_connfd.hasData()) {
-      // read the data on the socket up to 1024
-      count += _connfd.readBytes<uint8_t>(readbuf, 1024);
-
-      // check if we lost connection
-      if (readbuf.size() == 0) {
-         std::stringstream msg;
-         std::string ip_addr;
-         msg << "Connection from server " << _node_id << " lost (IP: " << 
-                                                         getIPAddrStr(ip_addr) << ")"; 
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return false;
-      }
-
-      buf.insert(buf.end(), readbuf.begin(), readbuf.end());
-
-      // concat the data onto anything we've read before
-//      _inputbuf.insert(_inputbuf.end(), readbuf.begin(), readbuf.end());
-   }
-   return true;
-}
-
-/**********************************************************************************************
- * decryptData - Takes in an encrypted buffer in the form IV/Data and decrypts it, replacing
- *               buf with the decrypted info (destroys IV string>
- *
- *    Params: buf - the encrypted string and holds the decrypted data (minus IV)
- *
- **********************************************************************************************/
-void TCPConn::decryptData(std::vector<uint8_t> &buf) {
-   // For the initialization vector
-   SecByteBlock init_vector(iv_size);
-
-   // Copy the IV from the incoming stream of data
-   init_vector.Assign(buf.data(), iv_size);
-   buf.erase(buf.begin(), buf.begin() + iv_size);
-
-   // Decrypt the data
-   CFB_Mode<AES>::Decryption decryptor;
-   decryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
-
-   std::string recovered;
-   ArraySource as(buf.data(), buf.size(), true,
-            new StreamTransformationFilter(decryptor, new StringSink(recovered)));
-
-   buf.assign(recovered.begin(), recovered.end());
-
-}
-
-
-/**********************************************************************************************
- * getEncryptedData - Reads in data from the socket and decrypts it, passing the decrypted
- *                    data back in buf
- *
- *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
- *
- *    Returns: true if the data is ready to be read, false otherwise
- *
- *    Throws: runtime_error for unrecoverable issues
- **********************************************************************************************/
-
-bool TCPConn::getEncryptedData(std::vector<uint8_t> &buf) {
-   // Get the data from the socket
-   if (!getData(buf))
-      return false;
-
-   decryptData(buf);
-
-   return true; 
-}
-
-/**********************************************************************************************
- * findCmd - returns an iterator to the location of a string where a command starts
- * hasCmd - returns true if command was found, false otherwise
- *
- *    Params: buf = the data buffer to look for the command within
- *            cmd - the command string to search for in the data
- *
- *    Returns: iterator - points to cmd position if found, end() if not found
- *
- **********************************************************************************************/
-
-std::vector<uint8_t>::iterator TCPConn::findCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd) {
-   return std::search(buf.begin(), buf.end(), cmd.begin(), cmd.end());
-}
-
-bool TCPConn::hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd) {
-   return !(findCmd(buf, cmd) == buf.end());
-}
-
-/**********************************************************************************************
- * getCmdData - looks for a startcmd and endcmd and returns the data between the two 
- *
- *    Params: buf = the string to search for the tags
- *            startcmd - the command at the beginning of the data sought
- *            endcmd - the command at the end of the data sought
- *
- *    Returns: cmd if found, empty vector otherwise
- *
- **********************************************************************************************/
-
-std::vector<uint8_t> TCPConn::getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd, 
-                                                    std::vector<uint8_t> &endcmd) {
-   std::vector<uint8_t> temp = buf;
-   auto start = findCmd(temp, startcmd);
-   auto end = findCmd(temp, endcmd);
-   std::vector<uint8_t> retval;
-
-   if ((start == temp.end()) || (end == temp.end()) || (start == end))
-      return retval;
-
-   //buf.assign(start + startcmd.size(), end);
-   retval.assign(start + startcmd.size(),end);
-   return retval;
-}
-
-/**********************************************************************************************
- * wrapCmd - wraps the command brackets around the passed-in data
- *
- *    Params: buf = the string to wrap around
- *            startcmd - the command at the beginning of the data
- *            endcmd - the command at the end of the data
- *
- **********************************************************************************************/
-
-void TCPConn::wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd) {
-   std::vector<uint8_t> temp = startcmd;
-   temp.insert(temp.end(), buf.begin(), buf.end());
-   temp.insert(temp.end(), endcmd.begin(), endcmd.end());
-
-   buf = temp;
-}
-
-
-/**********************************************************************************************
- * getReplData - Returns the data received on the socket and marks the socket as done
- *
- *    Params: buf = the data received
- *
- *
- *    Throws: runtime_error for unrecoverable issues
- **********************************************************************************************/
-
-void TCPConn::getInputData(std::vector<uint8_t> &buf) {
-
-   // Returns the replication data off this connection, then prepares it to be removed
-   buf = _inputbuf;
-
-   _data_ready = false;
-   _status = s_none;
-}
-
-/**********************************************************************************************
- * connect - Opens the socket FD, attempting to connect to the remote server
- *
- *    Params:  ip_addr - ip address string to connect to
- *             port - port in host format to connect to
- *
- *    Throws: socket_error exception if failed. socket_error is a child class of runtime_error
- **********************************************************************************************/
-
-void TCPConn::connect(const char *ip_addr, unsigned short port) {
-
-   // Set the status to connecting
-   _status = s_connecting;
-
-   // Try to connect
-   if (!_connfd.connectTo(ip_addr, port))
-      throw socket_error("TCP Connection failed!");
-
-   _connected = true;
-}
-
-// Same as above, but ip_addr and port are in network (big endian) format
-void TCPConn::connect(unsigned long ip_addr, unsigned short port) {
-   // Set the status to connecting
-   _status = s_connecting;
-
-   if (!_connfd.connectTo(ip_addr, port))
-      throw socket_error("TCP Connection failed!");
-
-   _connected = true;
-}
-
-/**********************************************************************************************
- * assignOutgoingData - sets up the connection so that, at the next handleConnection, the data
- *                      is sent to the target server
- *
- *    Params:  data - the data stream to send to the server
- *
- **********************************************************************************************/
-
-void TCPConn::assignOutgoingData(std::vector<uint8_t> &data) {
-
-   _outputbuf.clear();
-   _outputbuf = c_rep;
-   _outputbuf.insert(_outputbuf.end(), data.begin(), data.end());
-   _outputbuf.insert(_outputbuf.end(), c_endrep.begin(), c_endrep.end());
-}
- 
-
-/**********************************************************************************************
- * disconnect - cleans up the socket as required and closes the FD
- *
- *    Throws: runtime_error for unrecoverable issues
- **********************************************************************************************/
-void TCPConn::disconnect() {
-   _connfd.closeFD();
-   _connected = false;
-}
-
-
-/**********************************************************************************************
- * isConnected - performs a simple check on the socket to see if it is still open 
- *
- *    Throws: runtime_error for unrecoverable issues
- **********************************************************************************************/
-bool TCPConn::isConnected() {
-   return _connected;
-   // return _connfd.isOpen(); // This does not work very well
-}
-
-/**********************************************************************************************
- * getIPAddrStr - gets a string format of the IP address and loads it in buf
- *
- **********************************************************************************************/
-const char *TCPConn::getIPAddrStr(std::string &buf) {
-   _connfd.getIPAddrStr(buf);
-   return buf.c_str();
-}
-
-void TCPConn::waitForAuthentication(){
-   //verify encryption of OUR SID
-
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf, cmd;
-
-      if (!getData(buf))
-         return;
-
-     //verify encryption of our sid
-      cmd = getCmdData(buf, c_auth, c_endauth);
-      std::string command(cmd.begin(),cmd.end());
-      if (cmd.size() < 1) {
-         std::stringstream msg;
-         msg << "IN: waitForAuthentication. CMD: " << command << " AUTH string from connecting client invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
-      decryptData(cmd);
-      std::string decryptedSID(cmd.begin(),cmd.end());
-      if(decryptedSID != _svr_id)
-      {
-         std::stringstream msg;
-         msg << "IN: waitForAuthentication. SID: " << decryptedSID << " Encrypted SID does not match. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-      }
-
-      _status = s_datarx; 
-   }
-   
-}
-
-void TCPConn::initiateHandshake(){
-   //recieve and verify our sid
-   // send encrypted SID
-
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf, cmd;
-
-      if (!getData(buf))
-         return;
-
-      //verify encryption of our sid
-      cmd = getCmdData(buf, c_auth, c_endauth);
-      std::string command(cmd.begin(),cmd.end());
-      if (cmd.size() < 1) {
-         std::stringstream msg;
-         msg << "IN: initiateHandshake. CMD: " << command << " AUTH string from connecting client invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
-      decryptData(cmd);
-      std::string decryptedSID(cmd.begin(),cmd.end());
-      if(decryptedSID != _svr_id)
-      {  
-         std::stringstream msg;
-         msg << "IN: initiateHandshake. SID: " << decryptedSID << " Encrypted SID does not match. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-      }
-
-      //get their sid, encrypt and reply
-      cmd = getCmdData(buf, c_sid, c_endsid);
-      command = std::string(cmd.begin(),cmd.end());
-      if (cmd.size() < 1) {
-         std::stringstream msg;
-         msg << "IN: initiateHandshake. CMD: " << command << " SID string from server invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
-
-      std::string node(cmd.begin(), cmd.end());
-
-      std::string server(_svr_id.begin(), _svr_id.end());
-      //check if client sid matches server sid for reflection attack
-      if(node == server)
-      {
-         std::stringstream msg;
-         msg << "IN: initiateHandshake. Passed SID matches Server SID. Reflection Attack Thwarted.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-      }
-
-      //encrypt and return SID
-      encryptData(cmd);
-      wrapCmd(cmd,c_auth,c_endauth);
-      sendData(cmd);
-
-      _status = s_datatx;  
-   }
-}
-   
\ No newline at end of file
+#include <stdexcept>
+#include <strings.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include "TCPConn.h"
+#include "strfuncts.h"
+#include "Metrics.h"
+#include <crypto++/secblock.h>
+#include <crypto++/osrng.h>
+#include <crypto++/filters.h>
+#include <crypto++/rijndael.h>
+#include <crypto++/gcm.h>
+#include <crypto++/aes.h>
+
+using namespace CryptoPP;
+
+// Common defines for this TCPConn
+const unsigned int iv_size = AES::BLOCKSIZE;
+const unsigned int key_size = AES::DEFAULT_KEYLENGTH;
+const unsigned int auth_size = 16;
+
+// Most buffers handed to one gather write (two per frame)
+const int max_send_iov = 64;
+
+/**********************************************************************************************
+ * TCPConn (constructor) - creates the connector and initializes
+ *
+ *    Params: key - reference to the pre-loaded AES key
+ *            verbosity - stdout verbosity - 3 = max
+ *
+ **********************************************************************************************/
+
+// Source of connection IDs (several servers can share a process, so it is atomic)
+static std::atomic<uint64_t> last_conn_id(0);
+
+TCPConn::TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int verbosity):
+                                    reconnect(0),
+                                    _status_since(0),
+                                    _metrics(NULL),
+                                    _readable(false),
+                                    _conn_id(++last_conn_id),
+                                    _unacked(0),
+                                    _writable(false),
+                                    _watching_write(false),
+                                    _outbound(false),
+                                    _connect_pending(false),
+                                    _auth_verified(false),
+                                    _backoff(reconnect_delay),
+                                    _aes_key(key),
+                                    _ciphers_keyed(false),
+                                    _verbosity(verbosity),
+                                    _server_log(server_log)
+{
+}
+
+
+TCPConn::~TCPConn() {
+
+}
+
+/**********************************************************************************************
+ * accept - simply calls the acceptFD FileDesc method to accept a connection on a server socket.
+ *
+ *    Params: server - an open/bound server file descriptor with an available connection
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+bool TCPConn::accept(SocketFD &server) {
+   // Accept the connection
+   bool results = _connfd.acceptFD(server);
+
+
+   // Set the state as waiting for the authorization packet
+   setStatus(s_connected);
+   _connected = true;
+   return results;
+}
+
+/**********************************************************************************************
+ * sendData - sends the data in the parameter to the socket
+ *
+ *    Params:  msg - the string to be sent
+ *             size - if we know how much data we should expect to send, this should be populated
+ *
+ *    Throws: runtime_error for unrecoverable errors
+ **********************************************************************************************/
+
+bool TCPConn::sendData(std::vector<uint8_t> &buf) {
+   
+   _connfd.writeBytes<uint8_t>(buf);
+   
+   return true;
+}
+
+/**********************************************************************************************
+ * sendEncryptedData - sends the data in the parameter to the socket after block encrypting it
+ *
+ *    Params:  msg - the string to be sent
+ *             size - if we know how much data we should expect to send, this should be populated
+ *
+ *    Throws: runtime_error for unrecoverable errors
+ **********************************************************************************************/
+
+bool TCPConn::sendEncryptedData(std::vector<uint8_t> &buf) {
+
+   // Encrypt
+   encryptData(buf);
+
+   // And send!
+   return sendData(buf);
+}
+
+/**********************************************************************************************
+ * threadRNG - the random pool for IVs. Seeding reads the OS entropy source, so each thread
+ *             does it once rather than on every message
+ **********************************************************************************************/
+
+static AutoSeededRandomPool &threadRNG() {
+   thread_local AutoSeededRandomPool rnd;
+   return rnd;
+}
+
+/**********************************************************************************************
+ * keyCiphers - runs the AES key schedule for both directions. Done once per connection;
+ *              after that each message only resynchronizes with its own IV
+ **********************************************************************************************/
+
+void TCPConn::keyCiphers() {
+   uint8_t zero_iv[iv_size] = {0};
+
+   _encryptor.SetKeyWithIV(_aes_key, _aes_key.size(), zero_iv, iv_size);
+   _decryptor.SetKeyWithIV(_aes_key, _aes_key.size(), zero_iv, iv_size);
+   _ciphers_keyed = true;
+}
+
+/**********************************************************************************************
+ * encryptData - block encrypts data and places the results in the buffer in <IV><Data> format.
+ *               The buffer grows once to make room for the IV and is encrypted where it sits
+ *
+ *    Params:  buf - where to place the <IV><Data> stream
+ *
+ *    Throws: runtime_error for unrecoverable errors
+ **********************************************************************************************/
+
+void TCPConn::encryptData(std::vector<uint8_t> &buf) {
+   if (!_ciphers_keyed)
+      keyCiphers();
+
+   size_t len = buf.size();
+   buf.resize(iv_size + len);
+   if (len > 0)
+      memmove(&buf[iv_size], &buf[0], len);
+
+   // Generate our random init vector at the front
+   threadRNG().GenerateBlock(buf.data(), iv_size);
+
+   // Encrypt the data in place
+   _encryptor.Resynchronize(buf.data(), iv_size);
+   if (len > 0)
+      _encryptor.ProcessData(&buf[iv_size], &buf[iv_size], len);
+}
+
+/**********************************************************************************************
+ * handleConnection - performs a check of the connection, looking for data on the socket and
+ *                    handling it based on the _status, or stage, of the connection
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::handleConnection() {
+
+   try {
+      // An outbound connect still under way has to finish before anything else happens
+      if (_connect_pending && !finishConnect())
+         return;
+
+      // Finish off any output that was waiting on the socket
+      if (_writable)
+         flushOutput();
+
+      switch (_status) {
+
+         // Client: Just connected, send our SID
+         case s_connecting:
+            sendSID();
+            break;
+
+         // Server: Wait for the SID from a newly-connected client, then send our SID
+         case s_connected:
+            waitForSID();
+            break;
+
+         //encrypt sid and reply with encrypted sid and our unencrypted sid
+         //wait for reply of our encrypted sid, now we are authenticated
+
+         //Server: Wait for return of our encrypted sid
+         case s_authenticate:
+            waitForAuthentication();
+            break;
+         
+         //Client: verify return of encrypted SID, reply with encryption of server SID
+         case s_handshake:
+            initiateHandshake();
+            break;
+   
+         // Client: channel is up - collect acknowledgements and send anything queued
+         case s_datatx:
+         case s_waitack:
+            awaitAck();
+            if (_status == s_datatx || _status == s_waitack)
+               transmitData();
+            break;
+
+         // Server: Receive data from the client
+         case s_datarx:
+            waitForData();
+            break;
+
+         default:
+            throw std::runtime_error("Invalid connection status!");
+            break;
+      }
+   } catch (socket_error &e) {
+      std::cout << "Socket error, disconnecting.\n";
+      std::stringstream msg;
+      msg << "Connection with " << getNodeID() << " dropped. Msg: " << e.what();
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+
+}
+
+/**********************************************************************************************
+ * sendSID()  - Client: after a connection, client sends its Server ID to the server
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::sendSID() {
+   sendFrame(frame_sid, std::vector<uint8_t>(_svr_id.begin(), _svr_id.end()));
+
+   setStatus(s_handshake);
+}
+
+/**********************************************************************************************
+ * waitForSID()  - receives the SID and sends our SID
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::waitForSID() {
+
+   // Should be the SID from the connecting client, possibly split over several reads
+   if (!readInput())
+      return;
+
+   std::vector<uint8_t> cmd;
+   if (!nextFrame(frame_sid, cmd))
+      return;
+
+   if (cmd.size() < 1) {
+      std::stringstream msg;
+      msg << "SID string from connecting client invalid format. Cannot authenticate.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+
+   std::string node(cmd.begin(), cmd.end());
+   setNodeID(node.c_str());
+
+   std::string server(_svr_id.begin(), _svr_id.end());
+   //check if client sid matches server sid for reflection attack
+   if(node == server)
+   {
+      std::stringstream msg;
+      msg << "IN: waitForSID. Passed SID matches Server SID. Reflection Attack Thwarted.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+
+   //encrypt and return SID
+   encryptData(cmd);
+   sendFrame(frame_auth, std::move(cmd));
+
+   // Send our unencrypted Node ID
+   sendFrame(frame_sid, std::vector<uint8_t>(_svr_id.begin(), _svr_id.end()));
+
+   setStatus(s_authenticate);
+}
+
+
+/**********************************************************************************************
+ * transmitData()  - client: sends every queued message that has not gone out yet, back to
+ *                   back. They stay queued until acknowledged
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::transmitData() {
+
+   while (_unacked < _outqueue.size()) {
+      sendFrame(frame_rep, _outqueue[_unacked]);
+      _unacked++;
+
+      if (_verbosity >= 3)
+         std::cout << "Sent replication data to " << getNodeID() << ".\n";
+   }
+
+   setStatus((_unacked > 0) ? s_waitack : s_datatx);
+}
+
+
+/**********************************************************************************************
+ * waitForData - receiving server, authentication complete. Queues each complete replication
+ *               message that has arrived. It is acknowledged later, by ackInput, once the
+ *               server has stored it. The connection stays open for the next one
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::waitForData() {
+
+   if (!readInput())
+      return;
+
+   std::vector<uint8_t> cmd;
+   while (nextFrame(frame_rep, cmd)) {
+      if (cmd.size() < 1) {
+         std::stringstream msg;
+         msg << "Replication data possibly corrupted from" << getNodeID() << "\n";
+         _server_log.writeLog(msg.str().c_str());
+         disconnect();
+         return;
+      }
+
+      // Got the data, save it
+      _inqueue.push_back(std::move(cmd));
+
+      if (_verbosity >= 2)
+         std::cout << "Successfully received replication data from " << getNodeID() << "\n";
+   }
+}
+
+
+/**********************************************************************************************
+ * awaitAck - collects acknowledgements for messages sent, dropping each from the queue
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::awaitAck() {
+
+   if (!readInput())
+      return;
+
+   std::vector<uint8_t> none;
+   while (nextFrame(frame_ack, none)) {
+      if (_unacked == 0) {
+         std::stringstream msg;
+         msg << "Ack received with no data outstanding. Node:" << getNodeID() << "\n";
+         _server_log.writeLog(msg.str().c_str());
+      } else {
+         _outqueue.pop_front();
+         _unacked--;
+      }
+
+      if (_verbosity >= 3)
+         std::cout << "Data ack received from " << getNodeID() << ".\n";
+   }
+
+   setStatus((_unacked > 0) ? s_waitack : s_datatx);
+}
+
+/**********************************************************************************************
+ * getData - Reads in whatever data has arrived on the socket, without blocking, and appends
+ *           it to buf. Called once the reactor has flagged the socket readable
+ *
+ *    Params: buf - where to append the data
+ *
+ *    Returns: true if the connection is still up (even if nothing had arrived), false if
+ *             they lost connection
+ *
+ *    Throws: socket_error if the read fails, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+bool TCPConn::getData(std::vector<uint8_t> &buf) {
+
+   _readable = false;
+
+   // Take everything that has arrived without blocking
+   ssize_t got = _connfd.recvAvail(buf);
+   if (got < 0) {
+      std::stringstream msg;
+      std::string ip_addr;
+      msg << "Connection from server " << _node_id << " lost (IP: " << 
+                                                      getIPAddrStr(ip_addr) << ")"; 
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return false;
+   }
+
+   if ((got > 0) && (_metrics != NULL) && (_metrics->bytes_in != NULL))
+      _metrics->bytes_in->add((uint64_t) got);
+   return true;
+}
+
+/**********************************************************************************************
+ * readInput - if the reactor flagged the socket, feeds what arrived to the frame decoder
+ *
+ *    Returns: false if the connection was lost, true otherwise (even if nothing was read)
+ *
+ *    Throws: socket_error if the read fails
+ **********************************************************************************************/
+
+bool TCPConn::readInput() {
+   if (!_readable)
+      return true;
+
+   _readbuf.clear();
+   if (!getData(_readbuf))
+      return false;
+
+   _decoder.feed(_readbuf);
+   return true;
+}
+
+/**********************************************************************************************
+ * nextFrame - takes the next complete frame off the decoder
+ *
+ *    Params: type - the frame type expected next
+ *            payload - receives the frame's payload
+ *
+ *    Returns: true if a frame was taken, false if one has not fully arrived yet
+ *
+ *    Throws: socket_error if the frame is not the type expected (or the stream is corrupt)
+ **********************************************************************************************/
+
+bool TCPConn::nextFrame(uint8_t type, std::vector<uint8_t> &payload) {
+   uint8_t got_type;
+   uint16_t flags;
+
+   if (!_decoder.next(got_type, flags, payload))
+      return false;
+
+   if (got_type != type) {
+      std::stringstream msg;
+      msg << "Protocol error: expected frame type " << (int) type << ", got " << (int) got_type;
+      throw socket_error(msg.str());
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * sendFrame - queues a frame for the socket and tries to write it straight away. The body is
+ *             not copied--the frame just holds a reference to it
+ *
+ *    Params: type - the frame type
+ *            payload - the message body (may be empty)
+ *
+ *    Throws: socket_error if the write fails
+ **********************************************************************************************/
+
+void TCPConn::sendFrame(uint8_t type, SharedPayload payload) {
+   _sendq.emplace_back();
+   OutFrame &frame = _sendq.back();
+
+   uint32_t length = payload ? (uint32_t) payload->size() : 0;
+   encodeFrameHeader(type, 0, length, frame.header);
+   frame.body = std::move(payload);
+   frame.sent = 0;
+
+   // If older frames are still waiting on the socket, this one waits behind them
+   if (_sendq.size() == 1)
+      flushOutput();
+}
+
+void TCPConn::sendFrame(uint8_t type, std::vector<uint8_t> &&payload) {
+   sendFrame(type, std::make_shared<const std::vector<uint8_t>>(std::move(payload)));
+}
+
+/**********************************************************************************************
+ * flushOutput - writes queued frames to the socket with gather writes (header and body as
+ *               separate buffers, several frames per call). Stops when the socket is full,
+ *               remembering how far it got--the reactor reports when there is room again
+ *
+ *    Throws: socket_error if the write fails
+ **********************************************************************************************/
+
+void TCPConn::flushOutput() {
+   _writable = false;
+
+   while (_sendq.size() > 0) {
+      iovec iov[max_send_iov];
+      int n = 0;
+
+      for (auto fptr = _sendq.begin(); (fptr != _sendq.end()) && (n + 2 <= max_send_iov); fptr++) {
+         size_t body_sent = 0;
+         if (fptr->sent < frame_header_size) {
+            iov[n].iov_base = fptr->header + fptr->sent;
+            iov[n].iov_len = frame_header_size - fptr->sent;
+            n++;
+         } else
+            body_sent = fptr->sent - frame_header_size;
+
+         size_t body_len = fptr->body ? fptr->body->size() : 0;
+         if (body_len > body_sent) {
+            iov[n].iov_base = const_cast<uint8_t *>(fptr->body->data()) + body_sent;
+            iov[n].iov_len = body_len - body_sent;
+            n++;
+         }
+      }
+
+      size_t written = _connfd.sendVec(iov, n);
+      if (written == 0)
+         return;
+
+      if ((_metrics != NULL) && (_metrics->bytes_out != NULL))
+         _metrics->bytes_out->add(written);
+
+      // Retire whatever went out completely, note where a partial one stopped
+      while (written > 0) {
+         OutFrame &frame = _sendq.front();
+         size_t remaining = frame_header_size + (frame.body ? frame.body->size() : 0) - frame.sent;
+         if (written < remaining) {
+            frame.sent += written;
+            break;
+         }
+         written -= remaining;
+         _sendq.pop_front();
+      }
+   }
+}
+
+/**********************************************************************************************
+ * decryptInPlace - decrypts an IV/Data buffer without moving it
+ *
+ *    Params: data - the encrypted buffer, decrypted where it sits
+ *            len - its size including the IV
+ *
+ *    Returns: size of the decrypted data, which starts at data + iv_size (0 if the buffer is
+ *             too short to hold an IV)
+ *
+ **********************************************************************************************/
+size_t TCPConn::decryptInPlace(uint8_t *data, size_t len) {
+   if (len < iv_size)
+      return 0;
+
+   if (!_ciphers_keyed)
+      keyCiphers();
+
+   _decryptor.Resynchronize(data, iv_size);
+   if (len > iv_size)
+      _decryptor.ProcessData(data + iv_size, data + iv_size, len - iv_size);
+
+   return len - iv_size;
+}
+
+/**********************************************************************************************
+ * getInputData - Returns the oldest message received on this connection and drops it
+ *
+ *    Params: buf = the data received
+ *            seq = its number on this connection, to pass to ackInput once it is stored
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::getInputData(std::vector<uint8_t> &buf, uint64_t &seq) {
+   if (_inqueue.size() == 0)
+      throw std::runtime_error("getInputData called on a connection with no data waiting.");
+
+   buf = std::move(_inqueue.front());
+   _inqueue.pop_front();
+   seq = _rx_taken++;
+}
+
+/**********************************************************************************************
+ * ackInput - acknowledges a received message. The sender drops its oldest unacknowledged
+ *            message for each ACK, so they have to come back in order
+ *
+ *    Params: seq = the message's number, from getInputData
+ *
+ *    Returns: true if the ACK was sent, false if seq is out of turn or the channel is down
+ **********************************************************************************************/
+
+bool TCPConn::ackInput(uint64_t seq) {
+   if (!isConnected() || (_status != s_datarx))
+      return false;
+
+   if (seq != _rx_acked) {
+      std::stringstream msg;
+      msg << "Acknowledgement for message " << seq << " from " << getNodeID() <<
+                                    " out of turn (expected " << _rx_acked << ")";
+      _server_log.writeLog(msg.str().c_str());
+      return false;
+   }
+
+   sendFrame(frame_ack, SharedPayload());
+   _rx_acked++;
+   return true;
+}
+
+/**********************************************************************************************
+ * connect - Opens the socket FD, attempting to connect to the remote server
+ *
+ *    Params:  ip_addr - ip address string to connect to
+ *             port - port in host format to connect to
+ *
+ *    Throws: socket_error exception if failed. socket_error is a child class of runtime_error
+ **********************************************************************************************/
+
+void TCPConn::connect(const char *ip_addr, unsigned short port) {
+
+   // Set the status to connecting
+   setStatus(s_connecting);
+   _outbound = true;
+
+   // Start the connect--if it cannot finish at once, handleConnection finishes it
+   if (!_connfd.connectTo(ip_addr, port, _connect_pending))
+      throw socket_error("TCP Connection failed!");
+
+   _connected = true;
+}
+
+// Same as above, but ip_addr and port are in network (big endian) format
+void TCPConn::connect(unsigned long ip_addr, unsigned short port) {
+   // Set the status to connecting
+   setStatus(s_connecting);
+   _outbound = true;
+
+   if (!_connfd.connectTo(ip_addr, port, _connect_pending))
+      throw socket_error("TCP Connection failed!");
+
+   _connected = true;
+}
+
+/**********************************************************************************************
+ * finishConnect - once the reactor flags the socket of a connect in progress (writable when
+ *                 it connected, an error or hangup when it did not), picks up the result
+ *
+ *    Returns: true if the connect is done, false if the socket has not been flagged yet
+ *
+ *    Throws: socket_error if the connect failed
+ **********************************************************************************************/
+
+bool TCPConn::finishConnect() {
+   if (!_writable && !_readable)
+      return false;
+
+   _writable = false;
+   _readable = false;
+   _connect_pending = false;
+
+   int err = _connfd.connectError();
+   if (err != 0) {
+      std::string msg = "TCP Connection failed: ";
+      msg += strerror(err);
+      throw socket_error(msg.c_str());
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * assignOutgoingData - queues a message for the other server. It goes out at the next
+ *                      handleConnection once the channel is authenticated, and is kept
+ *                      (and re-sent after a reconnect) until acknowledged
+ *
+ *    Params:  data - the data stream to send to the server
+ *
+ **********************************************************************************************/
+
+void TCPConn::assignOutgoingData(SharedPayload data) {
+   _outqueue.push_back(std::move(data));
+}
+
+/**********************************************************************************************
+ * setStatus - changes the state of the connection. If the server is timing the state being
+ *             left, the time spent in it goes to that state's histogram. Staying in the same
+ *             state is not a change
+ *
+ *    Params:  status - the new state
+ *
+ **********************************************************************************************/
+void TCPConn::setStatus(statustype status) {
+   if (status == _status)
+      return;
+
+   int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+   if ((_metrics != NULL) && (_metrics->state_time[_status] != NULL) && (_status_since > 0))
+      _metrics->state_time[_status]->observe((uint64_t) (now - _status_since));
+
+   _status = status;
+   _status_since = now;
+}
+ 
+
+/**********************************************************************************************
+ * disconnect - cleans up the socket as required and closes the FD. An outbound channel goes
+ *              back to s_connecting and schedules a reconnect, backing off while the other
+ *              end stays unreachable
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+void TCPConn::disconnect() {
+   _connfd.closeFD();
+   _connected = false;
+   _readable = false;
+   _decoder.clear();
+   _auth_verified = false;
+
+   // Frames not yet written die with the socket (unacked messages are still in _outqueue)
+   _sendq.clear();
+   _writable = false;
+   _watching_write = false;
+   _connect_pending = false;
+
+   if (_outbound) {
+      setStatus(s_connecting);
+      _unacked = 0;
+      reconnect = time(NULL) + _backoff;
+      _backoff = std::min(_backoff * 2, max_reconnect_delay);
+   }
+}
+
+
+/**********************************************************************************************
+ * isConnected - performs a simple check on the socket to see if it is still open 
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+bool TCPConn::isConnected() {
+   return _connected;
+   // return _connfd.isOpen(); // This does not work very well
+}
+
+/**********************************************************************************************
+ * getIPAddrStr - gets a string format of the IP address and loads it in buf
+ *
+ **********************************************************************************************/
+const char *TCPConn::getIPAddrStr(std::string &buf) {
+   _connfd.getIPAddrStr(buf);
+   return buf.c_str();
+}
+
+void TCPConn::waitForAuthentication(){
+   //verify encryption of OUR SID
+
+   if (!readInput())
+      return;
+
+   std::vector<uint8_t> cmd;
+   if (!nextFrame(frame_auth, cmd))
+      return;
+
+   //verify encryption of our sid
+   if (cmd.size() < iv_size) {
+      std::stringstream msg;
+      msg << "IN: waitForAuthentication. AUTH string from connecting client invalid format. Cannot authenticate.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+   size_t sid_len = decryptInPlace(cmd.data(), cmd.size());
+   std::string decryptedSID((const char *) cmd.data() + iv_size, sid_len);
+   if(decryptedSID != _svr_id)
+   {
+      std::stringstream msg;
+      msg << "IN: waitForAuthentication. SID: " << decryptedSID << " Encrypted SID does not match. Cannot authenticate.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+
+   setStatus(s_datarx);
+
+   // The client starts sending as soon as it is through, so some may already be buffered
+   waitForData();
+}
+
+void TCPConn::initiateHandshake(){
+   //recieve and verify our sid
+   // send encrypted SID
+
+   if (!readInput())
+      return;
+
+   // The server sends its AUTH, then its SID, which may arrive in separate reads
+   std::vector<uint8_t> cmd;
+   if (!_auth_verified) {
+      if (!nextFrame(frame_auth, cmd))
+         return;
+
+      //verify encryption of our sid
+      if (cmd.size() < iv_size) {
+         std::stringstream msg;
+         msg << "IN: initiateHandshake. AUTH string from server invalid format. Cannot authenticate.";
+         _server_log.writeLog(msg.str().c_str());
+         disconnect();
+         return;
+      }
+      size_t sid_len = decryptInPlace(cmd.data(), cmd.size());
+      std::string decryptedSID((const char *) cmd.data() + iv_size, sid_len);
+      if(decryptedSID != _svr_id)
+      {  
+         std::stringstream msg;
+         msg << "IN: initiateHandshake. SID: " << decryptedSID << " Encrypted SID does not match. Cannot authenticate.";
+         _server_log.writeLog(msg.str().c_str());
+         disconnect();
+         return;
+      }
+      _auth_verified = true;
+   }
+
+   //get their sid, encrypt and reply
+   if (!nextFrame(frame_sid, cmd))
+      return;
+
+   if (cmd.size() < 1) {
+      std::stringstream msg;
+      msg << "IN: initiateHandshake. SID string from server invalid format. Cannot authenticate.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+
+   std::string node(cmd.begin(), cmd.end());
+
+   std::string server(_svr_id.begin(), _svr_id.end());
+   //check if client sid matches server sid for reflection attack
+   if(node == server)
+   {
+      std::stringstream msg;
+      msg << "IN: initiateHandshake. Passed SID matches Server SID. Reflection Attack Thwarted.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+
+   //encrypt and return SID
+   encryptData(cmd);
+   sendFrame(frame_auth, std::move(cmd));
+
+   if (_verbosity >= 3)
+      std::cout << "Successfully authenticated connection with " << getNodeID() << ".\n";
+
+   // Channel is up--reset the backoff and send whatever has been queued meanwhile
+   _backoff = reconnect_delay;
+   setStatus(s_datatx);
+   transmitData();
+}
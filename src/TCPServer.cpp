@@ -1,247 +1,411 @@
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <stdexcept>
-#include <strings.h>
-#include <vector>
-#include <iostream>
-#include <memory>
-#include <sstream>
-#include <crypto++/secblock.h>
-#include <crypto++/osrng.h>
-#include <crypto++/files.h>
-#include "TCPServer.h"
-#include "ALMgr.h"
-
-TCPServer::TCPServer(unsigned int verbosity)
-                        :_aes_key(CryptoPP::AES::DEFAULT_KEYLENGTH), 
-                         _server_log("server.log", 0),
-                         _verbosity(verbosity)
-{
-}
-
-
-TCPServer::~TCPServer() {
-
-}
-
-/**********************************************************************************************
- * bindSvr - Creates a network socket and sets it nonblocking so we can loop through looking for
- *           data. Then binds it to the ip address and port
- *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
- **********************************************************************************************/
-
-void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
-
-   // Set the socket to nonblocking
-   _sockfd.setNonBlocking();
-
-   _sockfd.setReusable();
-
-   // Load the socket information to prep for binding
-   _sockfd.bindFD(ip_addr, port);
- 
-}
-
-/**********************************************************************************************
- * listenSvr - Starts the server socket listening for incoming connections
- *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
- **********************************************************************************************/
-
-// Simple function that simply starts the server listening
-void TCPServer::listenSvr() {
-   _sockfd.listenFD(5);
-
-   std::string ipaddr_str;
-   std::stringstream msg;
-   _sockfd.getIPAddrStr(ipaddr_str);
-   msg << "Server listening on IP " << ipaddr_str << "' port '" << _sockfd.getPort() << "'";
-   _server_log.writeLog(msg.str().c_str());
-}
-
-/**********************************************************************************************
- * runSvr - Performs a loop to look for connections and create TCPConn objects to handle
- *          them. Also loops through the list of connections and handles data received and
- *          sending of data. 
- *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
- **********************************************************************************************/
-
-void TCPServer::runServer() {
-   bool online = true;
-   timespec sleeptime;
-   sleeptime.tv_sec = 0;
-   sleeptime.tv_nsec = 100000000;
-
-   // Start the server socket listening
-   listenSvr();
-
-   while (online) {
-      handleSocket();
-
-      handleConnections();
-
-      // So we're not chewing up CPU cycles unnecessarily
-      nanosleep(&sleeptime, NULL);
-   } 
-
-
-   
-}
-
-/**********************************************************************************************
- * handleSocket - Checks the socket for incoming connections and validates against the whitelist.
- *                Accepts valid connections and adds them to the connection list.
- *
- *    Returns: pointer to a new connection if one was found, otherwise NULL
- *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
- **********************************************************************************************/
-
-TCPConn *TCPServer::handleSocket() {
-  
-   // The socket has data, means a new connection 
-   if (_sockfd.hasData()) {
-
-      // Try to accept the connection
-      TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
-      if (!new_conn->accept(_sockfd)) {
-         _server_log.strerrLog("Data received on socket but failed to accept.");
-         return NULL;
-      }
-      std::cout << "***Got a connection***\n";
-
-      _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
-
-      // Get their IP Address string to use in logging
-      std::string ipaddr_str;
-      new_conn->getIPAddrStr(ipaddr_str);
-
-
-      // Check the whitelist
-      ALMgr al("whitelist");
-      if (!al.isAllowed(new_conn->getIPAddr()))
-      {
-         // Disconnect the user
-         new_conn->disconnect();
-
-         // Log their attempted connection
-         std::string msg = "Connection by IP address '";
-         msg += ipaddr_str;
-         msg += "' not on whitelist. Disconnecting.";
-         _server_log.writeLog(msg);
-
-         return NULL;
-      }
-
-      std::string msg = "Connection from IP address '";
-      msg += ipaddr_str;
-      msg += "'.";
-      _server_log.writeLog(msg);
-
-      // Send an authentication string in cleartext
-            
-
-      return new_conn;
-   }
-   return NULL;
-}
-
-/**********************************************************************************************
- * handleConnections - Loops through the list of clients, running their functions to handle the
- *                     clients input/output.
- *
- *    Returns: number of new connections accepted
- *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
- **********************************************************************************************/
-
-void TCPServer::handleConnections() {
-   // Loop through our connections, handling them
-   std::list<std::unique_ptr<TCPConn>>::iterator tptr = _connlist.begin();
-   while (tptr != _connlist.end())
-   {
-      // If the client is not connected, then either reconnect or drop 
-      if ((!(*tptr)->isConnected()) || ((*tptr)->getStatus() == TCPConn::s_none)) {
-         // Might be trying to connect
-         if ((*tptr)->getStatus() == TCPConn::s_connecting) {
-
-            // If our retry timer hasn't expired....skip
-            if ((*tptr)->reconnect > time(NULL)) {
-               tptr++;
-               continue;
-            }
-
-            unsigned long ip_addr = (*tptr)->getIPAddr();
-            unsigned short port = (*tptr)->getPort();
-            
-            // Try to connect and handle failure
-            try {
-               (*tptr)->connect(ip_addr, port);
-            } catch (socket_error &e) {
-               std::stringstream msg;
-               msg << "Connect to SID " << (*tptr)->getNodeID() << 
-                        " failed when trying to send data. Msg: " << e.what();
-               if (_verbosity >= 2)
-                  std::cout << msg.str() << "\n";
-               _server_log.writeLog(msg.str().c_str());
-               (*tptr)->disconnect();
-               (*tptr)->reconnect = time(NULL) + reconnect_delay;
-               tptr++;
-               continue;
-            }
-         // Else we're in a different state and there's not data waiting to be read
-         } else if (!(*tptr)->isInputDataReady()) {
-         // Log it
-            std::string msg = "Node ID '";
-            msg += (*tptr)->getNodeID();
-            msg += "' lost connection.";
-            _server_log.writeLog(msg);
-
-            // Remove them from the connect list
-            tptr = _connlist.erase(tptr);
-            std::cout << "Connection disconnected.\n";
-            continue;
-         }
-         tptr++;
-         continue;
-      } 
-
-      // Process any user inputs
-      (*tptr)->handleConnection();
-
-      // Increment our iterator
-      tptr++;
-   }
-
-}
-
-/*********************************************************************************************
- * loadAESKey - reads in the 128 bit AES key from the indicated file
- *********************************************************************************************/
-void TCPServer::loadAESKey(const char *filename) {
-
-   CryptoPP::FileSource keyfile(filename, true, new CryptoPP::ArraySink(_aes_key.begin(), _aes_key.size()));
-}
-
-
-/**********************************************************************************************
- * shutdown - Cleanly closes the socket FD.
- *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
- **********************************************************************************************/
-
-void TCPServer::shutdown() {
-   _server_log.writeLog("Server shutting down.");
-
-   _sockfd.closeFD();
-}
-
-void TCPServer::changeLogfile(const char *filename) {
-   _server_log.changeFilename(filename);
-}
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <cerrno>
+#include <stdexcept>
+#include <strings.h>
+#include <vector>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <crypto++/secblock.h>
+#include <crypto++/osrng.h>
+#include <crypto++/files.h>
+#include "TCPServer.h"
+
+/**********************************************************************************************
+ * TCPServer (constructor) - sets up the epoll instance used as the connection reactor, with
+ *                           the eventfd that wakes it already in it. The server log runs in
+ *                           async mode so logging on the connection paths never waits on the
+ *                           disk
+ *
+ *    Throws: socket_error if epoll or the eventfd cannot be created
+ **********************************************************************************************/
+TCPServer::TCPServer(unsigned int verbosity)
+                        :_aes_key(CryptoPP::AES::DEFAULT_KEYLENGTH), 
+                         _server_log("server.log", 0, server_log_rotate_bytes),
+                         _verbosity(verbosity),
+                         _conn_metrics(),
+                         _accept_ready(false),
+                         _access_list("whitelist")
+{
+   _epfd = epoll_create1(EPOLL_CLOEXEC);
+   if (_epfd == -1)
+      throw socket_error("Unable to create the epoll instance for the server.");
+
+   // The eventfd is marked in the events by a pointer to it
+   _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.ptr = &_wake_fd;
+   if ((_wake_fd == -1) || (epoll_ctl(_epfd, EPOLL_CTL_ADD, _wake_fd, &ev) != 0)) {
+      close(_epfd);
+      throw socket_error("Unable to create the wake eventfd for the server.");
+   }
+
+   _server_log.startAsync();
+}
+
+
+TCPServer::~TCPServer() {
+   close(_wake_fd);
+   close(_epfd);
+}
+
+/**********************************************************************************************
+ * bindSvr - Creates a network socket and sets it nonblocking so we can loop through looking for
+ *           data. Then binds it to the ip address and port
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
+
+   // Set the socket to nonblocking
+   _sockfd.setNonBlocking();
+
+   _sockfd.setReusable();
+
+   // Load the socket information to prep for binding
+   _sockfd.bindFD(ip_addr, port);
+ 
+}
+
+/**********************************************************************************************
+ * listenSvr - Starts the server socket listening for incoming connections
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+// Simple function that simply starts the server listening
+void TCPServer::listenSvr() {
+   // Every peer may reconnect at once (say, after a restart). If the backlog is full their
+   // SYNs are dropped and each connect waits out the retransmit timeouts
+   _sockfd.listenFD(SOMAXCONN);
+
+   // Watch the listening socket too--a NULL pointer marks it among the events
+   epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
+   if ((epoll_ctl(_epfd, EPOLL_CTL_ADD, _sockfd.getFD(), &ev) != 0) && (errno != EEXIST))
+      throw socket_error("Unable to add the server socket to epoll.");
+
+   std::string ipaddr_str;
+   std::stringstream msg;
+   _sockfd.getIPAddrStr(ipaddr_str);
+   msg << "Server listening on IP " << ipaddr_str << "' port '" << _sockfd.getPort() << "'";
+   _server_log.writeLog(msg.str().c_str());
+}
+
+/**********************************************************************************************
+ * runSvr - Performs a loop to look for connections and create TCPConn objects to handle
+ *          them. Also loops through the list of connections and handles data received and
+ *          sending of data. 
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPServer::runServer() {
+   bool online = true;
+
+   // Start the server socket listening
+   listenSvr();
+
+   while (online) {
+      // Sleeps until there is socket activity, but wakes at least every 100ms so
+      // reconnect timers still get checked
+      pollEvents(100);
+
+      handleSocket();
+
+      handleConnections();
+   } 
+
+
+   
+}
+
+/**********************************************************************************************
+ * pollEvents - the reactor: one epoll_wait over the listening socket and all connections.
+ *              Ready connections are flagged so their next handleConnection reads them;
+ *              a ready listening socket is left for handleSocket. A wake just ends the wait
+ *
+ *    Params:  timeout_ms - how long to wait for activity, 0 to just check
+ *
+ *    Throws: socket_error if epoll_wait fails
+ **********************************************************************************************/
+
+void TCPServer::pollEvents(int timeout_ms) {
+   epoll_event events[max_events];
+
+   int n = epoll_wait(_epfd, events, max_events, timeout_ms);
+   if (n == -1) {
+      if (errno == EINTR)
+         return;
+      throw socket_error("epoll_wait failed on the server.");
+   }
+
+   for (int i=0; i<n; i++) {
+      if (events[i].data.ptr == NULL) {
+         _accept_ready = true;
+         continue;
+      }
+
+      // Reading the eventfd resets it; any number of wakes since the last read are one
+      if (events[i].data.ptr == &_wake_fd) {
+         uint64_t count;
+         while (read(_wake_fd, &count, sizeof(count)) == (ssize_t) sizeof(count))
+            ;
+         continue;
+      }
+
+      TCPConn *conn = static_cast<TCPConn *>(events[i].data.ptr);
+      if (events[i].events & EPOLLOUT)
+         conn->markWritable();
+      if (events[i].events & ~EPOLLOUT)
+         conn->markReadable();
+   }
+}
+
+/**********************************************************************************************
+ * wake - makes the reactor's current (or next) pollEvents return without waiting. Only a
+ *        full eventfd counter can make the write fail, and then a wake is pending anyway
+ **********************************************************************************************/
+
+void TCPServer::wake() {
+   uint64_t one = 1;
+   ssize_t written = write(_wake_fd, &one, sizeof(one));
+   (void) written;
+}
+
+/**********************************************************************************************
+ * watchConn - adds a connection's socket to the reactor. Hangups and errors come through as
+ *             readable too, so the connection finds out on its next read. A connect still in
+ *             progress is watched for writable as well, which is how it reports finishing
+ *
+ *    Throws: socket_error if the socket cannot be added
+ **********************************************************************************************/
+
+void TCPServer::watchConn(TCPConn *conn) {
+   bool want = conn->wantsWrite();
+
+   epoll_event ev;
+   ev.events = EPOLLIN | EPOLLRDHUP | (want ? (uint32_t) EPOLLOUT : 0u);
+   ev.data.ptr = conn;
+   if (epoll_ctl(_epfd, EPOLL_CTL_ADD, conn->getFD(), &ev) != 0)
+      throw socket_error("Unable to add a connection to epoll.");
+   conn->setWatchingWrite(want);
+}
+
+/**********************************************************************************************
+ * updateWriteInterest - asks epoll for EPOLLOUT on a connection only while it has output
+ *                       backed up, so idle connections do not wake the reactor
+ *
+ *    Throws: socket_error if the registration cannot be changed
+ **********************************************************************************************/
+
+void TCPServer::updateWriteInterest(TCPConn *conn) {
+   bool want = conn->wantsWrite();
+   if (!conn->isConnected() || (want == conn->isWatchingWrite()))
+      return;
+
+   epoll_event ev;
+   ev.events = EPOLLIN | EPOLLRDHUP | (want ? (uint32_t) EPOLLOUT : 0u);
+   ev.data.ptr = conn;
+   if (epoll_ctl(_epfd, EPOLL_CTL_MOD, conn->getFD(), &ev) != 0)
+      throw socket_error("Unable to change a connection's epoll events.");
+   conn->setWatchingWrite(want);
+}
+
+/**********************************************************************************************
+ * handleSocket - Checks the socket for incoming connections and validates against the whitelist.
+ *                Accepts valid connections and adds them to the connection list.
+ *
+ *    Returns: pointer to a new connection if one was found, otherwise NULL
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+TCPConn *TCPServer::handleSocket() {
+  
+   // The reactor saw activity on the socket, means a new connection 
+   if (_accept_ready) {
+      _accept_ready = false;
+
+      // Try to accept the connection
+      TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
+      new_conn->setMetrics(&_conn_metrics);
+      if (!new_conn->accept(_sockfd)) {
+         _server_log.strerrLog("Data received on socket but failed to accept.");
+         return NULL;
+      }
+      std::cout << "***Got a connection***\n";
+
+      _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
+
+      // Get their IP Address string to use in logging
+      std::string ipaddr_str;
+      new_conn->getIPAddrStr(ipaddr_str);
+
+
+      // Check the whitelist
+      if (!_access_list.isAllowed(new_conn->getIPAddr()))
+      {
+         // Disconnect the user
+         new_conn->disconnect();
+
+         // Log their attempted connection
+         std::string msg = "Connection by IP address '";
+         msg += ipaddr_str;
+         msg += "' not on whitelist. Disconnecting.";
+         _server_log.writeLog(msg);
+
+         return NULL;
+      }
+
+      std::string msg = "Connection from IP address '";
+      msg += ipaddr_str;
+      msg += "'.";
+      _server_log.writeLog(msg);
+
+      watchConn(new_conn);
+
+      // Send an authentication string in cleartext
+            
+
+      return new_conn;
+   }
+   return NULL;
+}
+
+/**********************************************************************************************
+ * handleConnections - Loops through the list of clients, running their functions to handle the
+ *                     clients input/output.
+ *
+ *    Returns: number of new connections accepted
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPServer::handleConnections() {
+   // Loop through our connections, handling them
+   std::list<std::unique_ptr<TCPConn>>::iterator tptr = _connlist.begin();
+   while (tptr != _connlist.end())
+   {
+      // If the client is not connected, then either reconnect (outbound channels) or drop 
+      if ((!(*tptr)->isConnected()) || ((*tptr)->getStatus() == TCPConn::s_none)) {
+         // Might be trying to connect
+         if ((*tptr)->getStatus() == TCPConn::s_connecting) {
+
+            // If our retry timer hasn't expired....skip
+            if ((*tptr)->reconnect > time(NULL)) {
+               tptr++;
+               continue;
+            }
+
+            unsigned long ip_addr = (*tptr)->getIPAddr();
+            unsigned short port = htons((*tptr)->getPort());
+            
+            // Try to connect and handle failure (disconnect schedules the next attempt)
+            try {
+               (*tptr)->connect(ip_addr, port);
+            } catch (socket_error &e) {
+               std::stringstream msg;
+               msg << "Connect to SID " << (*tptr)->getNodeID() << 
+                        " failed when trying to send data. Msg: " << e.what();
+               if (_verbosity >= 2)
+                  std::cout << msg.str() << "\n";
+               _server_log.writeLog(msg.str().c_str());
+               (*tptr)->disconnect();
+               tptr++;
+               continue;
+            }
+            watchConn(tptr->get());
+
+         // Else we're in a different state and there's not data waiting to be read
+         } else if (!(*tptr)->isInputDataReady()) {
+         // Log it
+            std::string msg = "Node ID '";
+            msg += (*tptr)->getNodeID();
+            msg += "' lost connection.";
+            _server_log.writeLog(msg);
+
+            // Remove them from the connect list (closing first takes them out of epoll)
+            if ((*tptr)->isConnected())
+               (*tptr)->disconnect();
+            tptr = _connlist.erase(tptr);
+            std::cout << "Connection disconnected.\n";
+            continue;
+         }
+         tptr++;
+         continue;
+      } 
+
+      // Process any user inputs (returns at once if it is waiting on input that is not there)
+      (*tptr)->handleConnection();
+      updateWriteInterest(tptr->get());
+
+      // Increment our iterator
+      tptr++;
+   }
+
+}
+
+/*********************************************************************************************
+ * loadAESKey - reads in the 128 bit AES key from the indicated file
+ *********************************************************************************************/
+void TCPServer::loadAESKey(const char *filename) {
+
+   CryptoPP::FileSource keyfile(filename, true, new CryptoPP::ArraySink(_aes_key.begin(), _aes_key.size()));
+}
+
+
+/**********************************************************************************************
+ * shutdown - Cleanly closes the socket FD.
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPServer::shutdown() {
+   _server_log.writeLog("Server shutting down.");
+
+   _sockfd.closeFD();
+}
+
+void TCPServer::changeLogfile(const char *filename) {
+   _server_log.changeFilename(filename);
+}
+
+/**********************************************************************************************
+ * setMetrics - registers a histogram for each state worth timing: the handshake states and
+ *              waiting on acknowledgements. The steady data states last as long as the channel
+ *              and are not timed. Also counts the bytes all connections read and write, so the
+ *              whole cost on the wire (framing, handshakes and acks included) can be seen.
+ *              Call before any connections are made
+ *
+ *    Params:  registry - where the histograms live (must outlast the server)
+ **********************************************************************************************/
+
+void TCPServer::setMetrics(MetricsRegistry &registry) {
+   const char *name = "repsvr_conn_state_microseconds";
+   const char *help = "Time connections spent in each state before leaving it";
+
+   MetricHistogram **timers = _conn_metrics.state_time;
+
+   timers[TCPConn::s_connecting] = &registry.histogram(name, help, "state=\"connecting\"");
+   timers[TCPConn::s_connected] = &registry.histogram(name, help, "state=\"connected\"");
+   timers[TCPConn::s_handshake] = &registry.histogram(name, help, "state=\"handshake\"");
+   timers[TCPConn::s_authenticate] = &registry.histogram(name, help, "state=\"authenticate\"");
+   timers[TCPConn::s_waitack] = &registry.histogram(name, help, "state=\"waitack\"");
+
+   const char *bytes_help = "Bytes read and written on replication connections";
+   _conn_metrics.bytes_in = &registry.counter("repsvr_wire_bytes_total", bytes_help,
+                                                                     "direction=\"in\"");
+   _conn_metrics.bytes_out = &registry.counter("repsvr_wire_bytes_total", bytes_help,
+                                                                     "direction=\"out\"");
+}
@@ -0,0 +1,104 @@
+/****************************************************************************************
+ * journaltest_main - checks that a journal whose write fails stops committing and holds
+ *                    acknowledgements back. Run by "make check"
+ *
+ *                    The segment is capped with RLIMIT_FSIZE once the first batch is on
+ *                    disk, so the second batch's write fails with EFBIG
+ *
+ ****************************************************************************************/
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <csignal>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "DronePlotDB.h"
+#include "PlotJournal.h"
+
+int failures = 0;
+
+void check(bool cond, const char *what) {
+   if (!cond) {
+      std::cerr << "FAIL: " << what << "\n";
+      failures++;
+   }
+}
+
+void addTestPlots(DronePlotDB &db, int first, int count) {
+   for (int i=first; i<first + count; i++)
+      db.addPlot(i, 1, 1000 + i, 40.0f + i * 0.001f, -84.0f, 0);
+}
+
+int main(int argc, char *argv[]) {
+   (void) argc;
+   (void) argv;
+
+   char dirbuf[] = "/tmp/journaltest.XXXXXX";
+   if (mkdtemp(dirbuf) == NULL) {
+      std::cerr << "Unable to create a scratch directory\n";
+      return 1;
+   }
+   std::string dir(dirbuf);
+
+   // Past the cap, writes fail with EFBIG rather than killing the process
+   signal(SIGXFSZ, SIG_IGN);
+
+   {
+      PlotJournal journal(dir.c_str(), journal_checkpoint_records, 5);
+      DronePlotDB db;
+      db.recover(journal);
+      journal.start();
+      db.setJournal(&journal);
+
+      addTestPlots(db, 0, 10);
+      uint64_t first = db.journalMark();
+      check(journal.sync(), "first batch syncs");
+      check(db.journalSynced(first), "first batch counts as synced");
+      uint64_t committed = journal.committed();
+
+      // Cap the live segment at what it holds now
+      struct stat st;
+      check(stat((dir + "/journal.0000000000000001").c_str(), &st) == 0, "segment exists");
+      struct rlimit old, cap;
+      getrlimit(RLIMIT_FSIZE, &old);
+      cap.rlim_cur = (rlim_t) st.st_size;
+      cap.rlim_max = old.rlim_max;
+      check(setrlimit(RLIMIT_FSIZE, &cap) == 0, "file size cap set");
+
+      addTestPlots(db, 10, 10);
+      uint64_t second = db.journalMark();
+      check(!journal.sync(), "sync reports the failed write");
+      check(journal.failed(), "journal is failed");
+      check(journal.committed() == committed, "committed does not move past the failed batch");
+      check(!db.journalSynced(second), "failed batch is not synced");
+
+      // Later commits must not go after the torn write either
+      setrlimit(RLIMIT_FSIZE, &old);
+      addTestPlots(db, 20, 10);
+      check(!journal.sync(), "journal stays failed");
+      check(journal.committed() == committed, "committed stays put after the failure");
+      check(!db.journalSynced(db.journalMark()), "later changes are not synced");
+
+      db.setJournal(NULL);
+      journal.stop();
+   }
+
+   // Recovery gets exactly the batch that was committed
+   {
+      PlotJournal journal(dir.c_str());
+      DronePlotDB db;
+      check(db.recover(journal) == 10, "recovery holds only the committed batch");
+   }
+
+   std::string rm = "rm -rf " + dir;
+   if (system(rm.c_str()) != 0)
+      std::cerr << "Unable to remove " << dir << "\n";
+
+   if (failures > 0) {
+      std::cerr << failures << " check(s) failed\n";
+      return 1;
+   }
+   std::cout << "journal failure checks passed\n";
+   return 0;
+}
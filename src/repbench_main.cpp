@@ -0,0 +1,651 @@
+/****************************************************************************************
+ * repbench_main - microbenchmarks for the replication hot paths: plot and batch coding,
+ *                 framing, encryption, database sorting and contended inserts, and the
+ *                 skew and deduplication passes. Every run uses the same generated data
+ *                 for a given seed, so results can be compared release to release
+ *
+ *                 Each benchmark is run with more and more iterations until one run takes
+ *                 at least the minimum time; that run is reported. Setup inside a run
+ *                 (building a database to sort, say) is not timed or counted
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <getopt.h>
+#include <unistd.h>
+#include <crypto++/secblock.h>
+#include "DronePlotDB.h"
+#include "PlotCodec.h"
+#include "Frame.h"
+#include "TCPConn.h"
+#include "LogMgr.h"
+#include "ReplServer.h"
+#include "strfuncts.h"
+
+using namespace std;
+
+/*****************************************************************************************
+ * Allocation counting - every allocation in the process goes through these, so a
+ * benchmark can report how many its timed part made
+ *****************************************************************************************/
+
+static std::atomic<uint64_t> alloc_count(0);
+static std::atomic<uint64_t> alloc_bytes(0);
+
+static void *countedAlloc(size_t size, size_t align = 0) {
+   alloc_count.fetch_add(1, std::memory_order_relaxed);
+   alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+
+   void *ptr;
+   if (align > alignof(std::max_align_t))
+      ptr = aligned_alloc(align, (size + align - 1) / align * align);
+   else
+      ptr = malloc(size > 0 ? size : 1);
+
+   if (ptr == NULL)
+      throw std::bad_alloc();
+   return ptr;
+}
+
+// Kept out of line so the compiler does not see free() paired with operator new
+__attribute__((noinline)) static void countedFree(void *ptr) {
+   free(ptr);
+}
+
+void *operator new(size_t size) { return countedAlloc(size); }
+void *operator new[](size_t size) { return countedAlloc(size); }
+void *operator new(size_t size, std::align_val_t align) { return countedAlloc(size, (size_t) align); }
+void *operator new[](size_t size, std::align_val_t align) { return countedAlloc(size, (size_t) align); }
+void operator delete(void *ptr) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr) noexcept { countedFree(ptr); }
+void operator delete(void *ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { countedFree(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept { countedFree(ptr); }
+
+/*****************************************************************************************
+ * Bench - one run of a benchmark: how many iterations to do, and the time and allocations
+ *         of the timed part. The benchmark loops iterations() times, stepping outside the
+ *         timing with pause()/resume() for setup
+ *****************************************************************************************/
+
+class Bench
+{
+public:
+   Bench(uint64_t iterations):_iterations(iterations),_elapsed_ns(0),_allocs(0),
+                              _alloc_bytes(0),_items(1),_bytes(0),_running(false) {};
+
+   uint64_t iterations() { return _iterations; };
+
+   void resume() {
+      if (_running)
+         return;
+      _running = true;
+      _alloc_start = alloc_count.load();
+      _alloc_bytes_start = alloc_bytes.load();
+      _start = std::chrono::steady_clock::now();
+   };
+
+   void pause() {
+      if (!_running)
+         return;
+      auto now = std::chrono::steady_clock::now();
+      _elapsed_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(now - _start).count();
+      _allocs += alloc_count.load() - _alloc_start;
+      _alloc_bytes += alloc_bytes.load() - _alloc_bytes_start;
+      _running = false;
+   };
+
+   // Work done by one iteration--items (plots, messages) and bytes, for the throughput figures
+   void setItems(uint64_t items) { _items = items; };
+   void setBytes(uint64_t bytes) { _bytes = bytes; };
+
+   // Totals for the timed part of the run
+   uint64_t elapsedNs() { return _elapsed_ns; };
+   uint64_t allocs() { return _allocs; };
+   uint64_t allocBytes() { return _alloc_bytes; };
+   uint64_t items() { return _items * _iterations; };
+   uint64_t bytes() { return _bytes * _iterations; };
+
+private:
+   uint64_t _iterations;
+   uint64_t _elapsed_ns;
+   uint64_t _allocs;
+   uint64_t _alloc_bytes;
+   uint64_t _items;
+   uint64_t _bytes;
+
+   bool _running;
+   std::chrono::steady_clock::time_point _start;
+   uint64_t _alloc_start;
+   uint64_t _alloc_bytes_start;
+};
+
+struct BenchResult {
+   std::string name;
+   uint64_t size;
+   unsigned int threads;
+   uint64_t iterations;
+   double ns_per_op;
+   double items_per_sec;
+   double bytes_per_sec;
+   double allocs_per_op;
+   double alloc_bytes_per_op;
+};
+
+// Settings for the whole run (see displayHelp)
+struct BenchConfig {
+   double min_secs = 0.5;
+   uint64_t seed = 1;
+   bool quick = false;
+   std::string filter;
+};
+
+static BenchConfig config;
+static std::vector<BenchResult> results;
+
+/*****************************************************************************************
+ * runBench - runs a benchmark with more iterations each time until the timed part takes
+ *            at least min_secs, then reports that run. Skipped if it does not match the
+ *            filter
+ *
+ *    Params:  name - benchmark name
+ *             size - its size parameter (plots, bytes), 0 for none
+ *             threads - threads it uses
+ *             bench - the benchmark, called with a fresh Bench each run
+ *****************************************************************************************/
+
+template <typename F>
+void runBench(const char *name, uint64_t size, unsigned int threads, F bench) {
+   std::stringstream fullname;
+   fullname << name << "/" << size;
+   if (threads > 1)
+      fullname << "/threads:" << threads;
+   if ((config.filter.size() > 0) && (fullname.str().find(config.filter) == std::string::npos))
+      return;
+
+   uint64_t min_ns = (uint64_t) (config.min_secs * 1e9);
+   uint64_t iterations = 1;
+   while (true) {
+      Bench run(iterations);
+      run.resume();
+      bench(run);
+      run.pause();
+
+      if ((run.elapsedNs() >= min_ns) || (iterations >= 1000000000)) {
+         BenchResult result;
+         result.name = name;
+         result.size = size;
+         result.threads = threads;
+         result.iterations = iterations;
+         result.ns_per_op = (double) run.elapsedNs() / iterations;
+         double secs = run.elapsedNs() / 1e9;
+         result.items_per_sec = (secs > 0) ? run.items() / secs : 0;
+         result.bytes_per_sec = (secs > 0) ? run.bytes() / secs : 0;
+         result.allocs_per_op = (double) run.allocs() / iterations;
+         result.alloc_bytes_per_op = (double) run.allocBytes() / iterations;
+         results.push_back(result);
+
+         printf("%-34s %12lu %14.1f %14.0f %10.1f %12.2f\n", fullname.str().c_str(),
+                  (unsigned long) iterations, result.ns_per_op, result.items_per_sec,
+                  result.bytes_per_sec / (1024 * 1024), result.allocs_per_op);
+         fflush(stdout);
+         return;
+      }
+
+      // Aim past the minimum next time, growing at most 100x a step
+      double scale = (run.elapsedNs() > 0) ? (1.4 * min_ns) / run.elapsedNs() : 100.0;
+      scale = std::min(100.0, std::max(2.0, scale));
+      iterations = (uint64_t) (iterations * scale);
+   }
+}
+
+/*****************************************************************************************
+ * Test data - all of it generated from the seed
+ *****************************************************************************************/
+
+// Clock offsets of the three generated nodes--node 1 is the leader
+const int bench_offsets[] = {0, 0, 13, -7};
+
+/*****************************************************************************************
+ * makePlots - count plots from three nodes, each observation reported by all three with
+ *             its node's clock offset, so skew can be learned and two thirds are duplicates
+ *             once it is. shuffle mixes the order they arrive in
+ *****************************************************************************************/
+
+static void makePlots(size_t count, bool shuffle, std::vector<WirePlot> &plots) {
+   std::mt19937_64 rng(config.seed);
+   std::uniform_real_distribution<float> lat(39.0, 40.0), lon(-85.0, -84.0);
+
+   plots.clear();
+   plots.reserve(count);
+   for (size_t obs = 0; plots.size() < count; obs++) {
+      WirePlot plot;
+      plot.drone_id = (uint32_t) (obs % 64) + 1;
+      plot.latitude = lat(rng);
+      plot.longitude = lon(rng);
+
+      for (unsigned int node = 1; (node <= 3) && (plots.size() < count); node++) {
+         plot.node_id = node;
+         plot.timestamp = 1000 + (int64_t) (obs / 64) * 5 + bench_offsets[node];
+         plots.push_back(plot);
+      }
+   }
+
+   if (shuffle)
+      std::shuffle(plots.begin(), plots.end(), rng);
+}
+
+static void makePayload(size_t size, std::vector<uint8_t> &payload) {
+   std::mt19937_64 rng(config.seed);
+
+   payload.resize(size);
+   for (size_t i = 0; i < size; i++)
+      payload[i] = (uint8_t) rng();
+}
+
+/*****************************************************************************************
+ * makeReplServer - ReplServer wants servers.txt and sharedkey.bin in the working directory,
+ *                  which main has made dir. Writes a three node set there and builds the
+ *                  server
+ *****************************************************************************************/
+
+static ReplServer *makeReplServer(const std::string &dir, DronePlotDB &db) {
+   std::ofstream servers(dir + "/servers.txt");
+   servers << "ds1, 127.0.0.1, 9999\nds2, 127.0.0.1, 9998\nds3, 127.0.0.1, 9997\n";
+   servers.close();
+
+   std::vector<uint8_t> key;
+   makePayload(16, key);
+   std::ofstream keyfile(dir + "/sharedkey.bin", std::ios::binary);
+   keyfile.write((const char *) key.data(), key.size());
+   keyfile.close();
+
+   return new ReplServer(db, 1.0);
+}
+
+/*****************************************************************************************
+ * The benchmarks
+ *****************************************************************************************/
+
+// DronePlot::serialize and deserialize, one plot at a time
+static void benchPlotCoding() {
+   DronePlot plot(7, 1, 123456, 39.5, -84.5);
+   std::vector<uint8_t> buf;
+   buf.reserve(wire_plot_size);
+
+   runBench("plot_serialize", wire_plot_size, 1, [&](Bench &b) {
+      b.setBytes(wire_plot_size);
+      for (uint64_t i = 0; i < b.iterations(); i++) {
+         buf.clear();
+         plot.serialize(buf);
+      }
+   });
+
+   plot.serialize(buf);
+   DronePlot out;
+   runBench("plot_deserialize", wire_plot_size, 1, [&](Bench &b) {
+      b.setBytes(wire_plot_size);
+      for (uint64_t i = 0; i < b.iterations(); i++)
+         out.deserialize(buf);
+   });
+}
+
+// encodePlotBatch and decodePlotBatch--what replication actually sends
+static void benchBatchCoding() {
+   const size_t sizes[] = {100, 1000, 10000};
+
+   for (size_t count : sizes) {
+      std::vector<WirePlot> plots, decoded;
+      std::vector<uint8_t> buf;
+      makePlots(count, false, plots);
+      size_t bytes = wire_batch_header + count * wire_plot_size;
+
+      runBench("batch_encode", count, 1, [&](Bench &b) {
+         b.setItems(count);
+         b.setBytes(bytes);
+         for (uint64_t i = 0; i < b.iterations(); i++) {
+            buf.clear();
+            encodePlotBatch(plots.data(), plots.size(), buf);
+         }
+      });
+
+      runBench("batch_decode", count, 1, [&](Bench &b) {
+         b.setItems(count);
+         b.setBytes(bytes);
+         for (uint64_t i = 0; i < b.iterations(); i++)
+            decodePlotBatch(buf.data(), buf.size(), decoded);
+      });
+   }
+}
+
+// encodeFrame, and FrameDecoder fed the frame in TCP segment sized pieces
+static void benchFraming() {
+   const size_t sizes[] = {64, 4096, 65536, 1048576};
+   const size_t segment = 1448;
+
+   for (size_t size : sizes) {
+      std::vector<uint8_t> payload, frame, out;
+      makePayload(size, payload);
+      encodeFrame(frame_rep, 0, payload, frame);
+
+      runBench("frame_encode", size, 1, [&](Bench &b) {
+         b.setBytes(size);
+         for (uint64_t i = 0; i < b.iterations(); i++) {
+            out.clear();
+            encodeFrame(frame_rep, 0, payload, out);
+         }
+      });
+
+      FrameDecoder decoder;
+      uint8_t type;
+      uint16_t flags;
+      runBench("frame_decode", size, 1, [&](Bench &b) {
+         b.setBytes(size);
+         for (uint64_t i = 0; i < b.iterations(); i++) {
+            for (size_t pos = 0; pos < frame.size(); pos += segment)
+               decoder.feed(frame.data() + pos, std::min(segment, frame.size() - pos));
+            if (!decoder.next(type, flags, out))
+               throw std::runtime_error("frame_decode: frame did not come back out.");
+         }
+      });
+   }
+}
+
+// TCPConn::encryptData, and decryptInPlace over the payload of an encrypted frame the way the
+// receive path runs it. CFB costs the same whatever the bytes are, so the frame is decrypted
+// over and over where it sits and no copy is timed
+static void benchCrypto() {
+   const size_t sizes[] = {64, 4096, 65536, 1048576};
+   const size_t iv_size = 16;
+
+   std::vector<uint8_t> key;
+   makePayload(16, key);
+   CryptoPP::SecByteBlock aes_key(key.data(), key.size());
+   LogMgr log("repbench.log", 0);
+   TCPConn conn(log, aes_key, 0);
+
+   for (size_t size : sizes) {
+      std::vector<uint8_t> buf, frame;
+      makePayload(size, buf);
+      buf.reserve(size + iv_size);
+
+      runBench("encrypt", size, 1, [&](Bench &b) {
+         b.setBytes(size);
+         for (uint64_t i = 0; i < b.iterations(); i++) {
+            buf.resize(size);
+            conn.encryptData(buf);
+         }
+      });
+
+      encodeFrame(frame_rep, 0, buf, frame);
+      runBench("decrypt", size, 1, [&](Bench &b) {
+         b.setBytes(size);
+         for (uint64_t i = 0; i < b.iterations(); i++)
+            conn.decryptInPlace(frame.data() + frame_header_size, frame.size() - frame_header_size);
+      });
+   }
+}
+
+// DronePlotDB::sortByTime on plots that arrived out of order
+static void benchSort(const std::vector<size_t> &sizes) {
+   for (size_t count : sizes) {
+      std::vector<WirePlot> plots;
+      makePlots(count, true, plots);
+
+      runBench("db_sort", count, 1, [&](Bench &b) {
+         b.setItems(count);
+         for (uint64_t i = 0; i < b.iterations(); i++) {
+            b.pause();
+            std::unique_ptr<DronePlotDB> db(new DronePlotDB);
+            db->addPlots(plots.data(), plots.size());
+            b.resume();
+
+            db->sortByTime();
+
+            b.pause();
+            db.reset();
+            b.resume();
+         }
+      });
+   }
+}
+
+// DronePlotDB::addPlot from several threads at once into one database
+static void benchAddPlot() {
+   const size_t count = 100000;
+   const unsigned int threads[] = {1, 2, 4, 8};
+
+   std::vector<WirePlot> plots;
+   makePlots(count, false, plots);
+
+   for (unsigned int nthreads : threads) {
+      runBench("db_addplot", count, nthreads, [&](Bench &b) {
+         b.setItems(count);
+         for (uint64_t i = 0; i < b.iterations(); i++) {
+            b.pause();
+            std::unique_ptr<DronePlotDB> db(new DronePlotDB);
+            std::atomic<bool> go(false);
+            std::vector<std::thread> workers;
+            for (unsigned int t = 0; t < nthreads; t++) {
+               workers.emplace_back([&, t]() {
+                  while (!go.load())
+                     std::this_thread::yield();
+                  for (size_t p = t; p < count; p += nthreads) {
+                     const WirePlot &plot = plots[p];
+                     db->addPlot(plot.drone_id, plot.node_id, plot.timestamp, plot.latitude,
+                                                                           plot.longitude);
+                  }
+               });
+            }
+            b.resume();
+
+            go = true;
+            for (auto wptr = workers.begin(); wptr != workers.end(); wptr++)
+               wptr->join();
+
+            b.pause();
+            db.reset();
+            b.resume();
+         }
+      });
+   }
+}
+
+// ReplServer::checkSkew (with correctSkew) and deduplicate over a database of fresh plots
+static void benchMaintenance(const std::vector<size_t> &sizes, const std::string &dir) {
+   for (size_t count : sizes) {
+      std::vector<WirePlot> plots;
+      makePlots(count, true, plots);
+
+      runBench("repl_checkskew", count, 1, [&](Bench &b) {
+         b.setItems(count);
+         for (uint64_t i = 0; i < b.iterations(); i++) {
+            b.pause();
+            std::unique_ptr<DronePlotDB> db(new DronePlotDB);
+            db->addPlots(plots.data(), plots.size());
+            db->sortByTime();
+            std::unique_ptr<ReplServer> server(makeReplServer(dir, *db));
+            b.resume();
+
+            server->checkSkew();
+            server->correctSkew();
+
+            b.pause();
+            server.reset();
+            db.reset();
+            b.resume();
+         }
+      });
+
+      runBench("repl_deduplicate", count, 1, [&](Bench &b) {
+         b.setItems(count);
+         for (uint64_t i = 0; i < b.iterations(); i++) {
+            b.pause();
+            std::unique_ptr<DronePlotDB> db(new DronePlotDB);
+            db->addPlots(plots.data(), plots.size());
+            db->sortByTime();
+            std::unique_ptr<ReplServer> server(makeReplServer(dir, *db));
+            server->checkSkew();
+            server->correctSkew();
+            b.resume();
+
+            server->deduplicate();
+
+            b.pause();
+            server.reset();
+            db.reset();
+            b.resume();
+         }
+      });
+   }
+}
+
+/*****************************************************************************************
+ * writeJSON - writes the run settings and every result to filename
+ *
+ *    Returns: false if the file could not be written
+ *****************************************************************************************/
+
+static bool writeJSON(const char *filename) {
+   std::ofstream out(filename);
+   if (!out.is_open())
+      return false;
+
+   std::string stamp;
+   LogMgr::createTimestamp(stamp);
+
+   out.precision(10);
+   out << "{\n  \"context\": {\"date\": \"" << stamp << "\", \"seed\": " << config.seed <<
+          ", \"min_time_secs\": " << config.min_secs << ", \"quick\": " <<
+          (config.quick ? "true" : "false") << "},\n  \"benchmarks\": [\n";
+
+   for (size_t i = 0; i < results.size(); i++) {
+      const BenchResult &res = results[i];
+      out << "    {\"name\": \"" << res.name << "\", \"size\": " << res.size << ", \"threads\": " <<
+             res.threads << ", \"iterations\": " << res.iterations << ", \"ns_per_op\": " <<
+             res.ns_per_op << ", \"items_per_second\": " << res.items_per_sec <<
+             ", \"bytes_per_second\": " << res.bytes_per_sec << ", \"allocs_per_op\": " <<
+             res.allocs_per_op << ", \"alloc_bytes_per_op\": " << res.alloc_bytes_per_op << "}" <<
+             ((i + 1 < results.size()) ? ",\n" : "\n");
+   }
+   out << "  ]\n}\n";
+
+   out.close();
+   return !out.fail();
+}
+
+/*****************************************************************************************
+ * displayHelp - Shows command line parameters to the user.
+ *****************************************************************************************/
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [options]\n";
+   std::cout << "   j: write the results as JSON to this file\n";
+   std::cout << "   f: only run benchmarks whose name contains this (e.g. db_sort, /1000)\n";
+   std::cout << "   s: seed for the generated data (default: 1)\n";
+   std::cout << "   t: minimum seconds each benchmark is timed for (default: 0.5)\n";
+   std::cout << "   q: quick - database benchmarks stop at 100k plots\n";
+}
+
+
+int main(int argc, char *argv[]) {
+   std::string json_file;
+
+   int c = 0;
+   while ((c = getopt(argc, argv, "j:f:s:t:qh")) != -1) {
+      switch (c) {
+
+      case 'j':
+         json_file = optarg;
+         break;
+
+      case 'f':
+         config.filter = optarg;
+         break;
+
+      case 's':
+         config.seed = strtoull(optarg, NULL, 10);
+         break;
+
+      case 't':
+         config.min_secs = strtod(optarg, NULL);
+         if (config.min_secs <= 0.0) {
+            std::cerr << "Invalid minimum time. Must be > 0.\n";
+            exit(0);
+         }
+         break;
+
+      case 'q':
+         config.quick = true;
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   std::vector<size_t> db_sizes = {1000, 10000, 100000};
+   if (!config.quick)
+      db_sizes.push_back(1000000);
+
+   // Scratch directory for the ReplServer's configuration files and its server.log, all of
+   // which it finds relative to the working directory--so the benchmarks run from in there
+   char cwd[4096];
+   char dirbuf[] = "/tmp/repbenchXXXXXX";
+   if (getcwd(cwd, sizeof(cwd)) == NULL) {
+      std::cerr << "Unable to get the working directory.\n";
+      exit(-1);
+   }
+   if ((mkdtemp(dirbuf) == NULL) || (chdir(dirbuf) != 0)) {
+      std::cerr << "Unable to create a scratch directory.\n";
+      exit(-1);
+   }
+   std::string scratch = dirbuf;
+
+   printf("%-34s %12s %14s %14s %10s %12s\n", "benchmark", "iterations", "ns/op", "items/s",
+                                                                     "MB/s", "allocs/op");
+
+   try {
+      benchPlotCoding();
+      benchBatchCoding();
+      benchFraming();
+      benchCrypto();
+      benchSort(db_sizes);
+      benchAddPlot();
+      benchMaintenance(db_sizes, scratch);
+   } catch (std::exception &e) {
+      std::cerr << "Benchmark failed: " << e.what() << "\n";
+      exit(-1);
+   }
+
+   unlink("servers.txt");
+   unlink("sharedkey.bin");
+   unlink("server.log");
+   if (chdir(cwd) != 0) {
+      std::cerr << "Unable to change back to the working directory.\n";
+      exit(-1);
+   }
+   rmdir(scratch.c_str());
+
+   if ((json_file.size() > 0) && !writeJSON(json_file.c_str())) {
+      std::cerr << "Unable to write results to " << json_file << "\n";
+      exit(-1);
+   }
+   return 0;
+}
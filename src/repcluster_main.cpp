@@ -0,0 +1,884 @@
+/****************************************************************************************
+ * repcluster_main - runs a whole replication cluster on one machine and reports how it
+ *                   did: how long the nodes took to agree once the antennas went quiet,
+ *                   how far apart their final databases are, and the bytes on the wire
+ *                   and CPU each node used (less what its fingerprint sampling used, which
+ *                   is reported on its own)
+ *
+ *                   Each node is a ReplServer and AntennaSim, as repsvr runs them, in a
+ *                   child process of its own so its CPU can be measured on its own and
+ *                   one node falling over cannot take the rest with it. The nodes share a
+ *                   generated working directory--servers.txt (ds1..dsN on loopback),
+ *                   sharedkey.bin, the whitelist and one sim data file per node. The sim
+ *                   data is generated from the seed: every drone reports every so many
+ *                   seconds, each node hears a given report with some probability, and
+ *                   each node's clock is off by a random number of seconds
+ *
+ *                   While they run, the nodes report a fingerprint of their database
+ *                   (plot count and an order-independent hash of the corrected plots)
+ *                   to the harness every sample_ms. The cluster has converged once every
+ *                   fingerprint has been the same for the agreement window
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "DronePlotDB.h"
+#include "AntennaSim.h"
+#include "ReplServer.h"
+#include "LogMgr.h"
+
+using namespace std;
+
+// How often each node reports its fingerprint to the harness
+const int sample_ms = 100;
+
+// Largest cluster the harness will start
+const unsigned int max_cluster_nodes = 500;
+
+// Nodes get this long to shut down and write their databases before they are killed
+const int64_t stop_grace_us = 30000000;
+
+/*****************************************************************************************
+ * ClusterConfig - the shape of the cluster and the load driven through it. Times are sim
+ *                 seconds unless they say otherwise
+ *****************************************************************************************/
+
+struct ClusterConfig {
+   unsigned int nodes = 3;
+   unsigned int drones = 5;
+   unsigned int interval = 5;       // between one drone's reports
+   double coverage = 0.5;           // chance a node hears any one report
+   int duration = 300;              // reports are generated up to this time
+   int max_skew = 3;                // node clocks are off by up to this, either way
+   float time_mult = 10.0;
+   unsigned short base_port = 20000;
+   uint64_t seed = 1;
+   int agree_secs = 40;             // fingerprints must match this long to count
+   int settle_limit = 60;           // real seconds to wait for agreement after the last inject
+   bool keep = false;
+};
+
+static ClusterConfig config;
+
+/*****************************************************************************************
+ * NodeSample - what a node tells the harness every sample_ms, and once more (final set)
+ *              after it has shut down. Small enough that a pipe writes it in one piece
+ *****************************************************************************************/
+
+struct NodeSample {
+   uint32_t node;
+   uint32_t plots;
+   int64_t at_us;          // steady clock, shared by every process on the machine
+   uint64_t fingerprint;
+   uint64_t wire_in;
+   uint64_t wire_out;
+   int64_t injected_us;    // when the antenna ran out of plots, 0 until then
+   int64_t sample_user_us; // CPU spent taking the fingerprints so far
+   int64_t sample_sys_us;
+   uint32_t final;
+};
+
+/*****************************************************************************************
+ * NodeProc - the harness's view of one node process
+ *****************************************************************************************/
+
+struct NodeProc {
+   unsigned int node;
+   pid_t pid = -1;
+   int sample_fd[2] = {-1, -1};     // node writes, harness reads
+   int control_fd[2] = {-1, -1};    // harness holds the write end; closing it stops the node
+   NodeSample last;
+   bool reported = false;
+   bool finished = false;           // final sample in
+   bool lost = false;               // pipe closed with no final sample
+   int status = 0;
+   struct rusage usage;             // with the fingerprint sampling taken out
+   double sample_cpu_ms = 0.0;      // what the sampling used
+   size_t sim_plots = 0;
+   size_t db_plots = 0;
+   size_t missing = 0;
+};
+
+// A plot as every node should end up holding it: drone, corrected time, coordinate bits
+typedef std::tuple<unsigned int, time_t, uint32_t, uint32_t> PlotKey;
+
+static int64_t steadyMicros() {
+   return std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t tvMicros(const struct timeval &tv) {
+   return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*****************************************************************************************
+ * mix - splitmix64 finalizer, for the generated data and the plot hashes
+ *****************************************************************************************/
+
+static uint64_t mix(uint64_t x) {
+   x += 0x9e3779b97f4a7c15ULL;
+   x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+   return x ^ (x >> 31);
+}
+
+static PlotKey plotKey(unsigned int drone_id, time_t timestamp, float latitude, float longitude) {
+   uint32_t lat, lon;
+   memcpy(&lat, &latitude, sizeof(lat));
+   memcpy(&lon, &longitude, sizeof(lon));
+   return PlotKey(drone_id, timestamp, lat, lon);
+}
+
+static uint64_t plotHash(const PlotKey &key) {
+   uint64_t h = mix(std::get<0>(key));
+   h = mix(h ^ (uint64_t) std::get<1>(key));
+   return mix(h ^ (((uint64_t) std::get<2>(key) << 32) | std::get<3>(key)));
+}
+
+static std::string nodeFile(const std::string &dir, unsigned int node, const char *ext) {
+   return dir + "/node" + std::to_string(node) + ext;
+}
+
+/*****************************************************************************************
+ * writeConfig - writes the files every node reads from its working directory
+ *
+ *    Throws: runtime_error if a file cannot be written
+ *****************************************************************************************/
+
+static void writeConfig(const std::string &dir) {
+   std::ofstream servers(dir + "/servers.txt");
+   for (unsigned int i = 1; i <= config.nodes; i++)
+      servers << "ds" << i << ", 127.0.0.1, " << (config.base_port + i - 1) << "\n";
+   servers.close();
+
+   std::mt19937_64 rng(config.seed);
+   std::ofstream keyfile(dir + "/sharedkey.bin", std::ios::binary);
+   for (unsigned int i = 0; i < 16; i++)
+      keyfile.put((char) (rng() & 0xff));
+   keyfile.close();
+
+   std::ofstream whitelist(dir + "/whitelist");
+   whitelist << "127.0.0.1\n";
+   whitelist.close();
+
+   if (servers.fail() || keyfile.fail() || whitelist.fail())
+      throw std::runtime_error("Unable to write the cluster configuration.");
+}
+
+/*****************************************************************************************
+ * writeSimData - generates the reports and writes each node's share as its sim data file.
+ *                A drone's position at a given time is a function of the seed, so every
+ *                node that hears a report hears the same coordinates; only the timestamp
+ *                differs, by that node's clock skew
+ *
+ *    Returns: the number of distinct reports heard by at least one node--what every
+ *             database should hold once duplicates are gone
+ *
+ *    Throws: runtime_error if a node would hear nothing or a file cannot be written
+ *****************************************************************************************/
+
+static size_t writeSimData(const std::string &dir, std::vector<NodeProc> &procs) {
+   std::mt19937_64 rng(config.seed);
+   std::uniform_int_distribution<int> skew_dist(-config.max_skew, config.max_skew);
+
+   std::vector<int> skews(config.nodes + 1, 0);
+   for (unsigned int n = 1; n <= config.nodes; n++)
+      skews[n] = skew_dist(rng);
+
+   std::vector<std::vector<WirePlot>> heard(config.nodes + 1);
+   size_t distinct = 0;
+
+   // Start late enough that no skewed timestamp goes negative
+   for (int t = config.max_skew + 1; t <= config.duration; t += config.interval) {
+      for (unsigned int d = 1; d <= config.drones; d++) {
+         uint64_t report = mix(config.seed ^ ((uint64_t) d << 32) ^ (uint64_t) t);
+
+         WirePlot plot;
+         plot.drone_id = d;
+         plot.latitude = 39.5f + (float) (report & 0xffffff) / 16777216.0f;
+         plot.longitude = -84.5f + (float) ((report >> 24) & 0xffffff) / 16777216.0f;
+
+         bool seen = false;
+         for (unsigned int n = 1; n <= config.nodes; n++) {
+            double roll = (double) (mix(report ^ n) >> 11) / 9007199254740992.0;
+            if (roll >= config.coverage)
+               continue;
+
+            plot.node_id = n;
+            plot.timestamp = t + skews[n];
+            heard[n].push_back(plot);
+            seen = true;
+         }
+         if (seen)
+            distinct++;
+      }
+   }
+
+   for (unsigned int n = 1; n <= config.nodes; n++) {
+      if (heard[n].size() == 0)
+         throw std::runtime_error("Node " + std::to_string(n) + " hears no reports--raise the "
+                                                   "coverage, drone count or duration.");
+
+      DronePlotDB db;
+      db.addPlots(heard[n].data(), heard[n].size());
+      if (db.writeBinaryFile(nodeFile(dir, n, ".bin").c_str()) < 0)
+         throw std::runtime_error("Unable to write the sim data for node " + std::to_string(n));
+      procs[n - 1].sim_plots = heard[n].size();
+   }
+   return distinct;
+}
+
+/*****************************************************************************************
+ * fingerprint - counts the plots a node would keep (not flagged as duplicates) and adds up
+ *               their hashes, from a snapshot so replication carries on meanwhile
+ *****************************************************************************************/
+
+static void fingerprint(DronePlotDB &db, uint32_t &plots, uint64_t &print) {
+   PlotSnapshotPtr snap = db.snapshot();
+   plots = 0;
+   print = 0;
+
+   for (size_t slot = snap->firstLive(); slot < snap->endSlot(); slot = snap->nextLive(slot + 1)) {
+      if (snap->flags(slot) & DBFLAG_DUPE)
+         continue;
+      print += plotHash(plotKey(snap->droneID(slot), snap->correctedTime(slot),
+                                             snap->latitude(slot), snap->longitude(slot)));
+      plots++;
+   }
+}
+
+/*****************************************************************************************
+ * takeSample - fingerprints the node into sample, adding the CPU this thread spent doing it
+ *              to the sample's totals so the harness can keep it out of the node's figures
+ *****************************************************************************************/
+
+static void takeSample(DronePlotDB &db, NodeSample &sample) {
+   struct rusage before, after;
+   getrusage(RUSAGE_THREAD, &before);
+   fingerprint(db, sample.plots, sample.fingerprint);
+   getrusage(RUSAGE_THREAD, &after);
+
+   sample.sample_user_us += tvMicros(after.ru_utime) - tvMicros(before.ru_utime);
+   sample.sample_sys_us += tvMicros(after.ru_stime) - tvMicros(before.ru_stime);
+}
+
+static bool sendSample(int fd, const NodeSample &sample) {
+   ssize_t sent;
+   do {
+      sent = write(fd, &sample, sizeof(sample));
+   } while ((sent < 0) && (errno == EINTR));
+   return sent == (ssize_t) sizeof(sample);
+}
+
+/*****************************************************************************************
+ * runNode - the body of a node process: repsvr's main loop, reporting a sample each
+ *           sample_ms until the harness closes the control pipe, then writing the final
+ *           database to node<N>.csv as repsvr would
+ *
+ *    Returns: the process exit code
+ *****************************************************************************************/
+
+static int runNode(const std::string &dir, unsigned int node, int sample_fd, int control_fd) {
+
+   // Anything the node prints goes to its own log
+   int logfd = open(nodeFile(dir, node, ".log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (logfd >= 0) {
+      dup2(logfd, STDOUT_FILENO);
+      dup2(logfd, STDERR_FILENO);
+      close(logfd);
+   }
+
+   // Shares the directory with the other nodes--QueueMgr looks for its files here
+   if (chdir(dir.c_str()) != 0) {
+      std::cerr << "Unable to change to " << dir << "\n";
+      return -1;
+   }
+
+   try {
+      DronePlotDB db;
+      PlotRing ingest;
+
+      AntennaSim sim(db, nodeFile(dir, node, ".bin").c_str(), config.time_mult, 0);
+      sim.setIngestRing(&ingest);
+
+      // Clock skew is in the generated data, so the antenna adds no offset of its own
+      sim.setOffset(0);
+
+      // The server comes up before the antenna starts, so a port that will not bind fails
+      // the node with no threads left running
+      ReplServer repl_server(db, "127.0.0.1", config.base_port + node - 1, 0,
+                                                                        config.time_mult, 0);
+      repl_server.setIngestRing(&ingest);
+
+      std::atomic<int64_t> injected_us(0);
+      std::thread simthread([&]() {
+         sim.simulate();
+         injected_us = steadyMicros();
+      });
+
+      // Already registered by the server, so the help text here is not used
+      MetricsRegistry &metrics = repl_server.getMetrics();
+      MetricCounter &wire_in = metrics.counter("repsvr_wire_bytes_total", "", "direction=\"in\"");
+      MetricCounter &wire_out = metrics.counter("repsvr_wire_bytes_total", "",
+                                                                     "direction=\"out\"");
+
+      std::thread replthread([&]() { repl_server.replicate(); });
+
+      NodeSample sample;
+      memset(&sample, 0, sizeof(sample));
+      sample.node = node;
+
+      // Sample until the harness closes its end of the control pipe
+      pollfd pfd;
+      pfd.fd = control_fd;
+      pfd.events = POLLIN;
+      while (poll(&pfd, 1, sample_ms) == 0) {
+         takeSample(db, sample);
+         sample.at_us = steadyMicros();
+         sample.wire_in = wire_in.value();
+         sample.wire_out = wire_out.value();
+         sample.injected_us = injected_us;
+         if (!sendSample(sample_fd, sample))
+            break;
+      }
+
+      repl_server.shutdown();
+      sim.terminate();
+      simthread.join();
+      replthread.join();
+      repl_server.drainIngest();
+
+      db.sortByTime();
+      db.writeCSVFile(nodeFile(dir, node, ".csv").c_str());
+
+      takeSample(db, sample);
+      sample.at_us = steadyMicros();
+      sample.wire_in = wire_in.value();
+      sample.wire_out = wire_out.value();
+      sample.injected_us = injected_us;
+      sample.final = 1;
+      sendSample(sample_fd, sample);
+
+   } catch (std::exception &e) {
+      std::cerr << "Node " << node << " failed: " << e.what() << "\n";
+      return -1;
+   }
+   return 0;
+}
+
+/*****************************************************************************************
+ * startNodes - forks a process for each node. Every pipe is made first, so each child
+ *              closes the harness's ends--its own and every other node's--or a node would
+ *              never see its control pipe close
+ *
+ *    Throws: runtime_error if a pipe or process cannot be made
+ *****************************************************************************************/
+
+static void startNodes(const std::string &dir, std::vector<NodeProc> &procs) {
+   for (auto pptr = procs.begin(); pptr != procs.end(); pptr++) {
+      if ((pipe(pptr->sample_fd) != 0) || (pipe(pptr->control_fd) != 0))
+         throw std::runtime_error("Unable to create the node pipes.");
+   }
+
+   std::cout.flush();
+   for (size_t i = 0; i < procs.size(); i++) {
+      pid_t pid = fork();
+      if (pid < 0)
+         throw std::runtime_error("Unable to start node " + std::to_string(procs[i].node));
+
+      if (pid == 0) {
+         for (size_t j = 0; j < procs.size(); j++) {
+            close(procs[j].sample_fd[0]);
+            close(procs[j].control_fd[1]);
+            if (j != i) {
+               close(procs[j].sample_fd[1]);
+               close(procs[j].control_fd[0]);
+            }
+         }
+         _exit(runNode(dir, procs[i].node, procs[i].sample_fd[1], procs[i].control_fd[0]) & 0xff);
+      }
+      procs[i].pid = pid;
+   }
+
+   for (auto pptr = procs.begin(); pptr != procs.end(); pptr++) {
+      close(pptr->sample_fd[1]);
+      close(pptr->control_fd[0]);
+      pptr->sample_fd[1] = pptr->control_fd[0] = -1;
+   }
+}
+
+/*****************************************************************************************
+ * readSamples - waits up to sample_ms for samples and takes whatever has arrived
+ *
+ *    Returns: false once every node's pipe has closed
+ *****************************************************************************************/
+
+static bool readSamples(std::vector<NodeProc> &procs) {
+   std::vector<pollfd> pfds;
+   std::vector<NodeProc *> owners;
+   for (auto pptr = procs.begin(); pptr != procs.end(); pptr++) {
+      if (pptr->sample_fd[0] < 0)
+         continue;
+      pollfd pfd;
+      pfd.fd = pptr->sample_fd[0];
+      pfd.events = POLLIN;
+      pfds.push_back(pfd);
+      owners.push_back(&(*pptr));
+   }
+   if (pfds.size() == 0)
+      return false;
+
+   if (poll(pfds.data(), pfds.size(), sample_ms) <= 0)
+      return true;
+
+   for (size_t i = 0; i < pfds.size(); i++) {
+      if (pfds[i].revents == 0)
+         continue;
+
+      NodeProc &proc = *owners[i];
+      NodeSample sample;
+      ssize_t got = read(proc.sample_fd[0], &sample, sizeof(sample));
+      if ((got < 0) && (errno == EINTR))
+         continue;
+
+      if (got == (ssize_t) sizeof(sample)) {
+         proc.last = sample;
+         proc.reported = true;
+         proc.finished = proc.finished || sample.final;
+         continue;
+      }
+
+      // Closed (or garbled)--a node that goes before its final sample has failed
+      close(proc.sample_fd[0]);
+      proc.sample_fd[0] = -1;
+      proc.lost = !proc.finished;
+   }
+   return true;
+}
+
+/*****************************************************************************************
+ * stopNodes - closes every control pipe (or kills the nodes outright), takes the final
+ *             samples and reaps each process with its resource usage, less the CPU its
+ *             sampling used. A node still running stop_grace_us later is killed
+ *****************************************************************************************/
+
+static void stopNodes(std::vector<NodeProc> &procs, bool kill_nodes) {
+   for (auto pptr = procs.begin(); pptr != procs.end(); pptr++) {
+      if (kill_nodes)
+         kill(pptr->pid, SIGTERM);
+      close(pptr->control_fd[1]);
+      pptr->control_fd[1] = -1;
+   }
+
+   int64_t give_up = steadyMicros() + stop_grace_us;
+   while (readSamples(procs)) {
+      if (steadyMicros() < give_up)
+         continue;
+
+      for (auto pptr = procs.begin(); pptr != procs.end(); pptr++) {
+         if (pptr->sample_fd[0] >= 0)
+            kill(pptr->pid, SIGKILL);
+      }
+      give_up = INT64_MAX;
+   }
+
+   for (auto pptr = procs.begin(); pptr != procs.end(); pptr++) {
+      memset(&pptr->usage, 0, sizeof(pptr->usage));
+      while ((wait4(pptr->pid, &pptr->status, 0, &pptr->usage) < 0) && (errno == EINTR))
+         ;
+      if (!pptr->reported)
+         continue;
+
+      int64_t user_us = tvMicros(pptr->usage.ru_utime) - pptr->last.sample_user_us;
+      int64_t sys_us = tvMicros(pptr->usage.ru_stime) - pptr->last.sample_sys_us;
+      pptr->usage.ru_utime.tv_sec = user_us / 1000000;
+      pptr->usage.ru_utime.tv_usec = user_us % 1000000;
+      pptr->usage.ru_stime.tv_sec = sys_us / 1000000;
+      pptr->usage.ru_stime.tv_usec = sys_us % 1000000;
+      pptr->sample_cpu_ms = (double) (pptr->last.sample_user_us + pptr->last.sample_sys_us) /
+                                                                                    1000.0;
+   }
+}
+
+/*****************************************************************************************
+ * compareDatabases - loads each node's final CSV and counts how many of all the plots any
+ *                    node ended with each one is missing
+ *
+ *    Returns: the number of distinct plots across all the nodes; held_by_all is set to how
+ *             many of them every node has
+ *****************************************************************************************/
+
+static size_t compareDatabases(const std::string &dir, std::vector<NodeProc> &procs,
+                                                                     size_t &held_by_all) {
+   std::map<PlotKey, unsigned int> holders;
+   std::vector<std::vector<PlotKey>> held(procs.size());
+
+   for (size_t i = 0; i < procs.size(); i++) {
+      DronePlotDB db;
+      if (db.loadCSVFile(nodeFile(dir, procs[i].node, ".csv").c_str()) < 0)
+         continue;
+
+      PlotSnapshotPtr snap = db.snapshot();
+      for (size_t slot = snap->firstLive(); slot < snap->endSlot(); slot = snap->nextLive(slot + 1))
+         held[i].push_back(plotKey(snap->droneID(slot), snap->timestamp(slot),
+                                          snap->latitude(slot), snap->longitude(slot)));
+
+      // A node holding the same plot twice still only has it once
+      std::sort(held[i].begin(), held[i].end());
+      held[i].erase(std::unique(held[i].begin(), held[i].end()), held[i].end());
+      for (auto kptr = held[i].begin(); kptr != held[i].end(); kptr++)
+         holders[*kptr]++;
+      procs[i].db_plots = snap->endSlot();
+   }
+
+   held_by_all = 0;
+   for (auto hptr = holders.begin(); hptr != holders.end(); hptr++) {
+      if (hptr->second == procs.size())
+         held_by_all++;
+   }
+   for (size_t i = 0; i < procs.size(); i++)
+      procs[i].missing = holders.size() - held[i].size();
+
+   return holders.size();
+}
+
+/*****************************************************************************************
+ * removeDir - deletes the working directory and the files the run left in it
+ *****************************************************************************************/
+
+static void removeDir(const std::string &dir) {
+   DIR *dptr = opendir(dir.c_str());
+   if (dptr != NULL) {
+      struct dirent *entry;
+      while ((entry = readdir(dptr)) != NULL) {
+         if ((strcmp(entry->d_name, ".") != 0) && (strcmp(entry->d_name, "..") != 0))
+            unlink((dir + "/" + entry->d_name).c_str());
+      }
+      closedir(dptr);
+   }
+   rmdir(dir.c_str());
+}
+
+static double cpuMillis(const struct timeval &tv) {
+   return (double) tv.tv_sec * 1000.0 + (double) tv.tv_usec / 1000.0;
+}
+
+/*****************************************************************************************
+ * ClusterResult - what the run found, for the report
+ *****************************************************************************************/
+
+struct ClusterResult {
+   size_t injected = 0;
+   size_t distinct = 0;
+   bool converged = false;
+   double converge_secs = 0.0;
+   size_t union_plots = 0;
+   size_t held_by_all = 0;
+   uint64_t wire_bytes = 0;
+};
+
+/*****************************************************************************************
+ * writeJSON - writes the run settings, the cluster figures and each node's to filename
+ *
+ *    Returns: false if the file could not be written
+ *****************************************************************************************/
+
+static bool writeJSON(const char *filename, const ClusterResult &res,
+                                                      const std::vector<NodeProc> &procs) {
+   std::ofstream out(filename);
+   if (!out.is_open())
+      return false;
+
+   std::string stamp;
+   LogMgr::createTimestamp(stamp);
+
+   out.precision(10);
+   out << "{\n  \"context\": {\"date\": \"" << stamp << "\", \"seed\": " << config.seed <<
+          ", \"nodes\": " << config.nodes << ", \"drones\": " << config.drones <<
+          ", \"interval_secs\": " << config.interval << ", \"coverage\": " << config.coverage <<
+          ", \"duration_secs\": " << config.duration << ", \"max_skew_secs\": " <<
+          config.max_skew << ", \"time_mult\": " << config.time_mult << "},\n";
+
+   out << "  \"cluster\": {\"plots_injected\": " << res.injected << ", \"distinct_reports\": " <<
+          res.distinct << ", \"converged\": " << (res.converged ? "true" : "false") <<
+          ", \"convergence_secs\": " << res.converge_secs << ", \"union_plots\": " <<
+          res.union_plots << ", \"plots_on_every_node\": " << res.held_by_all <<
+          ", \"wire_bytes\": " << res.wire_bytes << "},\n  \"nodes\": [\n";
+
+   for (size_t i = 0; i < procs.size(); i++) {
+      const NodeProc &proc = procs[i];
+      out << "    {\"node\": " << proc.node << ", \"sim_plots\": " << proc.sim_plots <<
+             ", \"db_plots\": " << proc.db_plots << ", \"missing\": " << proc.missing <<
+             ", \"cpu_user_ms\": " << cpuMillis(proc.usage.ru_utime) << ", \"cpu_sys_ms\": " <<
+             cpuMillis(proc.usage.ru_stime) << ", \"sample_cpu_ms\": " << proc.sample_cpu_ms <<
+             ", \"max_rss_kb\": " << proc.usage.ru_maxrss <<
+             ", \"wire_in\": " << proc.last.wire_in << ", \"wire_out\": " << proc.last.wire_out <<
+             "}" << ((i + 1 < procs.size()) ? ",\n" : "\n");
+   }
+   out << "  ]\n}\n";
+
+   out.close();
+   return !out.fail();
+}
+
+/*****************************************************************************************
+ * displayHelp - Shows command line parameters to the user.
+ *****************************************************************************************/
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [options]\n";
+   std::cout << "   n: nodes in the cluster (default: 3)\n";
+   std::cout << "   D: drones (default: 5)\n";
+   std::cout << "   i: sim seconds between one drone's reports (default: 5)\n";
+   std::cout << "   c: chance each node hears a report, 0-1 (default: 0.5)\n";
+   std::cout << "   d: sim seconds of reports (default: 300)\n";
+   std::cout << "   k: most a node's clock is off by, in seconds (default: 3)\n";
+   std::cout << "   t: time multiplier - t=2.0 runs the sim at 2x speed (default: 10)\n";
+   std::cout << "   p: first node's port; the rest follow it (default: 20000)\n";
+   std::cout << "   s: seed for the generated data (default: 1)\n";
+   std::cout << "   a: sim seconds the nodes must agree for to count as converged (default: 40)\n";
+   std::cout << "   l: real seconds to wait for convergence after the last inject (default: 60)\n";
+   std::cout << "   j: write the results as JSON to this file\n";
+   std::cout << "   w: keep the working directory (sim data, node logs and CSVs)\n";
+}
+
+static long parseNumber(const char *arg, long low, long high, const char *what) {
+   long value = strtol(arg, NULL, 10);
+   if ((value < low) || (value > high)) {
+      std::cerr << "Invalid " << what << ". Range: " << low << " to " << high << "\n";
+      exit(0);
+   }
+   return value;
+}
+
+
+int main(int argc, char *argv[]) {
+   std::string json_file;
+
+   int c = 0;
+   while ((c = getopt(argc, argv, "n:D:i:c:d:k:t:p:s:a:l:j:wh")) != -1) {
+      switch (c) {
+
+      case 'n':
+         config.nodes = (unsigned int) parseNumber(optarg, 2, max_cluster_nodes, "node count");
+         break;
+
+      case 'D':
+         config.drones = (unsigned int) parseNumber(optarg, 1, 100000, "drone count");
+         break;
+
+      case 'i':
+         config.interval = (unsigned int) parseNumber(optarg, 1, 3600, "report interval");
+         break;
+
+      case 'c':
+         config.coverage = strtod(optarg, NULL);
+         if ((config.coverage <= 0.0) || (config.coverage > 1.0)) {
+            std::cerr << "Invalid coverage. Must be > 0 and <= 1.\n";
+            exit(0);
+         }
+         break;
+
+      case 'd':
+         config.duration = (int) parseNumber(optarg, 2, 100000, "duration");
+         break;
+
+      case 'k':
+         config.max_skew = (int) parseNumber(optarg, 0, 3600, "clock skew");
+         break;
+
+      case 't':
+         config.time_mult = strtof(optarg, NULL);
+         if (config.time_mult <= 0.0) {
+            std::cerr << "Invalid time multiplier. Must be > 0.\n";
+            exit(0);
+         }
+         break;
+
+      case 'p':
+         config.base_port = (unsigned short) parseNumber(optarg, 1, 65535, "port");
+         break;
+
+      case 's':
+         config.seed = strtoull(optarg, NULL, 10);
+         break;
+
+      case 'a':
+         config.agree_secs = (int) parseNumber(optarg, 0, 100000, "agreement window");
+         break;
+
+      case 'l':
+         config.settle_limit = (int) parseNumber(optarg, 1, 100000, "convergence limit");
+         break;
+
+      case 'j':
+         json_file = optarg;
+         break;
+
+      case 'w':
+         config.keep = true;
+         break;
+
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   if (config.base_port + config.nodes - 1 > 65535) {
+      std::cerr << "Not enough ports above " << config.base_port << " for " << config.nodes <<
+                                                                              " nodes.\n";
+      exit(0);
+   }
+
+   // A node that goes away must not take the harness with it
+   signal(SIGPIPE, SIG_IGN);
+
+   char dirbuf[] = "/tmp/repclusterXXXXXX";
+   if (mkdtemp(dirbuf) == NULL) {
+      std::cerr << "Unable to create a working directory.\n";
+      exit(-1);
+   }
+   std::string dir = dirbuf;
+
+   std::vector<NodeProc> procs(config.nodes);
+   for (unsigned int i = 0; i < config.nodes; i++)
+      procs[i].node = i + 1;
+
+   ClusterResult res;
+   bool failed = false;
+
+   try {
+      writeConfig(dir);
+      res.distinct = writeSimData(dir, procs);
+      for (auto pptr = procs.begin(); pptr != procs.end(); pptr++)
+         res.injected += pptr->sim_plots;
+
+      std::cout << "Cluster of " << config.nodes << " nodes in " << dir << ": " << config.drones <<
+                   " drones reporting every " << config.interval << " secs for " <<
+                   config.duration << " secs, coverage " << config.coverage << ", time x" <<
+                   config.time_mult << "\n";
+      std::cout << res.injected << " plots to inject, " << res.distinct << " distinct reports\n";
+
+      startNodes(dir, procs);
+   } catch (std::exception &e) {
+      std::cerr << "Unable to start the cluster: " << e.what() << "\n";
+      removeDir(dir);
+      exit(-1);
+   }
+
+   // Wait for every antenna to finish, then for the fingerprints to match for the whole
+   // agreement window (or for the limit to pass)
+   int64_t injected_us = 0, deadline_us = 0, agree_since_us = 0;
+   int64_t agree_us = (int64_t) (config.agree_secs / config.time_mult * 1000000.0);
+
+   while (readSamples(procs)) {
+      bool all_injected = true, agree = true, lost = false;
+      int64_t latest_us = 0;
+
+      for (auto pptr = procs.begin(); pptr != procs.end(); pptr++) {
+         lost = lost || pptr->lost;
+         if (!pptr->reported || (pptr->last.injected_us == 0)) {
+            all_injected = false;
+            continue;
+         }
+         agree = agree && (pptr->last.plots > 0) && (pptr->last.plots == procs[0].last.plots) &&
+                                    (pptr->last.fingerprint == procs[0].last.fingerprint);
+         latest_us = std::max(latest_us, pptr->last.at_us);
+      }
+
+      if (lost) {
+         failed = true;
+         break;
+      }
+      if (!all_injected)
+         continue;
+
+      if (injected_us == 0) {
+         for (auto pptr = procs.begin(); pptr != procs.end(); pptr++)
+            injected_us = std::max(injected_us, pptr->last.injected_us);
+         deadline_us = injected_us + (int64_t) config.settle_limit * 1000000;
+         std::cout << "All plots injected, waiting for the nodes to agree\n";
+      }
+
+      if (!agree)
+         agree_since_us = 0;
+      else if (agree_since_us == 0)
+         agree_since_us = std::max(latest_us, injected_us);
+
+      int64_t now = steadyMicros();
+      if ((agree_since_us != 0) && (now - agree_since_us >= agree_us)) {
+         res.converged = true;
+         res.converge_secs = (double) (agree_since_us - injected_us) / 1000000.0;
+         break;
+      }
+      if (now >= deadline_us)
+         break;
+   }
+
+   stopNodes(procs, failed);
+
+   for (auto pptr = procs.begin(); pptr != procs.end(); pptr++) {
+      if (!WIFEXITED(pptr->status) || (WEXITSTATUS(pptr->status) != 0) || !pptr->finished) {
+         std::cerr << "Node " << pptr->node << " failed--see node" << pptr->node <<
+                                                         ".log in the working directory\n";
+         failed = true;
+      }
+      res.wire_bytes += pptr->last.wire_out;
+   }
+
+   res.union_plots = compareDatabases(dir, procs, res.held_by_all);
+
+   if (res.converged)
+      std::cout << "Converged " << res.converge_secs << " secs (" <<
+                   res.converge_secs * config.time_mult << " sim secs) after the last inject\n";
+   else
+      std::cout << "Did not converge within " << config.settle_limit <<
+                                                   " secs of the last inject\n";
+   std::cout << "Final databases: " << res.union_plots << " distinct plots, " <<
+                res.held_by_all << " on every node, " << (res.union_plots - res.held_by_all) <<
+                " divergent; " << res.wire_bytes << " bytes on the wire\n\n";
+
+   printf("%6s %8s %8s %8s %12s %12s %12s %10s %12s %12s\n", "node", "injected", "plots",
+               "missing", "cpu_user_ms", "cpu_sys_ms", "sample_ms", "rss_kb", "wire_in",
+               "wire_out");
+   for (auto pptr = procs.begin(); pptr != procs.end(); pptr++) {
+      printf("%6u %8zu %8zu %8zu %12.1f %12.1f %12.1f %10ld %12llu %12llu\n", pptr->node,
+               pptr->sim_plots, pptr->db_plots, pptr->missing, cpuMillis(pptr->usage.ru_utime),
+               cpuMillis(pptr->usage.ru_stime), pptr->sample_cpu_ms, pptr->usage.ru_maxrss,
+               (unsigned long long) pptr->last.wire_in, (unsigned long long) pptr->last.wire_out);
+   }
+
+   if (config.keep || failed)
+      std::cout << "\nWorking directory kept: " << dir << "\n";
+   else
+      removeDir(dir);
+
+   if ((json_file.size() > 0) && !writeJSON(json_file.c_str(), res, procs)) {
+      std::cerr << "Unable to write results to " << json_file << "\n";
+      exit(-1);
+   }
+   return failed ? -1 : 0;
+}
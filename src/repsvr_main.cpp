@@ -13,8 +13,10 @@
 #include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
+#include <memory>
 #include "FileDesc.h"
 #include "DronePlotDB.h"
+#include "PlotJournal.h"
 #include "AntennaSim.h"
 #include "strfuncts.h"
 #include "ReplServer.h"
@@ -65,6 +67,8 @@ void displayHelp(const char *execname) {
    std::cout << "   o: the file to write the DB dump CSV to (default: replication_db.cv)\n";
    std::cout << "   d: duration - seconds in \"sim time\" to run the sim\n";
    std::cout << "   v: verbosity - how much information to send to stdout (0-3, 3=max)\n";
+   std::cout << "   j: journal directory - log every change there and recover from it on start\n";
+   std::cout << "   m: metrics port - serve Prometheus metrics at http://127.0.0.1:<port>/metrics\n";
 }
 
 
@@ -81,13 +85,15 @@ int main(int argc, char *argv[]) {
    // Filename to write the replication output
    std::string outfile("replication_db.csv");
    std::string simdata_file;
+   std::string journal_dir;
+   unsigned short metrics_port = 0;
 
    // Get the command line arguments and set params appropriately
    // The - at the beginning of our getopt optstring means that the inject database file
    // will appear in case 1
    unsigned long portval;
    int c = 0;
-   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:")) != -1) {
+   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:j:m:")) != -1) {
       switch (c) {
 
       // The inject database file specified in the command line
@@ -143,6 +149,21 @@ int main(int argc, char *argv[]) {
          outfile = optarg;
          break;
 
+      // Directory for the write-ahead journal and its checkpoints
+      case 'j':
+         journal_dir = optarg;
+         break;
+
+      // Local port to serve metrics on
+      case 'm':
+         portval = strtol(optarg, NULL, 10);
+         if ((portval < 1) || (portval > 65535)) {
+            std::cerr << "Invalid metrics port. Value must be between 1 and 65535\n";
+            exit(0);
+         }
+         metrics_port = (unsigned short) portval;
+         break;
+
       case '?':
               displayHelp(argv[0]);
               break;
@@ -163,9 +184,29 @@ int main(int argc, char *argv[]) {
 
    DronePlotDB db;
 
+   // Recover whatever the last run left in the journal, then log everything from here on
+   std::unique_ptr<PlotJournal> journal;
+   if (journal_dir.size() > 0) {
+      journal.reset(new PlotJournal(journal_dir.c_str()));
+
+      int recovered = db.recover(*journal);
+      if (recovered < 0) {
+         std::cerr << "Unable to recover the database from journal " << journal_dir << "\n";
+         exit(-1);
+      }
+      std::cout << "Recovered " << recovered << " plots from journal " << journal_dir << "\n";
+
+      journal->start();
+      db.setJournal(journal.get());
+   }
+
+   // Carries new plots from the simulator thread to the replication thread
+   PlotRing ingest;
+
    // Kick off the simulation thread by creating the sim management object
    // This will raise a runtime_exception if the simdata database load fails
    AntennaSim sim(db, simdata_file.c_str(), time_mult, verbosity);
+   sim.setIngestRing(&ingest);
 
    // Launch the thread
    pthread_t simthread;
@@ -174,6 +215,17 @@ int main(int argc, char *argv[]) {
 
    // Start the replication server
    ReplServer repl_server(db, ip_addr.c_str(), port, sim.getOffset(), time_mult, verbosity); 
+   repl_server.setIngestRing(&ingest);
+
+   // Metrics are only ever served locally
+   MetricsServer metrics(repl_server.getMetrics());
+   if (metrics_port != 0) {
+      try {
+         metrics.start("127.0.0.1", metrics_port);
+      } catch (socket_error &e) {
+         std::cerr << "Unable to serve metrics on port " << metrics_port << ": " << e.what() << "\n";
+      }
+   }
 
    pthread_t replthread;
    if (pthread_create(&replthread, NULL, t_replserver, (void *) &repl_server) != 0)
@@ -184,6 +236,7 @@ int main(int argc, char *argv[]) {
 
    // Stop the replication server
    repl_server.shutdown();
+   metrics.stop();
 
    // Stop the thread
    sim.terminate();
@@ -192,10 +245,19 @@ int main(int argc, char *argv[]) {
    pthread_join(simthread, NULL);
    pthread_join(replthread, NULL);
 
+   // Both threads are done--keep anything injected after replication stopped
+   repl_server.drainIngest();
+
    // Write the replication database to a CSV file
    std::cout << "Writing results to: " << outfile << "\n";
    db.sortByTime();
    db.writeCSVFile(outfile.c_str());
+
+   // Leave a fresh checkpoint so the next start has nothing to replay
+   if (journal) {
+      db.checkpoint();
+      journal->stop();
+   }
    
    return 0;
 }